@@ -0,0 +1,62 @@
+#include <string>
+#include <benchmark/benchmark.h>
+
+#include "../src/ast.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "generator.hpp"
+
+using namespace kccani;
+
+static void BM_AstToString(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    for (auto _ : state)
+    {
+        for (auto ast : asts)
+            if (auto function = std::get_if<FunctionAST*>(&ast))
+                benchmark::DoNotOptimize((*function)->to_string());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_AstToString, 4 << 10);
+
+// A stand-in for a second backend over the same AST: a plain recursive
+// walk with no allocation, so dispatch dominates.
+class Evaluator : public ExprVisitor<Evaluator, double>
+{
+public:
+    double visit_number(const NumberExprAST* expr) { return expr->value; }
+    double visit_variable(const VariableExprAST*) { return 1.0; }
+    double visit_binary(const BinaryExprAST* expr) { return this->visit(expr->lhs) + this->visit(expr->rhs); }
+    double visit_unary(const UnaryExprAST* expr) { return -this->visit(expr->operand); }
+    double visit_call(const FunctionCallExprAST* expr)
+    {
+        double sum = 0;
+        for (const ExprAST* arg : expr->args)
+            sum += this->visit(arg);
+        return sum;
+    }
+};
+
+static void BM_AstEvaluate(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    for (auto _ : state)
+    {
+        for (auto ast : asts)
+            if (auto function = std::get_if<FunctionAST*>(&ast))
+                benchmark::DoNotOptimize(Evaluator().visit((*function)->body));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_AstEvaluate, 16 << 10);
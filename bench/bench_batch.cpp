@@ -0,0 +1,54 @@
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "../src/batch.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+
+using namespace kccani;
+
+// A typical kernel: a few helpers, a comparison and no loop of its own.
+static const std::string BATCH_PROGRAM =
+    "def sq(x) x * x;"
+    "def lerp(a b t) a + (b - a) * t;"
+    "def f(x y) lerp(sq(x), y * 3 - 1, 0.25) * (x - y) + (x < y) * 2;";
+
+// Evaluating f at `points` points, `batch` of them per evaluate() call, 0
+// for all at once, on `threads` threads, 0 for every hardware thread.
+// Batches of 1 cost what a scalar call per point from C++ would.
+static void BM_BatchEvaluate(benchmark::State& state)
+{
+    const std::size_t points = state.range(0);
+    const std::size_t batch = state.range(1) ? state.range(1) : points;
+    auto source = SourceBuffer::from_string(BATCH_PROGRAM);
+    Lexer lexer(source);
+    Parser parser(lexer);
+    BatchEvaluator evaluator(static_cast<unsigned>(state.range(3)), state.range(2) != 0);
+    BatchKernel kernel = evaluator.compile(parser.fetch_all(), "f");
+    std::vector<double> x(points), y(points), results(points);
+    for (std::size_t i = 0; i < points; i++)
+    {
+        x[i] = static_cast<double>(i) * 0.001;
+        y[i] = static_cast<double>(i % 97);
+    }
+    for (auto _ : state)
+    {
+        for (std::size_t begin = 0; begin < points; begin += batch)
+        {
+            std::size_t size = std::min(batch, points - begin);
+            llvm::ArrayRef<double> columns[] = {llvm::ArrayRef<double>(x).slice(begin, size),
+                                                llvm::ArrayRef<double>(y).slice(begin, size)};
+            evaluator.evaluate(kernel, columns, llvm::MutableArrayRef<double>(results).slice(begin, size));
+        }
+        benchmark::DoNotOptimize(results.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * points);
+}
+BENCHMARK(BM_BatchEvaluate)
+    ->ArgNames({"points", "batch", "fast_math", "threads"})
+    ->ArgsProduct({{1 << 12, 1 << 20}, {1, 0}, {0, 1}, {1}})
+    ->Args({1 << 20, 0, 0, 0})
+    ->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,289 @@
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/CrashRecoveryContext.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "../src/codegen.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/lexer.hpp"
+#include "../src/optimizer.hpp"
+#include "../src/parallel_codegen.hpp"
+#include "../src/parser.hpp"
+#include "../src/pipeline.hpp"
+#include "../src/simplifier.hpp"
+#include "../src/source.hpp"
+#include "generator.hpp"
+
+using namespace kccani;
+
+struct ParsedProgram
+{
+    std::shared_ptr<AstArena> arena;
+    std::vector<ParsedAstContentType> asts;
+};
+
+static ParsedProgram parse_program(const std::string& program, bool share_subexpressions = false)
+{
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    Parser parser(lexer, std::make_shared<AstArena>(), share_subexpressions);
+    auto asts = parser.fetch_all();
+    return {parser.arena(), std::move(asts)};
+}
+
+// Includes the verifyFunction() call made for every definition.
+static void BM_CodegenVisit(benchmark::State& state, bool share_subexpressions)
+{
+    auto program = parse_program(generate_program(generator_options(state)), share_subexpressions);
+    std::size_t instructions = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        CodeGeneratorLLVM codegen;
+        state.ResumeTiming();
+        for (auto ast : program.asts)
+            benchmark::DoNotOptimize(std::visit(std::ref(codegen), ast));
+        state.PauseTiming();
+        instructions = 0;
+        for (const llvm::Function& function : codegen.get_module())
+            instructions += function.getInstructionCount();
+        // Tearing down the LLVMContext is not part of code generation.
+        { CodeGeneratorLLVM discarded = std::move(codegen); }
+        state.ResumeTiming();
+    }
+    state.counters["instructions"] = static_cast<double>(instructions);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+
+static void BM_CodegenVisitTree(benchmark::State& state)
+{
+    BM_CodegenVisit(state, false);
+}
+KCCANI_PROGRAM_BENCHMARK(BM_CodegenVisitTree, 4 << 10);
+
+static void BM_CodegenVisitShared(benchmark::State& state)
+{
+    BM_CodegenVisit(state, true);
+}
+KCCANI_PROGRAM_BENCHMARK(BM_CodegenVisitShared, 4 << 10);
+
+static void BM_CodegenFlat(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    FlatAst ast;
+    Lexer lexer(source);
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(ast)).fetch_all();
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        CodeGeneratorLLVM codegen;
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(codegen.generate(ast));
+        state.PauseTiming();
+        { CodeGeneratorLLVM discarded = std::move(codegen); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_CodegenFlat, 4 << 10);
+
+static void BM_VerifyFunction(benchmark::State& state)
+{
+    auto program = parse_program(generate_program(generator_options(state)));
+    CodeGeneratorLLVM codegen;
+    for (auto ast : program.asts)
+        std::visit(std::ref(codegen), ast);
+    for (auto _ : state)
+    {
+        for (const llvm::Function& function : codegen.get_module())
+            benchmark::DoNotOptimize(llvm::verifyFunction(function));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_VerifyFunction, 4 << 10);
+
+static void BM_ModulePrint(benchmark::State& state)
+{
+    auto program = parse_program(generate_program(generator_options(state)));
+    CodeGeneratorLLVM codegen;
+    for (auto ast : program.asts)
+        std::visit(std::ref(codegen), ast);
+    std::size_t printed = 0;
+    for (auto _ : state)
+    {
+        std::string output;
+        llvm::raw_string_ostream stream(output);
+        codegen.get_module().print(stream, nullptr);
+        printed += stream.str().size();
+    }
+    state.SetBytesProcessed(printed);
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_ModulePrint, 4 << 10);
+
+// Code generation with the passes of -O<level>, the fourth argument, and the
+// instructions left afterwards: compile latency against code size.
+static void BM_CodegenOptimized(benchmark::State& state)
+{
+    auto program = parse_program(generate_program(generator_options(state)));
+    Optimizer optimizer(static_cast<unsigned>(state.range(3)));
+    std::size_t instructions = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        CodeGeneratorLLVM codegen;
+        codegen.set_optimizer(optimizer);
+        state.ResumeTiming();
+        for (auto ast : program.asts)
+            benchmark::DoNotOptimize(std::visit(std::ref(codegen), ast));
+        codegen.optimize_module();
+        state.PauseTiming();
+        instructions = 0;
+        for (const llvm::Function& function : codegen.get_module())
+            instructions += function.getInstructionCount();
+        { CodeGeneratorLLVM discarded = std::move(codegen); }
+        state.ResumeTiming();
+    }
+    state.counters["instructions"] = static_cast<double>(instructions);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CodegenOptimized)
+    ->ArgNames({"functions", "depth", "fan_out", "level"})
+    ->ArgsProduct({{256, 1 << 10}, {8}, {2}, {0, 1, 2, 3}})
+    ->Unit(benchmark::kMillisecond);
+
+// BM_CodegenOptimized after simplifying the ASTs, not at all when the fifth
+// argument is 0, exactly when it is 1 and with fast math when it is 2.
+static void BM_CodegenSimplified(benchmark::State& state)
+{
+    auto program = parse_program(generate_program(generator_options(state)));
+    Optimizer optimizer(static_cast<unsigned>(state.range(3)));
+    const std::int64_t simplify = state.range(4);
+    std::size_t instructions = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        CodeGeneratorLLVM codegen;
+        codegen.set_optimizer(optimizer);
+        std::vector<ParsedAstContentType> asts = program.asts;
+        state.ResumeTiming();
+        if (simplify)
+            AstSimplifier(program.arena, simplify == 2).simplify(asts);
+        for (auto ast : asts)
+            benchmark::DoNotOptimize(std::visit(std::ref(codegen), ast));
+        codegen.optimize_module();
+        state.PauseTiming();
+        instructions = 0;
+        for (const llvm::Function& function : codegen.get_module())
+            instructions += function.getInstructionCount();
+        { CodeGeneratorLLVM discarded = std::move(codegen); }
+        state.ResumeTiming();
+    }
+    state.counters["instructions"] = static_cast<double>(instructions);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CodegenSimplified)
+    ->ArgNames({"functions", "depth", "fan_out", "level", "simplify"})
+    ->ArgsProduct({{1 << 10}, {8, 32}, {2}, {0, 2}, {0, 1, 2}})
+    ->Unit(benchmark::kMillisecond);
+
+// The same on a thread pool, one module per chunk, with the level as the
+// fourth argument and the number of threads as the fifth.
+static void BM_CodegenParallel(benchmark::State& state)
+{
+    auto program = parse_program(generate_program(generator_options(state)));
+    ParallelCodeGenerator codegen(static_cast<unsigned>(state.range(4)), static_cast<unsigned>(state.range(3)));
+    for (auto _ : state)
+    {
+        auto modules = codegen.generate(program.asts);
+        state.PauseTiming();
+        { auto discarded = std::move(modules); }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CodegenParallel)
+    ->ArgNames({"functions", "depth", "fan_out", "level", "threads"})
+    ->ArgsProduct({{4 << 10}, {8}, {2}, {0, 2}, {1, 2, 4}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Lexing, parsing and code generation of a source, one after the other as
+// the compiler does by default.
+static void BM_CompileSequential(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        auto codegen = std::make_unique<CodeGeneratorLLVM>();
+        state.ResumeTiming();
+        Lexer lexer(source);
+        Parser parser(lexer);
+        for (auto& ast : parser.fetch_all())
+            benchmark::DoNotOptimize(std::visit(std::ref(*codegen), ast));
+        state.PauseTiming();
+        codegen.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_CompileSequential, 4 << 10);
+
+// The same with the three stages overlapped by a Pipeline.
+static void BM_CompilePipelined(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    Pipeline pipeline;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        auto codegen = std::make_unique<CodeGeneratorLLVM>();
+        state.ResumeTiming();
+        pipeline.run(source.view(), [&codegen](const ParsedAstContentType& ast) {
+            benchmark::DoNotOptimize(std::visit(std::ref(*codegen), ast));
+        });
+        state.PauseTiming();
+        codegen.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_CompilePipelined, 4 << 10);
+
+// Code generation of a function whose body nests state.range(0) deep, first
+// checked to work on a thread with 256 KiB of stack.
+static void BM_CodegenDeepNesting(benchmark::State& state, std::string (*generate)(std::size_t))
+{
+    auto program = parse_program("def f(a b) a; def g(a) " + generate(state.range(0)));
+    auto generate_all = [&program]() {
+        auto codegen = std::make_unique<CodeGeneratorLLVM>();
+        for (auto ast : program.asts)
+            benchmark::DoNotOptimize(std::visit(std::ref(*codegen), ast));
+        return codegen;
+    };
+    if (!llvm::CrashRecoveryContext().RunSafelyOnThread([&]() { generate_all(); }, 256 << 10))
+        state.SkipWithError("Code generation failed on a small stack");
+    for (auto _ : state)
+    {
+        auto codegen = generate_all();
+        state.PauseTiming();
+        codegen.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK_CAPTURE(BM_CodegenDeepNesting, parentheses, generate_deep_expression)
+    ->RangeMultiplier(8)->Range(1 << 10, 1 << 16)->Complexity(benchmark::oN);
+BENCHMARK_CAPTURE(BM_CodegenDeepNesting, calls, generate_nested_calls)
+    ->RangeMultiplier(8)->Range(1 << 10, 1 << 16)->Complexity(benchmark::oN);
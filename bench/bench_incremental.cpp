@@ -0,0 +1,49 @@
+#include <string>
+#include <benchmark/benchmark.h>
+
+#include "../src/incremental.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+
+using namespace kccani;
+
+static std::string generate_functions(std::size_t count)
+{
+    std::string source;
+    for (std::size_t index = 0; index < count; index++)
+    {
+        std::string name = "f" + std::to_string(index);
+        source += "def " + name + "(a b)\n    (a + " + std::to_string(index) + ") * (b - a) < " + name + "(b, a);\n";
+    }
+    return source;
+}
+
+// One keystroke in the middle of the file: type a digit, then delete it.
+static void BM_IncrementalKeystroke(benchmark::State& state)
+{
+    std::string text = generate_functions(state.range(0));
+    IncrementalParser parser(text);
+    std::size_t offset = text.find("(a + ", text.size() / 2) + 5;
+    for (auto _ : state)
+    {
+        parser.apply(SourceEdit{offset, 0, "7"});
+        parser.apply(SourceEdit{offset, 1, ""});
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_IncrementalKeystroke)->Range(64, 16 << 10)->Unit(benchmark::kMicrosecond);
+
+// What every keystroke used to cost.
+static void BM_FullReparse(benchmark::State& state)
+{
+    std::string text = generate_functions(state.range(0));
+    for (auto _ : state)
+    {
+        auto source = SourceBuffer::from_string(text);
+        Lexer lexer(source);
+        benchmark::DoNotOptimize(Parser(lexer).fetch_all());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FullReparse)->Range(64, 16 << 10)->Unit(benchmark::kMicrosecond);
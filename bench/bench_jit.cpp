@@ -0,0 +1,212 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <variant>
+#include <benchmark/benchmark.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+
+#include "../src/code_cache.hpp"
+#include "../src/codegen.hpp"
+#include "../src/emitter.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/optimizer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "generator.hpp"
+
+using namespace kccani;
+
+// The generated program and a top level call of its last function, which
+// with a fan-out of 2 makes a number of calls linear in the program size.
+static std::string generate_program_and_call(const benchmark::State& state)
+{
+    GeneratorOptions options = generator_options(state);
+    return generate_program(options) + "f" + std::to_string(options.functions - 1) + "(1, 2);\n";
+}
+
+// Code generation, native compilation and the single run of the call.
+static void BM_JitRun(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    for (auto _ : state)
+    {
+        CodeGeneratorLLVM codegen;
+        for (auto& ast : asts)
+            std::visit(std::ref(codegen), ast);
+        JitEngine jit;
+        benchmark::DoNotOptimize(jit.run(codegen.take_module()));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_JitRun)
+    ->ArgNames({"functions", "depth", "fan_out"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 10, 4), {8}, {2}})
+    ->Unit(benchmark::kMillisecond)
+    ->Complexity(benchmark::oN);
+
+// BM_JitRun at -O2 with a CodeCache, emptied before every iteration when
+// `warm` is 0, filled by an earlier run when it is 1: a warm cache skips
+// code generation, optimization and compilation of every function.
+static void BM_JitRunCached(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    llvm::SmallString<128> directory;
+    if (llvm::sys::fs::createUniqueDirectory("kccani_bench_code_cache", directory))
+    {
+        state.SkipWithError("Could not create a cache directory");
+        return;
+    }
+    const bool warm = state.range(3) != 0;
+    auto compile_and_run = [&](CodeCache& cache) {
+        Optimizer optimizer(2);
+        CodeGeneratorLLVM codegen;
+        codegen.set_optimizer(optimizer);
+        codegen.set_code_cache(cache, JitEngine::target_description());
+        for (auto& ast : asts)
+            std::visit(std::ref(codegen), ast);
+        JitEngine jit(1, &cache);
+        benchmark::DoNotOptimize(jit.run(codegen.take_module()));
+    };
+    if (warm)
+    {
+        CodeCache cache{std::string(directory)};
+        compile_and_run(cache);
+    }
+    for (auto _ : state)
+    {
+        if (!warm)
+        {
+            state.PauseTiming();
+            llvm::sys::fs::remove_directories(directory);
+            state.ResumeTiming();
+        }
+        CodeCache cache{std::string(directory)};
+        compile_and_run(cache);
+    }
+    llvm::sys::fs::remove_directories(directory);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_JitRunCached)
+    ->ArgNames({"functions", "depth", "fan_out", "warm"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 10, 4), {8}, {2}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// A library of generated functions of which one call uses only the first,
+// run eagerly when `lazy` is 0 and with a LazyJitEngine when it is 1, which
+// compiles that function alone.
+static void BM_JitLibraryCall(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)) + "f0(1, 2);\n");
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    const bool lazy = state.range(3) != 0;
+    for (auto _ : state)
+    {
+        if (lazy)
+        {
+            LazyJitEngine jit;
+            benchmark::DoNotOptimize(jit.run(asts));
+        }
+        else
+        {
+            CodeGeneratorLLVM codegen;
+            for (auto& ast : asts)
+                std::visit(std::ref(codegen), ast);
+            JitEngine jit;
+            benchmark::DoNotOptimize(jit.run(codegen.take_module()));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_JitLibraryCall)
+    ->ArgNames({"functions", "depth", "fan_out", "lazy"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 12, 4), {8}, {2}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+// Calling a lazily compiled program again, with its bodies at -O0 when
+// `tiers` is 0, at -O3 when it is 1, and at -O0 tiering up to -O3 after 16
+// calls when it is 2. `first_run_ms` is the latency of the first run, which
+// compiles the bodies, and the timed calls follow the tier-ups.
+static void BM_JitTieredCall(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    const std::int64_t tiers = state.range(3);
+    LazyJitEngine jit(tiers == 0 ? 0 : 3, tiers == 2 ? 16 : 0);
+    auto start = std::chrono::steady_clock::now();
+    jit.run(asts);
+    state.counters["first_run_ms"] =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    for (int call = 0; call < 16; call++)
+        jit.call("__anon_expr");
+    jit.wait_for_tier_ups();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(jit.call("__anon_expr"));
+    state.counters["tier_ups"] = jit.get_tier_statistics().tier_ups;
+}
+BENCHMARK(BM_JitTieredCall)
+    ->ArgNames({"functions", "depth", "fan_out", "tiers"})
+    ->ArgsProduct({{256, 1024}, {8}, {2}, {0, 1, 2}});
+
+// Calling the compiled expression again, which is all a repeated evaluation
+// costs once compiled.
+static void BM_JitCall(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+    for (auto& ast : parser.fetch_all())
+        std::visit(std::ref(codegen), ast);
+    JitEngine jit;
+    jit.run(codegen.take_module());
+    for (auto _ : state)
+        benchmark::DoNotOptimize(jit.call("__anon_expr"));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_JitCall)
+    ->ArgNames({"functions", "depth", "fan_out"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 10, 4), {8}, {2}})
+    ->Complexity(benchmark::oN);
+
+// The ahead of time counterpart of BM_JitRun's compilation: code generation
+// and an object file written for the host.
+static void BM_EmitObject(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    Emitter emitter;
+    std::string path = "bench_emit_object.o";
+    for (auto _ : state)
+    {
+        CodeGeneratorLLVM codegen;
+        for (auto& ast : asts)
+            std::visit(std::ref(codegen), ast);
+        codegen.take_module().module.withModuleDo([&](llvm::Module& module) {
+            emitter.emit(module, EmitKind::OBJECT, path);
+        });
+    }
+    std::remove(path.c_str());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_EmitObject)
+    ->ArgNames({"functions", "depth", "fan_out"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 10, 4), {8}, {2}})
+    ->Unit(benchmark::kMillisecond)
+    ->Complexity(benchmark::oN);
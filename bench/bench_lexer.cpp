@@ -0,0 +1,138 @@
+#include <random>
+#include <sstream>
+#include <string>
+#include <benchmark/benchmark.h>
+
+#include "../src/lexer.hpp"
+#include "../src/scan.hpp"
+#include "../src/source.hpp"
+#include "generator.hpp"
+
+using namespace kccani;
+
+// Roughly the shape of machine generated Kaleidoscope: long identifiers,
+// indented bodies, float literals and banner comments.
+static std::string generate_lexer_source(std::size_t target_size)
+{
+    std::mt19937 random(42);
+    std::string source;
+    source.reserve(target_size + 256);
+    for (std::size_t index = 0; source.size() < target_size; index++)
+    {
+        std::string name = "generated_kernel_function_" + std::to_string(index);
+        source += "# ------------------------------------------------------------------\n";
+        source += "# " + name + ": automatically generated, do not edit by hand\n";
+        source += "def " + name + "(inputValueAlpha inputValueBeta)\n";
+        source += "        ";
+        for (int term = 0; term < 6; term++)
+        {
+            source += "(inputValueAlpha * " + std::to_string(random() % 100000) + ".125 - inputValueBeta)";
+            source += term == 5 ? ";\n\n" : " +\n        ";
+        }
+    }
+    return source;
+}
+
+static const std::string& lexer_source()
+{
+    static const std::string source = generate_lexer_source(16 << 20);
+    return source;
+}
+
+static void BM_LexStream(benchmark::State& state)
+{
+    const std::string& text = lexer_source();
+    for (auto _ : state)
+    {
+        std::istringstream stream(text);
+        Lexer lexer(stream);
+        while (lexer.get().type != Token::TokenType::TOKEN_EOF)
+            ;
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_LexStream)->Unit(benchmark::kMillisecond);
+
+static void BM_LexBuffer(benchmark::State& state)
+{
+    auto isa = static_cast<scan::InstructionSet>(state.range(0));
+    auto previous_isa = scan::active_instruction_set();
+    if (!scan::use_instruction_set(isa))
+    {
+        state.SkipWithError("Instruction set not supported on this host");
+        return;
+    }
+    auto source = SourceBuffer::from_string(lexer_source());
+    for (auto _ : state)
+    {
+        Lexer lexer(source);
+        while (lexer.get().type != Token::TokenType::TOKEN_EOF)
+            ;
+    }
+    scan::use_instruction_set(previous_isa);
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+BENCHMARK(BM_LexBuffer)
+    ->ArgName("isa")
+    ->Arg(static_cast<int>(scan::InstructionSet::SCALAR))
+    ->Arg(static_cast<int>(scan::InstructionSet::SSE2))
+    ->Arg(static_cast<int>(scan::InstructionSet::AVX2))
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_LexerGet(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    for (auto _ : state)
+    {
+        Lexer lexer(source);
+        while (lexer.get().type != Token::TokenType::TOKEN_EOF)
+            ;
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_LexerGet, 16 << 10);
+
+static void BM_LexerFetchAll(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    for (auto _ : state)
+    {
+        Lexer lexer(source);
+        benchmark::DoNotOptimize(lexer.fetch_all());
+    }
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_LexerFetchAll, 16 << 10);
+
+// The individual kernels over inputs made of a single long run, which is
+// where the vector width shows most directly.
+
+using ScanKernel = const char* (*scan::ScanKernels::*)(const char*, const char*);
+
+static void BM_ScanKernel(benchmark::State& state, ScanKernel kernel_member, std::string text)
+{
+    auto isa = static_cast<scan::InstructionSet>(state.range(0));
+    if (!scan::is_supported(isa))
+    {
+        state.SkipWithError("Instruction set not supported on this host");
+        return;
+    }
+    auto kernel = scan::kernels_for(isa).*kernel_member;
+    for (auto _ : state)
+    {
+        const char* stop = kernel(text.data(), text.data() + text.size());
+        benchmark::DoNotOptimize(stop);
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+#define KCCANI_SCAN_BENCHMARK(NAME, KERNEL, TEXT)                     \
+    BENCHMARK_CAPTURE(BM_ScanKernel, NAME, &scan::ScanKernels::KERNEL, TEXT) \
+        ->ArgName("isa")->DenseRange(0, 2)
+
+KCCANI_SCAN_BENCHMARK(whitespace, skip_whitespace, std::string(1 << 16, ' ') + "x");
+KCCANI_SCAN_BENCHMARK(identifier, skip_identifier, std::string(1 << 16, 'q') + " ");
+KCCANI_SCAN_BENCHMARK(number, skip_number, std::string(1 << 16, '7') + " ");
+KCCANI_SCAN_BENCHMARK(comment, find_line_end, std::string(1 << 16, '-') + "\n");
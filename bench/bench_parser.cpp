@@ -0,0 +1,196 @@
+#include <string>
+#include <benchmark/benchmark.h>
+#include <llvm/Support/CrashRecoveryContext.h>
+
+#include "../src/ast_cache.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parallel_parser.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "generator.hpp"
+
+namespace kccani
+{
+
+class ParserBenchmark
+{
+public:
+    static ExprAST* parse_primary(Parser& parser)
+    {
+        return parser.parse_primary();
+    }
+
+    static ExprAST* parse_binary_op_rhs(Parser& parser, ExprAST* lhs)
+    {
+        return parser.parse_expression(0, lhs);
+    }
+};
+
+}
+
+using namespace kccani;
+
+// Parsing alone: the tokens are lexed up front and replayed.
+static void BM_ParserGet(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    TokenStream tokens = Lexer(source).fetch_all();
+    for (auto _ : state)
+    {
+        Lexer lexer(tokens);
+        Parser parser(lexer);
+        while (lexer.peek().type != Token::TokenType::TOKEN_EOF)
+            benchmark::DoNotOptimize(parser.get());
+    }
+    state.SetItemsProcessed(state.iterations() * tokens.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_ParserGet, 16 << 10);
+
+static void BM_ParserFetchAll(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    TokenStream tokens = Lexer(source).fetch_all();
+    std::size_t arena_bytes = 0;
+    for (auto _ : state)
+    {
+        Lexer lexer(tokens);
+        Parser parser(lexer);
+        benchmark::DoNotOptimize(parser.fetch_all());
+        arena_bytes = parser.arena()->size();
+    }
+    state.counters["ast_bytes"] = static_cast<double>(arena_bytes);
+    state.SetItemsProcessed(state.iterations() * tokens.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_ParserFetchAll, 16 << 10);
+
+// Hash-consing costs a table lookup per node and saves the arena space of
+// every repeated subexpression.
+static void BM_ParserFetchAllShared(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    TokenStream tokens = Lexer(source).fetch_all();
+    std::size_t arena_bytes = 0;
+    std::size_t shared_nodes = 0;
+    for (auto _ : state)
+    {
+        Lexer lexer(tokens);
+        Parser parser(lexer, std::make_shared<AstArena>(), true);
+        benchmark::DoNotOptimize(parser.fetch_all());
+        arena_bytes = parser.arena()->size();
+        shared_nodes = parser.get_builder().shared_nodes();
+    }
+    state.counters["ast_bytes"] = static_cast<double>(arena_bytes);
+    state.counters["shared_nodes"] = static_cast<double>(shared_nodes);
+    state.SetItemsProcessed(state.iterations() * tokens.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_ParserFetchAllShared, 16 << 10);
+
+// The same parse appending to a FlatAst instead of building the pointer tree.
+static void BM_ParserFetchAllFlat(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    TokenStream tokens = Lexer(source).fetch_all();
+    std::size_t ast_bytes = 0;
+    std::size_t nodes = 0;
+    for (auto _ : state)
+    {
+        FlatAst ast;
+        Lexer lexer(tokens);
+        BasicParser<FlatAstBuilder> parser(lexer, FlatAstBuilder(ast));
+        benchmark::DoNotOptimize(parser.fetch_all());
+        ast_bytes = ast.memory_usage();
+        nodes = ast.size();
+    }
+    state.counters["ast_bytes"] = static_cast<double>(ast_bytes);
+    state.counters["nodes"] = static_cast<double>(nodes);
+    state.SetItemsProcessed(state.iterations() * tokens.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_ParserFetchAllFlat, 16 << 10);
+
+// What an unchanged source costs instead of BM_ParserFetchAllFlat and lexing.
+static void BM_AstCacheLoad(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    FlatAst ast;
+    Lexer lexer(source);
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(ast)).fetch_all();
+    std::uint64_t hash = AstCache::source_hash(source.view());
+    std::string image = AstCache::serialize(ast, hash);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(AstCache::source_hash(source.view()));
+        benchmark::DoNotOptimize(AstCache::deserialize(image, hash));
+    }
+    state.counters["image_bytes"] = static_cast<double>(image.size());
+    state.SetBytesProcessed(state.iterations() * source.size());
+    state.SetComplexityN(state.range(0));
+}
+KCCANI_PROGRAM_BENCHMARK(BM_AstCacheLoad, 16 << 10);
+
+static void BM_ParseBinaryOpRhs(benchmark::State& state, std::string (*generate)(std::size_t))
+{
+    auto source = SourceBuffer::from_string(generate(state.range(0)));
+    TokenStream tokens = Lexer(source).fetch_all();
+    for (auto _ : state)
+    {
+        Lexer lexer(tokens);
+        Parser parser(lexer);
+        auto lhs = ParserBenchmark::parse_primary(parser);
+        benchmark::DoNotOptimize(ParserBenchmark::parse_binary_op_rhs(parser, lhs));
+    }
+    state.SetItemsProcessed(state.iterations() * tokens.size());
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK_CAPTURE(BM_ParseBinaryOpRhs, wide, generate_wide_expression)
+    ->RangeMultiplier(4)->Range(16, 16 << 10)->Complexity(benchmark::oN);
+BENCHMARK_CAPTURE(BM_ParseBinaryOpRhs, deep, generate_deep_expression)
+    ->RangeMultiplier(4)->Range(16, 4 << 10)->Complexity(benchmark::oN);
+
+// Nesting costs heap, not native stack: after checking that the expression
+// parses on a thread with only NESTED_STACK_BYTES of stack, time grows
+// linearly with the depth.
+static constexpr unsigned NESTED_STACK_BYTES = 256 << 10;
+
+static void BM_ParseDeepNesting(benchmark::State& state, std::string (*generate)(std::size_t))
+{
+    auto source = SourceBuffer::from_string(generate(state.range(0)));
+    TokenStream tokens = Lexer(source).fetch_all();
+    auto parse = [&tokens]() {
+        Lexer lexer(tokens);
+        Parser parser(lexer);
+        benchmark::DoNotOptimize(parser.fetch_all());
+    };
+    if (!llvm::CrashRecoveryContext().RunSafelyOnThread(parse, NESTED_STACK_BYTES))
+        state.SkipWithError("Parsing failed on a small stack");
+    for (auto _ : state)
+        parse();
+    state.counters["stack_bytes"] = NESTED_STACK_BYTES;
+    state.SetItemsProcessed(state.iterations() * tokens.size());
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK_CAPTURE(BM_ParseDeepNesting, parentheses, generate_deep_expression)
+    ->RangeMultiplier(8)->Range(1 << 10, 1 << 19)->Complexity(benchmark::oN);
+BENCHMARK_CAPTURE(BM_ParseDeepNesting, calls, generate_nested_calls)
+    ->RangeMultiplier(8)->Range(1 << 10, 1 << 19)->Complexity(benchmark::oN);
+
+// BM_ParserFetchAll including lexing, split into chunks parsed on a pool of
+// `threads` threads.
+static void BM_ParallelParse(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program(generator_options(state)));
+    ParallelParser parser(static_cast<unsigned>(state.range(3)), 64 << 10);
+    std::size_t chunks = ParallelParser::split(source.view(), 64 << 10).size();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(parser.parse(source.view()));
+    state.counters["chunks"] = static_cast<double>(chunks);
+    state.SetBytesProcessed(state.iterations() * source.size());
+}
+BENCHMARK(BM_ParallelParse)
+    ->ArgNames({"functions", "depth", "fan_out", "threads"})
+    ->ArgsProduct({{16 << 10}, {8}, {2}, {1, 2, 4}})
+    ->Unit(benchmark::kMillisecond);
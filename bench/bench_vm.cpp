@@ -0,0 +1,104 @@
+#include <string>
+#include <variant>
+#include <benchmark/benchmark.h>
+
+#include "../src/bytecode.hpp"
+#include "../src/codegen.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "../src/vm.hpp"
+#include "generator.hpp"
+
+using namespace kccani;
+
+// The generated program and a top level call of its last function, as in
+// bench_jit.cpp, so that these compare with BM_JitRun and BM_JitCall.
+static std::string generate_program_and_call(const benchmark::State& state)
+{
+    GeneratorOptions options = generator_options(state);
+    return generate_program(options) + "f" + std::to_string(options.functions - 1) + "(1, 2);\n";
+}
+
+// Bytecode compilation and the single run of the call.
+static void BM_VmRun(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto asts = parser.fetch_all();
+    for (auto _ : state)
+    {
+        BytecodeProgram program;
+        BytecodeCompiler compiler(program);
+        for (auto& ast : asts)
+            std::visit(std::ref(compiler), ast);
+        VirtualMachine vm(program);
+        benchmark::DoNotOptimize(vm.run());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_VmRun)
+    ->ArgNames({"functions", "depth", "fan_out"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 10, 4), {8}, {2}})
+    ->Unit(benchmark::kMillisecond)
+    ->Complexity(benchmark::oN);
+
+// Interpreting the compiled expression again.
+static void BM_VmCall(benchmark::State& state)
+{
+    auto source = SourceBuffer::from_string(generate_program_and_call(state));
+    Lexer lexer(source);
+    Parser parser(lexer);
+    BytecodeProgram program;
+    BytecodeCompiler compiler(program);
+    for (auto& ast : parser.fetch_all())
+        std::visit(std::ref(compiler), ast);
+    VirtualMachine vm(program);
+    vm.run();
+    std::uint32_t expression = program.find("__anon_expr");
+    for (auto _ : state)
+        benchmark::DoNotOptimize(vm.call(expression));
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(BM_VmCall)
+    ->ArgNames({"functions", "depth", "fan_out"})
+    ->ArgsProduct({benchmark::CreateRange(64, 1 << 10, 4), {8}, {2}})
+    ->Complexity(benchmark::oN);
+
+// From source text to the value of a small script, as a one-off run of the
+// compiler does it, with the LLVM JIT when `vm` is 0 and the VM when it is 1.
+static void BM_ScriptStartup(benchmark::State& state)
+{
+    const std::string script = generate_program_and_call(state);
+    const bool vm = state.range(3) != 0;
+    for (auto _ : state)
+    {
+        auto source = SourceBuffer::from_string(script);
+        Lexer lexer(source);
+        Parser parser(lexer);
+        auto asts = parser.fetch_all();
+        if (vm)
+        {
+            BytecodeProgram program;
+            BytecodeCompiler compiler(program);
+            for (auto& ast : asts)
+                std::visit(std::ref(compiler), ast);
+            benchmark::DoNotOptimize(VirtualMachine(program).run());
+        }
+        else
+        {
+            CodeGeneratorLLVM codegen;
+            for (auto& ast : asts)
+                std::visit(std::ref(codegen), ast);
+            JitEngine jit;
+            benchmark::DoNotOptimize(jit.run(codegen.take_module()));
+        }
+    }
+}
+BENCHMARK(BM_ScriptStartup)
+    ->ArgNames({"functions", "depth", "fan_out", "vm"})
+    ->ArgsProduct({{1, 8}, {4}, {2}, {0, 1}})
+    ->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,82 @@
+#include "generator.hpp"
+
+#include <random>
+
+namespace kccani
+{
+
+static const char OPERATORS[] = {'+', '-', '*', '<'};
+
+static std::string generate_leaf(std::mt19937& random)
+{
+    switch (random() % 3)
+    {
+    case 0:
+        return "a";
+    case 1:
+        return "b";
+    default:
+        return std::to_string(random() % 1000) + ".5";
+    }
+}
+
+// Alternates the nested side, so that both operands of the parser's
+// precedence climbing get exercised.
+static std::string generate_expression(std::mt19937& random, std::size_t depth)
+{
+    if (depth == 0)
+        return generate_leaf(random);
+    std::string op = std::string(" ") + OPERATORS[random() % 4] + " ";
+    if (depth % 2)
+        return "(" + generate_leaf(random) + op + generate_expression(random, depth - 1) + ")";
+    return "(" + generate_expression(random, depth - 1) + op + generate_leaf(random) + ")";
+}
+
+std::string generate_program(const GeneratorOptions& options)
+{
+    std::mt19937 random(options.seed);
+    std::string program;
+    for (std::size_t index = 0; index < options.functions; index++)
+    {
+        program += "def f" + std::to_string(index) + "(a b)\n    ";
+        for (std::size_t call = 0; call < options.fan_out && index > 0; call++)
+            program += "f" + std::to_string(random() % index) + "(b, " + generate_leaf(random) + ") + ";
+        program += generate_expression(random, options.depth) + ";\n";
+    }
+    return program;
+}
+
+std::string generate_wide_expression(std::size_t terms)
+{
+    std::string expression = "a";
+    for (std::size_t index = 1; index < terms; index++)
+        expression += " + a";
+    return expression;
+}
+
+std::string generate_deep_expression(std::size_t depth)
+{
+    std::string expression;
+    for (std::size_t index = 0; index < depth; index++)
+        expression += "(a + ";
+    return expression + "a" + std::string(depth, ')');
+}
+
+std::string generate_nested_calls(std::size_t depth)
+{
+    std::string expression;
+    for (std::size_t index = 0; index < depth; index++)
+        expression += "f(a, ";
+    return expression + "a" + std::string(depth, ')');
+}
+
+GeneratorOptions generator_options(const benchmark::State& state)
+{
+    GeneratorOptions options;
+    options.functions = state.range(0);
+    options.depth = state.range(1);
+    options.fan_out = state.range(2);
+    return options;
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <benchmark/benchmark.h>
+
+namespace kccani
+{
+
+struct GeneratorOptions
+{
+    // Number of top level function definitions.
+    std::size_t functions = 256;
+    // Nesting depth of the expression in each function body.
+    std::size_t depth = 8;
+    // Number of calls to earlier functions in each function body.
+    std::size_t fan_out = 2;
+    std::uint32_t seed = 42;
+};
+
+// A valid, deterministic Kaleidoscope program: every function takes two
+// arguments and only calls functions defined before it, so the whole program
+// parses and generates code without diagnostics.
+std::string generate_program(const GeneratorOptions& options);
+
+// `a + a + ... + a` with `terms` operands, parsed without any recursion.
+std::string generate_wide_expression(std::size_t terms);
+// `(a + (a + (... + a)))` nested `depth` parentheses deep.
+std::string generate_deep_expression(std::size_t depth);
+// `f(a, f(a, (... f(a, a))))` nested `depth` calls deep.
+std::string generate_nested_calls(std::size_t depth);
+
+// Reads the options from the arguments registered by KCCANI_PROGRAM_BENCHMARK.
+GeneratorOptions generator_options(const benchmark::State& state);
+
+}
+
+// Registers FUNCTION twice: scaling the number of functions up to
+// MAX_FUNCTIONS, with a fitted complexity, and as FUNCTION_shape over the
+// depth and fan-out of a fixed size program.
+#define KCCANI_PROGRAM_BENCHMARK(FUNCTION, MAX_FUNCTIONS)                             \
+    BENCHMARK(FUNCTION)                                                              \
+        ->ArgNames({"functions", "depth", "fan_out"})                                \
+        ->ArgsProduct({benchmark::CreateRange(64, MAX_FUNCTIONS, 4), {8}, {2}})      \
+        ->Complexity(benchmark::oN);                                                 \
+    BENCHMARK(FUNCTION)                                                              \
+        ->Name(#FUNCTION "_shape")                                                   \
+        ->ArgNames({"functions", "depth", "fan_out"})                                \
+        ->ArgsProduct({{1024}, {2, 8, 32}, {0, 4, 16}})
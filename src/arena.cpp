@@ -0,0 +1,26 @@
+#include "arena.hpp"
+
+#include <algorithm>
+
+namespace kccani
+{
+
+void* AstArena::allocate_slow(std::size_t size, std::size_t alignment)
+{
+    // Oversized requests get a block of their own, so that the current block
+    // keeps serving the small nodes.
+    std::size_t block_size = std::max(BLOCK_SIZE, size + alignment);
+    auto& block = this->blocks.emplace_back(new std::byte[block_size]);
+    if (block_size > BLOCK_SIZE)
+    {
+        auto address = reinterpret_cast<std::uintptr_t>(block.get());
+        auto aligned = (address + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+        this->allocated_bytes += size;
+        return reinterpret_cast<void*>(aligned);
+    }
+    this->cursor = block.get();
+    this->block_end = block.get() + block_size;
+    return this->allocate(size, alignment);
+}
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace kccani
+{
+
+// A fixed size array living in an AstArena.
+template <typename T>
+class ArenaSpan
+{
+    T* items = nullptr;
+    std::uint32_t count = 0;
+
+public:
+    ArenaSpan() = default;
+    ArenaSpan(T* _items, std::uint32_t _count) : items(_items), count(_count) {}
+    // Views a span of T as one of const T.
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U*, T*>>>
+    ArenaSpan(const ArenaSpan<U>& other) : items(other.begin()), count(static_cast<std::uint32_t>(other.size())) {}
+
+    [[nodiscard]] T* begin() const noexcept { return this->items; }
+    [[nodiscard]] T* end() const noexcept { return this->items + this->count; }
+    [[nodiscard]] std::size_t size() const noexcept { return this->count; }
+    [[nodiscard]] bool empty() const noexcept { return this->count == 0; }
+    [[nodiscard]] T& operator[](std::size_t index) const { return this->items[index]; }
+};
+
+// Bump pointer allocator owning the AST of one compilation unit. Nothing
+// allocated here is ever destroyed on its own, the memory of all of it is
+// released in one go with the arena, so only trivially destructible types
+// are accepted.
+class AstArena
+{
+    static constexpr std::size_t BLOCK_SIZE = 64 << 10;
+
+    std::vector<std::unique_ptr<std::byte[]>> blocks;
+    std::byte* cursor = nullptr;
+    std::byte* block_end = nullptr;
+    std::size_t allocated_bytes = 0;
+
+    void* allocate_slow(std::size_t size, std::size_t alignment);
+
+public:
+    AstArena() = default;
+    AstArena(const AstArena&) = delete;
+    AstArena& operator=(const AstArena&) = delete;
+
+    void* allocate(std::size_t size, std::size_t alignment)
+    {
+        auto address = reinterpret_cast<std::uintptr_t>(this->cursor);
+        auto aligned = (address + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+        if (aligned + size > reinterpret_cast<std::uintptr_t>(this->block_end))
+            return this->allocate_slow(size, alignment);
+        this->cursor = reinterpret_cast<std::byte*>(aligned + size);
+        this->allocated_bytes += size;
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena objects are never destroyed");
+        return new (this->allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Copies `items[begin, end)` into the arena.
+    template <typename T>
+    ArenaSpan<T> make_array(const std::vector<T>& items, std::size_t begin = 0)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Arena arrays are copied bytewise");
+        auto count = static_cast<std::uint32_t>(items.size() - begin);
+        if (count == 0)
+            return {};
+        T* copy = static_cast<T*>(this->allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_copy(items.begin() + begin, items.end(), copy);
+        return {copy, count};
+    }
+
+    // Bytes handed out so far, not counting alignment padding or the unused
+    // tail of each block.
+    [[nodiscard]] std::size_t size() const noexcept { return this->allocated_bytes; }
+};
+
+}
@@ -1,106 +1,204 @@
 #include "ast.hpp"
 #include "error.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <variant>
 
 namespace kccani
 {
 
-NumberExprAST::NumberExprAST(
-    double _value
-) : value(_value) {}
+namespace
+{
 
-std::string NumberExprAST::to_string()
+class ExprPrinter : public ExprVisitor<ExprPrinter, std::string>
 {
-    return std::to_string(this->value);
-}
+public:
+    std::string visit_number(const NumberExprAST* expr)
+    {
+        return std::to_string(expr->value);
+    }
 
-VariableExprAST::VariableExprAST(
-    const std::string &_name
-) : name(_name) {}
+    std::string visit_variable(const VariableExprAST* expr)
+    {
+        return expr->name.str();
+    }
 
-std::string VariableExprAST::to_string() 
+    std::string visit_binary(const BinaryExprAST* expr)
+    {
+        return "(" + this->visit(expr->lhs) + ") " + expr->opcode +
+            " (" + this->visit(expr->rhs) + ")";
+    }
+
+    std::string visit_call(const FunctionCallExprAST* expr)
+    {
+        std::string args_string = "";
+        for (int i = 0; i < expr->args.size(); i++)
+        {
+            args_string += this->visit(expr->args[i]);
+            if (i != expr->args.size() - 1) {
+                args_string += ", ";
+            }
+        }
+        return expr->callee.str() + "(" + args_string + ")";
+    }
+
+    std::string visit_unary(const UnaryExprAST* expr)
+    {
+        return expr->opcode + ("(" + this->visit(expr->operand) + ")");
+    }
+};
+
+}
+
+std::string ExprAST::to_string() const
 {
-    return this->name;
+    return ExprPrinter().visit(this);
 }
 
+NumberExprAST::NumberExprAST(
+    double _value
+) : ExprAST(TYPE), value(_value) {}
+
+VariableExprAST::VariableExprAST(
+    Symbol _name
+) : ExprAST(TYPE), name(_name) {}
+
 BinaryExprAST::BinaryExprAST(
     char _opcode,
-    std::unique_ptr<ExprAST> _lhs,
-    std::unique_ptr<ExprAST> _rhs
-) : opcode(_opcode), lhs(std::move(_lhs)), rhs(std::move(_rhs)) {}
-
-std::string BinaryExprAST::to_string()
-{
-    return "(" + this->lhs->to_string() + ") " + this->opcode + 
-        " (" + this->rhs->to_string() + ")";
-}
+    ExprAST* _lhs,
+    ExprAST* _rhs
+) : ExprAST(TYPE), opcode(_opcode), lhs(_lhs), rhs(_rhs) {}
 
 FunctionCallExprAST::FunctionCallExprAST(
-    const std::string &_callee,
-    std::vector<std::unique_ptr<ExprAST>> args
-) : callee(_callee), args(std::move(args)) {}
+    Symbol _callee,
+    ArenaSpan<ExprAST*> _args
+) : ExprAST(TYPE), callee(_callee), args(_args) {}
+
+UnaryExprAST::UnaryExprAST(
+    char _opcode,
+    ExprAST* _operand
+) : ExprAST(TYPE), opcode(_opcode), operand(_operand) {}
 
-std::string FunctionCallExprAST::to_string()
+FunctionPrototypeAST::FunctionPrototypeAST(
+    Symbol _name,
+    ArenaSpan<Symbol> _args
+) : name(_name), args(_args) {}
+
+std::string FunctionPrototypeAST::to_string() const
 {
     std::string args_string = "";
     for (int i = 0; i < this->args.size(); i++)
     {
-        args_string += this->args[i]->to_string();
+        args_string += this->args[i].name();
         if (i != this->args.size() - 1) {
             args_string += ", ";
         }
     }
-    return this->callee + "(" + args_string + ")";
+    return "def " + this->name.str() + "(" + args_string + ")";
 }
 
-FunctionPrototypeAST::FunctionPrototypeAST(
-    const std::string &_name,
-    std::vector<std::string> _args
-) : name(_name), args(std::move(_args)) {}
+FunctionAST::FunctionAST(
+    FunctionPrototypeAST* _prototype,
+    ExprAST* _body
+) : prototype(_prototype), body(_body) {}
 
-std::string FunctionPrototypeAST::to_string()
+std::string FunctionAST::to_string() const
 {
-    std::string args_string = "";
-    for (int i = 0; i < this->args.size(); i++)
+    return this->prototype->to_string() + "{" + this->body->to_string() + "}";
+}
+
+namespace
+{
+
+std::size_t hash_combine(std::size_t seed, std::size_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+}
+
+template <typename Node, typename Equal, typename Make>
+ExprAST* AstBuilder::unique_node(ExprAST::ExpressionType type, std::size_t hash, Equal&& equal, Make&& make)
+{
+    auto [begin, end] = this->unique_nodes.equal_range(hash);
+    for (auto it = begin; it != end; ++it)
     {
-        args_string += this->args[i];
-        if (i != this->args.size() - 1) {
-            args_string += ", ";
+        ExprAST* candidate = it->second;
+        if (candidate->get_type() == type && equal(static_cast<Node*>(candidate)))
+        {
+            candidate->shared = true;
+            this->shared_count++;
+            return candidate;
         }
     }
-    return "def " + this->name + "(" + args_string + ")";
+    ExprAST* node = make();
+    this->unique_nodes.emplace(hash, node);
+    return node;
 }
 
-FunctionAST::FunctionAST(
-    std::unique_ptr<FunctionPrototypeAST> _prototype,
-    std::unique_ptr<ExprAST> _body
-) : prototype(std::move(_prototype)), body(std::move(_body)) {}
-
-std::string FunctionAST::to_string()
+ExprAST* AstBuilder::unique_number(double value)
 {
-    return this->prototype->to_string() + "{" + this->body->to_string() + "}";
+    // Compare the bits, 0.0 and -0.0 must stay apart.
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return this->unique_node<NumberExprAST>(
+        ExprAST::ExpressionType::NUMBER_EXPR,
+        hash_combine(0, bits),
+        [&](NumberExprAST* node) { return std::memcmp(&node->value, &bits, sizeof(bits)) == 0; },
+        [&]() { return this->ast_arena->make<NumberExprAST>(value); });
 }
 
-ExprAST::ExpressionType NumberExprAST::get_type()
+ExprAST* AstBuilder::unique_variable(Symbol name)
 {
-    return ExprAST::ExpressionType::NUMBER_EXPR;
+    return this->unique_node<VariableExprAST>(
+        ExprAST::ExpressionType::VARIABLE_EXPR,
+        hash_combine(1, name.id),
+        [&](VariableExprAST* node) { return node->name.id == name.id; },
+        [&]() { return this->ast_arena->make<VariableExprAST>(name); });
 }
 
-ExprAST::ExpressionType VariableExprAST::get_type()
+ExprAST* AstBuilder::unique_binary(char opcode, ExprAST* lhs, ExprAST* rhs)
 {
-    return ExprAST::ExpressionType::VARIABLE_EXPR;
+    std::size_t hash = hash_combine(2, static_cast<unsigned char>(opcode));
+    hash = hash_combine(hash, reinterpret_cast<std::uintptr_t>(lhs));
+    hash = hash_combine(hash, reinterpret_cast<std::uintptr_t>(rhs));
+    return this->unique_node<BinaryExprAST>(
+        ExprAST::ExpressionType::BINARY_EXPR,
+        hash,
+        [&](BinaryExprAST* node) { return node->opcode == opcode && node->lhs == lhs && node->rhs == rhs; },
+        [&]() { return this->ast_arena->make<BinaryExprAST>(opcode, lhs, rhs); });
 }
 
-ExprAST::ExpressionType BinaryExprAST::get_type()
+ExprAST* AstBuilder::unique_call(Symbol callee, const std::vector<ExprAST*>& args, std::size_t begin)
 {
-    return ExprAST::ExpressionType::BINARY_EXPR;
+    std::size_t hash = hash_combine(3, callee.id);
+    for (std::size_t i = begin; i < args.size(); i++)
+        hash = hash_combine(hash, reinterpret_cast<std::uintptr_t>(args[i]));
+    return this->unique_node<FunctionCallExprAST>(
+        ExprAST::ExpressionType::FUNCTION_CALL_EXPR,
+        hash,
+        [&](FunctionCallExprAST* node) {
+            return node->callee.id == callee.id
+                && node->args.size() == args.size() - begin
+                && std::equal(node->args.begin(), node->args.end(), args.begin() + begin);
+        },
+        [&]() {
+            return this->ast_arena->make<FunctionCallExprAST>(callee, this->ast_arena->make_array(args, begin));
+        });
 }
 
-ExprAST::ExpressionType FunctionCallExprAST::get_type()
+ExprAST* AstBuilder::unique_unary(char opcode, ExprAST* operand)
 {
-    return ExprAST::ExpressionType::FUNCTION_CALL_EXPR;
+    std::size_t hash = hash_combine(4, static_cast<unsigned char>(opcode));
+    hash = hash_combine(hash, reinterpret_cast<std::uintptr_t>(operand));
+    return this->unique_node<UnaryExprAST>(
+        ExprAST::ExpressionType::UNARY_EXPR,
+        hash,
+        [&](UnaryExprAST* node) { return node->opcode == opcode && node->operand == operand; },
+        [&]() { return this->ast_arena->make<UnaryExprAST>(opcode, operand); });
 }
 
 }
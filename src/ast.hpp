@@ -1,122 +1,335 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <variant>
 #include <vector>
 
+#include "arena.hpp"
 #include "lexer.hpp"
+#include "operators.hpp"
+#include "symbol.hpp"
 
 namespace kccani
 {
 
-const std::vector<char> OPERATOR_PRECEDENCE_ORDER = {'*', '-', '+', '<'};
-
+// Expression nodes carry their kind as a plain tag rather than a vtable:
+// dispatch goes through ExprVisitor below or `dyn_cast`, both a switch on the
+// tag, and the nodes get a pointer smaller.
 class ExprAST
 {
 public:
-    enum class ExpressionType
+    enum class ExpressionType : std::uint8_t
     {
         NUMBER_EXPR,
         VARIABLE_EXPR,
         BINARY_EXPR,
         FUNCTION_CALL_EXPR,
+        UNARY_EXPR,
     };
 
-    virtual ~ExprAST() = default;
+    std::string to_string() const;
+    ExpressionType get_type() const noexcept { return this->type; }
+
+private:
+    ExpressionType type;
+
+public:
+    // Set when a hash-consing AstBuilder hands this node out more than once,
+    // which makes the tree a DAG.
+    bool shared = false;
 
-    virtual std::string to_string() = 0;
-    virtual ExpressionType get_type() = 0;
+protected:
+    explicit ExprAST(ExpressionType _type) : type(_type) {}
+    // Nodes live in an AstArena and are never deleted one by one.
+    ~ExprAST() = default;
 };
 
 class NumberExprAST : public ExprAST
 {
 public:
+    static constexpr ExpressionType TYPE = ExpressionType::NUMBER_EXPR;
     double value;
 
     NumberExprAST(
         double _value
     );
-
-    std::string to_string();
-    ExprAST::ExpressionType get_type() override;
 };
 
 class VariableExprAST : public ExprAST
 {
 public:
-    std::string name;
+    static constexpr ExpressionType TYPE = ExpressionType::VARIABLE_EXPR;
+    Symbol name;
 
     VariableExprAST(
-        const std::string &_name
+        Symbol _name
     );
-
-    std::string to_string();
-    ExprAST::ExpressionType get_type() override;
 };
 
 class BinaryExprAST : public ExprAST
 {
 public:
+    static constexpr ExpressionType TYPE = ExpressionType::BINARY_EXPR;
     char opcode;
-    std::unique_ptr<ExprAST> lhs, rhs;
+    ExprAST *lhs, *rhs;
 
     BinaryExprAST(
         char _opcode,
-        std::unique_ptr<ExprAST> _lhs,
-        std::unique_ptr<ExprAST> _rhs
+        ExprAST* _lhs,
+        ExprAST* _rhs
     );
-
-    std::string to_string();
-    ExprAST::ExpressionType get_type() override;
 };
 
 class FunctionCallExprAST : public ExprAST
 {
 public:
-    std::string callee;
-    std::vector<std::unique_ptr<ExprAST>> args;
+    static constexpr ExpressionType TYPE = ExpressionType::FUNCTION_CALL_EXPR;
+    Symbol callee;
+    ArenaSpan<ExprAST*> args;
 
     FunctionCallExprAST(
-        const std::string &_callee,
-        std::vector<std::unique_ptr<ExprAST>> _args
+        Symbol _callee,
+        ArenaSpan<ExprAST*> _args
+    );
+};
+
+// A user-defined prefix operator, a call to the function `unary<opcode>`.
+class UnaryExprAST : public ExprAST
+{
+public:
+    static constexpr ExpressionType TYPE = ExpressionType::UNARY_EXPR;
+    char opcode;
+    ExprAST* operand;
+
+    UnaryExprAST(
+        char _opcode,
+        ExprAST* _operand
     );
+};
+
+// `expr` as a `Node`, or nullptr when it is another kind of node.
+template <typename Node>
+Node* dyn_cast(ExprAST* expr) noexcept
+{
+    return expr && expr->get_type() == Node::TYPE ? static_cast<Node*>(expr) : nullptr;
+}
+
+template <typename Node>
+const Node* dyn_cast(const ExprAST* expr) noexcept
+{
+    return expr && expr->get_type() == Node::TYPE ? static_cast<const Node*>(expr) : nullptr;
+}
 
-    std::string to_string();
-    ExprAST::ExpressionType get_type() override;
+// Statically dispatched, read only walk over expressions. `Derived` provides
+//
+//     Result visit_number(const NumberExprAST*);
+//     Result visit_variable(const VariableExprAST*);
+//     Result visit_binary(const BinaryExprAST*);
+//     Result visit_call(const FunctionCallExprAST*);
+//     Result visit_unary(const UnaryExprAST*);
+//
+// and recurses by calling visit() on the children it wants. Visiting never
+// modifies the AST, so one parse can feed any number of visitors.
+template <typename Derived, typename Result>
+class ExprVisitor
+{
+public:
+    Result visit(const ExprAST* expr)
+    {
+        Derived& derived = static_cast<Derived&>(*this);
+        switch (expr->get_type())
+        {
+        case ExprAST::ExpressionType::NUMBER_EXPR:
+            return derived.visit_number(static_cast<const NumberExprAST*>(expr));
+        case ExprAST::ExpressionType::VARIABLE_EXPR:
+            return derived.visit_variable(static_cast<const VariableExprAST*>(expr));
+        case ExprAST::ExpressionType::BINARY_EXPR:
+            return derived.visit_binary(static_cast<const BinaryExprAST*>(expr));
+        case ExprAST::ExpressionType::FUNCTION_CALL_EXPR:
+            return derived.visit_call(static_cast<const FunctionCallExprAST*>(expr));
+        case ExprAST::ExpressionType::UNARY_EXPR:
+            return derived.visit_unary(static_cast<const UnaryExprAST*>(expr));
+        }
+        __builtin_unreachable();
+    }
 };
 
 class FunctionPrototypeAST
 {
 public:
-    std::string name;
-    std::vector<std::string> args;
+    Symbol name;
+    ArenaSpan<Symbol> args;
 
     FunctionPrototypeAST(
-        const std::string &_name,
-        std::vector<std::string> _args
+        Symbol _name,
+        ArenaSpan<Symbol> _args
     );
 
-    std::string to_string();
+    std::string to_string() const;
 };
 
 class FunctionAST
 {
 public:
-    std::unique_ptr<FunctionPrototypeAST> prototype;
-    std::unique_ptr<ExprAST> body;
+    FunctionPrototypeAST* prototype;
+    ExprAST* body;
 
     FunctionAST(
-        std::unique_ptr<FunctionPrototypeAST> _prototype,
-        std::unique_ptr<ExprAST> _body
+        FunctionPrototypeAST* _prototype,
+        ExprAST* _body
     );
 
-    std::string to_string();
+    std::string to_string() const;
 };
 
+static_assert(std::is_trivially_destructible_v<NumberExprAST>);
+static_assert(std::is_trivially_destructible_v<VariableExprAST>);
+static_assert(std::is_trivially_destructible_v<BinaryExprAST>);
+static_assert(std::is_trivially_destructible_v<FunctionCallExprAST>);
+static_assert(std::is_trivially_destructible_v<UnaryExprAST>);
+static_assert(std::is_trivially_destructible_v<FunctionPrototypeAST>);
+static_assert(std::is_trivially_destructible_v<FunctionAST>);
+
+// Top level items, pointing into the AstArena of the Parser that made them.
 using ParsedAstContentType = std::variant<
-    std::unique_ptr<FunctionAST>,
-    std::unique_ptr<FunctionPrototypeAST>,
-    std::unique_ptr<ExprAST>,
+    FunctionAST*,
+    FunctionPrototypeAST*,
+    ExprAST*,
     std::monostate>;
 
+// Builds the pointer tree for BasicParser, allocating it in an AstArena.
+//
+// With `share_subexpressions` the expression nodes are hash-consed: a node
+// structurally equal to one built before is not allocated again, the earlier
+// node is returned and marked shared. Children are already unique then, so
+// comparing them by address is a full structural comparison.
+//
+// Only nodes without side effects are shared, as evaluating a shared node
+// once must not change what the program does: calls, user-defined operators
+// and every node above one are allocated anew each time, unless the caller
+// vouches for them through the overloads taking `pure`.
+class AstBuilder
+{
+    std::shared_ptr<AstArena> ast_arena;
+    bool share_subexpressions;
+    // Structural hash to the nodes with that hash.
+    std::unordered_multimap<std::size_t, ExprAST*> unique_nodes;
+    // Nodes built while sharing that may have side effects.
+    std::unordered_set<const ExprAST*> impure_nodes;
+    std::size_t shared_count = 0;
+
+    [[nodiscard]] bool is_pure(const ExprAST* node) const { return !this->impure_nodes.count(node); }
+    ExprAST* impure(ExprAST* node)
+    {
+        this->impure_nodes.insert(node);
+        return node;
+    }
+
+    template <typename Node, typename Equal, typename Make>
+    ExprAST* unique_node(ExprAST::ExpressionType type, std::size_t hash, Equal&& equal, Make&& make);
+    ExprAST* unique_number(double value);
+    ExprAST* unique_variable(Symbol name);
+    ExprAST* unique_binary(char opcode, ExprAST* lhs, ExprAST* rhs);
+    ExprAST* unique_call(Symbol callee, const std::vector<ExprAST*>& args, std::size_t begin);
+    ExprAST* unique_unary(char opcode, ExprAST* operand);
+
+public:
+    using Expr = ExprAST*;
+    using Prototype = FunctionPrototypeAST*;
+    using Function = FunctionAST*;
+    using Item = ParsedAstContentType;
+
+    explicit AstBuilder(std::shared_ptr<AstArena> arena, bool _share_subexpressions = false)
+        : ast_arena(std::move(arena)), share_subexpressions(_share_subexpressions) {}
+
+    [[nodiscard]] const std::shared_ptr<AstArena>& arena() const noexcept { return this->ast_arena; }
+    // Nodes built from now on go to `arena`. Sharing starts over, so that no
+    // new node points into the previous arena.
+    void set_arena(std::shared_ptr<AstArena> arena)
+    {
+        this->ast_arena = std::move(arena);
+        this->unique_nodes.clear();
+        this->impure_nodes.clear();
+    }
+    // Number of nodes requested that an existing node was reused for.
+    [[nodiscard]] std::size_t shared_nodes() const noexcept { return this->shared_count; }
+
+    Expr number(double value)
+    {
+        if (this->share_subexpressions)
+            return this->unique_number(value);
+        return this->ast_arena->make<NumberExprAST>(value);
+    }
+    Expr variable(Symbol name)
+    {
+        if (this->share_subexpressions)
+            return this->unique_variable(name);
+        return this->ast_arena->make<VariableExprAST>(name);
+    }
+    Expr binary(char opcode, Expr lhs, Expr rhs)
+    {
+        return this->binary(opcode, lhs, rhs,
+            BUILTIN_OPERATORS[opcode].builtin && this->is_pure(lhs) && this->is_pure(rhs));
+    }
+    // `pure` tells whether the node, operands included, has no side effect.
+    Expr binary(char opcode, Expr lhs, Expr rhs, bool pure)
+    {
+        if (this->share_subexpressions)
+        {
+            if (pure)
+                return this->unique_binary(opcode, lhs, rhs);
+            return this->impure(this->ast_arena->make<BinaryExprAST>(opcode, lhs, rhs));
+        }
+        return this->ast_arena->make<BinaryExprAST>(opcode, lhs, rhs);
+    }
+    // The arguments are `args[begin, end)`.
+    Expr call(Symbol callee, const std::vector<Expr>& args, std::size_t begin)
+    {
+        return this->call(callee, args, begin, false);
+    }
+    Expr call(Symbol callee, const std::vector<Expr>& args, std::size_t begin, bool pure)
+    {
+        if (this->share_subexpressions)
+        {
+            if (pure)
+                return this->unique_call(callee, args, begin);
+            return this->impure(
+                this->ast_arena->make<FunctionCallExprAST>(callee, this->ast_arena->make_array(args, begin)));
+        }
+        return this->ast_arena->make<FunctionCallExprAST>(callee, this->ast_arena->make_array(args, begin));
+    }
+    Expr unary(char opcode, Expr operand)
+    {
+        return this->unary(opcode, operand, false);
+    }
+    Expr unary(char opcode, Expr operand, bool pure)
+    {
+        if (this->share_subexpressions)
+        {
+            if (pure)
+                return this->unique_unary(opcode, operand);
+            return this->impure(this->ast_arena->make<UnaryExprAST>(opcode, operand));
+        }
+        return this->ast_arena->make<UnaryExprAST>(opcode, operand);
+    }
+    Prototype prototype(Symbol name, const std::vector<Symbol>& params)
+    {
+        return this->ast_arena->make<FunctionPrototypeAST>(name, this->ast_arena->make_array(params));
+    }
+    Function function(Prototype prototype, Expr body) { return this->ast_arena->make<FunctionAST>(prototype, body); }
+
+    void begin_item() {}
+    Item function_item(Function function) { return function; }
+    Item extern_item(Prototype prototype) { return prototype; }
+    Item expression_item(Expr expression) { return expression; }
+    // Nodes of a failed item simply stay unused in the arena.
+    Item error_item() { return std::monostate{}; }
+};
+
 }
@@ -0,0 +1,393 @@
+#include "ast_cache.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <llvm/Support/xxhash.h>
+#include <spdlog/spdlog.h>
+
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+constexpr std::uint32_t NO_SYMBOL = std::numeric_limits<std::uint32_t>::max();
+
+struct ImageHeader
+{
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t source_hash;
+    std::uint32_t node_count;
+    std::uint32_t number_count;
+    std::uint32_t call_argument_count;
+    std::uint32_t parameter_count;
+    std::uint32_t item_count;
+    std::uint32_t symbol_count;
+    std::uint32_t string_bytes;
+    std::uint32_t reserved;
+};
+
+// FlatAst::Item with explicit widths and no padding.
+struct ImageItem
+{
+    std::uint32_t kind;
+    std::uint32_t name;
+    std::uint32_t parameters_begin;
+    std::uint32_t parameter_count;
+    std::uint32_t nodes_begin;
+    std::uint32_t body;
+};
+
+static_assert(std::is_trivially_copyable_v<ImageHeader> && sizeof(ImageHeader) == 48);
+static_assert(std::is_trivially_copyable_v<ImageItem> && sizeof(ImageItem) == 24);
+static_assert(sizeof(FlatAst::NodeKind) == 1);
+
+void append(std::string& image, const void* data, std::size_t size)
+{
+    image.append(static_cast<const char*>(data), size);
+    image.resize((image.size() + 7) & ~std::size_t(7), '\0');
+}
+
+template <typename T>
+void append(std::string& image, const std::vector<T>& items)
+{
+    append(image, items.data(), items.size() * sizeof(T));
+}
+
+// Hands out the sections of an image front to back.
+class ImageReader
+{
+    std::string_view image;
+    std::size_t cursor = 0;
+
+public:
+    explicit ImageReader(std::string_view _image) : image(_image) {}
+
+    const char* take(std::size_t size)
+    {
+        if (size > this->image.size() - this->cursor)
+            return nullptr;
+        const char* data = this->image.data() + this->cursor;
+        this->cursor = std::min(this->image.size(), (this->cursor + size + 7) & ~std::size_t(7));
+        return data;
+    }
+
+    template <typename T>
+    bool take(std::vector<T>& items, std::size_t count)
+    {
+        const char* data = this->take(count * sizeof(T));
+        if (!data)
+            return false;
+        items.resize(count);
+        std::memcpy(items.data(), data, count * sizeof(T));
+        return true;
+    }
+};
+
+}
+
+std::uint64_t AstCache::source_hash(std::string_view source)
+{
+    return llvm::xxHash64(llvm::StringRef(source.data(), source.size()));
+}
+
+std::string AstCache::cache_path(const std::string& source_path)
+{
+    return source_path + "c";
+}
+
+std::string AstCache::serialize(const FlatAst& ast, std::uint64_t source_hash)
+{
+    // Renumber the symbols in use densely, in order of first use.
+    std::vector<std::uint32_t> local_ids;
+    std::vector<Symbol> symbols;
+    auto local = [&](Symbol symbol) {
+        if (symbol.id >= local_ids.size())
+            local_ids.resize(symbol.id + 1, NO_SYMBOL);
+        if (local_ids[symbol.id] == NO_SYMBOL)
+        {
+            local_ids[symbol.id] = static_cast<std::uint32_t>(symbols.size());
+            symbols.push_back(symbol);
+        }
+        return local_ids[symbol.id];
+    };
+
+    std::vector<std::uint32_t> operands = ast.operands;
+    for (std::size_t node = 0; node < ast.kinds.size(); node++)
+        if (ast.kinds[node] == FlatAst::NodeKind::VARIABLE || ast.kinds[node] == FlatAst::NodeKind::CALL)
+            operands[node] = local(Symbol(operands[node]));
+    std::vector<std::uint32_t> parameters;
+    parameters.reserve(ast.parameters.size());
+    for (Symbol parameter : ast.parameters)
+        parameters.push_back(local(parameter));
+    std::vector<ImageItem> items;
+    items.reserve(ast.items.size());
+    for (const FlatAst::Item& item : ast.items)
+    {
+        bool has_prototype = item.kind == FlatAst::ItemKind::FUNCTION || item.kind == FlatAst::ItemKind::EXTERN;
+        items.push_back({
+            static_cast<std::uint32_t>(item.kind),
+            has_prototype ? local(item.name) : NO_SYMBOL,
+            item.parameters_begin,
+            item.parameter_count,
+            item.nodes_begin,
+            item.body,
+        });
+    }
+
+    std::vector<std::uint32_t> string_offsets{0};
+    std::string strings;
+    for (Symbol symbol : symbols)
+    {
+        strings += symbol.name();
+        string_offsets.push_back(static_cast<std::uint32_t>(strings.size()));
+    }
+
+    ImageHeader header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.source_hash = source_hash;
+    header.node_count = static_cast<std::uint32_t>(ast.kinds.size());
+    header.number_count = static_cast<std::uint32_t>(ast.numbers.size());
+    header.call_argument_count = static_cast<std::uint32_t>(ast.call_arguments.size());
+    header.parameter_count = static_cast<std::uint32_t>(parameters.size());
+    header.item_count = static_cast<std::uint32_t>(items.size());
+    header.symbol_count = static_cast<std::uint32_t>(symbols.size());
+    header.string_bytes = static_cast<std::uint32_t>(strings.size());
+
+    std::string image;
+    append(image, &header, sizeof(header));
+    append(image, ast.numbers);
+    append(image, operands);
+    append(image, ast.links);
+    append(image, ast.call_arguments);
+    append(image, parameters);
+    append(image, items);
+    append(image, string_offsets);
+    append(image, ast.kinds);
+    append(image, strings.data(), strings.size());
+    return image;
+}
+
+std::optional<FlatAst> AstCache::deserialize(std::string_view image, std::uint64_t source_hash)
+{
+    ImageReader reader(image);
+    const char* header_data = reader.take(sizeof(ImageHeader));
+    if (!header_data)
+        return std::nullopt;
+    ImageHeader header;
+    std::memcpy(&header, header_data, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        || header.version != VERSION
+        || header.source_hash != source_hash)
+        return std::nullopt;
+
+    FlatAst ast;
+    std::vector<std::uint32_t> parameters;
+    std::vector<ImageItem> items;
+    std::vector<std::uint32_t> string_offsets;
+    if (!reader.take(ast.numbers, header.number_count)
+        || !reader.take(ast.operands, header.node_count)
+        || !reader.take(ast.links, header.node_count)
+        || !reader.take(ast.call_arguments, header.call_argument_count)
+        || !reader.take(parameters, header.parameter_count)
+        || !reader.take(items, header.item_count)
+        || !reader.take(string_offsets, std::size_t(header.symbol_count) + 1)
+        || !reader.take(ast.kinds, header.node_count))
+        return std::nullopt;
+    const char* strings = reader.take(header.string_bytes);
+    if (!strings)
+        return std::nullopt;
+
+    std::vector<Symbol> symbols;
+    symbols.reserve(header.symbol_count);
+    for (std::uint32_t i = 0; i < header.symbol_count; i++)
+    {
+        std::uint32_t begin = string_offsets[i], end = string_offsets[i + 1];
+        if (begin > end || end > header.string_bytes)
+            return std::nullopt;
+        symbols.push_back(Symbol::intern(std::string_view(strings + begin, end - begin)));
+    }
+
+    // Map the symbols back, checking every index codegen will follow.
+    for (std::uint32_t node = 0; node < header.node_count; node++)
+    {
+        std::uint32_t& operand = ast.operands[node];
+        std::uint32_t link = ast.links[node];
+        switch (ast.kinds[node])
+        {
+        case FlatAst::NodeKind::NUMBER:
+            if (operand >= header.number_count)
+                return std::nullopt;
+            break;
+        case FlatAst::NodeKind::VARIABLE:
+            if (operand >= header.symbol_count)
+                return std::nullopt;
+            operand = symbols[operand].id;
+            break;
+        case FlatAst::NodeKind::BINARY:
+            if (node == 0 || link >= node - 1)
+                return std::nullopt;
+            break;
+        case FlatAst::NodeKind::UNARY:
+            break;
+        case FlatAst::NodeKind::CALL:
+            if (operand >= header.symbol_count
+                || link >= header.call_argument_count
+                || ast.call_arguments[link] > header.call_argument_count - link - 1)
+                return std::nullopt;
+            operand = symbols[operand].id;
+            break;
+        default:
+            return std::nullopt;
+        }
+    }
+    ast.parameters.reserve(header.parameter_count);
+    for (std::uint32_t parameter : parameters)
+    {
+        if (parameter >= header.symbol_count)
+            return std::nullopt;
+        ast.parameters.push_back(symbols[parameter]);
+    }
+    ast.items.reserve(header.item_count);
+    for (const ImageItem& image_item : items)
+    {
+        FlatAst::Item item;
+        item.kind = static_cast<FlatAst::ItemKind>(image_item.kind);
+        item.parameters_begin = image_item.parameters_begin;
+        item.parameter_count = image_item.parameter_count;
+        item.nodes_begin = image_item.nodes_begin;
+        item.body = image_item.body;
+        if (image_item.kind > static_cast<std::uint32_t>(FlatAst::ItemKind::ERROR)
+            || item.parameters_begin > header.parameter_count
+            || item.parameter_count > header.parameter_count - item.parameters_begin)
+            return std::nullopt;
+        if (item.kind == FlatAst::ItemKind::FUNCTION || item.kind == FlatAst::ItemKind::EXTERN)
+        {
+            if (image_item.name >= header.symbol_count)
+                return std::nullopt;
+            item.name = symbols[image_item.name];
+        }
+        if (item.kind == FlatAst::ItemKind::FUNCTION || item.kind == FlatAst::ItemKind::EXPRESSION)
+        {
+            if (item.body >= header.node_count || item.nodes_begin > item.body)
+                return std::nullopt;
+            // The nodes have to form one post-order expression, or the value
+            // stack of a linear scan would run dry.
+            std::size_t depth = 0;
+            for (FlatAst::NodeIndex node = item.nodes_begin; node <= item.body; node++)
+            {
+                std::size_t operands = 0;
+                if (ast.kinds[node] == FlatAst::NodeKind::BINARY)
+                    operands = 2;
+                else if (ast.kinds[node] == FlatAst::NodeKind::UNARY)
+                    operands = 1;
+                else if (ast.kinds[node] == FlatAst::NodeKind::CALL)
+                    operands = ast.argument_count(node);
+                if (depth < operands)
+                    return std::nullopt;
+                depth = depth - operands + 1;
+            }
+            if (depth != 1)
+                return std::nullopt;
+        }
+        ast.items.push_back(item);
+    }
+    return ast;
+}
+
+bool AstCache::write(const FlatAst& ast, std::uint64_t source_hash, const std::string& path)
+{
+    std::string image = AstCache::serialize(ast, source_hash);
+    std::string temporary_path = path + ".tmp";
+    {
+        std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+        if (!out.write(image.data(), image.size()))
+            return false;
+    }
+    if (std::rename(temporary_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::optional<FlatAst> AstCache::read(const std::string& path, std::uint64_t source_hash)
+{
+    try
+    {
+        auto image = SourceBuffer::from_file(path);
+        return AstCache::deserialize(image.view(), source_hash);
+    }
+    catch (const std::system_error&)
+    {
+        return std::nullopt;
+    }
+}
+
+// Only a regular file has a stable place for its image next to it: "-" is
+// standard input, and a pipe such as /dev/fd/N has other contents every run.
+static bool is_regular_file(const std::string& path)
+{
+    struct stat file_stat;
+    return path != "-" && ::stat(path.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+}
+
+FlatAst AstCache::load_or_parse(
+    const SourceBuffer& source,
+    const std::string& source_path,
+    bool* cache_hit,
+    ParallelParser* parser
+)
+{
+    const bool cacheable = is_regular_file(source_path);
+    std::uint64_t hash = AstCache::source_hash(source.view());
+    std::string path = AstCache::cache_path(source_path);
+    if (cacheable)
+    {
+        if (auto cached = AstCache::read(path, hash))
+        {
+            if (cache_hit)
+                *cache_hit = true;
+            return std::move(*cached);
+        }
+    }
+    if (cache_hit)
+        *cache_hit = false;
+
+    FlatAst ast;
+    BufferedDiagnostics diagnostics;
+    if (parser)
+        ast = parser->parse_flat(source.view(), diagnostics);
+    else
+    {
+        Lexer lexer(source);
+        BasicParser<FlatAstBuilder> flat_parser(lexer, FlatAstBuilder(ast));
+        flat_parser.set_diagnostics(diagnostics);
+        flat_parser.fetch_all();
+    }
+    diagnostics.replay(DiagnosticSink::standard());
+    // A cached program would skip its diagnostics next time.
+    if (!cacheable || !diagnostics.get_messages().empty())
+        return ast;
+    if (!AstCache::write(ast, hash, path))
+        spdlog::warn("Could not write the AST cache " + path);
+    return ast;
+}
+
+}
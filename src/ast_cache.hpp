@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "flat_ast.hpp"
+#include "parallel_parser.hpp"
+#include "source.hpp"
+
+namespace kccani
+{
+
+// On-disk image of a FlatAst, stored next to its source as `<source>c`
+// (`lib.kld` -> `lib.kldc`) so unchanged sources skip lexing and parsing.
+//
+// The image is a fixed header followed by the FlatAst arrays verbatim, each
+// 8 byte aligned, and a string table of the symbols they use. Symbol ids are
+// renumbered densely on write and mapped back through the global SymbolTable
+// on read, the only per element work besides copying. The header records
+// the xxHash64 of the source, an image for any other source is ignored.
+//
+// Images are written and read in host byte order and layout; VERSION changes
+// whenever that layout does.
+class AstCache
+{
+public:
+    static constexpr char MAGIC[4] = {'K', 'L', 'D', 'C'};
+    static constexpr std::uint32_t VERSION = 2;
+
+    static std::uint64_t source_hash(std::string_view source);
+    static std::string cache_path(const std::string& source_path);
+
+    static std::string serialize(const FlatAst& ast, std::uint64_t source_hash);
+    // nullopt for an image of another source, another VERSION, or one that is
+    // truncated or inconsistent.
+    static std::optional<FlatAst> deserialize(std::string_view image, std::uint64_t source_hash);
+
+    // Written to a temporary file first and renamed over `path`, so readers
+    // never see a partial image. Returns false if it could not be written.
+    static bool write(const FlatAst& ast, std::uint64_t source_hash, const std::string& path);
+    static std::optional<FlatAst> read(const std::string& path, std::uint64_t source_hash);
+
+    // The AST of `source`, read from the image at cache_path(source_path) if
+    // it matches, otherwise parsed (by `parser` if given) and written there
+    // for the next time. Sources that are not regular files, such as "-" for
+    // standard input, and sources that parse with errors are not cached.
+    static FlatAst load_or_parse(
+        const SourceBuffer& source,
+        const std::string& source_path,
+        bool* cache_hit = nullptr,
+        ParallelParser* parser = nullptr
+    );
+};
+
+}
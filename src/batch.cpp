@@ -0,0 +1,207 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <variant>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Threading.h>
+
+#include "codegen.hpp"
+#include "error.hpp"
+#include "jit.hpp"
+
+namespace kccani
+{
+
+// Defines `kernel_name` in the module of `function`, a BatchKernel::Entry
+// that calls it at every point of the range.
+static void define_kernel(llvm::Function& function, const std::string& kernel_name)
+{
+    llvm::Module& module = *function.getParent();
+    llvm::LLVMContext& context = module.getContext();
+    llvm::IRBuilder<> builder(context);
+    llvm::Type* value_type = builder.getDoubleTy();
+    llvm::Type* column_type = value_type->getPointerTo();
+    llvm::FunctionType* kernel_type = llvm::FunctionType::get(
+        builder.getVoidTy(),
+        {column_type->getPointerTo(), column_type, builder.getInt64Ty(), builder.getInt64Ty()},
+        false);
+    llvm::Function* kernel = llvm::Function::Create(
+        kernel_type, llvm::Function::ExternalLinkage, kernel_name, module);
+    llvm::Argument* columns = kernel->getArg(0);
+    llvm::Argument* results = kernel->getArg(1);
+    llvm::Argument* begin = kernel->getArg(2);
+    llvm::Argument* end = kernel->getArg(3);
+    columns->setName("columns");
+    results->setName("results");
+    begin->setName("begin");
+    end->setName("end");
+
+    llvm::BasicBlock* entry = llvm::BasicBlock::Create(context, "entry", kernel);
+    llvm::BasicBlock* loop = llvm::BasicBlock::Create(context, "loop", kernel);
+    llvm::BasicBlock* exit = llvm::BasicBlock::Create(context, "exit", kernel);
+
+    // The columns are loaded once, ahead of the loop.
+    builder.SetInsertPoint(entry);
+    llvm::SmallVector<llvm::Value*, 8> column_pointers;
+    for (std::size_t i = 0; i < function.arg_size(); i++)
+        column_pointers.push_back(builder.CreateLoad(
+            column_type, builder.CreateConstInBoundsGEP1_64(column_type, columns, i), "column"));
+    builder.CreateCondBr(builder.CreateICmpSLT(begin, end), loop, exit);
+
+    builder.SetInsertPoint(loop);
+    llvm::PHINode* index = builder.CreatePHI(builder.getInt64Ty(), 2, "i");
+    index->addIncoming(begin, entry);
+    llvm::SmallVector<llvm::Value*, 8> arguments;
+    for (llvm::Value* column : column_pointers)
+        arguments.push_back(builder.CreateLoad(
+            value_type, builder.CreateInBoundsGEP(value_type, column, index), "argument"));
+    llvm::Value* value = builder.CreateCall(&function, arguments, "value");
+    builder.CreateStore(value, builder.CreateInBoundsGEP(value_type, results, index));
+    llvm::Value* next = builder.CreateAdd(index, builder.getInt64(1), "next", true, true);
+    index->addIncoming(next, loop);
+    builder.CreateCondBr(builder.CreateICmpSLT(next, end), loop, exit);
+
+    builder.SetInsertPoint(exit);
+    builder.CreateRetVoid();
+}
+
+BatchEvaluator::BatchEvaluator(unsigned threads, bool _fast_math, std::size_t _min_chunk_points)
+    : fast_math(_fast_math), min_chunk_points(std::max<std::size_t>(_min_chunk_points, 1))
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    // The optimizer and the JIT target the same host, vector extensions
+    // included.
+    auto machine_builder = unwrap(llvm::orc::JITTargetMachineBuilder::detectHost());
+    machine_builder.setCodeGenOptLevel(llvm::CodeGenOpt::Aggressive);
+    this->machine = unwrap(machine_builder.createTargetMachine());
+    this->jit = unwrap(llvm::orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(machine_builder)).create());
+    this->jit->getMainJITDylib().addGenerator(unwrap(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(this->jit->getDataLayout().getGlobalPrefix())));
+    if (threads != 1)
+        this->pool = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(threads));
+}
+
+BatchEvaluator::~BatchEvaluator() = default;
+
+// Every kernel gets a module of its own, in which the program's definitions
+// are internal: the copies inlined into the loop are the only ones left, and
+// kernels of the same program do not clash.
+BatchKernel BatchEvaluator::compile(const std::vector<ParsedAstContentType>& asts, const std::string& name)
+{
+    CodeGeneratorLLVM codegen;
+    for (const ParsedAstContentType& ast : asts)
+    {
+        if (std::holds_alternative<FunctionAST*>(ast))
+            codegen(std::get<FunctionAST*>(ast));
+        else if (std::holds_alternative<FunctionPrototypeAST*>(ast))
+            codegen(std::get<FunctionPrototypeAST*>(ast));
+    }
+    GeneratedModule generated = codegen.take_module();
+
+    const std::string kernel_name = "__batch." + std::to_string(this->kernel_count++);
+    std::size_t arity = 0;
+    generated.module.withModuleDo([&](llvm::Module& module) {
+        llvm::Function* function = module.getFunction(name);
+        if (!function || function->isDeclaration())
+            throw JitException("No function " + name + " is defined to evaluate in batches");
+        arity = function->arg_size();
+        module.setTargetTriple(this->machine->getTargetTriple().str());
+        module.setDataLayout(this->machine->createDataLayout());
+        for (llvm::Function& definition : module)
+        {
+            if (definition.isDeclaration())
+                continue;
+            definition.setLinkage(llvm::GlobalValue::InternalLinkage);
+            definition.addFnAttr(llvm::Attribute::AlwaysInline);
+            if (!this->fast_math)
+                continue;
+            for (llvm::BasicBlock& block : definition)
+                for (llvm::Instruction& instruction : block)
+                    if (llvm::isa<llvm::FPMathOperator>(instruction))
+                        instruction.setFast(true);
+        }
+        define_kernel(*function, kernel_name);
+        for (llvm::Function& definition : module)
+        {
+            if (definition.isDeclaration())
+                continue;
+            definition.addFnAttr("target-cpu", this->machine->getTargetCPU());
+            definition.addFnAttr("target-features", this->machine->getTargetFeatureString());
+        }
+        if (llvm::verifyModule(module, &llvm::errs()))
+            throw JitException("The batch kernel of " + name + " is invalid");
+
+        llvm::LoopAnalysisManager loop_analyses;
+        llvm::FunctionAnalysisManager function_analyses;
+        llvm::CGSCCAnalysisManager cgscc_analyses;
+        llvm::ModuleAnalysisManager module_analyses;
+        llvm::PassBuilder pass_builder(this->machine.get());
+        pass_builder.registerModuleAnalyses(module_analyses);
+        pass_builder.registerCGSCCAnalyses(cgscc_analyses);
+        pass_builder.registerFunctionAnalyses(function_analyses);
+        pass_builder.registerLoopAnalyses(loop_analyses);
+        pass_builder.crossRegisterProxies(loop_analyses, function_analyses, cgscc_analyses, module_analyses);
+        pass_builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3).run(module, module_analyses);
+    });
+    unwrap(this->jit->addIRModule(std::move(generated.module)));
+    auto address = unwrap(this->jit->lookup(kernel_name)).getAddress();
+    return {reinterpret_cast<BatchKernel::Entry>(address), arity};
+}
+
+void BatchEvaluator::evaluate(
+    const BatchKernel& kernel,
+    llvm::ArrayRef<llvm::ArrayRef<double>> columns,
+    llvm::MutableArrayRef<double> results
+)
+{
+    if (columns.size() != kernel.arity)
+        throw JitException("Expected " + std::to_string(kernel.arity) + " argument columns, got "
+            + std::to_string(columns.size()));
+    const std::size_t points = results.size();
+    const auto results_begin = reinterpret_cast<std::uintptr_t>(results.data());
+    const auto results_end = reinterpret_cast<std::uintptr_t>(results.data() + points);
+    bool shifted_overlap = false;
+    llvm::SmallVector<const double*, 8> column_pointers;
+    for (llvm::ArrayRef<double> column : columns)
+    {
+        if (column.size() != points)
+            throw JitException("An argument column has " + std::to_string(column.size()) + " values for "
+                + std::to_string(points) + " results");
+        const auto column_begin = reinterpret_cast<std::uintptr_t>(column.data());
+        const auto column_end = reinterpret_cast<std::uintptr_t>(column.data() + points);
+        shifted_overlap = shifted_overlap
+            || (column_begin != results_begin && column_begin < results_end && results_begin < column_end);
+        column_pointers.push_back(column.data());
+    }
+
+    // A point may then read what another one wrote, which only the single
+    // ascending pass of one chunk does in a defined order.
+    std::size_t workers = this->pool && !shifted_overlap ? this->pool->getThreadCount() : 1;
+    std::size_t chunk_count = std::max<std::size_t>(1, std::min(workers, points / this->min_chunk_points));
+    auto run = [&](std::size_t chunk) {
+        kernel.entry(column_pointers.data(), results.data(),
+            static_cast<std::int64_t>(points * chunk / chunk_count),
+            static_cast<std::int64_t>(points * (chunk + 1) / chunk_count));
+    };
+    if (this->pool && chunk_count > 1)
+    {
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++)
+            this->pool->async([&run, chunk]() { run(chunk); });
+        this->pool->wait();
+    }
+    else
+    {
+        run(0);
+    }
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "ast.hpp"
+
+namespace kccani
+{
+
+// A function compiled by BatchEvaluator::compile(), to evaluate over arrays
+// of arguments. Valid as long as its evaluator.
+struct BatchKernel
+{
+    // Stores the function's value for every point in [begin, end) to
+    // `results`, its arguments being `columns[0][i]`, `columns[1][i]`, ...
+    using Entry = void (*)(const double* const* columns, double* results, std::int64_t begin, std::int64_t end);
+
+    Entry entry = nullptr;
+    std::size_t arity = 0;
+};
+
+// Evaluates one function of a program over many points at once, for
+// workloads that would otherwise call it once per point.
+//
+// compile() generates the program's definitions into a module of their own
+// together with a loop over the points that calls the function, and
+// optimizes the module at -O3 for the host: the function, and whatever it
+// calls that can be, is inlined into the loop, which the loop vectorizer
+// then turns into one over vectors as wide as the host's. Runtime checks
+// fall back to the scalar loop when the results overlap an argument column.
+// With `fast_math`, every floating point operation of the module is marked
+// fast, which allows reassociation and contraction into FMAs; results may
+// then differ in the last bits, and for NaN, infinite or signed zero
+// arguments. Calls that remain, of recursive functions or of `extern`s of
+// the C library, keep their iterations scalar, but still save a call per
+// point from C++.
+//
+// evaluate() splits the points into consecutive chunks of at least
+// `min_chunk_points`, one per thread of the evaluator.
+class BatchEvaluator
+{
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<llvm::TargetMachine> machine;
+    bool fast_math;
+    std::size_t min_chunk_points;
+    std::unique_ptr<llvm::ThreadPool> pool;
+    std::size_t kernel_count = 0;
+
+public:
+    static constexpr std::size_t DEFAULT_MIN_CHUNK_POINTS = 1 << 14;
+
+    // `threads` 0 evaluates on every hardware thread, 1 on the calling
+    // thread. Throws JitException if no JIT can be made for the host.
+    explicit BatchEvaluator(
+        unsigned threads = 1,
+        bool _fast_math = false,
+        std::size_t _min_chunk_points = DEFAULT_MIN_CHUNK_POINTS
+    );
+    ~BatchEvaluator();
+
+    // Compiles a kernel for the function `name` defined in `asts`, whose
+    // other definitions and externs it may call. Top level expressions are
+    // ignored. Throws JitException if `name` is not defined, for example
+    // because its body failed to generate, or if the program does not link.
+    BatchKernel compile(const std::vector<ParsedAstContentType>& asts, const std::string& name);
+
+    // Evaluates `kernel` at every point, the i-th point's arguments being
+    // the i-th values of `columns`, one column per argument, into `results`.
+    // Results are those of evaluating the points one at a time in ascending
+    // order, so `results` may overlap the columns. Evaluating in place is
+    // safe on any number of threads; a column shifted against `results`
+    // keeps the evaluation on the calling thread.
+    // Throws JitException, before evaluating anything, if there are not as
+    // many columns as arguments or if a column is not as long as `results`.
+    // Evaluations of one evaluator must not run concurrently.
+    void evaluate(
+        const BatchKernel& kernel,
+        llvm::ArrayRef<llvm::ArrayRef<double>> columns,
+        llvm::MutableArrayRef<double> results
+    );
+};
+
+}
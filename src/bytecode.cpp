@@ -0,0 +1,491 @@
+#include "bytecode.hpp"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+namespace kccani
+{
+
+static constexpr std::uint32_t REGISTER_LIMIT = std::numeric_limits<std::uint16_t>::max() + 1;
+
+static std::string register_name(std::uint16_t number)
+{
+    return "r" + std::to_string(number);
+}
+
+std::uint32_t BytecodeProgram::find(std::string_view name) const noexcept
+{
+    for (std::size_t index = this->functions.size(); index-- > 0;)
+    {
+        if (this->functions[index].name == name)
+            return static_cast<std::uint32_t>(index);
+    }
+    return NO_FUNCTION;
+}
+
+std::string BytecodeProgram::to_string(const BytecodeFunction& function) const
+{
+    std::string text = (function.is_defined() ? "def " : "extern ") + function.name + "/" + std::to_string(function.arity);
+    if (!function.is_defined())
+        return text + "\n";
+    text += ", " + std::to_string(function.register_count) + " registers\n";
+    for (const Instruction& instruction : function.code)
+    {
+        std::string destination = register_name(instruction.destination);
+        std::string left = register_name(instruction.left);
+        std::string right = register_name(instruction.right);
+        switch (instruction.opcode)
+        {
+        case Opcode::LOAD_CONSTANT:
+            text += "    load_constant " + destination + ", " + std::to_string(function.constants[instruction.index()]);
+            break;
+        case Opcode::MOVE:
+            text += "    move " + destination + ", " + left;
+            break;
+        case Opcode::ADD:
+            text += "    add " + destination + ", " + left + ", " + right;
+            break;
+        case Opcode::SUBTRACT:
+            text += "    subtract " + destination + ", " + left + ", " + right;
+            break;
+        case Opcode::MULTIPLY:
+            text += "    multiply " + destination + ", " + left + ", " + right;
+            break;
+        case Opcode::LESS_THAN:
+            text += "    less_than " + destination + ", " + left + ", " + right;
+            break;
+        case Opcode::CALL:
+            text += "    call " + destination + ", " + this->functions[instruction.index()].name;
+            break;
+        case Opcode::RETURN:
+            text += "    return " + left;
+            break;
+        }
+        text += "\n";
+    }
+    return text;
+}
+
+std::string BytecodeProgram::to_string() const
+{
+    std::string text;
+    for (const BytecodeFunction& function : this->functions)
+        text += this->to_string(function);
+    return text;
+}
+
+std::uint32_t BytecodeCompiler::declare(Symbol name, std::size_t arity)
+{
+    std::vector<std::uint32_t>& indices = this->program.function_indices;
+    if (name.id >= indices.size())
+        indices.resize(std::max<std::size_t>(name.id + 1, SymbolTable::global().size()), BytecodeProgram::NO_FUNCTION);
+    BytecodeFunction function;
+    function.name = name.str();
+    function.arity = static_cast<std::uint32_t>(arity);
+    this->program.functions.push_back(std::move(function));
+    indices[name.id] = static_cast<std::uint32_t>(this->program.functions.size() - 1);
+    return indices[name.id];
+}
+
+// An `extern` matching an earlier declaration or definition keeps it, one
+// that does not replaces it for later calls, as in CodeGeneratorLLVM.
+bool BytecodeCompiler::declare_extern(Symbol name, std::size_t arity)
+{
+    std::uint32_t index = this->program.find(name);
+    if (index == BytecodeProgram::NO_FUNCTION || this->program.functions[index].arity != arity)
+        this->declare(name, arity);
+    return true;
+}
+
+std::uint32_t BytecodeCompiler::lookup_callee(Symbol callee, std::size_t argument_count)
+{
+    std::uint32_t index = this->program.find(callee);
+    if (index == BytecodeProgram::NO_FUNCTION)
+    {
+        spdlog::error("Undefined function with name: " + callee.str());
+        return BytecodeProgram::NO_FUNCTION;
+    }
+    if (this->program.functions[index].arity != argument_count)
+    {
+        spdlog::error("Incorrect number of arguments passed");
+        return BytecodeProgram::NO_FUNCTION;
+    }
+    return index;
+}
+
+std::uint32_t BytecodeCompiler::lookup_operator(Symbol keyword, char opcode, std::size_t operand_count)
+{
+    Symbol name = Symbol::intern(std::string(keyword.name()) + opcode);
+    if (this->program.find(name) == BytecodeProgram::NO_FUNCTION)
+    {
+        spdlog::error("Unknown operator: " + std::string(1, opcode));
+        return BytecodeProgram::NO_FUNCTION;
+    }
+    return this->lookup_callee(name, operand_count);
+}
+
+void BytecodeCompiler::emit(Instruction instruction)
+{
+    this->function->code.push_back(instruction);
+}
+
+bool BytecodeCompiler::allocate(std::uint16_t& destination)
+{
+    if (this->next_register >= REGISTER_LIMIT)
+    {
+        spdlog::error("Expression of " + this->function->name + " needs too many registers");
+        return false;
+    }
+    destination = static_cast<std::uint16_t>(this->next_register++);
+    this->function->register_count = std::max(this->function->register_count, this->next_register);
+    return true;
+}
+
+// The temporaries on the operand stack are always the registers from the
+// arity up to `next_register`, in order, so those among the top `count`
+// operands are the last allocated and freeing them is resetting
+// `next_register` to the first.
+std::uint16_t BytecodeCompiler::pop_operands(std::size_t count)
+{
+    const std::size_t begin = this->operands.size() - count;
+    for (std::size_t i = begin; i < this->operands.size(); i++)
+    {
+        if (this->operands[i] >= this->function->arity)
+        {
+            this->next_register = this->operands[i];
+            break;
+        }
+    }
+    this->operands.resize(begin);
+    return static_cast<std::uint16_t>(this->next_register);
+}
+
+bool BytecodeCompiler::push_number(double value)
+{
+    std::uint16_t destination;
+    if (!this->allocate(destination))
+        return false;
+    std::vector<double>& constants = this->function->constants;
+    this->emit(Instruction::with_index(Opcode::LOAD_CONSTANT, destination, static_cast<std::uint32_t>(constants.size())));
+    constants.push_back(value);
+    this->operands.push_back(destination);
+    return true;
+}
+
+// Reads the argument in place. A later parameter of the same name hides an
+// earlier one, as in CodeGeneratorLLVM.
+bool BytecodeCompiler::push_variable(Symbol name)
+{
+    for (std::size_t i = this->parameters.size(); i-- > 0;)
+    {
+        if (this->parameters[i] == name)
+        {
+            this->operands.push_back(static_cast<std::uint16_t>(i));
+            return true;
+        }
+    }
+    spdlog::error("Unknown variable name: " + name.str());
+    return false;
+}
+
+bool BytecodeCompiler::push_binary(char opcode)
+{
+    Opcode operation;
+    switch (opcode)
+    {
+    case '+':
+        operation = Opcode::ADD;
+        break;
+    case '-':
+        operation = Opcode::SUBTRACT;
+        break;
+    case '*':
+        operation = Opcode::MULTIPLY;
+        break;
+    case '<':
+        operation = Opcode::LESS_THAN;
+        break;
+    default:
+    {
+        // A user-defined operator, implemented by the function `binary<op>`.
+        std::uint32_t callee = this->lookup_operator(symbols::BINARY, opcode, 2);
+        return callee != BytecodeProgram::NO_FUNCTION && this->push_call(callee, 2);
+    }
+    }
+    std::uint16_t right = this->operands.back();
+    std::uint16_t left = this->operands[this->operands.size() - 2];
+    this->pop_operands(2);
+    std::uint16_t destination;
+    if (!this->allocate(destination))
+        return false;
+    this->emit({operation, destination, left, right});
+    this->operands.push_back(destination);
+    return true;
+}
+
+bool BytecodeCompiler::push_unary(char opcode)
+{
+    std::uint32_t callee = this->lookup_operator(symbols::UNARY, opcode, 1);
+    return callee != BytecodeProgram::NO_FUNCTION && this->push_call(callee, 1);
+}
+
+// The arguments go to consecutive registers from the first temporary among
+// them. Every temporary argument is then at or below its place, so moving
+// them from the last one down never overwrites one still to move.
+bool BytecodeCompiler::push_call(std::uint32_t callee, std::size_t argument_count)
+{
+    const std::size_t begin = this->operands.size() - argument_count;
+    std::vector<std::uint16_t> arguments(this->operands.begin() + begin, this->operands.end());
+    std::uint16_t base = this->pop_operands(argument_count);
+    if (base + argument_count > REGISTER_LIMIT)
+    {
+        spdlog::error("Expression of " + this->function->name + " needs too many registers");
+        return false;
+    }
+    for (std::size_t i = argument_count; i-- > 0;)
+    {
+        if (arguments[i] != base + i)
+            this->emit({Opcode::MOVE, static_cast<std::uint16_t>(base + i), arguments[i]});
+    }
+    std::uint16_t destination;
+    if (!this->allocate(destination))
+        return false;
+    this->function->register_count = std::max(this->function->register_count, static_cast<std::uint32_t>(base + argument_count));
+    this->emit(Instruction::with_index(Opcode::CALL, destination, callee));
+    std::vector<std::uint32_t>& callees = this->function->callees;
+    if (std::find(callees.begin(), callees.end(), callee) == callees.end())
+        callees.push_back(callee);
+    this->operands.push_back(destination);
+    return true;
+}
+
+// Post-order with an explicit stack, like CodeGeneratorLLVM::generate_expression(),
+// looking a call's callee up before its arguments, but stopping at the first
+// error. Shared subexpressions are compiled at every use.
+bool BytecodeCompiler::compile_expression(const ExprAST* root)
+{
+    std::vector<PendingNode>& pending = this->pending_nodes;
+    pending.clear();
+    pending.push_back({root});
+    while (!pending.empty())
+    {
+        PendingNode& top = pending.back();
+        const ExprAST* node = top.node;
+        switch (node->get_type())
+        {
+        case ExprAST::ExpressionType::NUMBER_EXPR:
+            if (!this->push_number(static_cast<const NumberExprAST*>(node)->value))
+                return false;
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::VARIABLE_EXPR:
+            if (!this->push_variable(static_cast<const VariableExprAST*>(node)->name))
+                return false;
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::BINARY_EXPR:
+        {
+            auto binary = static_cast<const BinaryExprAST*>(node);
+            if (top.next_child < 2)
+            {
+                const ExprAST* child = top.next_child == 0 ? binary->lhs : binary->rhs;
+                top.next_child++;
+                pending.push_back({child});
+                break;
+            }
+            if (!this->push_binary(binary->opcode))
+                return false;
+            pending.pop_back();
+            break;
+        }
+        case ExprAST::ExpressionType::UNARY_EXPR:
+        {
+            auto unary = static_cast<const UnaryExprAST*>(node);
+            if (top.next_child == 0)
+            {
+                top.next_child++;
+                pending.push_back({unary->operand});
+                break;
+            }
+            if (!this->push_unary(unary->opcode))
+                return false;
+            pending.pop_back();
+            break;
+        }
+        case ExprAST::ExpressionType::FUNCTION_CALL_EXPR:
+        {
+            auto call = static_cast<const FunctionCallExprAST*>(node);
+            if (top.next_child == 0)
+            {
+                top.callee = this->lookup_callee(call->callee, call->args.size());
+                if (top.callee == BytecodeProgram::NO_FUNCTION)
+                    return false;
+            }
+            if (top.next_child < call->args.size())
+            {
+                const ExprAST* arg = call->args[top.next_child];
+                top.next_child++;
+                pending.push_back({arg});
+                break;
+            }
+            if (!this->push_call(top.callee, call->args.size()))
+                return false;
+            pending.pop_back();
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+// The nodes are in post-order, so operands are always on top of the stack
+// by the time their user is reached.
+bool BytecodeCompiler::compile_flat_expression(const FlatAst& ast, const FlatAst::Item& item)
+{
+    for (FlatAst::NodeIndex node = item.nodes_begin; node <= item.body; node++)
+    {
+        bool compiled = true;
+        switch (ast.kind(node))
+        {
+        case FlatAst::NodeKind::NUMBER:
+            compiled = this->push_number(ast.number(node));
+            break;
+        case FlatAst::NodeKind::VARIABLE:
+            compiled = this->push_variable(ast.variable(node));
+            break;
+        case FlatAst::NodeKind::BINARY:
+            compiled = this->push_binary(ast.opcode(node));
+            break;
+        case FlatAst::NodeKind::UNARY:
+            compiled = this->push_unary(ast.opcode(node));
+            break;
+        case FlatAst::NodeKind::CALL:
+        {
+            std::uint32_t count = ast.argument_count(node);
+            std::uint32_t callee = this->lookup_callee(ast.callee(node), count);
+            compiled = callee != BytecodeProgram::NO_FUNCTION && this->push_call(callee, count);
+            break;
+        }
+        }
+        if (!compiled)
+            return false;
+    }
+    return true;
+}
+
+// The body is compiled into a function of its own and moved into the
+// program's once complete, so that a body that fails leaves nothing behind.
+template <typename CompileBody>
+bool BytecodeCompiler::define(Symbol name, ArenaSpan<const Symbol> _parameters, CompileBody&& compile_body)
+{
+    const bool declared_here = this->program.find(name) == BytecodeProgram::NO_FUNCTION;
+    std::uint32_t index = declared_here ? this->declare(name, _parameters.size()) : this->program.find(name);
+    if (this->program.functions[index].arity != _parameters.size())
+    {
+        spdlog::error("Definition of " + name.str() + " does not match its declaration");
+        return false;
+    }
+    if (this->program.functions[index].is_defined())
+    {
+        spdlog::error("Redefinition of function " + name.str());
+        return false;
+    }
+
+    BytecodeFunction body;
+    body.name = this->program.functions[index].name;
+    body.arity = static_cast<std::uint32_t>(_parameters.size());
+    body.register_count = body.arity;
+    this->function = &body;
+    this->parameters = _parameters;
+    this->operands.clear();
+    this->next_register = body.arity;
+    const bool compiled = compile_body();
+    this->function = nullptr;
+    if (!compiled)
+    {
+        if (declared_here)
+        {
+            this->program.functions.pop_back();
+            this->program.function_indices[name.id] = BytecodeProgram::NO_FUNCTION;
+        }
+        return false;
+    }
+    body.code.push_back({Opcode::RETURN, 0, this->operands.back()});
+    body.host = this->program.functions[index].host;
+    this->program.functions[index] = std::move(body);
+    return true;
+}
+
+template <typename CompileBody>
+bool BytecodeCompiler::define_expression(CompileBody&& compile_body)
+{
+    std::string name(symbols::ANON_EXPR.name());
+    if (this->program.expression_count > 0)
+        name += "." + std::to_string(this->program.expression_count);
+    // Declared fresh every time, define() then finds it in the slot.
+    std::uint32_t index = this->declare(symbols::ANON_EXPR, 0);
+    this->program.functions[index].name = name;
+    const bool defined = this->define(symbols::ANON_EXPR, {}, std::forward<CompileBody>(compile_body));
+    this->program.function_indices[symbols::ANON_EXPR.id] = BytecodeProgram::NO_FUNCTION;
+    if (!defined)
+    {
+        this->program.functions.pop_back();
+        return false;
+    }
+    this->program.expressions.push_back(index);
+    this->program.expression_count++;
+    return true;
+}
+
+bool BytecodeCompiler::operator()(const ExprAST* ast)
+{
+    return this->define_expression([&]() {
+        return this->compile_expression(ast);
+    });
+}
+
+bool BytecodeCompiler::operator()(const FunctionAST* ast)
+{
+    return this->define(ast->prototype->name, ast->prototype->args, [&]() {
+        return this->compile_expression(ast->body);
+    });
+}
+
+bool BytecodeCompiler::operator()(const FunctionPrototypeAST* ast)
+{
+    return this->declare_extern(ast->name, ast->args.size());
+}
+
+bool BytecodeCompiler::operator()(std::monostate)
+{
+    return false;
+}
+
+bool BytecodeCompiler::operator()(const FlatAst& ast, const FlatAst::Item& item)
+{
+    switch (item.kind)
+    {
+    case FlatAst::ItemKind::FUNCTION:
+        return this->define(item.name, ast.parameters_of(item), [&]() {
+            return this->compile_flat_expression(ast, item);
+        });
+    case FlatAst::ItemKind::EXTERN:
+        return this->declare_extern(item.name, item.parameter_count);
+    case FlatAst::ItemKind::EXPRESSION:
+        return this->define_expression([&]() {
+            return this->compile_flat_expression(ast, item);
+        });
+    case FlatAst::ItemKind::ERROR:
+        break;
+    }
+    return false;
+}
+
+void BytecodeCompiler::compile(const FlatAst& ast)
+{
+    for (const FlatAst::Item& item : ast.get_items())
+        (*this)(ast, item);
+}
+
+}
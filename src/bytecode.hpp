@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "ast.hpp"
+#include "flat_ast.hpp"
+#include "symbol.hpp"
+
+namespace kccani
+{
+
+enum class Opcode : std::uint8_t
+{
+    // r[destination] = constants[index()]
+    LOAD_CONSTANT,
+    // r[destination] = r[left]
+    MOVE,
+    // r[destination] = r[left] <op> r[right]
+    ADD,
+    SUBTRACT,
+    MULTIPLY,
+    // 1 if r[left] < r[right] or either is NaN, else 0, as the LLVM code.
+    LESS_THAN,
+    // Calls functions[index()] with its arguments in r[destination],
+    // r[destination + 1], ..., and leaves its result in r[destination].
+    CALL,
+    // Returns r[left].
+    RETURN,
+};
+
+// One instruction of a register machine whose registers hold doubles, eight
+// bytes. A function's arguments are its first registers.
+struct Instruction
+{
+    Opcode opcode;
+    std::uint16_t destination = 0;
+    std::uint16_t left = 0;
+    std::uint16_t right = 0;
+
+    // LOAD_CONSTANT and CALL keep a 32 bit index in `left` and `right`.
+    [[nodiscard]] std::uint32_t index() const noexcept
+    {
+        return this->left | static_cast<std::uint32_t>(this->right) << 16;
+    }
+    static Instruction with_index(Opcode opcode, std::uint16_t destination, std::uint32_t index) noexcept
+    {
+        return {opcode, destination, static_cast<std::uint16_t>(index), static_cast<std::uint16_t>(index >> 16)};
+    }
+};
+
+// A function of a BytecodeProgram: defined by `code`, or declared only, an
+// `extern` that links to the host function of the same name.
+struct BytecodeFunction
+{
+    std::string name;
+    std::uint32_t arity = 0;
+    // Registers a call needs, arguments included.
+    std::uint32_t register_count = 0;
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    // Indices of the functions `code` calls, for linking.
+    std::vector<std::uint32_t> callees;
+    // The host function of a declaration, once linked.
+    void* host = nullptr;
+
+    [[nodiscard]] bool is_defined() const noexcept { return !this->code.empty(); }
+};
+
+// Every function compiled so far, with the top level expressions still to
+// evaluate. Functions are never removed, so their indices are stable.
+struct BytecodeProgram
+{
+    static constexpr std::uint32_t NO_FUNCTION = std::numeric_limits<std::uint32_t>::max();
+
+    std::vector<BytecodeFunction> functions;
+    // The function of each Symbol::id, or NO_FUNCTION.
+    std::vector<std::uint32_t> function_indices;
+    // Functions of the top level expressions compiled since they were last
+    // evaluated, in source order.
+    std::vector<std::uint32_t> expressions;
+    // How many top level expressions there have been in all.
+    std::size_t expression_count = 0;
+
+    [[nodiscard]] std::uint32_t find(Symbol name) const noexcept
+    {
+        return name.id < this->function_indices.size() ? this->function_indices[name.id] : NO_FUNCTION;
+    }
+    // The latest function named `name`, expressions included, or NO_FUNCTION.
+    [[nodiscard]] std::uint32_t find(std::string_view name) const noexcept;
+    [[nodiscard]] std::string to_string(const BytecodeFunction& function) const;
+    [[nodiscard]] std::string to_string() const;
+};
+
+// Compiles ASTs to bytecode for a VirtualMachine, as CodeGeneratorLLVM
+// generates LLVM IR from them: definitions and externs become functions of
+// the same name, top level expressions functions without arguments named
+// __anon_expr, __anon_expr.1, ..., and the same errors are reported through
+// spdlog, skipping the item.
+//
+// Registers are allocated as a stack over the post-order walk of an
+// expression, after the arguments: an operand is consumed by the node that
+// uses it, whose result then takes the lowest register freed. Variables are
+// read in place. A call's arguments are moved to consecutive registers if
+// they are not there yet, and the callee's registers start at the first, so
+// that calls copy nothing.
+class BytecodeCompiler
+{
+    BytecodeProgram& program;
+
+    // The function being compiled, and its operand stack of registers.
+    BytecodeFunction* function = nullptr;
+    ArenaSpan<const Symbol> parameters;
+    std::vector<std::uint16_t> operands;
+    std::uint32_t next_register = 0;
+
+    // A pointer tree node in the middle of the walk, `next_child` of its
+    // operands visited, and the function a call node calls.
+    struct PendingNode
+    {
+        const ExprAST* node;
+        std::uint32_t next_child = 0;
+        std::uint32_t callee = BytecodeProgram::NO_FUNCTION;
+    };
+    std::vector<PendingNode> pending_nodes;
+
+    std::uint32_t declare(Symbol name, std::size_t arity);
+    bool declare_extern(Symbol name, std::size_t arity);
+    std::uint32_t lookup_callee(Symbol callee, std::size_t argument_count);
+    std::uint32_t lookup_operator(Symbol keyword, char opcode, std::size_t operand_count);
+    bool allocate(std::uint16_t& destination);
+    std::uint16_t pop_operands(std::size_t count);
+    bool push_number(double value);
+    bool push_variable(Symbol name);
+    bool push_binary(char opcode);
+    bool push_unary(char opcode);
+    bool push_call(std::uint32_t callee, std::size_t argument_count);
+    bool compile_expression(const ExprAST* root);
+    bool compile_flat_expression(const FlatAst& ast, const FlatAst::Item& item);
+    void emit(Instruction instruction);
+    template <typename CompileBody>
+    bool define(Symbol name, ArenaSpan<const Symbol> _parameters, CompileBody&& compile_body);
+    template <typename CompileBody>
+    bool define_expression(CompileBody&& compile_body);
+
+public:
+    explicit BytecodeCompiler(BytecodeProgram& _program) : program(_program) {}
+
+    // Each compiles one item and tells whether it did.
+    bool operator()(const ExprAST* ast);
+    bool operator()(const FunctionAST* ast);
+    bool operator()(const FunctionPrototypeAST* ast);
+    bool operator()(std::monostate ast);
+    bool operator()(const FlatAst& ast, const FlatAst::Item& item);
+    // Compiles every item of `ast` in order.
+    void compile(const FlatAst& ast);
+};
+
+}
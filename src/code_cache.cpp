@@ -0,0 +1,327 @@
+#include "code_cache.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+#include <spdlog/spdlog.h>
+
+namespace kccani
+{
+
+static constexpr std::size_t KEY_SIZE = 40;
+
+FunctionKey::FunctionKey(std::string_view context, Symbol name, ArenaSpan<const Symbol> _parameters)
+    : parameters(_parameters)
+{
+    this->add("kccani-code-cache-" + std::to_string(CodeCache::VERSION) + "\n" LLVM_VERSION_STRING "\n");
+    this->add(context);
+    this->add("\n");
+    this->add(name.name());
+    this->add("(" + std::to_string(this->parameters.size()) + ")");
+}
+
+void FunctionKey::add(std::string_view bytes)
+{
+    this->hash.update(llvm::StringRef(bytes.data(), bytes.size()));
+}
+
+void FunctionKey::add_number(double value)
+{
+    char bytes[1 + sizeof(double)] = {'n'};
+    std::memcpy(bytes + 1, &value, sizeof(double));
+    this->add(std::string_view(bytes, sizeof(bytes)));
+}
+
+void FunctionKey::add_variable(Symbol name)
+{
+    for (std::size_t i = 0; i < this->parameters.size(); i++)
+        if (this->parameters[i] == name)
+        {
+            this->add("p" + std::to_string(i) + ";");
+            return;
+        }
+    // Fails to generate, but is hashed all the same.
+    this->add("v" + std::to_string(name.name().size()) + ":");
+    this->add(name.name());
+}
+
+void FunctionKey::add_binary(char opcode)
+{
+    this->add({"b", 1});
+    this->add({&opcode, 1});
+    if (opcode != '+' && opcode != '-' && opcode != '*' && opcode != '<')
+        this->callees.emplace_back(Symbol::intern(std::string(symbols::BINARY.name()) + opcode), 2);
+}
+
+void FunctionKey::add_unary(char opcode)
+{
+    this->add({"u", 1});
+    this->add({&opcode, 1});
+    this->callees.emplace_back(Symbol::intern(std::string(symbols::UNARY.name()) + opcode), 1);
+}
+
+void FunctionKey::add_call(Symbol callee, std::size_t argument_count)
+{
+    this->add("c" + std::to_string(argument_count) + "," + std::to_string(callee.name().size()) + ":");
+    this->add(callee.name());
+    this->callees.emplace_back(callee, argument_count);
+}
+
+// Post-order with an explicit stack, like CodeGeneratorLLVM::generate_expression().
+void FunctionKey::add_body(const ExprAST* body)
+{
+    std::vector<std::pair<const ExprAST*, std::uint32_t>> pending{{body, 0}};
+    while (!pending.empty())
+    {
+        const ExprAST* node = pending.back().first;
+        std::uint32_t child = pending.back().second++;
+        switch (node->get_type())
+        {
+        case ExprAST::ExpressionType::NUMBER_EXPR:
+            this->add_number(static_cast<const NumberExprAST*>(node)->value);
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::VARIABLE_EXPR:
+            this->add_variable(static_cast<const VariableExprAST*>(node)->name);
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::BINARY_EXPR:
+        {
+            auto binary = static_cast<const BinaryExprAST*>(node);
+            if (child < 2)
+                pending.emplace_back(child == 0 ? binary->lhs : binary->rhs, 0);
+            else
+            {
+                this->add_binary(binary->opcode);
+                pending.pop_back();
+            }
+            break;
+        }
+        case ExprAST::ExpressionType::UNARY_EXPR:
+        {
+            auto unary = static_cast<const UnaryExprAST*>(node);
+            if (child == 0)
+                pending.emplace_back(unary->operand, 0);
+            else
+            {
+                this->add_unary(unary->opcode);
+                pending.pop_back();
+            }
+            break;
+        }
+        case ExprAST::ExpressionType::FUNCTION_CALL_EXPR:
+        {
+            auto call = static_cast<const FunctionCallExprAST*>(node);
+            if (child < call->args.size())
+                pending.emplace_back(call->args[child], 0);
+            else
+            {
+                this->add_call(call->callee, call->args.size());
+                pending.pop_back();
+            }
+            break;
+        }
+        }
+    }
+}
+
+void FunctionKey::add_body(const FlatAst& ast, const FlatAst::Item& item)
+{
+    for (FlatAst::NodeIndex node = item.nodes_begin; node <= item.body; node++)
+    {
+        switch (ast.kind(node))
+        {
+        case FlatAst::NodeKind::NUMBER:
+            this->add_number(ast.number(node));
+            break;
+        case FlatAst::NodeKind::VARIABLE:
+            this->add_variable(ast.variable(node));
+            break;
+        case FlatAst::NodeKind::BINARY:
+            this->add_binary(ast.opcode(node));
+            break;
+        case FlatAst::NodeKind::UNARY:
+            this->add_unary(ast.opcode(node));
+            break;
+        case FlatAst::NodeKind::CALL:
+            this->add_call(ast.callee(node), ast.argument_count(node));
+            break;
+        }
+    }
+}
+
+std::string FunctionKey::finish()
+{
+    return llvm::toHex(this->hash.final(), true);
+}
+
+CodeCache::CodeCache(std::string _directory, std::uint64_t _max_bytes)
+    : directory(std::move(_directory)), max_bytes(_max_bytes)
+{
+    if (std::error_code error = llvm::sys::fs::create_directories(this->directory))
+    {
+        spdlog::warn("Code cache " + this->directory + " is not usable: " + error.message());
+        this->usable = false;
+        return;
+    }
+    std::error_code error;
+    for (llvm::sys::fs::directory_iterator file(this->directory, error), end; file != end && !error;
+         file.increment(error))
+    {
+        llvm::StringRef path = file->path();
+        if (llvm::sys::path::extension(path) != ".o" || !CodeCache::is_key(llvm::sys::path::stem(path)))
+            continue;
+        auto status = file->status();
+        if (!status)
+            continue;
+        Entry entry{status->getSize(), status->getLastModificationTime()};
+        this->entries.emplace(llvm::sys::path::stem(path).str(), entry);
+        this->statistics.bytes += entry.size;
+    }
+}
+
+std::unique_ptr<CodeCache> CodeCache::from_environment(std::uint64_t max_bytes)
+{
+    const char* directory = std::getenv("KCCANI_CACHE_DIR");
+    if (!directory || !*directory)
+        return nullptr;
+    return std::make_unique<CodeCache>(directory, max_bytes);
+}
+
+bool CodeCache::is_key(llvm::StringRef name)
+{
+    return name.size() == KEY_SIZE
+        && std::all_of(name.begin(), name.end(), [](char c) { return llvm::isDigit(c) || (c >= 'a' && c <= 'f'); });
+}
+
+std::string CodeCache::path_of(const std::string& key) const
+{
+    llvm::SmallString<128> path(this->directory);
+    llvm::sys::path::append(path, key + ".o");
+    return std::string(path);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> CodeCache::load(const std::string& key)
+{
+    std::string path = this->path_of(key);
+    auto object = this->usable ? llvm::MemoryBuffer::getFile(path, false, false) : std::make_error_code(std::errc::no_such_file_or_directory);
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto entry = this->entries.find(key);
+    if (!object)
+    {
+        this->statistics.misses++;
+        // Evicted by another process.
+        if (entry != this->entries.end())
+        {
+            this->statistics.bytes -= entry->second.size;
+            this->entries.erase(entry);
+        }
+        return nullptr;
+    }
+    this->statistics.hits++;
+    auto now = Clock::now();
+    int descriptor;
+    if (!llvm::sys::fs::openFileForRead(path, descriptor))
+    {
+        llvm::sys::fs::setLastAccessAndModificationTime(descriptor, now);
+        llvm::sys::Process::SafelyCloseFileDescriptor(descriptor);
+    }
+    std::uint64_t size = (*object)->getBufferSize();
+    if (entry == this->entries.end())
+    {
+        this->entries.emplace(key, Entry{size, now});
+        this->statistics.bytes += size;
+    }
+    else
+        entry->second.last_use = now;
+    return std::move(*object);
+}
+
+void CodeCache::store(const std::string& key, llvm::MemoryBufferRef object)
+{
+    if (!this->usable)
+        return;
+    llvm::SmallString<128> model(this->directory);
+    llvm::sys::path::append(model, "%%%%%%%%%%%%.tmp");
+    int descriptor;
+    llvm::SmallString<128> temporary_path;
+    if (std::error_code error = llvm::sys::fs::createUniqueFile(model, descriptor, temporary_path))
+    {
+        spdlog::warn("Could not write to the code cache: " + error.message());
+        return;
+    }
+    {
+        llvm::raw_fd_ostream out(descriptor, true);
+        out << object.getBuffer();
+        out.close();
+        if (out.has_error())
+        {
+            spdlog::warn("Could not write to the code cache: " + out.error().message());
+            out.clear_error();
+            llvm::sys::fs::remove(temporary_path);
+            return;
+        }
+    }
+    std::string path = this->path_of(key);
+    if (std::error_code error = llvm::sys::fs::rename(temporary_path, path))
+    {
+        spdlog::warn("Could not write to the code cache: " + error.message());
+        llvm::sys::fs::remove(temporary_path);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->statistics.stores++;
+    Entry& entry = this->entries[key];
+    this->statistics.bytes += object.getBufferSize() - entry.size;
+    entry = {object.getBufferSize(), Clock::now()};
+    this->evict();
+}
+
+// Called with the mutex held.
+void CodeCache::evict()
+{
+    if (this->statistics.bytes <= this->max_bytes)
+        return;
+    std::vector<std::pair<Clock::time_point, std::string>> by_age;
+    by_age.reserve(this->entries.size());
+    for (const auto& [key, entry] : this->entries)
+        by_age.emplace_back(entry.last_use, key);
+    std::sort(by_age.begin(), by_age.end());
+    for (const auto& [last_use, key] : by_age)
+    {
+        if (this->statistics.bytes <= this->max_bytes)
+            break;
+        llvm::sys::fs::remove(this->path_of(key));
+        this->statistics.bytes -= this->entries[key].size;
+        this->statistics.evictions++;
+        this->entries.erase(key);
+    }
+}
+
+CodeCache::Statistics CodeCache::get_statistics()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->statistics;
+}
+
+void CodeCache::notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object)
+{
+    if (CodeCache::is_key(module->getModuleIdentifier()))
+        this->store(module->getModuleIdentifier(), object);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> CodeCache::getObject(const llvm::Module*)
+{
+    return nullptr;
+}
+
+}
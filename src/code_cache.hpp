@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+
+#include "arena.hpp"
+#include "ast.hpp"
+#include "flat_ast.hpp"
+#include "symbol.hpp"
+
+namespace kccani
+{
+
+// Cache key of one function definition: the SHA-1 of its normalized AST and
+// of everything else its object code depends on.
+//
+// The body is hashed in post-order, the same for the pointer tree and the
+// FlatAst, with parameters by position so that renaming them keeps the key.
+// A function with a key is compiled alone, so besides its body only the
+// signatures of the functions it calls reach its code; every call site adds
+// the callee's name and argument count. `context` names what else does:
+// the target, the code generation settings and the optimization level.
+class FunctionKey
+{
+    llvm::SHA1 hash;
+    ArenaSpan<const Symbol> parameters;
+    std::vector<std::pair<Symbol, std::size_t>> callees;
+
+    void add(std::string_view bytes);
+    void add_number(double value);
+    void add_variable(Symbol name);
+    void add_binary(char opcode);
+    void add_unary(char opcode);
+    void add_call(Symbol callee, std::size_t argument_count);
+
+public:
+    FunctionKey(std::string_view context, Symbol name, ArenaSpan<const Symbol> _parameters);
+
+    void add_body(const ExprAST* body);
+    void add_body(const FlatAst& ast, const FlatAst::Item& item);
+
+    // The functions the body calls, user-defined operators included, with
+    // the number of arguments of each call, in call order.
+    [[nodiscard]] const std::vector<std::pair<Symbol, std::size_t>>& get_callees() const noexcept { return this->callees; }
+    // Hexadecimal digest. Nothing can be added afterwards.
+    std::string finish();
+};
+
+// Object code of a function taken from a CodeCache instead of generated.
+struct CachedObject
+{
+    std::string function;
+    std::unique_ptr<llvm::MemoryBuffer> object;
+};
+
+// Object code of single functions on disk, one `<key>.o` per FunctionKey in
+// a directory that any number of processes may share.
+//
+// Code generation looks a definition up before generating it, and a hit
+// skips code generation, optimization and compilation. As an
+// llvm::ObjectCache, it stores the object that a JIT compiles from a module
+// whose identifier is a key, and Emitter stores the ones it compiles.
+//
+// The cache holds at most `max_bytes`. Storing beyond that evicts the least
+// recently used entries, as told by the modification times of their files,
+// which a hit renews.
+class CodeCache : public llvm::ObjectCache
+{
+public:
+    struct Statistics
+    {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t stores = 0;
+        std::uint64_t evictions = 0;
+        // Size of the objects in the cache.
+        std::uint64_t bytes = 0;
+    };
+
+private:
+    using Clock = std::chrono::system_clock;
+    struct Entry
+    {
+        std::uint64_t size;
+        Clock::time_point last_use;
+    };
+
+    std::string directory;
+    std::uint64_t max_bytes;
+    bool usable = true;
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    Statistics statistics;
+
+    std::string path_of(const std::string& key) const;
+    void evict();
+
+public:
+    static constexpr std::uint64_t DEFAULT_MAX_BYTES = 256 << 20;
+    // Changes whenever keys or objects change meaning.
+    static constexpr std::uint32_t VERSION = 1;
+
+    // Creates `_directory` if needed. If that fails, a warning is logged and
+    // the cache stays empty.
+    CodeCache(std::string _directory, std::uint64_t _max_bytes = DEFAULT_MAX_BYTES);
+
+    // The cache in $KCCANI_CACHE_DIR, or nullptr if it is not set.
+    static std::unique_ptr<CodeCache> from_environment(std::uint64_t max_bytes = DEFAULT_MAX_BYTES);
+    // Whether `name` is a FunctionKey digest.
+    static bool is_key(llvm::StringRef name);
+
+    // The object stored under `key`, counted as a hit, or nullptr, counted as
+    // a miss.
+    std::unique_ptr<llvm::MemoryBuffer> load(const std::string& key);
+    // Written to a temporary file first and renamed, so that concurrent
+    // readers never see a partial object. Failures are only logged.
+    void store(const std::string& key, llvm::MemoryBufferRef object);
+
+    [[nodiscard]] Statistics get_statistics();
+
+    // Stores the object of a module whose identifier is a key.
+    void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override;
+    // Always nullptr: definitions are looked up with load() before their
+    // module is even generated.
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override;
+};
+
+}
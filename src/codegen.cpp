@@ -5,126 +5,585 @@
 namespace kccani
 {
 
-CodegenContentType CodeGeneratorLLVM::operator()(std::unique_ptr<ExprAST>&& ast)
+CodegenContentType CodeGeneratorLLVM::operator()(const ExprAST* ast)
 {
-    switch (ast->get_type())
-    {
-    case ExprAST::ExpressionType::NUMBER_EXPR:
+    return this->define_expression([&]() {
+        return this->generate_expression(ast);
+    });
+}
+
+llvm::Value* CodeGeneratorLLVM::emit_number(double value)
+{
+    return llvm::ConstantFP::get(*this->context, llvm::APFloat(value));
+}
+
+llvm::Value* CodeGeneratorLLVM::emit_variable(Symbol name)
+{
+    llvm::Value *value = symbol_slot(this->named_values, name);
+    if (!value)
+        spdlog::error("Unknown variable name: " + name.str());
+    return value;
+}
+
+// A post-order walk with explicit stacks, so that deeply nested expressions
+// do not run out of native stack. Values are emitted in the order a
+// recursive visit would: operands left to right, every operand of a binary
+// operator even if an earlier one failed, a call's callee before its
+// arguments and none after the first that failed.
+llvm::Value* CodeGeneratorLLVM::generate_expression(const ExprAST* root)
+{
+    std::vector<PendingNode>& pending = this->pending_nodes;
+    std::vector<llvm::Value*>& values = this->operand_values;
+    const std::size_t pending_begin = pending.size();
+    const std::size_t values_begin = values.size();
+    pending.push_back({root});
+    while (pending.size() > pending_begin)
     {
-        auto expr = std::unique_ptr<NumberExprAST>(static_cast<NumberExprAST*>(ast.release()));
-        return llvm::ConstantFP::get(*this->context, llvm::APFloat(expr->value));
+        PendingNode& top = pending.back();
+        const ExprAST* node = top.node;
+        switch (node->get_type())
+        {
+        case ExprAST::ExpressionType::NUMBER_EXPR:
+            values.push_back(this->emit_number(static_cast<const NumberExprAST*>(node)->value));
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::VARIABLE_EXPR:
+            values.push_back(this->emit_variable(static_cast<const VariableExprAST*>(node)->name));
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::BINARY_EXPR:
+        {
+            auto binary = static_cast<const BinaryExprAST*>(node);
+            const bool reuse = binary->shared && this->defining_function;
+            if (top.next_child == 0 && reuse)
+            {
+                auto emitted = this->shared_values.find(binary);
+                if (emitted != this->shared_values.end())
+                {
+                    values.push_back(emitted->second);
+                    pending.pop_back();
+                    break;
+                }
+            }
+            if (top.next_child < 2)
+            {
+                const ExprAST* child = top.next_child == 0 ? binary->lhs : binary->rhs;
+                top.next_child++;
+                pending.push_back({child});
+                break;
+            }
+            llvm::Value* r = values.back();
+            values.pop_back();
+            llvm::Value* l = values.back();
+            llvm::Value* value = l && r ? this->emit_binary(binary->opcode, l, r) : nullptr;
+            if (reuse && value)
+                this->shared_values.emplace(binary, value);
+            values.back() = value;
+            pending.pop_back();
+            break;
+        }
+        case ExprAST::ExpressionType::UNARY_EXPR:
+        {
+            auto unary = static_cast<const UnaryExprAST*>(node);
+            if (top.next_child == 0)
+            {
+                top.next_child++;
+                pending.push_back({unary->operand});
+                break;
+            }
+            if (values.back())
+                values.back() = this->emit_unary(unary->opcode, values.back());
+            pending.pop_back();
+            break;
+        }
+        case ExprAST::ExpressionType::FUNCTION_CALL_EXPR:
+        {
+            auto call = static_cast<const FunctionCallExprAST*>(node);
+            if (top.next_child == 0)
+            {
+                top.callee = this->lookup_callee(call->callee, call->args.size());
+                if (!top.callee)
+                {
+                    values.push_back(nullptr);
+                    pending.pop_back();
+                    break;
+                }
+            }
+            else if (!values.back())
+            {
+                values.resize(values.size() - top.next_child);
+                values.push_back(nullptr);
+                pending.pop_back();
+                break;
+            }
+            if (top.next_child < call->args.size())
+            {
+                const ExprAST* arg = call->args[top.next_child];
+                top.next_child++;
+                pending.push_back({arg});
+                break;
+            }
+            std::size_t count = call->args.size();
+            llvm::ArrayRef<llvm::Value*> args(values.data() + values.size() - count, count);
+            llvm::Value* value = this->builder->CreateCall(top.callee, args, "calltmp");
+            values.resize(values.size() - count);
+            values.push_back(value);
+            pending.pop_back();
+            break;
+        }
+        }
     }
-    case ExprAST::ExpressionType::VARIABLE_EXPR:
+    llvm::Value* result = values.back();
+    values.resize(values_begin);
+    return result;
+}
+
+CodegenContentType CodeGeneratorLLVM::operator()(const FunctionAST* ast)
+{
+    return this->define_cached_function(
+        ast->prototype->name, ast->prototype->args,
+        [&](FunctionKey& key) { key.add_body(ast->body); },
+        [&]() { return this->generate_expression(ast->body); });
+}
+
+CodegenContentType CodeGeneratorLLVM::operator()(const FunctionPrototypeAST* ast)
+{
+    return this->declare_function(ast->name, ast->args);
+}
+
+CodegenContentType CodeGeneratorLLVM::operator()(const FlatAst& ast, const FlatAst::Item& item)
+{
+    switch (item.kind)
     {
-        auto expr = std::unique_ptr<VariableExprAST>(static_cast<VariableExprAST*>(ast.release()));
-        llvm::Value *value = this->named_values[expr->name];
-        if (!value)
-            spdlog::error("Unknown variable name: " + expr->name);
-        return value;
+    case FlatAst::ItemKind::FUNCTION:
+        return this->define_cached_function(
+            item.name, ast.parameters_of(item),
+            [&](FunctionKey& key) { key.add_body(ast, item); },
+            [&]() { return this->generate_flat_expression(ast, item); });
+    case FlatAst::ItemKind::EXTERN:
+        return this->declare_function(item.name, ast.parameters_of(item));
+    case FlatAst::ItemKind::EXPRESSION:
+        return this->define_expression([&]() {
+            return this->generate_flat_expression(ast, item);
+        });
+    case FlatAst::ItemKind::ERROR:
+        break;
     }
-    case ExprAST::ExpressionType::BINARY_EXPR:
+    return std::monostate{};
+}
+
+std::vector<CodegenContentType> CodeGeneratorLLVM::generate(const FlatAst& ast)
+{
+    std::vector<CodegenContentType> results;
+    results.reserve(ast.get_items().size());
+    for (const FlatAst::Item& item : ast.get_items())
+        results.push_back((*this)(ast, item));
+    return results;
+}
+
+// The nodes are in post-order, so operands are always on top of the stack
+// by the time their user is reached. Failures push nullptr and generation
+// goes on, in the order of generate_expression(): a call looks its callee up
+// when the scan enters its subtree, and skips the rest of its arguments once
+// one fails, so both report the same errors.
+llvm::Value* CodeGeneratorLLVM::generate_flat_expression(const FlatAst& ast, const FlatAst::Item& item)
+{
+    using NodeIndex = FlatAst::NodeIndex;
+    const NodeIndex begin = item.nodes_begin;
+    std::vector<FlatNodeStarts>& starts = this->flat_node_starts;
+    starts.assign(item.body + 1 - begin, {FlatAst::NO_NODE, FlatAst::NO_NODE, FlatAst::NO_NODE});
+    for (NodeIndex node = begin; node <= item.body; node++)
     {
-        auto expr = std::unique_ptr<BinaryExprAST>(static_cast<BinaryExprAST*>(ast.release()));
-        llvm::Value* l = std::get<llvm::Value*>((*this)(std::move(expr->lhs)));
-        llvm::Value* r = std::get<llvm::Value*>((*this)(std::move(expr->rhs)));
-        if (!l || !r)
-            return (llvm::Value*) nullptr;
-        switch (expr->opcode)
+        NodeIndex& subtree_begin = starts[node - begin].subtree_begin;
+        switch (ast.kind(node))
         {
-        case '+':
-            return this->builder->CreateFAdd(l, r, "addtmp");
-        case '-':
-            return this->builder->CreateFSub(l, r, "subtmp");
-        case '*':
-            return this->builder->CreateFMul(l, r, "multmp");
-        case '<':
-            return this->builder->CreateUIToFP(
-                this->builder->CreateFCmpULT(l, r, "cmptmp"),
-                llvm::Type::getDoubleTy(*(this->context)),
-                "booltmp"
-            );
-        default:
-            spdlog::error("The opcode for the binary operation was not recognized");
-            return (llvm::Value*) nullptr;
+        case FlatAst::NodeKind::NUMBER:
+        case FlatAst::NodeKind::VARIABLE:
+            subtree_begin = node;
+            break;
+        case FlatAst::NodeKind::BINARY:
+            subtree_begin = starts[ast.lhs(node) - begin].subtree_begin;
+            break;
+        case FlatAst::NodeKind::UNARY:
+            subtree_begin = starts[ast.operand(node) - begin].subtree_begin;
+            break;
+        case FlatAst::NodeKind::CALL:
+        {
+            subtree_begin = ast.argument_count(node) ? starts[ast.argument(node, 0) - begin].subtree_begin : node;
+            // Calls come after the calls inside them, so this one is outermost.
+            FlatNodeStarts& entry = starts[subtree_begin - begin];
+            starts[node - begin].next_entered_call = entry.entered_call;
+            entry.entered_call = node;
+            break;
+        }
         }
     }
-    case ExprAST::ExpressionType::FUNCTION_CALL_EXPR:
-    {
-        auto expr = std::unique_ptr<FunctionCallExprAST>(static_cast<FunctionCallExprAST*>(ast.release()));
 
-        llvm::Function *callee_func = this->module->getFunction(expr->callee);
-        if (!callee_func)
+    std::vector<llvm::Value*>& stack = this->operand_values;
+    std::vector<OpenCall>& calls = this->open_calls;
+    stack.clear();
+    calls.clear();
+    for (NodeIndex node = begin; node <= item.body; node++)
+    {
+        for (NodeIndex call = starts[node - begin].entered_call; call != FlatAst::NO_NODE;
+             call = starts[call - begin].next_entered_call)
         {
-            spdlog::error("Undefined function with name: " + expr->callee);
-            return (llvm::Value*) nullptr;
+            llvm::Function* callee = this->lookup_callee(ast.callee(call), ast.argument_count(call));
+            calls.push_back({call, callee, 0, stack.size()});
+            // Its arguments are not generated.
+            if (!callee)
+            {
+                node = call;
+                break;
+            }
         }
-
-        if (callee_func->arg_size() != expr->args.size())
+        switch (ast.kind(node))
+        {
+        case FlatAst::NodeKind::NUMBER:
+            stack.push_back(this->emit_number(ast.number(node)));
+            break;
+        case FlatAst::NodeKind::VARIABLE:
+            stack.push_back(this->emit_variable(ast.variable(node)));
+            break;
+        case FlatAst::NodeKind::BINARY:
         {
-            spdlog::error("Incorrect number of arguments passed");
-            return (llvm::Value*) nullptr;
+            llvm::Value* r = stack.back();
+            stack.pop_back();
+            llvm::Value* l = stack.back();
+            stack.back() = l && r ? this->emit_binary(ast.opcode(node), l, r) : nullptr;
+            break;
         }
-        std::vector<llvm::Value*> args_llvm_values;
-        for (unsigned i = 0, e = expr->args.size(); i != e; ++i) {
-            args_llvm_values.push_back(std::get<llvm::Value*>((*this)(std::move(expr->args[i]))));
-            if (!args_llvm_values.back())
-                return (llvm::Value*) nullptr;
+        case FlatAst::NodeKind::UNARY:
+            if (stack.back())
+                stack.back() = this->emit_unary(ast.opcode(node), stack.back());
+            break;
+        case FlatAst::NodeKind::CALL:
+        {
+            OpenCall call = calls.back();
+            calls.pop_back();
+            llvm::Value* value = nullptr;
+            // Otherwise the stack is back at `values_begin` already.
+            if (call.callee)
+            {
+                std::uint32_t count = ast.argument_count(node);
+                llvm::ArrayRef<llvm::Value*> args(stack.data() + stack.size() - count, count);
+                value = this->builder->CreateCall(call.callee, args, "calltmp");
+                stack.resize(stack.size() - count);
+            }
+            stack.push_back(value);
+            break;
+        }
+        }
+        if (calls.empty())
+            continue;
+        OpenCall& call = calls.back();
+        if (call.next_argument < ast.argument_count(call.node) && node == ast.argument(call.node, call.next_argument))
+        {
+            call.next_argument++;
+            if (!stack.back())
+            {
+                call.callee = nullptr;
+                stack.resize(call.values_begin);
+                node = call.node - 1;
+            }
         }
-
-        return this->builder->CreateCall(callee_func, args_llvm_values, "calltmp");
     }
+    return stack.back();
+}
+
+llvm::Value* CodeGeneratorLLVM::emit_binary(char opcode, llvm::Value* l, llvm::Value* r)
+{
+    switch (opcode)
+    {
+    case '+':
+        return this->builder->CreateFAdd(l, r, "addtmp");
+    case '-':
+        return this->builder->CreateFSub(l, r, "subtmp");
+    case '*':
+        return this->builder->CreateFMul(l, r, "multmp");
+    case '<':
+        return this->builder->CreateUIToFP(
+            this->builder->CreateFCmpULT(l, r, "cmptmp"),
+            llvm::Type::getDoubleTy(*(this->context)),
+            "booltmp"
+        );
     default:
-        spdlog::error("Invalid expression type, all expression types should be in switch above");
-        return (llvm::Value*) nullptr;
+    {
+        // A user-defined operator, implemented by the function `binary<op>`.
+        llvm::Function* function = this->lookup_operator(symbols::BINARY, opcode, 2);
+        if (!function)
+            return nullptr;
+        return this->builder->CreateCall(function, {l, r}, "binop");
+    }
+    }
+}
+
+llvm::Value* CodeGeneratorLLVM::emit_unary(char opcode, llvm::Value* operand)
+{
+    llvm::Function* function = this->lookup_operator(symbols::UNARY, opcode, 1);
+    if (!function)
+        return nullptr;
+    return this->builder->CreateCall(function, operand, "unop");
+}
+
+llvm::Function* CodeGeneratorLLVM::find_function(Symbol name)
+{
+    llvm::Function* function = symbol_slot(this->functions, name);
+    if (!function && this->prototypes && name.id < this->prototypes->size() && (*this->prototypes)[name.id])
+        function = this->declare_function(name, (*this->prototypes)[name.id]->args);
+    return function;
+}
+
+llvm::Function* CodeGeneratorLLVM::lookup_operator(Symbol keyword, char opcode, std::size_t operand_count)
+{
+    Symbol name = Symbol::intern(std::string(keyword.name()) + opcode);
+    if (!this->find_function(name))
+    {
+        spdlog::error("Unknown operator: " + std::string(1, opcode));
+        return nullptr;
     }
+    return this->lookup_callee(name, operand_count);
 }
 
-CodegenContentType CodeGeneratorLLVM::operator()(std::unique_ptr<FunctionAST>&& ast)
+llvm::Function* CodeGeneratorLLVM::lookup_callee(Symbol callee, std::size_t arg_count)
+{
+    llvm::Function *callee_func = this->find_function(callee);
+    if (!callee_func)
+    {
+        spdlog::error("Undefined function with name: " + callee.str());
+        return nullptr;
+    }
+    if (callee_func->arg_size() != arg_count)
+    {
+        spdlog::error("Incorrect number of arguments passed");
+        return nullptr;
+    }
+    return callee_func;
+}
+
+llvm::Function* CodeGeneratorLLVM::declare_function(Symbol name, ArenaSpan<const Symbol> args)
+{
+    std::vector<llvm::Type*> doubles(args.size(), llvm::Type::getDoubleTy(*this->context));
+    llvm::FunctionType *function_type = llvm::FunctionType::get(
+        llvm::Type::getDoubleTy(*this->context), doubles, false);
+    llvm::Function *function = llvm::Function::Create(
+        function_type, llvm::Function::ExternalLinkage, name.name(), this->module.get());
+
+    uint32_t idx = 0;
+    for (auto &arg : function->args())
+        arg.setName(args[idx++].name());
+
+    symbol_slot(this->functions, name) = function;
+    return function;
+}
+
+template <typename GenerateBody>
+llvm::Function* CodeGeneratorLLVM::define_function(Symbol name, ArenaSpan<const Symbol> arg_names, GenerateBody&& generate_body)
 {
     // First, check for an existing function from a previous 'extern' declaration.
-    llvm::Function *the_function = this->module->getFunction(ast->prototype->name);
+    llvm::Function *the_function = symbol_slot(this->functions, name);
     if (!the_function)
-        the_function = std::get<llvm::Function*>((*this)(std::move(ast->prototype)));
+        the_function = this->declare_function(name, arg_names);
     if (!the_function)
-        return (llvm::Function*) nullptr;
+        return nullptr;
+    if (the_function->arg_size() != arg_names.size())
+    {
+        spdlog::error("Definition of " + name.str() + " does not match its declaration");
+        return nullptr;
+    }
+    if (!the_function->empty())
+    {
+        spdlog::error("Redefinition of function " + name.str());
+        return nullptr;
+    }
 
     // Create a new basic block to start insertion into.
     llvm::BasicBlock *basic_block = llvm::BasicBlock::Create(*this->context, "entry", the_function);
     this->builder->SetInsertPoint(basic_block);
 
-    // Record the function arguments in the NamedValues map.
-    this->named_values.clear();
+    // Record the function arguments in the NamedValues table. The names come
+    // from this definition, an earlier extern may have spelled them differently.
+    uint32_t idx = 0;
     for (auto &arg : the_function->args())
-    this->named_values[std::string(arg.getName())] = &arg;
+    {
+        arg.setName(arg_names[idx].name());
+        symbol_slot(this->named_values, arg_names[idx++]) = &arg;
+    }
+
+    // The body is a single basic block, so a value emitted anywhere in it
+    // dominates every later use.
+    this->defining_function = true;
+    llvm::Value *return_value = generate_body();
+    this->defining_function = false;
+    this->shared_values.clear();
+    for (Symbol arg_name : arg_names)
+        symbol_slot(this->named_values, arg_name) = nullptr;
 
-    if (llvm::Value *return_value = std::get<llvm::Value*>((*this)(std::move(ast->body)))) {
+    if (return_value) {
         // Finish off the function.
         this->builder->CreateRet(return_value);
         // Validate the generated code, checking for consistency.
         llvm::verifyFunction(*the_function);
+        if (this->optimizer)
+            this->optimizer->run(*the_function);
         return the_function;
     }
     // Error reading body, remove function.
+    symbol_slot(this->functions, name) = nullptr;
     the_function->eraseFromParent();
-    return (llvm::Function*) nullptr;
+    return nullptr;
 }
 
-CodegenContentType CodeGeneratorLLVM::operator()(std::unique_ptr<FunctionPrototypeAST>&& ast)
+template <typename AddBody, typename GenerateBody>
+llvm::Function* CodeGeneratorLLVM::define_cached_function(
+    Symbol name, ArenaSpan<const Symbol> arg_names, AddBody&& add_body, GenerateBody&& generate_body)
 {
-    std::vector<llvm::Type*> doubles(ast->args.size(), llvm::Type::getDoubleTy(*this->context));
-    llvm::FunctionType *function_type = llvm::FunctionType::get(
-        llvm::Type::getDoubleTy(*this->context), doubles, false);
-    llvm::Function *function = llvm::Function::Create(
-        function_type, llvm::Function::ExternalLinkage, ast->name, this->module.get());
+    if (!this->code_cache)
+        return this->define_function(name, arg_names, std::forward<GenerateBody>(generate_body));
+    llvm::Function* cached = symbol_slot(this->cached_definitions, name);
+    if (cached && cached == symbol_slot(this->functions, name))
+    {
+        spdlog::error("Redefinition of function " + name.str());
+        return nullptr;
+    }
+    unsigned level = this->optimizer ? this->optimizer->get_level() : 0;
+    FunctionKey key(this->cache_target + ";O" + std::to_string(level), name, arg_names);
+    add_body(key);
+    std::string digest = key.finish();
+    std::unique_ptr<llvm::MemoryBuffer> object = this->code_cache->load(digest);
+    if (!object)
+    {
+        llvm::Function* function = this->define_function(name, arg_names, std::forward<GenerateBody>(generate_body));
+        if (function)
+            this->uncached_functions.emplace_back(function, std::move(digest));
+        return function;
+    }
 
+    // A hit skips generating the body, but not the checks that doing so makes.
+    llvm::Function *the_function = symbol_slot(this->functions, name);
+    if (!the_function)
+        the_function = this->declare_function(name, arg_names);
+    if (the_function->arg_size() != arg_names.size())
+    {
+        spdlog::error("Definition of " + name.str() + " does not match its declaration");
+        return nullptr;
+    }
+    if (!the_function->empty())
+    {
+        spdlog::error("Redefinition of function " + name.str());
+        return nullptr;
+    }
+    for (const auto& [callee, arg_count] : key.get_callees())
+    {
+        if (!this->lookup_callee(callee, arg_count))
+        {
+            symbol_slot(this->functions, name) = nullptr;
+            the_function->eraseFromParent();
+            return nullptr;
+        }
+    }
     uint32_t idx = 0;
-    for (auto &arg : function->args())
-        arg.setName(ast->args[idx++]);
+    for (auto &arg : the_function->args())
+        arg.setName(arg_names[idx++].name());
+    symbol_slot(this->cached_definitions, name) = the_function;
+    this->cached_objects.push_back({name.str(), std::move(object)});
+    return the_function;
+}
 
+template <typename GenerateBody>
+llvm::Function* CodeGeneratorLLVM::define_expression(GenerateBody&& generate_body)
+{
+    std::string name(symbols::ANON_EXPR.name());
+    if (this->expression_count > 0)
+        name += "." + std::to_string(this->expression_count);
+    // Declared fresh every time, define_function() then finds it in the slot.
+    llvm::Function* function = this->declare_function(symbols::ANON_EXPR, {});
+    function->setName(name);
+    function = this->define_function(symbols::ANON_EXPR, {}, std::forward<GenerateBody>(generate_body));
+    symbol_slot(this->functions, symbols::ANON_EXPR) = nullptr;
+    if (function)
+    {
+        this->expressions.push_back(name);
+        this->expression_count++;
+    }
     return function;
 }
 
-CodegenContentType CodeGeneratorLLVM::operator()(std::monostate&& invalid)
+void CodeGeneratorLLVM::optimize_module()
+{
+    if (this->optimizer)
+        this->optimizer->run(*this->module);
+}
+
+// Each function keeps its name and is declared in `module` in its place.
+// Calls to functions of other modules are redirected to declarations in its
+// own, so that it compiles alone, as the cache key assumes.
+std::vector<llvm::orc::ThreadSafeModule> CodeGeneratorLLVM::split_uncached_functions()
+{
+    std::vector<llvm::orc::ThreadSafeModule> function_modules;
+    function_modules.reserve(this->uncached_functions.size());
+    for (auto& [function, key] : this->uncached_functions)
+    {
+        auto function_module = std::make_unique<llvm::Module>(key, *this->context);
+        function->removeFromParent();
+        function_module->getFunctionList().push_back(function);
+        llvm::Function* declaration = llvm::Function::Create(
+            function->getFunctionType(), llvm::Function::ExternalLinkage, function->getName(), this->module.get());
+        for (std::size_t i = 0; i < function->arg_size(); i++)
+            declaration->getArg(i)->setName(function->getArg(i)->getName());
+        function->replaceUsesWithIf(declaration, [function = function](llvm::Use& use) {
+            auto instruction = llvm::dyn_cast<llvm::Instruction>(use.getUser());
+            return !instruction || instruction->getFunction() != function;
+        });
+        for (llvm::BasicBlock& block : *function)
+        {
+            for (llvm::Instruction& instruction : block)
+            {
+                auto call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+                if (!call || call->getCalledFunction()->getParent() == function_module.get())
+                    continue;
+                llvm::Function* callee = call->getCalledFunction();
+                call->setCalledFunction(llvm::cast<llvm::Function>(
+                    function_module->getOrInsertFunction(callee->getName(), callee->getFunctionType()).getCallee()));
+            }
+        }
+        if (this->optimizer)
+            this->optimizer->run(*function_module);
+        function_modules.emplace_back(std::move(function_module), this->thread_safe_context);
+    }
+    this->uncached_functions.clear();
+    return function_modules;
+}
+
+GeneratedModule CodeGeneratorLLVM::take_module()
+{
+    std::vector<llvm::orc::ThreadSafeModule> function_modules = this->split_uncached_functions();
+    this->optimize_module();
+    auto next_module = std::make_unique<llvm::Module>("kccani_jit", *this->context);
+    for (llvm::Function*& function : this->functions)
+    {
+        if (!function)
+            continue;
+        llvm::Function* declaration = llvm::Function::Create(
+            function->getFunctionType(), llvm::Function::ExternalLinkage, function->getName(), next_module.get());
+        for (std::size_t i = 0; i < function->arg_size(); i++)
+            declaration->getArg(i)->setName(function->getArg(i)->getName());
+        function = declaration;
+    }
+    GeneratedModule generated{
+        llvm::orc::ThreadSafeModule(std::move(this->module), this->thread_safe_context),
+        std::move(this->expressions),
+        std::move(function_modules),
+        std::move(this->cached_objects),
+    };
+    this->module = std::move(next_module);
+    this->expressions.clear();
+    this->cached_objects.clear();
+    this->cached_definitions.clear();
+    return generated;
+}
+
+CodegenContentType CodeGeneratorLLVM::operator()(std::monostate invalid)
 {
     return std::monostate{};
 }
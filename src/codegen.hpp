@@ -1,7 +1,12 @@
 #pragma once
 
-#include <map>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
 
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
@@ -9,6 +14,9 @@
 #include <llvm/IR/Verifier.h>
 
 #include "ast.hpp"
+#include "code_cache.hpp"
+#include "flat_ast.hpp"
+#include "optimizer.hpp"
 
 namespace kccani
 {
@@ -18,18 +26,158 @@ using CodegenContentType = std::variant<
     llvm::Function*,
     std::monostate>;
 
+// A module handed over by CodeGeneratorLLVM::take_module(), with the names
+// of the functions its top level expressions became, in source order.
+//
+// With a CodeCache, `module` only declares the functions defined in the
+// rest: those the cache missed, each alone in a module named by its
+// FunctionKey, and the objects of those it hit.
+struct GeneratedModule
+{
+    llvm::orc::ThreadSafeModule module;
+    std::vector<std::string> expressions;
+    std::vector<llvm::orc::ThreadSafeModule> function_modules;
+    std::vector<CachedObject> objects;
+};
+
+// Generates every top level item into the current module. Definitions and
+// externs become functions of the same name, top level expressions become
+// functions without arguments named __anon_expr, __anon_expr.1, ..., numbered
+// across all the modules of one generator.
 class CodeGeneratorLLVM
 {
-    std::unique_ptr<llvm::LLVMContext> context{std::make_unique<llvm::LLVMContext>()};
+    // Shared with the modules handed to a JIT by take_module().
+    llvm::orc::ThreadSafeContext thread_safe_context{std::make_unique<llvm::LLVMContext>()};
+    llvm::LLVMContext* context{thread_safe_context.getContext()};
     std::unique_ptr<llvm::IRBuilder<>> builder{std::make_unique<llvm::IRBuilder<>>(*context)};
     std::unique_ptr<llvm::Module> module{std::make_unique<llvm::Module>("kccani_jit", *context)};
-    std::map<std::string, llvm::Value*> named_values;
+    // Both indexed by Symbol::id: the arguments of the function being
+    // generated, and every function declared in `module` so far.
+    std::vector<llvm::Value*> named_values;
+    std::vector<llvm::Function*> functions;
+    // Functions of the top level expressions in `module`, and how many there
+    // have been in all.
+    std::vector<std::string> expressions;
+    std::size_t expression_count = 0;
+    // Runs over every function once it is defined, and over every module
+    // before it is handed over or printed.
+    Optimizer* optimizer = nullptr;
+    // Looked up before every definition, see set_code_cache(). The
+    // definitions of `module` it missed, with their keys, and the objects of
+    // those it hit, which `module` only declares, indexed by Symbol::id.
+    CodeCache* code_cache = nullptr;
+    std::string cache_target;
+    std::vector<std::pair<llvm::Function*, std::string>> uncached_functions;
+    std::vector<CachedObject> cached_objects;
+    std::vector<llvm::Function*> cached_definitions;
+    // Prototypes of functions defined elsewhere, see set_prototypes().
+    const std::vector<const FunctionPrototypeAST*>* prototypes = nullptr;
+
+    // Values of the shared binary nodes already emitted in the function
+    // being defined, so that a DAG built by a hash-consing AstBuilder emits
+    // each of them once. The builder only shares nodes without calls or
+    // user-defined operators below them, so reusing one skips no side effect.
+    std::unordered_map<const ExprAST*, llvm::Value*> shared_values;
+    bool defining_function = false;
+
+    // A node generate_expression() is in the middle of: `next_child` of its
+    // operands have been generated, and `callee` is a call's function.
+    struct PendingNode
+    {
+        const ExprAST* node;
+        std::uint32_t next_child = 0;
+        llvm::Function* callee = nullptr;
+    };
+    std::vector<PendingNode> pending_nodes;
+    // Per node of the item generate_flat_expression() is in: the first node
+    // of its subtree, the outermost call whose subtree starts there and, for
+    // a call, the next call inside it that starts at the same node.
+    struct FlatNodeStarts
+    {
+        FlatAst::NodeIndex subtree_begin;
+        FlatAst::NodeIndex entered_call;
+        FlatAst::NodeIndex next_entered_call;
+    };
+    std::vector<FlatNodeStarts> flat_node_starts;
+    // A call generate_flat_expression() is inside of: its callee, nullptr
+    // once an argument failed, how many arguments are generated and the
+    // operand stack size before them.
+    struct OpenCall
+    {
+        FlatAst::NodeIndex node;
+        llvm::Function* callee;
+        std::uint32_t next_argument;
+        std::size_t values_begin;
+    };
+    std::vector<OpenCall> open_calls;
+    // Operand stack of both expression generators, kept to reuse its storage.
+    std::vector<llvm::Value*> operand_values;
+
+    llvm::Value* emit_number(double value);
+    llvm::Value* emit_variable(Symbol name);
+    llvm::Value* emit_binary(char opcode, llvm::Value* l, llvm::Value* r);
+    llvm::Value* emit_unary(char opcode, llvm::Value* operand);
+    llvm::Function* find_function(Symbol name);
+    llvm::Function* lookup_operator(Symbol keyword, char opcode, std::size_t operand_count);
+    llvm::Function* lookup_callee(Symbol callee, std::size_t arg_count);
+    template <typename GenerateBody>
+    llvm::Function* define_function(Symbol name, ArenaSpan<const Symbol> args, GenerateBody&& generate_body);
+    template <typename AddBody, typename GenerateBody>
+    llvm::Function* define_cached_function(
+        Symbol name, ArenaSpan<const Symbol> args, AddBody&& add_body, GenerateBody&& generate_body);
+    template <typename GenerateBody>
+    llvm::Function* define_expression(GenerateBody&& generate_body);
+    std::vector<llvm::orc::ThreadSafeModule> split_uncached_functions();
+    llvm::Value* generate_expression(const ExprAST* root);
+    llvm::Value* generate_flat_expression(const FlatAst& ast, const FlatAst::Item& item);
 
 public:
-    CodegenContentType operator()(std::unique_ptr<ExprAST>&& ast);
-    CodegenContentType operator()(std::unique_ptr<FunctionAST>&& ast);
-    CodegenContentType operator()(std::unique_ptr<FunctionPrototypeAST>&& ast);
-    CodegenContentType operator()(std::monostate&& ast);
+    // None of these modify the AST, the same one can be generated again.
+    CodegenContentType operator()(const ExprAST* ast);
+    CodegenContentType operator()(const FunctionAST* ast);
+    CodegenContentType operator()(const FunctionPrototypeAST* ast);
+    CodegenContentType operator()(std::monostate ast);
+    // Generates one item of `ast`.
+    CodegenContentType operator()(const FlatAst& ast, const FlatAst::Item& item);
+    // Generates every item of `ast` in order, in a single pass over its nodes.
+    std::vector<CodegenContentType> generate(const FlatAst& ast);
+
+    // Declares `name` in the current module, as an `extern` does.
+    llvm::Function* declare_function(Symbol name, ArenaSpan<const Symbol> args);
+    // The next top level expression becomes __anon_expr.<first>, so that
+    // generators of different parts of a program give them distinct names.
+    void number_expressions_from(std::size_t first) noexcept { this->expression_count = first; }
+
+    // `_optimizer` must outlive the generator.
+    void set_optimizer(Optimizer& _optimizer) noexcept { this->optimizer = &_optimizer; }
+    // Calls of functions this generator has neither defined nor declared
+    // declare them from `_prototypes`, indexed by Symbol::id, as if an
+    // `extern` had. It must outlive the generator, and may grow meanwhile.
+    void set_prototypes(const std::vector<const FunctionPrototypeAST*>& _prototypes) noexcept
+    {
+        this->prototypes = &_prototypes;
+    }
+    // Looks every function definition up in `_code_cache`, which must
+    // outlive the generator, under a key made for `target`: what the code
+    // is compiled for and how, see JitEngine::target_description() and
+    // Emitter::target_description(). A hit only declares the function and
+    // keeps its object for take_module(). The optimization level is added
+    // to the key by the generator.
+    void set_code_cache(CodeCache& _code_cache, std::string target)
+    {
+        this->code_cache = &_code_cache;
+        this->cache_target = std::move(target);
+    }
+    // Runs the module pipeline of the optimizer, if there is one, over the
+    // module generated so far. take_module() does so itself.
+    void optimize_module();
+
+    const llvm::Module& get_module() const noexcept { return *this->module; }
+    // Hands over the module generated so far and continues in a new one, in
+    // which the functions defined or declared so far are declared again.
+    // With a code cache, the definitions it missed are moved to modules of
+    // their own first, and optimized there.
+    GeneratedModule take_module();
 
     void print() const;
     std::string to_string() const;
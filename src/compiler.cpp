@@ -4,11 +4,90 @@
 #include <variant>
 
 #include <boost/program_options.hpp>
+#include <spdlog/spdlog.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Path.h>
 
+#include "source.hpp"
+#include "ast_cache.hpp"
 #include "lexer.hpp"
 #include "ast.hpp"
+#include "bytecode.hpp"
 #include "parser.hpp"
+#include "parallel_parser.hpp"
+#include "parallel_codegen.hpp"
+#include "pipeline.hpp"
+#include "simplifier.hpp"
 #include "codegen.hpp"
+#include "code_cache.hpp"
+#include "emitter.hpp"
+#include "error.hpp"
+#include "jit.hpp"
+#include "optimizer.hpp"
+#include "vm.hpp"
+
+
+// Compiles `generated`, one GeneratedModule or several for a JitEngine,
+// parsed items for a LazyJitEngine, and prints the values of its top level
+// expressions.
+template <typename Engine, typename Generated>
+static void run(Engine& jit, Generated generated)
+{
+    try
+    {
+        for (double value : jit.run(std::move(generated)))
+            std::cout << "Evaluated to " << value << std::endl;
+    }
+    catch (const kccani::JitException& error)
+    {
+        spdlog::error(error.what());
+    }
+}
+
+
+// Evaluates the top level expressions compiled for `vm` since its last run
+// and prints their values.
+static void run(kccani::VirtualMachine& vm)
+{
+    try
+    {
+        for (double value : vm.run())
+            std::cout << "Evaluated to " << value << std::endl;
+    }
+    catch (const kccani::VmException& error)
+    {
+        spdlog::error(error.what());
+    }
+}
+
+
+// Writes `generated`, an llvm::Module or a GeneratedModule, as --emit asks
+// to and reports where.
+template <typename Generated>
+static void emit(kccani::Emitter& emitter, Generated& generated, kccani::EmitKind kind, const std::string& path)
+{
+    try
+    {
+        emitter.emit(generated, kind, path);
+        std::cout << "Wrote " << path << std::endl;
+    }
+    catch (const kccani::EmitException& error)
+    {
+        spdlog::error(error.what());
+    }
+}
+
+
+// Reports the tier transitions of a tiered LazyJitEngine, once the tier-ups
+// under way are done.
+static void print_tier_statistics(kccani::LazyJitEngine& jit)
+{
+    jit.wait_for_tier_ups();
+    auto statistics = jit.get_tier_statistics();
+    std::cout << "Tiers: " << statistics.baseline_compilations << " baseline compilations, "
+              << statistics.tier_up_requests << " tier-up requests, " << statistics.tier_ups << " tier-ups, "
+              << statistics.failed_tier_ups << " failed" << std::endl;
+}
 
 
 int main(int argc, char* argv[])
@@ -18,7 +97,36 @@ int main(int argc, char* argv[])
     boost::program_options::options_description options{"Kaliedoscope Args"};
     options.add_options()
         ("help,h", "Displays all the possible commands and flags.")
-        ("file,f", boost::program_options::value<std::vector<std::string>>(), "File or list of files to compile.");
+        ("file,f", boost::program_options::value<std::vector<std::string>>(), "File or list of files to compile.")
+        ("run,r", "Compile the files to native code and print the value of every top level expression instead of the IR.")
+        ("engine", boost::program_options::value<std::string>()->default_value("llvm"),
+            "What --run and the REPL execute with: llvm compiles to native code, vm compiles to bytecode and "
+            "interprets it, which starts much faster and runs slower. Without --run, vm prints the bytecode.")
+        ("lazy", "With --run and in the REPL, generate and compile every function only when it is first called.")
+        ("tier-up-calls", boost::program_options::value<std::uint64_t>()->default_value(0),
+            "With --lazy, compile functions without optimization first, and again at the -O level in the background "
+            "once called this many times. 0 compiles them at the -O level at once.")
+        ("emit", boost::program_options::value<std::string>(),
+            "Write the files' code instead of printing the IR: ll, bc, asm, obj, or shared for a shared library and a C header.")
+        ("output,o", boost::program_options::value<std::string>(),
+            "Output of --emit for a single file, by default the file with the extension of the output.")
+        ("share-subexpressions", "Build equal subexpressions once and generate their code once per function.")
+        ("simplify", "Fold constants, drop identities such as x * 1, order commutative operands canonically and share "
+            "equal subexpressions without side effects before generating code.")
+        ("fast-math", "Let --simplify, which this implies, change results as if floating point arithmetic were "
+            "associative and never NaN, infinite or signed zero: reassociate sums and products to fold their "
+            "constants, and simplify x + 0, x * 0 and x - x.")
+        ("no-ast-cache", "Always parse, ignoring and not writing the <file>c AST caches.")
+        ("pipeline", "Lex, parse and generate code on separate threads, streaming items between them.")
+        ("optimize,O", boost::program_options::value<unsigned>()->default_value(0),
+            "Optimization level, -O0 to -O3: -O1 simplifies every function, -O2 also inlines, -O3 inlines more.")
+        ("time-phases", "Print the time spent in the front end, in function passes and in module passes.")
+        ("jobs,j", boost::program_options::value<unsigned>()->default_value(1),
+            "Threads to parse, generate code and compile with, 0 for one per hardware thread.")
+        ("cache-max-mb", boost::program_options::value<std::uint64_t>()->default_value(kccani::CodeCache::DEFAULT_MAX_BYTES >> 20),
+            "Size in MiB the compiled code cache in $KCCANI_CACHE_DIR is kept under. It caches the functions of --run, "
+            "--emit=obj, --emit=shared and the REPL, without -j.")
+        ("cache-stats", "Print the hits, misses, stores and evictions of the compiled code cache.");
     boost::program_options::variables_map parsed_args;
     boost::program_options::store(
         boost::program_options::parse_command_line(argc, argv, options),
@@ -31,38 +139,303 @@ int main(int argc, char* argv[])
         std::cout << "This is an experimental compiler for the LLVM tutorial language" << std::endl;
     }
     
+    const bool share_subexpressions = parsed_args.count("share-subexpressions") > 0;
+    const bool fast_math = parsed_args.count("fast-math") > 0;
+    const bool simplify = parsed_args.count("simplify") > 0 || fast_math;
+    // Hash-consing and simplification work on the pointer tree only.
+    const bool use_pointer_tree = share_subexpressions || simplify;
+    const bool use_ast_cache = parsed_args.count("no-ast-cache") == 0;
+    const bool run_files = parsed_args.count("run") > 0;
+    const std::string engine = parsed_args.at("engine").as<std::string>();
+    if (engine != "llvm" && engine != "vm")
+    {
+        spdlog::error("Unknown engine " + engine + ", expected llvm or vm");
+        return 1;
+    }
+    const bool use_vm = engine == "vm";
+    const bool lazy = parsed_args.count("lazy") > 0;
+    const std::uint64_t tier_up_calls = parsed_args.at("tier-up-calls").as<std::uint64_t>();
+    const unsigned jobs = parsed_args.at("jobs").as<unsigned>();
+    // The pipeline never shares subexpressions, see kccani::Pipeline.
+    const bool use_pipeline = parsed_args.count("pipeline") > 0 && !use_pointer_tree;
+
+    std::unique_ptr<kccani::PhaseTimers> timers;
+    if (parsed_args.count("time-phases"))
+        timers = std::make_unique<kccani::PhaseTimers>();
+    const unsigned optimization_level = parsed_args.at("optimize").as<unsigned>();
+    kccani::Optimizer optimizer(optimization_level, timers.get());
+
+    auto code_cache = kccani::CodeCache::from_environment(parsed_args.at("cache-max-mb").as<std::uint64_t>() << 20);
+
+    std::unique_ptr<kccani::Emitter> emitter;
+    kccani::EmitKind emit_kind = kccani::EmitKind::OBJECT;
+    if (parsed_args.count("emit"))
+    {
+        try
+        {
+            emit_kind = kccani::Emitter::parse_kind(parsed_args.at("emit").as<std::string>());
+            emitter = std::make_unique<kccani::Emitter>(optimization_level, code_cache.get());
+        }
+        catch (const kccani::EmitException& error)
+        {
+            spdlog::error(error.what());
+            return 1;
+        }
+        if (use_vm)
+        {
+            spdlog::error("--emit needs --engine=llvm");
+            return 1;
+        }
+    }
+
     if (parsed_args.count("file"))
     {
         auto file_names = parsed_args.at("file").as<std::vector<std::string>>();
+        if (parsed_args.count("output") && file_names.size() > 1)
+        {
+            spdlog::error("--output needs a single file");
+            return 1;
+        }
+        auto output_path = [&](const std::string& file_name) {
+            if (parsed_args.count("output"))
+                return parsed_args.at("output").as<std::string>();
+            llvm::SmallString<128> path(file_name);
+            llvm::sys::path::replace_extension(path, kccani::Emitter::extension(emit_kind));
+            return std::string(path);
+        };
+        std::unique_ptr<kccani::ParallelParser> parallel_parser;
+        std::unique_ptr<kccani::ParallelCodeGenerator> parallel_codegen;
+        if (jobs != 1)
+        {
+            parallel_parser = std::make_unique<kccani::ParallelParser>(jobs);
+            parallel_codegen = std::make_unique<kccani::ParallelCodeGenerator>(jobs, optimization_level);
+        }
         for (auto file_name : file_names)
         {
             std::cout << "Compiling: " << file_name << std::endl;
-            std::ifstream fin(file_name, std::fstream::in);
+            auto source = kccani::SourceBuffer::from_file(file_name);
+
+            if (use_vm)
+            {
+                kccani::BytecodeProgram program;
+                kccani::BytecodeCompiler bytecode(program);
+                {
+                    llvm::TimeRegion front_end(timers ? &(*timers)[kccani::PhaseTimers::FRONT_END] : nullptr);
+                    if (use_pipeline)
+                    {
+                        kccani::Pipeline().run(source.view(), [&bytecode](const kccani::ParsedAstContentType& ast) {
+                            std::visit(std::ref(bytecode), ast);
+                        });
+                    }
+                    else if (use_pointer_tree || !use_ast_cache)
+                    {
+                        auto lexer = kccani::Lexer(source);
+                        auto parser = kccani::Parser(lexer, std::make_shared<kccani::AstArena>(), share_subexpressions);
+                        auto asts = parser.fetch_all();
+                        if (simplify)
+                            kccani::AstSimplifier(parser.arena(), fast_math).simplify(asts);
+                        for (auto& ast : asts)
+                            std::visit(std::ref(bytecode), ast);
+                    }
+                    else
+                        bytecode.compile(kccani::AstCache::load_or_parse(source, file_name, nullptr, parallel_parser.get()));
+                }
+                if (run_files)
+                {
+                    kccani::VirtualMachine vm(program);
+                    run(vm);
+                }
+                else
+                {
+                    std::cout << "Bytecode output:" << std::endl;
+                    std::cout << program.to_string();
+                }
+                continue;
+            }
+
+            // Bodies are generated from the pointer tree on their first call.
+            if (run_files && lazy)
+            {
+                auto lexer = kccani::Lexer(source);
+                auto parser = kccani::Parser(lexer, std::make_shared<kccani::AstArena>(), share_subexpressions);
+                std::vector<kccani::ParsedAstContentType> asts;
+                {
+                    llvm::TimeRegion front_end(timers ? &(*timers)[kccani::PhaseTimers::FRONT_END] : nullptr);
+                    asts = parser.fetch_all();
+                    if (simplify)
+                        kccani::AstSimplifier(parser.arena(), fast_math).simplify(asts);
+                }
+                kccani::LazyJitEngine jit(optimization_level, tier_up_calls);
+                run(jit, std::move(asts));
+                if (tier_up_calls > 0)
+                    print_tier_statistics(jit);
+                continue;
+            }
 
-            auto lexer = kccani::Lexer(fin);
-            auto parser = kccani::Parser(lexer);
-            auto asts = parser.fetch_all();
+            // Hash-consing works on the pointer tree of one parser only.
+            if (parallel_codegen && !use_pipeline && !use_pointer_tree)
+            {
+                std::vector<kccani::GeneratedModule> modules;
+                {
+                    // Includes the passes, which run on the worker threads.
+                    llvm::TimeRegion front_end(timers ? &(*timers)[kccani::PhaseTimers::FRONT_END] : nullptr);
+                    if (use_ast_cache)
+                        modules = parallel_codegen->generate(kccani::AstCache::load_or_parse(
+                            source, file_name, nullptr, parallel_parser.get()));
+                    else
+                        modules = parallel_codegen->generate(parallel_parser->parse(source.view()).items);
+                }
+                if (run_files)
+                {
+                    kccani::JitEngine jit(jobs);
+                    run(jit, std::move(modules));
+                }
+                else
+                {
+                    llvm::LLVMContext context;
+                    if (auto linked = kccani::ParallelCodeGenerator::link(std::move(modules), context))
+                    {
+                        if (emitter)
+                            emit(*emitter, *linked, emit_kind, output_path(file_name));
+                        else
+                        {
+                            std::cout << "Final LLVM Intermediate Representation output:" << std::endl;
+                            linked->print(llvm::errs(), nullptr);
+                        }
+                    }
+                }
+                continue;
+            }
 
             kccani::CodeGeneratorLLVM codegen;
-            for (auto &ast : asts)
-                std::visit(std::ref(codegen), std::move(ast));
-            std::cout << "Final LLVM Intermediate Representation output:" << std::endl;
-            codegen.print();
+            codegen.set_optimizer(optimizer);
+            if (code_cache && run_files)
+                codegen.set_code_cache(*code_cache, kccani::JitEngine::target_description());
+            else if (code_cache && emitter
+                && (emit_kind == kccani::EmitKind::OBJECT || emit_kind == kccani::EmitKind::SHARED_LIBRARY))
+                codegen.set_code_cache(*code_cache, emitter->target_description());
+            {
+                llvm::TimeRegion front_end(timers ? &(*timers)[kccani::PhaseTimers::FRONT_END] : nullptr);
+                if (use_pipeline)
+                {
+                    kccani::Pipeline().run(source.view(), [&codegen](const kccani::ParsedAstContentType& ast) {
+                        std::visit(std::ref(codegen), ast);
+                    });
+                }
+                else if (use_pointer_tree || !use_ast_cache)
+                {
+                    auto lexer = kccani::Lexer(source);
+                    auto parser = kccani::Parser(lexer, std::make_shared<kccani::AstArena>(), share_subexpressions);
+                    auto asts = parser.fetch_all();
+                    if (simplify)
+                        kccani::AstSimplifier(parser.arena(), fast_math).simplify(asts);
+                    for (auto &ast : asts)
+                        std::visit(std::ref(codegen), ast);
+                }
+                else
+                {
+                    // Hash-consing works on the pointer tree only, so the cache
+                    // holds the plain flat form.
+                    auto ast = kccani::AstCache::load_or_parse(source, file_name, nullptr, parallel_parser.get());
+                    codegen.generate(ast);
+                }
+            }
+            if (run_files)
+            {
+                kccani::JitEngine jit(1, code_cache.get());
+                run(jit, codegen.take_module());
+            }
+            else if (emitter)
+            {
+                auto generated = codegen.take_module();
+                emit(*emitter, generated, emit_kind, output_path(file_name));
+            }
+            else
+            {
+                codegen.optimize_module();
+                std::cout << "Final LLVM Intermediate Representation output:" << std::endl;
+                codegen.print();
+            }
+        }
+    }
+    else if (use_vm)
+    {
+        auto lexer = kccani::Lexer(std::cin);
+        auto parser = kccani::Parser(lexer, std::make_shared<kccani::AstArena>(), share_subexpressions);
+        kccani::AstSimplifier simplifier(parser.arena(), fast_math);
+        kccani::BytecodeProgram program;
+        kccani::BytecodeCompiler bytecode(program);
+        kccani::VirtualMachine vm(program);
+        while (true)
+        {
+            std::cout << "kccani> ";
+            if (lexer.peek().type == kccani::Token::TokenType::TOKEN_EOF)
+                break;
+            auto ast = parser.get();
+            if (simplify)
+                ast = simplifier.simplify(ast);
+            if (std::visit(std::ref(bytecode), ast))
+                run(vm);
         }
     }
+    else if (lazy)
+    {
+        auto lexer = kccani::Lexer(std::cin);
+        auto parser = kccani::Parser(lexer, std::make_shared<kccani::AstArena>(), share_subexpressions);
+        kccani::AstSimplifier simplifier(parser.arena(), fast_math);
+        kccani::LazyJitEngine jit(optimization_level, tier_up_calls);
+        while (true)
+        {
+            std::cout << "kccani> ";
+            if (lexer.peek().type == kccani::Token::TokenType::TOKEN_EOF)
+                break;
+            auto ast = parser.get();
+            if (simplify)
+                ast = simplifier.simplify(ast);
+            run(jit, std::vector<kccani::ParsedAstContentType>{ast});
+        }
+        if (tier_up_calls > 0)
+            print_tier_statistics(jit);
+    }
     else
     {
         auto lexer = kccani::Lexer(std::cin);
-        auto parser = kccani::Parser(lexer);
+        auto parser = kccani::Parser(lexer, std::make_shared<kccani::AstArena>(), share_subexpressions);
+        kccani::AstSimplifier simplifier(parser.arena(), fast_math);
         kccani::CodeGeneratorLLVM codegen;
+        codegen.set_optimizer(optimizer);
+        if (code_cache)
+            codegen.set_code_cache(*code_cache, kccani::JitEngine::target_description());
+        kccani::JitEngine jit(1, code_cache.get());
         while (true)
         {
             std::cout << "kccani> ";
+            if (lexer.peek().type == kccani::Token::TokenType::TOKEN_EOF)
+                break;
             auto ast = parser.get();
+            if (simplify)
+                ast = simplifier.simplify(ast);
 
-            auto result = std::visit(std::ref(codegen), std::move(ast));
+            auto result = std::visit(std::ref(codegen), ast);
             kccani::CodeGeneratorLLVM::print(result);
             std::cout << std::endl;
+            if (std::holds_alternative<llvm::Function*>(result) && std::get<llvm::Function*>(result))
+                run(jit, codegen.take_module());
+        }
+    }
+
+    if (timers)
+        timers->print(llvm::errs());
+    if (parsed_args.count("cache-stats"))
+    {
+        if (!code_cache)
+            spdlog::warn("No code cache, $KCCANI_CACHE_DIR is not set");
+        else
+        {
+            auto statistics = code_cache->get_statistics();
+            std::cout << "Code cache: " << statistics.hits << " hits, " << statistics.misses << " misses, "
+                      << statistics.stores << " stores, " << statistics.evictions << " evictions, "
+                      << statistics.bytes << " bytes" << std::endl;
         }
     }
 }
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace kccani
+{
+
+// Receives the errors the parser reports and recovers from.
+class DiagnosticSink
+{
+public:
+    virtual ~DiagnosticSink() = default;
+    virtual void error(const std::string& message) = 0;
+
+    // Logs through spdlog, used unless a parser is given another sink.
+    static DiagnosticSink& standard();
+};
+
+class LoggingDiagnostics : public DiagnosticSink
+{
+public:
+    void error(const std::string& message) override { spdlog::error(message); }
+};
+
+// Holds on to the messages, for work whose diagnostics may be dropped or
+// have to be reported in a different order than they were produced.
+class BufferedDiagnostics : public DiagnosticSink
+{
+    std::vector<std::string> messages;
+
+public:
+    void error(const std::string& message) override { this->messages.push_back(message); }
+
+    [[nodiscard]] const std::vector<std::string>& get_messages() const noexcept { return this->messages; }
+    void replay(DiagnosticSink& sink) const
+    {
+        for (const std::string& message : this->messages)
+            sink.error(message);
+    }
+};
+
+inline DiagnosticSink& DiagnosticSink::standard()
+{
+    static LoggingDiagnostics sink;
+    return sink;
+}
+
+}
@@ -0,0 +1,325 @@
+#include "emitter.hpp"
+
+#include <cctype>
+#include <cstdlib>
+#include <system_error>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetOptions.h>
+
+#include "error.hpp"
+#include "symbol.hpp"
+
+namespace kccani
+{
+
+static llvm::CodeGenOpt::Level code_generation_level(unsigned optimization_level)
+{
+    switch (optimization_level)
+    {
+    case 0:
+        return llvm::CodeGenOpt::None;
+    case 1:
+        return llvm::CodeGenOpt::Less;
+    case 2:
+        return llvm::CodeGenOpt::Default;
+    default:
+        return llvm::CodeGenOpt::Aggressive;
+    }
+}
+
+// Calls `write` with a stream to `path`. A stream left with an error would
+// abort the process when destroyed, so errors are checked and cleared.
+template <typename Write>
+static void write_output(const std::string& path, llvm::sys::fs::OpenFlags flags, Write&& write)
+{
+    std::error_code error;
+    llvm::raw_fd_ostream out(path, error, flags);
+    if (error)
+        throw EmitException("Could not open " + path + ": " + error.message());
+    write(out);
+    out.close();
+    if (out.has_error())
+    {
+        std::string message = out.error().message();
+        out.clear_error();
+        throw EmitException("Could not write " + path + ": " + message);
+    }
+}
+
+static llvm::SmallString<128> temporary_object()
+{
+    llvm::SmallString<128> object_path;
+    if (std::error_code error = llvm::sys::fs::createTemporaryFile("kccani", "o", object_path))
+        throw EmitException("Could not create a temporary object file: " + error.message());
+    return object_path;
+}
+
+// A shared library's header goes to `path` with the extension ".h".
+static void write_header(const std::string& path, const std::string& header)
+{
+    llvm::SmallString<128> header_path(path);
+    llvm::sys::path::replace_extension(header_path, "h");
+    write_output(std::string(header_path), llvm::sys::fs::OF_Text, [&](llvm::raw_fd_ostream& out) {
+        out << header;
+    });
+}
+
+Emitter::Emitter(unsigned _optimization_level, CodeCache* cache)
+    : optimization_level(_optimization_level), code_cache(cache)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    std::string triple = llvm::sys::getDefaultTargetTriple();
+    std::string error;
+    const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple, error);
+    if (!target)
+        throw EmitException(error);
+    this->target_machine.reset(target->createTargetMachine(
+        triple, "generic", "", llvm::TargetOptions(), llvm::Reloc::PIC_, llvm::None,
+        code_generation_level(this->optimization_level)));
+    if (!this->target_machine)
+        throw EmitException("Could not create a target machine for " + triple);
+}
+
+std::string Emitter::target_description() const
+{
+    return this->target_machine->getTargetTriple().str() + ";generic;pic;"
+        + std::to_string(static_cast<int>(code_generation_level(this->optimization_level)));
+}
+
+EmitKind Emitter::parse_kind(std::string_view name)
+{
+    if (name == "ll")
+        return EmitKind::LLVM_IR;
+    if (name == "bc")
+        return EmitKind::BITCODE;
+    if (name == "asm")
+        return EmitKind::ASSEMBLY;
+    if (name == "obj")
+        return EmitKind::OBJECT;
+    if (name == "shared")
+        return EmitKind::SHARED_LIBRARY;
+    throw EmitException("Unknown output kind " + std::string(name) + ", expected ll, bc, asm, obj or shared");
+}
+
+std::string Emitter::extension(EmitKind kind)
+{
+    switch (kind)
+    {
+    case EmitKind::LLVM_IR:
+        return ".ll";
+    case EmitKind::BITCODE:
+        return ".bc";
+    case EmitKind::ASSEMBLY:
+        return ".s";
+    case EmitKind::OBJECT:
+        return ".o";
+    case EmitKind::SHARED_LIBRARY:
+        return ".so";
+    }
+    __builtin_unreachable();
+}
+
+void Emitter::emit(llvm::Module& module, EmitKind kind, const std::string& path)
+{
+    module.setTargetTriple(this->target_machine->getTargetTriple().str());
+    module.setDataLayout(this->target_machine->createDataLayout());
+    switch (kind)
+    {
+    case EmitKind::LLVM_IR:
+        write_output(path, llvm::sys::fs::OF_Text, [&](llvm::raw_fd_ostream& out) {
+            module.print(out, nullptr);
+        });
+        break;
+    case EmitKind::BITCODE:
+        write_output(path, llvm::sys::fs::OF_None, [&](llvm::raw_fd_ostream& out) {
+            llvm::WriteBitcodeToFile(module, out);
+        });
+        break;
+    case EmitKind::ASSEMBLY:
+    case EmitKind::OBJECT:
+        this->emit_native(module, kind, path);
+        break;
+    case EmitKind::SHARED_LIBRARY:
+    {
+        // Written first, code generation may rewrite the module.
+        write_header(path, Emitter::c_header(module));
+        llvm::SmallString<128> object_path = temporary_object();
+        try
+        {
+            this->emit_native(module, EmitKind::OBJECT, std::string(object_path));
+            this->link_objects({std::string(object_path)}, kind, path);
+        }
+        catch (...)
+        {
+            llvm::sys::fs::remove(object_path);
+            throw;
+        }
+        llvm::sys::fs::remove(object_path);
+        break;
+    }
+    }
+}
+
+// Every object is written to a temporary file for the driver to link:
+// `module`'s, those compiled from the function modules, which are stored in
+// the cache on the way, and the cached ones.
+void Emitter::emit(GeneratedModule& generated, EmitKind kind, const std::string& path)
+{
+    if (generated.function_modules.empty() && generated.objects.empty())
+    {
+        generated.module.withModuleDo([&](llvm::Module& module) { this->emit(module, kind, path); });
+        return;
+    }
+    if (kind != EmitKind::OBJECT && kind != EmitKind::SHARED_LIBRARY)
+        throw EmitException("Cached code can only be emitted as obj or shared");
+
+    std::vector<std::string> object_paths;
+    std::vector<std::string> defined_elsewhere;
+    auto write_object = [&](llvm::StringRef object) {
+        object_paths.push_back(std::string(temporary_object()));
+        write_output(object_paths.back(), llvm::sys::fs::OF_None, [&](llvm::raw_fd_ostream& out) {
+            out << object;
+        });
+    };
+    try
+    {
+        object_paths.push_back(std::string(temporary_object()));
+        generated.module.withModuleDo([&](llvm::Module& module) {
+            module.setTargetTriple(this->target_machine->getTargetTriple().str());
+            module.setDataLayout(this->target_machine->createDataLayout());
+            this->emit_native(module, EmitKind::OBJECT, object_paths.back());
+        });
+        for (llvm::orc::ThreadSafeModule& function_module : generated.function_modules)
+        {
+            function_module.withModuleDo([&](llvm::Module& module) {
+                module.setTargetTriple(this->target_machine->getTargetTriple().str());
+                module.setDataLayout(this->target_machine->createDataLayout());
+                for (const llvm::Function& function : module)
+                    if (!function.isDeclaration())
+                        defined_elsewhere.push_back(function.getName().str());
+                llvm::SmallVector<char, 0> object;
+                llvm::raw_svector_ostream out(object);
+                this->compile(module, EmitKind::OBJECT, out);
+                llvm::StringRef contents(object.data(), object.size());
+                if (this->code_cache)
+                    this->code_cache->store(module.getModuleIdentifier(), llvm::MemoryBufferRef(contents, module.getModuleIdentifier()));
+                write_object(contents);
+            });
+        }
+        for (const CachedObject& object : generated.objects)
+        {
+            defined_elsewhere.push_back(object.function);
+            write_object(object.object->getBuffer());
+        }
+        if (kind == EmitKind::SHARED_LIBRARY)
+        {
+            generated.module.withModuleDo([&](llvm::Module& module) {
+                write_header(path, Emitter::c_header(module, defined_elsewhere));
+            });
+        }
+        this->link_objects(object_paths, kind, path);
+    }
+    catch (...)
+    {
+        for (const std::string& object_path : object_paths)
+            llvm::sys::fs::remove(object_path);
+        throw;
+    }
+    for (const std::string& object_path : object_paths)
+        llvm::sys::fs::remove(object_path);
+}
+
+// Native code generation still runs on the legacy pass manager.
+void Emitter::compile(llvm::Module& module, EmitKind kind, llvm::raw_pwrite_stream& out)
+{
+    llvm::legacy::PassManager passes;
+    if (this->target_machine->addPassesToEmitFile(
+            passes, out, nullptr, kind == EmitKind::ASSEMBLY ? llvm::CGFT_AssemblyFile : llvm::CGFT_ObjectFile))
+        throw EmitException("The target cannot emit this kind of file");
+    passes.run(module);
+}
+
+void Emitter::emit_native(llvm::Module& module, EmitKind kind, const std::string& path)
+{
+    bool assembly = kind == EmitKind::ASSEMBLY;
+    write_output(path, assembly ? llvm::sys::fs::OF_Text : llvm::sys::fs::OF_None, [&](llvm::raw_fd_ostream& out) {
+        this->compile(module, kind, out);
+    });
+}
+
+// A shared library against the C math library, or a single relocatable
+// object.
+void Emitter::link_objects(const std::vector<std::string>& object_paths, EmitKind kind, const std::string& path)
+{
+    const char* driver = std::getenv("CC");
+    auto program = llvm::sys::findProgramByName(driver && *driver ? driver : "cc");
+    if (!program)
+        throw EmitException("No C compiler driver to link " + path + " with: " + program.getError().message());
+    const bool shared = kind == EmitKind::SHARED_LIBRARY;
+    std::vector<llvm::StringRef> arguments{*program, shared ? "-shared" : "-r", "-o", path};
+    if (!shared)
+        arguments.push_back("-nostdlib");
+    arguments.insert(arguments.end(), object_paths.begin(), object_paths.end());
+    if (shared)
+        arguments.push_back("-lm");
+    std::string error;
+    if (llvm::sys::ExecuteAndWait(*program, arguments, llvm::None, {}, 0, 0, &error) != 0)
+        throw EmitException("Linking " + path + " failed" + (error.empty() ? "" : ": " + error));
+}
+
+static bool is_c_identifier(llvm::StringRef name)
+{
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front())))
+        return false;
+    for (char c : name)
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+            return false;
+    return true;
+}
+
+std::string Emitter::c_header(const llvm::Module& module, llvm::ArrayRef<std::string> defined_elsewhere)
+{
+    llvm::StringSet<> elsewhere;
+    for (const std::string& name : defined_elsewhere)
+        elsewhere.insert(name);
+    std::string header =
+        "// Kaleidoscope functions of the accompanying library, generated by kccani.\n"
+        "#pragma once\n"
+        "\n"
+        "#ifdef __cplusplus\n"
+        "extern \"C\" {\n"
+        "#endif\n"
+        "\n";
+    for (const llvm::Function& function : module)
+    {
+        if ((function.isDeclaration() && !elsewhere.contains(function.getName())) || !is_c_identifier(function.getName())
+            || function.getName().startswith(symbols::ANON_EXPR.name()))
+            continue;
+        header += "double " + function.getName().str() + "(";
+        if (function.arg_empty())
+            header += "void";
+        for (std::size_t i = 0; i < function.arg_size(); i++)
+            header += i == 0 ? "double" : ", double";
+        header += ");\n";
+    }
+    header +=
+        "\n"
+        "#ifdef __cplusplus\n"
+        "}\n"
+        "#endif\n";
+    return header;
+}
+
+}
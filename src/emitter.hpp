@@ -0,0 +1,80 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "code_cache.hpp"
+#include "codegen.hpp"
+
+namespace kccani
+{
+
+enum class EmitKind
+{
+    LLVM_IR,
+    BITCODE,
+    ASSEMBLY,
+    OBJECT,
+    SHARED_LIBRARY,
+};
+
+// Lowers generated modules ahead of time, for the host's target triple and a
+// generic CPU of its architecture, so that the output also runs on other
+// machines of the kind.
+//
+// Code is always position independent. A shared library is linked from the
+// object file by the system's C compiler driver (`cc`, or $CC), against the
+// C math library that `extern`s usually come from, and comes with a C header
+// declaring the functions it defines.
+//
+// A GeneratedModule with cached code can only become an object file or a
+// shared library: its objects are linked together by the driver, after the
+// function modules are compiled and stored in the CodeCache, if any.
+class Emitter
+{
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+    unsigned optimization_level;
+    CodeCache* code_cache;
+
+    void compile(llvm::Module& module, EmitKind kind, llvm::raw_pwrite_stream& out);
+    void emit_native(llvm::Module& module, EmitKind kind, const std::string& path);
+    void link_objects(const std::vector<std::string>& object_paths, EmitKind kind, const std::string& path);
+
+public:
+    // Native code is generated at -O`optimization_level`, which does not
+    // run the Optimizer's passes. `cache` must outlive the emitter. Throws
+    // EmitException if LLVM cannot target the host.
+    explicit Emitter(unsigned _optimization_level = 0, CodeCache* cache = nullptr);
+
+    [[nodiscard]] const llvm::TargetMachine& get_target_machine() const noexcept { return *this->target_machine; }
+    // What the emitter compiles for, to key a CodeCache with.
+    [[nodiscard]] std::string target_description() const;
+
+    // "ll", "bc", "asm", "obj" or "shared". Throws EmitException otherwise.
+    static EmitKind parse_kind(std::string_view name);
+    // The usual extension of the output, with its dot: ".ll", ".bc", ".s",
+    // ".o" or ".so".
+    static std::string extension(EmitKind kind);
+
+    // Writes `module`, retargeted to the host, to `path`. A shared library's
+    // header goes next to it, to `path` with the extension ".h". Throws
+    // EmitException if an output cannot be written.
+    void emit(llvm::Module& module, EmitKind kind, const std::string& path);
+    // The same for everything `generated` holds, cached code included.
+    void emit(GeneratedModule& generated, EmitKind kind, const std::string& path);
+
+    // C declarations of the functions `module` defines, `double name(double
+    // a, ...)`, and of those of `defined_elsewhere` it declares. Top level
+    // expressions and operators, whose names are no C identifiers, are left
+    // out.
+    static std::string c_header(const llvm::Module& module, llvm::ArrayRef<std::string> defined_elsewhere = {});
+};
+
+}
@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <exception>
+#include <string>
 
 namespace kccani
 {
@@ -21,4 +22,49 @@ public:
     }
 };
 
+class JitException : public std::exception
+{
+    std::string message;
+
+public:
+    explicit JitException(std::string _message) : message(_message) {}
+    JitException(JitException const&) noexcept = default;
+    JitException& operator=(JitException const&) noexcept = default;
+
+    const char* what() const noexcept override
+    {
+        return message.c_str();
+    }
+};
+
+class EmitException : public std::exception
+{
+    std::string message;
+
+public:
+    explicit EmitException(std::string _message) : message(_message) {}
+    EmitException(EmitException const&) noexcept = default;
+    EmitException& operator=(EmitException const&) noexcept = default;
+
+    const char* what() const noexcept override
+    {
+        return message.c_str();
+    }
+};
+
+class VmException : public std::exception
+{
+    std::string message;
+
+public:
+    explicit VmException(std::string _message) : message(_message) {}
+    VmException(VmException const&) noexcept = default;
+    VmException& operator=(VmException const&) noexcept = default;
+
+    const char* what() const noexcept override
+    {
+        return message.c_str();
+    }
+};
+
 }
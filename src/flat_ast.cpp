@@ -0,0 +1,234 @@
+#include "flat_ast.hpp"
+
+#include <cassert>
+
+namespace kccani
+{
+
+std::size_t FlatAst::memory_usage() const noexcept
+{
+    return this->kinds.capacity() * sizeof(NodeKind)
+        + this->operands.capacity() * sizeof(std::uint32_t)
+        + this->links.capacity() * sizeof(std::uint32_t)
+        + this->numbers.capacity() * sizeof(double)
+        + this->call_arguments.capacity() * sizeof(NodeIndex)
+        + this->parameters.capacity() * sizeof(Symbol)
+        + this->items.capacity() * sizeof(Item);
+}
+
+void FlatAst::append(const FlatAst& other)
+{
+    auto node_offset = static_cast<NodeIndex>(this->kinds.size());
+    auto number_offset = static_cast<std::uint32_t>(this->numbers.size());
+    auto call_offset = static_cast<std::uint32_t>(this->call_arguments.size());
+    auto parameter_offset = static_cast<std::uint32_t>(this->parameters.size());
+
+    this->kinds.insert(this->kinds.end(), other.kinds.begin(), other.kinds.end());
+    this->numbers.insert(this->numbers.end(), other.numbers.begin(), other.numbers.end());
+    this->parameters.insert(this->parameters.end(), other.parameters.begin(), other.parameters.end());
+    this->operands.reserve(this->kinds.size());
+    this->links.reserve(this->kinds.size());
+    for (NodeIndex node = 0; node < other.kinds.size(); node++)
+    {
+        std::uint32_t operand = other.operands[node];
+        std::uint32_t link = other.links[node];
+        if (other.kinds[node] == NodeKind::NUMBER)
+            operand += number_offset;
+        else if (other.kinds[node] == NodeKind::BINARY)
+            link += node_offset;
+        else if (other.kinds[node] == NodeKind::CALL)
+            link += call_offset;
+        this->operands.push_back(operand);
+        this->links.push_back(link);
+    }
+    this->call_arguments.reserve(this->call_arguments.size() + other.call_arguments.size());
+    for (std::size_t i = 0; i < other.call_arguments.size(); i += 1 + other.call_arguments[i])
+    {
+        NodeIndex count = other.call_arguments[i];
+        this->call_arguments.push_back(count);
+        for (NodeIndex j = 0; j < count; j++)
+            this->call_arguments.push_back(other.call_arguments[i + 1 + j] + node_offset);
+    }
+    for (Item item : other.items)
+    {
+        item.parameters_begin += parameter_offset;
+        item.nodes_begin += node_offset;
+        if (item.body != NO_NODE)
+            item.body += node_offset;
+        this->items.push_back(item);
+    }
+}
+
+std::string FlatAst::to_string(const Item& item) const
+{
+    std::string prototype;
+    if (item.kind == ItemKind::FUNCTION || item.kind == ItemKind::EXTERN)
+    {
+        std::string args_string;
+        for (std::uint32_t i = 0; i < item.parameter_count; i++)
+        {
+            args_string += this->parameters[item.parameters_begin + i].name();
+            if (i != item.parameter_count - 1)
+                args_string += ", ";
+        }
+        prototype = "def " + item.name.str() + "(" + args_string + ")";
+    }
+    if (item.kind != ItemKind::FUNCTION && item.kind != ItemKind::EXPRESSION)
+        return prototype;
+
+    std::vector<std::string> stack;
+    for (NodeIndex node = item.nodes_begin; node <= item.body; node++)
+    {
+        switch (this->kinds[node])
+        {
+        case NodeKind::NUMBER:
+            stack.push_back(std::to_string(this->number(node)));
+            break;
+        case NodeKind::VARIABLE:
+            stack.push_back(this->variable(node).str());
+            break;
+        case NodeKind::BINARY:
+        {
+            std::string rhs = std::move(stack.back());
+            stack.pop_back();
+            stack.back() = "(" + stack.back() + ") " + this->opcode(node) + " (" + rhs + ")";
+            break;
+        }
+        case NodeKind::UNARY:
+            stack.back() = this->opcode(node) + ("(" + stack.back() + ")");
+            break;
+        case NodeKind::CALL:
+        {
+            std::uint32_t count = this->argument_count(node);
+            std::string args_string;
+            for (std::size_t i = stack.size() - count; i < stack.size(); i++)
+            {
+                args_string += stack[i];
+                if (i != stack.size() - 1)
+                    args_string += ", ";
+            }
+            stack.resize(stack.size() - count);
+            stack.push_back(this->callee(node).str() + "(" + args_string + ")");
+            break;
+        }
+        }
+    }
+    assert(stack.size() == 1);
+    if (item.kind == ItemKind::EXPRESSION)
+        return stack.back();
+    return prototype + "{" + stack.back() + "}";
+}
+
+
+FlatAst::NodeIndex FlatAstBuilder::push_node(FlatAst::NodeKind kind, std::uint32_t operand, std::uint32_t link)
+{
+    auto index = static_cast<FlatAst::NodeIndex>(this->ast.kinds.size());
+    this->ast.kinds.push_back(kind);
+    this->ast.operands.push_back(operand);
+    this->ast.links.push_back(link);
+    return index;
+}
+
+FlatAstBuilder::Expr FlatAstBuilder::number(double value)
+{
+    auto number_index = static_cast<std::uint32_t>(this->ast.numbers.size());
+    this->ast.numbers.push_back(value);
+    return {this->push_node(FlatAst::NodeKind::NUMBER, number_index, 0)};
+}
+
+FlatAstBuilder::Expr FlatAstBuilder::variable(Symbol name)
+{
+    return {this->push_node(FlatAst::NodeKind::VARIABLE, name.id, 0)};
+}
+
+FlatAstBuilder::Expr FlatAstBuilder::binary(char opcode, Expr lhs, Expr rhs)
+{
+    assert(rhs.index + 1 == this->ast.kinds.size());
+    return {this->push_node(FlatAst::NodeKind::BINARY, static_cast<unsigned char>(opcode), lhs.index)};
+}
+
+FlatAstBuilder::Expr FlatAstBuilder::call(Symbol callee, const std::vector<Expr>& args, std::size_t begin)
+{
+    auto offset = static_cast<std::uint32_t>(this->ast.call_arguments.size());
+    this->ast.call_arguments.push_back(static_cast<FlatAst::NodeIndex>(args.size() - begin));
+    for (std::size_t i = begin; i < args.size(); i++)
+        this->ast.call_arguments.push_back(args[i].index);
+    return {this->push_node(FlatAst::NodeKind::CALL, callee.id, offset)};
+}
+
+FlatAstBuilder::Expr FlatAstBuilder::unary(char opcode, Expr operand)
+{
+    assert(operand.index + 1 == this->ast.kinds.size());
+    return {this->push_node(FlatAst::NodeKind::UNARY, static_cast<unsigned char>(opcode), 0)};
+}
+
+FlatAstBuilder::Prototype FlatAstBuilder::prototype(Symbol name, const std::vector<Symbol>& params)
+{
+    auto begin = static_cast<std::uint32_t>(this->ast.parameters.size());
+    this->ast.parameters.insert(this->ast.parameters.end(), params.begin(), params.end());
+    return {name, begin, static_cast<std::uint32_t>(params.size()), true};
+}
+
+FlatAstBuilder::Function FlatAstBuilder::function(Prototype prototype, Expr body)
+{
+    return {prototype, body};
+}
+
+void FlatAstBuilder::begin_item()
+{
+    this->item_nodes = this->ast.kinds.size();
+    this->item_numbers = this->ast.numbers.size();
+    this->item_call_arguments = this->ast.call_arguments.size();
+    this->item_parameters = this->ast.parameters.size();
+}
+
+FlatAstBuilder::Item FlatAstBuilder::function_item(Function function)
+{
+    FlatAst::Item item;
+    item.kind = FlatAst::ItemKind::FUNCTION;
+    item.name = function.prototype.name;
+    item.parameters_begin = function.prototype.parameters_begin;
+    item.parameter_count = function.prototype.parameter_count;
+    item.nodes_begin = static_cast<FlatAst::NodeIndex>(this->item_nodes);
+    item.body = function.body.index;
+    this->ast.items.push_back(item);
+    return static_cast<Item>(this->ast.items.size() - 1);
+}
+
+FlatAstBuilder::Item FlatAstBuilder::extern_item(Prototype prototype)
+{
+    FlatAst::Item item;
+    item.kind = FlatAst::ItemKind::EXTERN;
+    item.name = prototype.name;
+    item.parameters_begin = prototype.parameters_begin;
+    item.parameter_count = prototype.parameter_count;
+    item.nodes_begin = static_cast<FlatAst::NodeIndex>(this->item_nodes);
+    this->ast.items.push_back(item);
+    return static_cast<Item>(this->ast.items.size() - 1);
+}
+
+FlatAstBuilder::Item FlatAstBuilder::expression_item(Expr expression)
+{
+    FlatAst::Item item;
+    item.kind = FlatAst::ItemKind::EXPRESSION;
+    item.nodes_begin = static_cast<FlatAst::NodeIndex>(this->item_nodes);
+    item.body = expression.index;
+    this->ast.items.push_back(item);
+    return static_cast<Item>(this->ast.items.size() - 1);
+}
+
+FlatAstBuilder::Item FlatAstBuilder::error_item()
+{
+    this->ast.kinds.resize(this->item_nodes);
+    this->ast.operands.resize(this->item_nodes);
+    this->ast.links.resize(this->item_nodes);
+    this->ast.numbers.resize(this->item_numbers);
+    this->ast.call_arguments.resize(this->item_call_arguments);
+    this->ast.parameters.erase(this->ast.parameters.begin() + this->item_parameters, this->ast.parameters.end());
+    FlatAst::Item item;
+    item.nodes_begin = static_cast<FlatAst::NodeIndex>(this->item_nodes);
+    this->ast.items.push_back(item);
+    return static_cast<Item>(this->ast.items.size() - 1);
+}
+
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "arena.hpp"
+#include "symbol.hpp"
+
+namespace kccani
+{
+
+// A whole parsed program in a handful of flat arrays.
+//
+// Expression nodes are stored in post-order, every node after its children,
+// as a struct of arrays indexed by 32 bit NodeIndex. Walking a range of nodes
+// front to back therefore visits operands before their users, so codegen and
+// printing are single linear scans with a value stack. Per node this costs a
+// kind byte plus two 32 bit words, and eight more bytes for numbers.
+class FlatAst
+{
+public:
+    using NodeIndex = std::uint32_t;
+    static constexpr NodeIndex NO_NODE = std::numeric_limits<NodeIndex>::max();
+
+    enum class NodeKind : std::uint8_t
+    {
+        NUMBER,
+        VARIABLE,
+        BINARY,
+        CALL,
+        UNARY,
+    };
+
+    enum class ItemKind : std::uint8_t
+    {
+        FUNCTION,
+        EXTERN,
+        EXPRESSION,
+        // A top level item that failed to parse, kept so that items line up
+        // with what Parser::fetch_all() returns.
+        ERROR,
+    };
+
+    // A top level definition, extern or expression.
+    struct Item
+    {
+        ItemKind kind = ItemKind::ERROR;
+        // Prototype of FUNCTION and EXTERN items.
+        Symbol name{0};
+        std::uint32_t parameters_begin = 0;
+        std::uint32_t parameter_count = 0;
+        // The nodes of the body are [nodes_begin, body], the body is its root.
+        NodeIndex nodes_begin = 0;
+        NodeIndex body = NO_NODE;
+    };
+
+private:
+    friend class FlatAstBuilder;
+    friend class AstCache;
+
+    std::vector<NodeKind> kinds;
+    // NUMBER: index into `numbers`, VARIABLE: symbol id, BINARY and UNARY:
+    // opcode, CALL: callee symbol id.
+    std::vector<std::uint32_t> operands;
+    // BINARY: root of the left operand (the right one ends just before the
+    // node), CALL: offset into `call_arguments`.
+    std::vector<std::uint32_t> links;
+    std::vector<double> numbers;
+    // For each call its argument count followed by the argument roots.
+    std::vector<NodeIndex> call_arguments;
+    std::vector<Symbol> parameters;
+    std::vector<Item> items;
+
+public:
+    [[nodiscard]] std::size_t size() const noexcept { return this->kinds.size(); }
+    [[nodiscard]] NodeKind kind(NodeIndex node) const { return this->kinds[node]; }
+    [[nodiscard]] double number(NodeIndex node) const { return this->numbers[this->operands[node]]; }
+    [[nodiscard]] Symbol variable(NodeIndex node) const { return Symbol(this->operands[node]); }
+    [[nodiscard]] char opcode(NodeIndex node) const { return static_cast<char>(this->operands[node]); }
+    [[nodiscard]] NodeIndex lhs(NodeIndex node) const { return this->links[node]; }
+    [[nodiscard]] NodeIndex rhs(NodeIndex node) const { return node - 1; }
+    [[nodiscard]] NodeIndex operand(NodeIndex node) const { return node - 1; }
+    [[nodiscard]] Symbol callee(NodeIndex node) const { return Symbol(this->operands[node]); }
+    [[nodiscard]] std::uint32_t argument_count(NodeIndex node) const { return this->call_arguments[this->links[node]]; }
+    [[nodiscard]] NodeIndex argument(NodeIndex node, std::uint32_t index) const
+    {
+        return this->call_arguments[this->links[node] + 1 + index];
+    }
+
+    [[nodiscard]] const std::vector<Item>& get_items() const noexcept { return this->items; }
+    [[nodiscard]] ArenaSpan<const Symbol> parameters_of(const Item& item) const
+    {
+        return {this->parameters.data() + item.parameters_begin, item.parameter_count};
+    }
+
+    // Appends the items and nodes of `other`, renumbering its indices.
+    void append(const FlatAst& other);
+
+    // Approximate heap footprint of the arrays, for comparing encodings.
+    [[nodiscard]] std::size_t memory_usage() const noexcept;
+
+    // Same text as to_string() on the equivalent pointer tree item.
+    [[nodiscard]] std::string to_string(const Item& item) const;
+};
+
+
+// Appends what BasicParser parses to a FlatAst.
+class FlatAstBuilder
+{
+    FlatAst& ast;
+    // Sizes of the arrays when the current item started, to drop the nodes
+    // of an item that fails to parse.
+    std::size_t item_nodes = 0;
+    std::size_t item_numbers = 0;
+    std::size_t item_call_arguments = 0;
+    std::size_t item_parameters = 0;
+
+    FlatAst::NodeIndex push_node(FlatAst::NodeKind kind, std::uint32_t operand, std::uint32_t link);
+
+public:
+    struct Expr
+    {
+        FlatAst::NodeIndex index = FlatAst::NO_NODE;
+        explicit operator bool() const noexcept { return this->index != FlatAst::NO_NODE; }
+    };
+    struct Prototype
+    {
+        Symbol name{0};
+        std::uint32_t parameters_begin = 0;
+        std::uint32_t parameter_count = 0;
+        bool valid = false;
+        explicit operator bool() const noexcept { return this->valid; }
+    };
+    struct Function
+    {
+        Prototype prototype;
+        Expr body;
+        explicit operator bool() const noexcept { return static_cast<bool>(this->body); }
+    };
+    // Index into FlatAst::get_items().
+    using Item = std::uint32_t;
+
+    explicit FlatAstBuilder(FlatAst& _ast) : ast(_ast) {}
+
+    Expr number(double value);
+    Expr variable(Symbol name);
+    Expr binary(char opcode, Expr lhs, Expr rhs);
+    // The arguments are `args[begin, end)`.
+    Expr call(Symbol callee, const std::vector<Expr>& args, std::size_t begin);
+    Expr unary(char opcode, Expr operand);
+    Prototype prototype(Symbol name, const std::vector<Symbol>& params);
+    Function function(Prototype prototype, Expr body);
+
+    void begin_item();
+    Item function_item(Function function);
+    Item extern_item(Prototype prototype);
+    Item expression_item(Expr expression);
+    Item error_item();
+};
+
+}
@@ -0,0 +1,179 @@
+#include "incremental.hpp"
+#include "parser.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace kccani
+{
+
+// Copies tokens [begin, end) of `tokens`, moving their offsets by `shift`.
+static TokenStream slice_tokens(const TokenStream& tokens, std::size_t begin, std::size_t end, std::int64_t shift)
+{
+    TokenStream slice;
+    slice.reserve(end - begin);
+    for (std::size_t i = begin; i < end; i++)
+    {
+        Token token = tokens[i];
+        token.offset = static_cast<std::uint32_t>(token.offset + shift);
+        slice.push_back(token);
+    }
+    return slice;
+}
+
+bool IncrementalParser::parse_window(
+    const std::string& window,
+    const std::shared_ptr<const OperatorTable>& operators,
+    const Item* lookahead,
+    std::vector<Item>& output)
+{
+    auto source = SourceBuffer::from_string(lookahead ? window + lookahead->text : window);
+    TokenStream tokens = Lexer(source).fetch_all();
+
+    Lexer replay(tokens);
+    Parser parser(replay);
+    parser.set_operators(*operators);
+    std::shared_ptr<const OperatorTable> current = operators;
+    std::vector<std::size_t> item_starts;
+    output.clear();
+    while (replay.peek().type != Token::TokenType::TOKEN_EOF &&
+        tokens.offset(replay.position()) < window.size())
+    {
+        std::size_t item_start = replay.position();
+        ParsedAstContentType ast = parser.get();
+        // A token that cannot start an item is left in place by the parser,
+        // drop it so that a stray `)` typed by the user cannot stall us.
+        if (replay.position() == item_start)
+            replay.get();
+        item_starts.push_back(item_start);
+        output.push_back(Item{"", {}, ast, parser.arena(), current});
+        if (parser.get_operators() != *current)
+            current = std::make_shared<const OperatorTable>(parser.get_operators());
+    }
+
+    std::size_t next = replay.position();
+    if (lookahead)
+    {
+        // The window is only closed off if lexing resynchronised exactly on
+        // the lookahead's first token, the parser stopped right before it and
+        // it would parse the rest with the same operators.
+        std::size_t expected_offset = window.size() + lookahead->tokens.offset(0);
+        if (tokens.offset(next) != expected_offset ||
+            tokens.length(next) != lookahead->tokens.length(0) ||
+            !(tokens[next] == lookahead->tokens[0]) ||
+            *current != *lookahead->operators)
+            return false;
+    }
+
+    item_starts.push_back(next);
+    for (std::size_t k = 0; k < output.size(); k++)
+    {
+        std::size_t text_begin = k == 0 ? 0 : tokens.offset(item_starts[k]);
+        std::size_t text_end = k + 1 == output.size() ? window.size() : tokens.offset(item_starts[k + 1]);
+        output[k].text = window.substr(text_begin, text_end - text_begin);
+        output[k].tokens = slice_tokens(
+            tokens, item_starts[k], item_starts[k + 1], -static_cast<std::int64_t>(text_begin));
+    }
+    return true;
+}
+
+IncrementalParser::IncrementalParser(std::string text) : total_size(text.size())
+{
+    static const auto builtin_operators = std::make_shared<const OperatorTable>(BUILTIN_OPERATORS);
+    std::vector<Item> parsed;
+    parse_window(text, builtin_operators, nullptr, parsed);
+    if (parsed.empty())
+        this->unparsed_text = std::move(text);
+    this->items = std::move(parsed);
+    this->reparsed_items = this->items.size();
+}
+
+void IncrementalParser::apply(const SourceEdit& edit)
+{
+    if (edit.offset + edit.removed > this->total_size)
+        throw std::out_of_range("Source edit extends past the end of the text");
+
+    if (this->items.empty())
+    {
+        std::string text = this->unparsed_text;
+        text.replace(edit.offset, edit.removed, edit.inserted);
+        *this = IncrementalParser(std::move(text));
+        return;
+    }
+
+    // Find the items overlapping the edit. The parser peeks at the first
+    // token of the next item to end the previous one, so an edit touching
+    // that token re-parses the previous item as well (and its predecessor,
+    // if the edit also touches its first token: deleting the `(` in `def(ef`).
+    std::size_t first = 0, window_begin = 0;
+    while (first + 1 < this->items.size() && window_begin + this->items[first].text.size() <= edit.offset)
+        window_begin += this->items[first++].text.size();
+    while (first > 0 && edit.offset - window_begin <=
+        this->items[first].tokens.offset(0) + this->items[first].tokens.length(0))
+        window_begin -= this->items[--first].text.size();
+
+    std::size_t last = first;
+    std::size_t window_end = window_begin + this->items[first].text.size();
+    while (last + 1 < this->items.size() && window_end < edit.offset + edit.removed)
+        window_end += this->items[++last].text.size();
+
+    std::string window;
+    for (std::size_t i = first; i <= last; i++)
+        window += this->items[i].text;
+    window.replace(edit.offset - window_begin, edit.removed, edit.inserted);
+
+    std::vector<Item> parsed;
+    while (true)
+    {
+        const Item* lookahead = last + 1 < this->items.size() ? &this->items[last + 1] : nullptr;
+        if (parse_window(window, this->items[first].operators, lookahead, parsed))
+            break;
+        // The change spilled over into the next items. Widen geometrically,
+        // so that a cascading change costs at most twice a full re-parse.
+        std::size_t grow = last - first + 1;
+        while (grow-- > 0 && last + 1 < this->items.size())
+            window += this->items[++last].text;
+    }
+
+    if (parsed.empty() && !window.empty())
+    {
+        // Only whitespace and comments remain, they go to a neighbour.
+        if (last + 1 < this->items.size())
+        {
+            Item& next = this->items[last + 1];
+            next.tokens = slice_tokens(next.tokens, 0, next.tokens.size(), window.size());
+            next.text.insert(0, window);
+        }
+        else if (first > 0)
+            this->items[first - 1].text += window;
+        else
+            this->unparsed_text = window;
+    }
+
+    // Replace items [first, last] by the parsed ones, moving the tail only if
+    // the number of items changed.
+    std::size_t replaced = last - first + 1;
+    std::size_t common = std::min(replaced, parsed.size());
+    std::move(parsed.begin(), parsed.begin() + common, this->items.begin() + first);
+    if (parsed.size() < replaced)
+        this->items.erase(this->items.begin() + first + common, this->items.begin() + last + 1);
+    else
+        this->items.insert(
+            this->items.begin() + first + common,
+            std::make_move_iterator(parsed.begin() + common),
+            std::make_move_iterator(parsed.end()));
+
+    this->total_size = this->total_size - edit.removed + edit.inserted.size();
+    this->reparsed_items = parsed.size();
+}
+
+std::string IncrementalParser::text() const
+{
+    std::string text = this->unparsed_text;
+    text.reserve(this->total_size);
+    for (const auto& item : this->items)
+        text += item.text;
+    return text;
+}
+
+}
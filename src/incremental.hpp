@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.hpp"
+#include "lexer.hpp"
+#include "operators.hpp"
+
+namespace kccani
+{
+
+// Replace `removed` bytes at `offset` with `inserted`.
+struct SourceEdit
+{
+    std::size_t offset;
+    std::size_t removed;
+    std::string inserted;
+};
+
+// A source file that stays lexed and parsed while it is being edited.
+//
+// The text is split into top-level items (definitions, externs and
+// expressions, in the order Parser::fetch_all() returns them). Each item owns
+// its slice of the text, the tokens lexed from it and its AST, so an edit
+// only re-lexes and re-parses the items it touches. The re-parsed window is
+// widened until it ends exactly where an untouched item starts with the same
+// first token: from that point on lexing and parsing would replay identically,
+// so the remaining items keep their AST nodes.
+//
+// Operators defined by `def binary<op>` and `def unary<op>` change how the
+// items after them parse. A window is parsed with the operators in effect
+// where it starts, and is widened as well while the operators in effect at
+// its end differ from those the next item was parsed with.
+class IncrementalParser
+{
+public:
+    struct Item
+    {
+        // From the end of the previous item up to the start of the next one.
+        std::string text;
+        // Tokens of this item, offsets are relative to `text`.
+        TokenStream tokens;
+        ParsedAstContentType ast;
+        // Shared by the items parsed together, freed with the last of them.
+        std::shared_ptr<AstArena> arena;
+        // The operators in effect where the item starts, shared by the
+        // items in between two operator definitions.
+        std::shared_ptr<const OperatorTable> operators;
+    };
+
+private:
+    std::vector<Item> items;
+    // Whitespace and comments of a file that has no items at all.
+    std::string unparsed_text;
+    std::size_t total_size = 0;
+    std::size_t reparsed_items = 0;
+
+    // Parses `window`, starting with `operators`, followed by the untouched
+    // `lookahead` item (if any). On success the items of `window` are stored
+    // in `output`, otherwise the parse ran into `lookahead` or left other
+    // operators for it, and the window has to be widened.
+    static bool parse_window(
+        const std::string& window,
+        const std::shared_ptr<const OperatorTable>& operators,
+        const Item* lookahead,
+        std::vector<Item>& output);
+
+public:
+    explicit IncrementalParser(std::string text);
+
+    void apply(const SourceEdit& edit);
+
+    [[nodiscard]] const std::vector<Item>& get_items() const noexcept { return this->items; }
+    [[nodiscard]] std::size_t size() const noexcept { return this->total_size; }
+    [[nodiscard]] std::string text() const;
+    // Items produced by the last call to apply(), for diagnostics.
+    [[nodiscard]] std::size_t last_reparsed_items() const noexcept { return this->reparsed_items; }
+};
+
+}
@@ -0,0 +1,437 @@
+#include "jit.hpp"
+
+#include <limits>
+#include <thread>
+#include <unordered_map>
+
+#include <spdlog/spdlog.h>
+
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Threading.h>
+
+#include "error.hpp"
+
+namespace kccani
+{
+
+JitEngine::JitEngine(unsigned threads, CodeCache* cache)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::orc::LLJITBuilder builder;
+    if (threads != 1)
+        builder.setNumCompileThreads(llvm::hardware_concurrency(threads).compute_thread_count());
+    // The compilers LLJIT picks by default, with the cache.
+    if (cache)
+        builder.setCompileFunctionCreator([cache, threads](llvm::orc::JITTargetMachineBuilder machine_builder)
+            -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+            if (threads != 1)
+                return std::make_unique<llvm::orc::ConcurrentIRCompiler>(std::move(machine_builder), cache);
+            auto target_machine = machine_builder.createTargetMachine();
+            if (!target_machine)
+                return target_machine.takeError();
+            return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(std::move(*target_machine), cache);
+        });
+    this->jit = unwrap(builder.create());
+    this->jit->getMainJITDylib().addGenerator(unwrap(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(this->jit->getDataLayout().getGlobalPrefix())));
+}
+
+std::string JitEngine::target_description()
+{
+    auto machine_builder = unwrap(llvm::orc::JITTargetMachineBuilder::detectHost());
+    return machine_builder.getTargetTriple().str() + ";" + machine_builder.getCPU() + ";"
+        + machine_builder.getFeatures().getString();
+}
+
+std::vector<double> JitEngine::run(GeneratedModule generated)
+{
+    std::vector<GeneratedModule> modules;
+    modules.push_back(std::move(generated));
+    return this->run(std::move(modules));
+}
+
+// All the expressions are looked up at once, with the functions of the
+// function modules, which compiles every module they need, on the compile
+// threads if there are any.
+std::vector<double> JitEngine::run(std::vector<GeneratedModule> generated)
+{
+    std::vector<llvm::orc::SymbolStringPtr> expressions;
+    llvm::orc::SymbolLookupSet symbols;
+    for (GeneratedModule& module : generated)
+    {
+        unwrap(this->jit->addIRModule(std::move(module.module)));
+        for (CachedObject& object : module.objects)
+            unwrap(this->jit->addObjectFile(std::move(object.object)));
+        for (llvm::orc::ThreadSafeModule& function_module : module.function_modules)
+        {
+            function_module.withModuleDo([&](llvm::Module& definition) {
+                for (const llvm::Function& function : definition)
+                    if (!function.isDeclaration())
+                        symbols.add(this->jit->mangleAndIntern(function.getName()));
+            });
+            unwrap(this->jit->addIRModule(std::move(function_module)));
+        }
+        for (const std::string& expression : module.expressions)
+        {
+            expressions.push_back(this->jit->mangleAndIntern(expression));
+            symbols.add(expressions.back());
+        }
+    }
+    auto addresses = unwrap(this->jit->getExecutionSession().lookup(
+        llvm::orc::makeJITDylibSearchOrder(&this->jit->getMainJITDylib()), std::move(symbols)));
+
+    std::vector<double> results;
+    results.reserve(expressions.size());
+    for (const llvm::orc::SymbolStringPtr& expression : expressions)
+        results.push_back(reinterpret_cast<double (*)()>(addresses[expression].getAddress())());
+    return results;
+}
+
+double JitEngine::call(const std::string& name)
+{
+    auto address = unwrap(this->jit->lookup(name)).getAddress();
+    return reinterpret_cast<double (*)()>(address)();
+}
+
+// Makes `function` count its calls in `tier`, and request its tier-up on
+// the call that reaches `threshold`. The addresses are this process's, the
+// code runs in it.
+static void count_calls(llvm::Function& function, LazyJitEngine::FunctionTier& tier, std::uint64_t threshold)
+{
+    llvm::BasicBlock& entry = function.getEntryBlock();
+    llvm::BasicBlock* body = entry.splitBasicBlock(entry.begin(), "body");
+    llvm::BasicBlock* request = llvm::BasicBlock::Create(function.getContext(), "tier_up", &function, body);
+    entry.getTerminator()->eraseFromParent();
+    llvm::IRBuilder<> builder(&entry);
+    auto address = [&](std::uintptr_t value, llvm::Type* type) {
+        return builder.CreateIntToPtr(builder.getInt64(value), type->getPointerTo());
+    };
+    llvm::Value* calls = builder.CreateAtomicRMW(
+        llvm::AtomicRMWInst::Add, address(reinterpret_cast<std::uintptr_t>(&tier.calls), builder.getInt64Ty()),
+        builder.getInt64(1), llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+    builder.CreateCondBr(builder.CreateICmpEQ(calls, builder.getInt64(threshold - 1)), request, body);
+
+    builder.SetInsertPoint(request);
+    llvm::FunctionType* callback_type = llvm::FunctionType::get(builder.getVoidTy(), {builder.getInt8PtrTy()}, false);
+    builder.CreateCall(
+        callback_type,
+        address(reinterpret_cast<std::uintptr_t>(&LazyJitEngine::request_tier_up), callback_type),
+        {address(reinterpret_cast<std::uintptr_t>(&tier), builder.getInt8Ty())});
+    builder.CreateBr(body);
+}
+
+// Jumped to instead of a function whose body failed to compile, with its
+// arguments, however many there are.
+static double failed_lazy_call()
+{
+    return std::numeric_limits<double>::quiet_NaN();
+}
+
+namespace
+{
+
+// Compiles with a target machine per thread, made by its first compilation.
+// ConcurrentIRCompiler makes one per module, which costs more than
+// compiling a single function.
+class PerThreadCompiler : public llvm::orc::IRCompileLayer::IRCompiler
+{
+    llvm::orc::JITTargetMachineBuilder machine_builder;
+    std::mutex mutex;
+    std::unordered_map<std::thread::id, std::unique_ptr<llvm::TargetMachine>> machines;
+
+public:
+    explicit PerThreadCompiler(llvm::orc::JITTargetMachineBuilder _machine_builder)
+        : IRCompiler(llvm::orc::irManglingOptionsFromTargetOptions(_machine_builder.getOptions())),
+          machine_builder(std::move(_machine_builder))
+    {
+    }
+
+    llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> operator()(llvm::Module& module) override
+    {
+        llvm::TargetMachine* machine;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::unique_ptr<llvm::TargetMachine>& slot = this->machines[std::this_thread::get_id()];
+            if (!slot)
+            {
+                auto created = this->machine_builder.createTargetMachine();
+                if (!created)
+                    return created.takeError();
+                slot = std::move(*created);
+            }
+            machine = slot.get();
+        }
+        return llvm::orc::SimpleCompiler(*machine)(module);
+    }
+};
+
+// The body of one definition, generated when its symbol is first looked up.
+class FunctionBodyUnit : public llvm::orc::MaterializationUnit
+{
+    llvm::orc::LLJIT& jit;
+    Optimizer& optimizer;
+    const std::vector<const FunctionPrototypeAST*>& prototypes;
+    const FunctionAST* function;
+    std::string body_name;
+    std::atomic<std::size_t>& compiled_functions;
+    // Set when compilation is tiered, the body is then a baseline.
+    LazyJitEngine::FunctionTier* tier;
+    std::uint64_t tier_up_calls;
+
+public:
+    FunctionBodyUnit(
+        llvm::orc::LLJIT& _jit,
+        Optimizer& _optimizer,
+        const std::vector<const FunctionPrototypeAST*>& _prototypes,
+        const FunctionAST* _function,
+        std::string _body_name,
+        std::atomic<std::size_t>& _compiled_functions,
+        LazyJitEngine::FunctionTier* _tier,
+        std::uint64_t _tier_up_calls
+    )
+        : MaterializationUnit(Interface(
+              llvm::orc::SymbolFlagsMap{{_jit.mangleAndIntern(_body_name),
+                                         llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable}},
+              nullptr)),
+          jit(_jit), optimizer(_optimizer), prototypes(_prototypes), function(_function),
+          body_name(std::move(_body_name)), compiled_functions(_compiled_functions),
+          tier(_tier), tier_up_calls(_tier_up_calls)
+    {
+    }
+
+    llvm::StringRef getName() const override { return "FunctionBodyUnit"; }
+
+    // The body calls other functions by their names, that is through their
+    // stubs, and itself directly.
+    void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> responsibility) override
+    {
+        CodeGeneratorLLVM codegen;
+        if (!this->tier)
+            codegen.set_optimizer(this->optimizer);
+        codegen.set_prototypes(this->prototypes);
+        CodegenContentType generated = codegen(this->function);
+        auto body = std::get_if<llvm::Function*>(&generated);
+        if (!body || !*body)
+        {
+            responsibility->failMaterialization();
+            return;
+        }
+        (*body)->setName(this->body_name);
+        if (this->tier)
+            count_calls(**body, *this->tier, this->tier_up_calls);
+        GeneratedModule module = codegen.take_module();
+        module.module.withModuleDo([&](llvm::Module& definition) {
+            definition.setDataLayout(this->jit.getDataLayout());
+        });
+        this->compiled_functions++;
+        this->jit.getIRCompileLayer().emit(std::move(responsibility), std::move(module.module));
+    }
+
+private:
+    // A definition is never replaced.
+    void discard(const llvm::orc::JITDylib&, const llvm::orc::SymbolStringPtr&) override {}
+};
+
+}
+
+LazyJitEngine::LazyJitEngine(unsigned _optimization_level, std::uint64_t _tier_up_calls)
+    : optimization_level(_optimization_level), optimizer(_optimization_level), tier_up_calls(_tier_up_calls)
+{
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::orc::LLJITBuilder builder;
+    // Tier-ups compile on their own thread while calls compile baselines,
+    // which a single shared target machine does not allow.
+    if (this->tier_up_calls > 0)
+        builder.setCompileFunctionCreator([](llvm::orc::JITTargetMachineBuilder machine_builder)
+            -> llvm::Expected<std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+            return std::make_unique<PerThreadCompiler>(std::move(machine_builder));
+        });
+    this->jit = unwrap(builder.create());
+    this->jit->getMainJITDylib().addGenerator(unwrap(
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(this->jit->getDataLayout().getGlobalPrefix())));
+
+    llvm::orc::ExecutionSession& session = this->jit->getExecutionSession();
+    const llvm::Triple& triple = this->jit->getTargetTriple();
+    this->call_through = unwrap(llvm::orc::createLocalLazyCallThroughManager(
+        triple, session, llvm::pointerToJITTargetAddress(&failed_lazy_call)));
+    auto stubs_builder = llvm::orc::createLocalIndirectStubsManagerBuilder(triple);
+    if (!stubs_builder)
+        throw JitException("No lazy compilation for " + triple.str());
+    this->stubs = stubs_builder();
+    auto bodies_dylib = session.createJITDylib("kccani_bodies");
+    if (!bodies_dylib)
+        throw JitException(llvm::toString(bodies_dylib.takeError()));
+    this->bodies = &*bodies_dylib;
+    // Callees and externs are found through the main JITDylib.
+    this->bodies->addToLinkOrder(this->jit->getMainJITDylib());
+
+    // Expressions run once, tiered compilation does not optimize them.
+    if (this->tier_up_calls == 0)
+        this->expression_codegen.set_optimizer(this->optimizer);
+    else
+        this->tier_up_pool = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(1));
+    this->expression_codegen.set_prototypes(this->prototypes);
+}
+
+LazyJitEngine::~LazyJitEngine()
+{
+    this->wait_for_tier_ups();
+}
+
+// Checked as CodeGeneratorLLVM would check it, the body waits for the first
+// call.
+void LazyJitEngine::define(const FunctionAST* function, llvm::orc::SymbolAliasMap& aliases)
+{
+    Symbol name = function->prototype->name;
+    const FunctionPrototypeAST* declared;
+    {
+        // Even reading may grow the table, which a tier-up may be copying.
+        std::lock_guard<std::mutex> lock(this->prototypes_mutex);
+        declared = symbol_slot(this->prototypes, name);
+    }
+    if (symbol_slot(this->definitions, name))
+    {
+        spdlog::error("Redefinition of function " + name.str());
+        return;
+    }
+    if (declared && declared->args.size() != function->prototype->args.size())
+    {
+        spdlog::error("Definition of " + name.str() + " does not match its declaration");
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->prototypes_mutex);
+        symbol_slot(this->prototypes, name) = function->prototype;
+    }
+    symbol_slot(this->definitions, name) = function;
+
+    FunctionTier* tier = nullptr;
+    if (this->tier_up_calls > 0)
+    {
+        tier = &this->tiers.emplace_back();
+        tier->engine = this;
+        tier->function = function;
+    }
+    std::string body_name = name.str() + ".body";
+    auto body = this->jit->mangleAndIntern(body_name);
+    unwrap(this->bodies->define(std::make_unique<FunctionBodyUnit>(
+        *this->jit, this->optimizer, this->prototypes, function, std::move(body_name), this->compiled_functions,
+        tier, this->tier_up_calls)));
+    aliases[this->jit->mangleAndIntern(name.name())] = llvm::orc::SymbolAliasMapEntry(
+        body, llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+}
+
+void LazyJitEngine::declare(const FunctionPrototypeAST* prototype)
+{
+    if (symbol_slot(this->definitions, prototype->name))
+        return;
+    std::lock_guard<std::mutex> lock(this->prototypes_mutex);
+    symbol_slot(this->prototypes, prototype->name) = prototype;
+}
+
+void LazyJitEngine::request_tier_up(FunctionTier* tier)
+{
+    LazyJitEngine& engine = *tier->engine;
+    engine.tier_up_requests++;
+    engine.tier_up_pool->async([&engine, tier]() { engine.tier_up(*tier); });
+}
+
+// Runs on the tier-up thread. The optimized body, `<name>.optimized`, joins
+// the baseline ones and calls other functions through their stubs too.
+void LazyJitEngine::tier_up(FunctionTier& tier)
+{
+    std::vector<const FunctionPrototypeAST*> known_prototypes;
+    {
+        std::lock_guard<std::mutex> lock(this->prototypes_mutex);
+        known_prototypes = this->prototypes;
+    }
+    Optimizer tier_optimizer(this->optimization_level);
+    CodeGeneratorLLVM codegen;
+    codegen.set_optimizer(tier_optimizer);
+    codegen.set_prototypes(known_prototypes);
+    Symbol name = tier.function->prototype->name;
+    try
+    {
+        CodegenContentType generated = codegen(tier.function);
+        auto body = std::get_if<llvm::Function*>(&generated);
+        if (!body || !*body)
+            throw JitException("its body did not generate");
+        std::string optimized_name = name.str() + ".optimized";
+        (*body)->setName(optimized_name);
+        unwrap(this->jit->addIRModule(*this->bodies, codegen.take_module().module));
+        auto address = unwrap(this->jit->lookup(*this->bodies, optimized_name)).getAddress();
+        unwrap(this->stubs->updatePointer(*this->jit->mangleAndIntern(name.name()), address));
+        this->tier_ups++;
+    }
+    catch (const JitException& error)
+    {
+        spdlog::error("Could not tier up " + name.str() + ": " + error.what());
+        this->failed_tier_ups++;
+    }
+}
+
+LazyJitEngine::TierStatistics LazyJitEngine::get_tier_statistics() const noexcept
+{
+    TierStatistics statistics;
+    if (this->tier_up_calls > 0)
+        statistics.baseline_compilations = this->compiled_functions;
+    statistics.tier_up_requests = this->tier_up_requests;
+    statistics.tier_ups = this->tier_ups;
+    statistics.failed_tier_ups = this->failed_tier_ups;
+    return statistics;
+}
+
+void LazyJitEngine::wait_for_tier_ups()
+{
+    if (this->tier_up_pool)
+        this->tier_up_pool->wait();
+}
+
+std::vector<double> LazyJitEngine::run(const std::vector<ParsedAstContentType>& asts)
+{
+    llvm::orc::SymbolAliasMap aliases;
+    for (const ParsedAstContentType& ast : asts)
+    {
+        if (auto function = std::get_if<FunctionAST*>(&ast))
+            this->define(*function, aliases);
+        else if (auto prototype = std::get_if<FunctionPrototypeAST*>(&ast))
+            this->declare(*prototype);
+        else if (auto expression = std::get_if<ExprAST*>(&ast))
+            this->expression_codegen(*expression);
+    }
+    if (!aliases.empty())
+        unwrap(this->jit->getMainJITDylib().define(
+            llvm::orc::lazyReexports(*this->call_through, *this->stubs, *this->bodies, std::move(aliases))));
+
+    GeneratedModule generated = this->expression_codegen.take_module();
+    if (generated.expressions.empty())
+        return {};
+    std::vector<llvm::orc::SymbolStringPtr> expressions;
+    llvm::orc::SymbolLookupSet symbols;
+    for (const std::string& expression : generated.expressions)
+    {
+        expressions.push_back(this->jit->mangleAndIntern(expression));
+        symbols.add(expressions.back());
+    }
+    unwrap(this->jit->addIRModule(std::move(generated.module)));
+    auto addresses = unwrap(this->jit->getExecutionSession().lookup(
+        llvm::orc::makeJITDylibSearchOrder(&this->jit->getMainJITDylib()), std::move(symbols)));
+
+    std::vector<double> results;
+    results.reserve(expressions.size());
+    for (const llvm::orc::SymbolStringPtr& expression : expressions)
+        results.push_back(reinterpret_cast<double (*)()>(addresses[expression].getAddress())());
+    return results;
+}
+
+double LazyJitEngine::call(const std::string& name)
+{
+    auto address = unwrap(this->jit->lookup(name)).getAddress();
+    return reinterpret_cast<double (*)()>(address)();
+}
+
+}
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/LazyReexports.h>
+#include <llvm/Support/ThreadPool.h>
+
+#include "ast.hpp"
+#include "code_cache.hpp"
+#include "codegen.hpp"
+#include "error.hpp"
+#include "optimizer.hpp"
+
+namespace kccani
+{
+
+// The value of an ORC call that can fail, or a JitException with its error.
+template <typename T>
+T unwrap(llvm::Expected<T> value)
+{
+    if (!value)
+        throw JitException(llvm::toString(value.takeError()));
+    return std::move(*value);
+}
+
+inline void unwrap(llvm::Error error)
+{
+    if (error)
+        throw JitException(llvm::toString(std::move(error)));
+}
+
+// Compiles generated modules to native code in this process with ORC's
+// LLJIT and runs their top level expressions.
+//
+// Modules are added for good: the functions a module defines stay callable
+// from every module added after it. Names no added module defines, such as
+// the `extern`s of the C library (`sin`, `atan2`, ...), are looked up in the
+// host process.
+//
+// With more than one thread, modules are compiled to native code
+// concurrently, as far as one lookup needs several of them.
+//
+// With a CodeCache, the objects of cached functions are linked in as they
+// are, and every function module of a GeneratedModule is compiled and
+// stored in the cache, whether or not anything calls it.
+class JitEngine
+{
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+
+public:
+    // `threads` 0 compiles on every hardware thread, 1 on the calling
+    // thread. `cache` must outlive the engine. Throws JitException if no JIT
+    // can be made for the host.
+    explicit JitEngine(unsigned threads = 1, CodeCache* cache = nullptr);
+
+    // What the JIT compiles for, to key a CodeCache with: the host's target
+    // triple, CPU and features.
+    static std::string target_description();
+
+    // Compiles `generated` and evaluates its top level expressions in order.
+    // Throws JitException, before evaluating any of them, if it does not
+    // link, for example because it calls an extern that is nowhere to be
+    // found.
+    std::vector<double> run(GeneratedModule generated);
+    // The same for modules that may refer to each other, such as those of a
+    // ParallelCodeGenerator, evaluating their expressions in module order.
+    std::vector<double> run(std::vector<GeneratedModule> generated);
+    // Calls a compiled function that takes no arguments.
+    double call(const std::string& name);
+};
+
+// Runs pointer trees like JitEngine runs their modules, but generates no
+// function before it is called: every definition becomes a stub through
+// ORC's lazy re-exports, and the first call of a stub generates, optimizes
+// and compiles the body of its function, alone in a module. Startup costs
+// then grow with the definitions, the rest with the code that runs.
+//
+// Bodies are generated on the calling thread. One that fails to generate,
+// for example because it calls an undefined function, is reported through
+// spdlog and its calls evaluate to NaN. Cross-function inlining never
+// happens, each body is optimized without the others.
+//
+// Compilation can also be tiered: bodies are first compiled without
+// optimization and count their calls, and a body called often enough is
+// generated again at the optimization level on a background thread. Its
+// stub is then pointed at the new code, a single pointer store, so calls
+// already running finish in the old code and later ones run the new.
+class LazyJitEngine
+{
+public:
+    struct TierStatistics
+    {
+        // Bodies compiled without optimization for their first call.
+        std::uint64_t baseline_compilations = 0;
+        // Bodies that reached the threshold, and those of them since
+        // recompiled and swapped in, or that failed to.
+        std::uint64_t tier_up_requests = 0;
+        std::uint64_t tier_ups = 0;
+        std::uint64_t failed_tier_ups = 0;
+    };
+
+    // The call counter of one tiered definition, which its baseline code
+    // increments. Only reaching the threshold calls back into the engine.
+    struct FunctionTier
+    {
+        LazyJitEngine* engine;
+        const FunctionAST* function;
+        std::atomic<std::uint64_t> calls{0};
+    };
+
+private:
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    std::unique_ptr<llvm::orc::LazyCallThroughManager> call_through;
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+    // Holds the bodies, as `<name>.body`, which the stubs in the main
+    // JITDylib call through to.
+    llvm::orc::JITDylib* bodies = nullptr;
+    unsigned optimization_level;
+    Optimizer optimizer;
+    // Both indexed by Symbol::id: the prototypes of every function defined
+    // or declared so far, and the definitions. Tier-ups copy the
+    // prototypes under the mutex, the calling thread writes and grows them
+    // under it.
+    std::vector<const FunctionPrototypeAST*> prototypes;
+    std::vector<const FunctionAST*> definitions;
+    std::mutex prototypes_mutex;
+    // Generates the top level expressions, which run at once.
+    CodeGeneratorLLVM expression_codegen;
+    std::atomic<std::size_t> compiled_functions{0};
+
+    // Calls before a tier-up, 0 when compilation is not tiered. `tiers`
+    // never moves its elements, the baseline code points to them.
+    std::uint64_t tier_up_calls;
+    std::deque<FunctionTier> tiers;
+    std::atomic<std::uint64_t> tier_up_requests{0};
+    std::atomic<std::uint64_t> tier_ups{0};
+    std::atomic<std::uint64_t> failed_tier_ups{0};
+    // Destroyed first, finishing the tier-ups under way.
+    std::unique_ptr<llvm::ThreadPool> tier_up_pool;
+
+    void define(const FunctionAST* function, llvm::orc::SymbolAliasMap& aliases);
+    void declare(const FunctionPrototypeAST* prototype);
+    void tier_up(FunctionTier& tier);
+
+public:
+    // With `_tier_up_calls` above 0, bodies are compiled without
+    // optimization first and at -O`_optimization_level` after that many
+    // calls. Throws JitException if no lazy JIT can be made for the host.
+    explicit LazyJitEngine(unsigned _optimization_level = 0, std::uint64_t _tier_up_calls = 0);
+    ~LazyJitEngine();
+
+    // Called by baseline code when `tier` reaches the threshold, queues its
+    // tier-up.
+    static void request_tier_up(FunctionTier* tier);
+
+    // Defines and declares the functions of `asts` and evaluates its top
+    // level expressions in order. The ASTs must outlive the engine, bodies
+    // are generated from them later. Throws JitException, before evaluating
+    // any expression, if the expressions do not link.
+    std::vector<double> run(const std::vector<ParsedAstContentType>& asts);
+    // Calls a function that takes no arguments, compiling it if needed.
+    double call(const std::string& name);
+
+    // How many function bodies have been generated and compiled so far,
+    // each counted once whatever its tiers.
+    [[nodiscard]] std::size_t get_compiled_functions() const noexcept { return this->compiled_functions; }
+    [[nodiscard]] TierStatistics get_tier_statistics() const noexcept;
+    // Returns once every tier-up requested so far is done.
+    void wait_for_tier_ups();
+};
+
+}
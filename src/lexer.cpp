@@ -1,31 +1,40 @@
 #include "lexer.hpp"
+#include "error.hpp"
 
 #include <cassert>
-#include <fstream>
+#include <charconv>
+#include <limits>
 
 namespace kccani
 {
 
-Token::Token(TokenType _type) : type(_type), data(std::nullopt)
+Token::Token(TokenType _type) : type(_type)
 {
     assert(this->type != TokenType::TOKEN_IDENTIFIER);
     assert(this->type != TokenType::TOKEN_NUMBER);
     assert(this->type != TokenType::TOKEN_SPECIAL);
 }
 
-Token::Token(TokenType _type, std::string _name) : type(_type), data(_name)
+Token::Token(TokenType _type, Symbol _name) : type(_type)
 {
     assert(this->type == TokenType::TOKEN_IDENTIFIER);
+    this->value.symbol_id = _name.id;
 }
 
-Token::Token(TokenType _type, double _value) : type(_type), data(_value)
+Token::Token(TokenType _type, std::string_view _name) : Token(_type, Symbol::intern(_name))
+{
+}
+
+Token::Token(TokenType _type, double _value) : type(_type)
 {
     assert(this->type == TokenType::TOKEN_NUMBER);
+    this->value.number = _value;
 }
 
-Token::Token(TokenType _type, char _operator) : type(_type), data(_operator)
+Token::Token(TokenType _type, char _operator) : type(_type)
 {
     assert(this->type == TokenType::TOKEN_SPECIAL);
+    this->value.special = static_cast<unsigned char>(_operator);
 }
 
 Token::operator bool()
@@ -33,118 +42,355 @@ Token::operator bool()
     return this->type != TokenType::TOKEN_EOF;
 }
 
-[[nodiscard]] bool Token::operator ==(std::string other) const noexcept
+[[nodiscard]] bool Token::operator ==(const Token& other) const noexcept
+{
+    if (this->type != other.type)
+        return false;
+    switch (this->type)
+    {
+    case TokenType::TOKEN_IDENTIFIER:
+        return this->value.symbol_id == other.value.symbol_id;
+    case TokenType::TOKEN_NUMBER:
+        return this->value.number == other.value.number;
+    case TokenType::TOKEN_SPECIAL:
+        return this->value.special == other.value.special;
+    default:
+        return true;
+    }
+}
+
+[[nodiscard]] bool Token::operator ==(Symbol other) const noexcept
+{
+    if (this->type != TokenType::TOKEN_IDENTIFIER)
+        return false;
+    return this->symbol() == other;
+}
+
+[[nodiscard]] bool Token::operator ==(std::string_view other) const noexcept
 {
     if (this->type != TokenType::TOKEN_IDENTIFIER)
         return false;
-    return std::get<std::string>(this->data.value()) == other;
+    return this->symbol().name() == other;
 }
 
 [[nodiscard]] bool Token::operator ==(double other) const noexcept
 {
     if (this->type != TokenType::TOKEN_NUMBER)
         return false;
-    return std::get<double>(this->data.value()) == other;
+    return this->number() == other;
 }
 
 [[nodiscard]] bool Token::operator ==(char other) const noexcept
 {
     if (this->type != TokenType::TOKEN_SPECIAL)
         return false;
-    return std::get<char>(this->data.value()) == other;
+    return this->special() == other;
 }
 
 
+void TokenStream::push_back(const Token& token)
+{
+    this->types.push_back(static_cast<std::int8_t>(token.type));
+    this->offsets.push_back(token.offset);
+    this->lengths.push_back(token.length);
+    this->values.push_back(token.value);
+}
+
+void TokenStream::reserve(std::size_t count)
+{
+    this->types.reserve(count);
+    this->offsets.reserve(count);
+    this->lengths.reserve(count);
+    this->values.reserve(count);
+}
+
+void TokenStream::clear()
+{
+    this->types.clear();
+    this->offsets.clear();
+    this->lengths.clear();
+    this->values.clear();
+}
+
+Token TokenStream::operator[](std::size_t index) const
+{
+    return Token(this->type(index), this->values[index], this->offsets[index], this->lengths[index]);
+}
+
+
+// Converts the digits straight out of the source, without an intermediate
+// string. Like std::stod, trailing characters that do not belong to the
+// number ("1.2.3") are ignored and literals a double cannot represent are
+// rejected.
+static double parse_number(const char* begin, const char* end)
+{
+    double value = 0;
+    auto result = std::from_chars(begin, end, value);
+    if (result.ec == std::errc::invalid_argument)
+        throw ParsingException("Malformed number literal: " + std::string(begin, end));
+    if (result.ec == std::errc::result_out_of_range)
+        throw ParsingException("Number literal out of range: " + std::string(begin, result.ptr));
+    return value;
+}
+
+static Token keyword_or_identifier(Symbol symbol)
+{
+    if (symbol == symbols::DEF)
+        return Token::TokenType::TOKEN_DEF;
+    else if (symbol == symbols::EXTERN)
+        return Token::TokenType::TOKEN_EXTERN;
+    else
+        return {Token::TokenType::TOKEN_IDENTIFIER, symbol};
+}
+
+Symbol Lexer::intern_source_identifier(std::string_view name)
+{
+    // FNV-1a, identifiers are short enough that anything stronger costs more
+    // than the collisions it avoids.
+    std::uint32_t hash = 2166136261u;
+    for (char c : name)
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+
+    SymbolCacheEntry& entry = this->symbol_cache[hash & (SYMBOL_CACHE_SIZE - 1)];
+    if (entry.name != name)
+    {
+        entry.name = name;
+        entry.symbol = Symbol::intern(name);
+    }
+    return entry.symbol;
+}
+
 Token Lexer::get()
 {
-    if (this->buffered_token)
+    if (this->token_stream)
     {
-        auto output_value = this->buffered_token.value();
-        this->buffered_token.reset();
-        return output_value;
+        if (this->token_position >= this->token_stream->size())
+            return Token::TokenType::TOKEN_EOF;
+        Token token = (*this->token_stream)[this->token_position];
+        // Like the other backends, keep returning EOF once it is reached.
+        if (token.type != Token::TokenType::TOKEN_EOF)
+            this->token_position++;
+        return token;
     }
+    if (!this->lookahead.empty())
+    {
+        Token token = this->lookahead.front();
+        this->lookahead.pop_front();
+        return token;
+    }
+    return this->lex();
+}
 
-    this->input_stream >> std::noskipws;
+Token Lexer::lex()
+{
+    if (this->input_stream)
+        return this->get_from_stream();
+    if (this->token_queue)
+        return this->get_from_queue();
+    return this->get_from_buffer();
+}
 
-    while (stream_char == ' ')
-        input_stream >> stream_char;
+bool Lexer::read_stream_char()
+{
+    if (this->stream_exhausted)
+        return false;
+    this->stream_offset++;
+    if (*this->input_stream >> this->stream_char)
+        return true;
+    this->stream_exhausted = true;
+    this->stream_char = '\0';
+    return false;
+}
 
-    if (isalpha(stream_char))
+Token Lexer::get_from_stream()
+{
+    *this->input_stream >> std::noskipws;
+    while (true)
     {
-        std::string token = "";
-        do {
-            token += stream_char;
-            input_stream >> stream_char;
-        } while (isalnum(stream_char));
-
-        if (token == "def")
-            return Token::TokenType::TOKEN_DEF;
-        else if (token == "extern")
-            return Token::TokenType::TOKEN_EXTERN;
+        while (!this->stream_exhausted && scan::has_class(this->stream_char, scan::CHAR_WHITESPACE))
+            this->read_stream_char();
+
+        std::uint32_t token_offset = this->stream_offset;
+        Token token = Token::TokenType::TOKEN_EOF;
+
+        if (this->stream_exhausted)
+        {
+            token.offset = token_offset;
+            return token;
+        }
+        else if (scan::has_class(this->stream_char, scan::CHAR_ALPHA))
+        {
+            std::string text;
+            do {
+                text += this->stream_char;
+            } while (this->read_stream_char() &&
+                scan::has_class(this->stream_char, scan::CHAR_ALPHA | scan::CHAR_DIGIT));
+            token = keyword_or_identifier(Symbol::intern(text));
+        }
+        else if (scan::has_class(this->stream_char, scan::CHAR_DIGIT | scan::CHAR_DOT))
+        {
+            std::string text;
+            do {
+                text += this->stream_char;
+            } while (this->read_stream_char() &&
+                scan::has_class(this->stream_char, scan::CHAR_DIGIT | scan::CHAR_DOT));
+            token = {Token::TokenType::TOKEN_NUMBER, parse_number(text.data(), text.data() + text.size())};
+        }
+        else if (this->stream_char == '#')
+        {
+            while (this->read_stream_char() && !scan::has_class(this->stream_char, scan::CHAR_LINE_END))
+                ;
+            continue;
+        }
         else
-            return {Token::TokenType::TOKEN_IDENTIFIER, token};
+        {
+            token = {Token::TokenType::TOKEN_SPECIAL, this->stream_char};
+            this->read_stream_char();
+        }
+
+        token.offset = token_offset;
+        token.length = this->stream_offset - token_offset;
+        return token;
     }
+}
 
-    if (isdigit(stream_char) || stream_char == '.') {
-        std::string token = "";
-        do {
-            token += stream_char;
-            input_stream >> stream_char;
-        } while (isdigit(stream_char) || stream_char == '.');
+Token Lexer::get_from_buffer()
+{
+    const char* end = this->source_end;
+    while (true)
+    {
+        if (this->cursor != end && scan::has_class(*this->cursor, scan::CHAR_WHITESPACE))
+            this->cursor = this->kernels->skip_whitespace(this->cursor + 1, end);
 
-        std::size_t __string_size_v;
-        double value = std::stod(token, &__string_size_v);
-        return {Token::TokenType::TOKEN_NUMBER, value};
-    }
+        const char* token_begin = this->cursor;
+        Token token = Token::TokenType::TOKEN_EOF;
 
-    if (stream_char == '#') {
-        do {
-            input_stream >> stream_char;
-        } while (stream_char != EOF && stream_char != '\n' && stream_char != '\r');
+        if (this->cursor == end)
+        {
+            token.offset = this->cursor - this->source_begin;
+            return token;
+        }
 
-        if (stream_char != EOF)
-            return get();
+        char current_char = *this->cursor;
+        if (scan::has_class(current_char, scan::CHAR_ALPHA))
+        {
+            this->cursor = this->kernels->skip_identifier(this->cursor + 1, end);
+            token = keyword_or_identifier(this->intern_source_identifier(
+                {token_begin, std::size_t(this->cursor - token_begin)}));
+        }
+        else if (scan::has_class(current_char, scan::CHAR_DIGIT | scan::CHAR_DOT))
+        {
+            this->cursor = this->kernels->skip_number(this->cursor + 1, end);
+            token = {Token::TokenType::TOKEN_NUMBER, parse_number(token_begin, this->cursor)};
+        }
+        else if (current_char == '#')
+        {
+            this->cursor = this->kernels->find_line_end(this->cursor + 1, end);
+            continue;
+        }
+        else
+        {
+            this->cursor++;
+            token = {Token::TokenType::TOKEN_SPECIAL, current_char};
+        }
+
+        token.offset = token_begin - this->source_begin;
+        token.length = this->cursor - token_begin;
+        return token;
     }
+}
 
-    char current_char = stream_char;
-    if (input_stream >> stream_char)
+Token Lexer::get_from_queue()
+{
+    while (this->queue_position == this->queue_batch.tokens.size())
     {
-        if (current_char == '\n' || current_char == ' ')
-            return this->get();
-        return {Token::TokenType::TOKEN_SPECIAL, current_char};
+        if (this->queue_batch.error)
+            std::rethrow_exception(this->queue_batch.error);
+        // A closed queue without an EOF token means the lexing thread was
+        // told to stop.
+        if (!this->token_queue->pop(this->queue_batch))
+            return Token::TokenType::TOKEN_EOF;
+        this->queue_position = 0;
     }
-    else
-        return Token::TokenType::TOKEN_EOF;
+    Token token = this->queue_batch.tokens[this->queue_position];
+    // Like the other backends, keep returning EOF once it is reached.
+    if (token.type != Token::TokenType::TOKEN_EOF)
+        this->queue_position++;
+    return token;
 }
 
 Token Lexer::peek()
 {
-    if (!this->buffered_token)
-        this->buffered_token = this->get();
-    return this->buffered_token.value();
+    return this->peek(0);
+}
+
+Token Lexer::peek(std::size_t distance)
+{
+    if (this->token_stream)
+    {
+        if (this->token_stream->empty())
+            return Token::TokenType::TOKEN_EOF;
+        std::size_t index = std::min(this->token_position + distance, this->token_stream->size() - 1);
+        return (*this->token_stream)[index];
+    }
+    while (this->lookahead.size() <= distance)
+        this->lookahead.push_back(this->lex());
+    return this->lookahead[distance];
+}
+
+Lexer::Lexer(std::basic_istream<char>& text_stream) : input_stream(&text_stream)
+{
+}
+
+Lexer::Lexer(const SourceBuffer& source) : Lexer(source.view())
+{
+}
+
+Lexer::Lexer(std::string_view source)
+    : source_begin(source.data()), cursor(source.data()), source_end(source.data() + source.size()),
+      kernels(&scan::active_kernels()), symbol_cache(SYMBOL_CACHE_SIZE)
+{
+    if (source.size() > std::numeric_limits<std::uint32_t>::max())
+        throw ParsingException("Sources larger than 4 GiB are not supported");
 }
 
-Lexer::Lexer(std::basic_istream<char>& text_stream) : input_stream(text_stream)
+Lexer::Lexer(const TokenStream& tokens) : token_stream(&tokens)
 {
 }
 
+Lexer::Lexer(SpscQueue<TokenBatch>& tokens) : token_queue(&tokens)
+{
+}
+
+std::size_t Lexer::position() const noexcept
+{
+    return this->token_position;
+}
+
+void Lexer::seek(std::size_t index)
+{
+    assert(this->token_stream && index <= this->token_stream->size());
+    this->token_position = index;
+}
+
 Lexer Lexer::operator>>(Token& output_token)
 {
     output_token = this->get();
     return *this;
 }
 
-std::queue<Token> Lexer::fetch_all()
+TokenStream Lexer::fetch_all()
 {
-    std::queue<Token> all_tokens;
-    do
+    TokenStream all_tokens;
+    if (this->source_begin)
+        all_tokens.reserve((this->source_end - this->cursor) / 4);
+    while (true)
     {
         Token token = this->get();
-        all_tokens.push(token);
-    } while (
-        all_tokens.empty() ||
-        all_tokens.back().type != Token::TokenType::TOKEN_EOF);
-    return all_tokens;
+        all_tokens.push_back(token);
+        if (token.type == Token::TokenType::TOKEN_EOF)
+            return all_tokens;
+    }
 }
 
 }
@@ -1,12 +1,21 @@
 #pragma once
 
 #include <cctype>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <iostream>
-#include <optional>
-#include <queue>
-#include <variant>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <type_traits>
 #include <vector>
 
+#include "scan.hpp"
+#include "source.hpp"
+#include "spsc_queue.hpp"
+#include "symbol.hpp"
+
 namespace kccani
 {
 
@@ -27,33 +36,159 @@ public:
         TOKEN_SPECIAL = -1,
     };
 
+    // The payload of a token, which of the members is set depends on its type.
+    // Every member is a full word: writing a narrower one and then copying the
+    // token stalls store forwarding on the lexer's hot path.
+    union Value
+    {
+        double number;
+        std::uint64_t symbol_id;
+        std::uint64_t special;
+    };
+
     TokenType type;
-    std::optional<std::variant<std::string, double, char>> data;
+    // Position of the token in the source it was lexed from.
+    std::uint32_t offset = 0;
+    std::uint32_t length = 0;
+    Value value{};
 
+private:
+    // Rebuilds a stored token of any type, without the checks of the public
+    // constructors.
+    Token(TokenType _type, Value _value, std::uint32_t _offset, std::uint32_t _length) noexcept
+        : type(_type), offset(_offset), length(_length), value(_value)
+    {
+    }
+    friend class TokenStream;
+
+public:
     Token(TokenType _type);
-    Token(TokenType _type, std::string _name);
+    Token(TokenType _type, Symbol _name);
+    Token(TokenType _type, std::string_view _name);
     Token(TokenType _type, double _value);
     Token(TokenType _type, char _operator);
 
+    [[nodiscard]] double number() const noexcept { return this->value.number; }
+    [[nodiscard]] Symbol symbol() const noexcept { return Symbol(static_cast<std::uint32_t>(this->value.symbol_id)); }
+    [[nodiscard]] char special() const noexcept { return static_cast<char>(this->value.special); }
+
     operator bool();
-    [[nodiscard]] bool operator ==(std::string other) const noexcept;
+    // Compares type and payload, not the source position.
+    [[nodiscard]] bool operator ==(const Token& other) const noexcept;
+    [[nodiscard]] bool operator ==(Symbol other) const noexcept;
+    [[nodiscard]] bool operator ==(std::string_view other) const noexcept;
     [[nodiscard]] bool operator ==(double other) const noexcept;
     [[nodiscard]] bool operator ==(char other) const noexcept;
 };
 
+static_assert(std::is_trivially_copyable_v<Token>);
+static_assert(sizeof(Token) <= 24);
+
+
+// A lexed program stored as a struct of arrays, so that walking the types
+// alone (what the parser mostly looks at) touches one byte per token.
+class TokenStream
+{
+    std::vector<std::int8_t> types;
+    std::vector<std::uint32_t> offsets;
+    std::vector<std::uint32_t> lengths;
+    std::vector<Token::Value> values;
+
+public:
+    void push_back(const Token& token);
+    void reserve(std::size_t count);
+    void clear();
+
+    [[nodiscard]] std::size_t size() const noexcept { return this->types.size(); }
+    [[nodiscard]] bool empty() const noexcept { return this->types.empty(); }
+    [[nodiscard]] Token::TokenType type(std::size_t index) const
+    {
+        return static_cast<Token::TokenType>(this->types[index]);
+    }
+    [[nodiscard]] std::uint32_t offset(std::size_t index) const { return this->offsets[index]; }
+    [[nodiscard]] std::uint32_t length(std::size_t index) const { return this->lengths[index]; }
+    [[nodiscard]] Token operator[](std::size_t index) const;
+};
+
+
+// Tokens lexed on one thread for a Lexer reading them on another, see
+// Pipeline. The last batch of a source ends with its EOF token, or has
+// `error` set if lexing failed after its tokens.
+struct TokenBatch
+{
+    std::vector<Token> tokens;
+    std::exception_ptr error;
+};
+
 
 class Lexer
 {
+    // Stream backend, used by the REPL: reads one character at a time.
+    // `stream_char` is the character at `stream_offset`, the initial blank
+    // sits just before the first character of the stream.
     char stream_char = ' ';
-    std::istream& input_stream;
-    std::optional<Token> buffered_token;
+    std::uint32_t stream_offset = std::numeric_limits<std::uint32_t>::max();
+    bool stream_exhausted = false;
+    std::istream* input_stream = nullptr;
+
+    // Buffer backend: scans the raw bytes of a SourceBuffer in place.
+    const char* source_begin = nullptr;
+    const char* cursor = nullptr;
+    const char* source_end = nullptr;
+    const scan::ScanKernels* kernels = nullptr;
+    // Direct-mapped cache of recently interned identifiers, keyed by views
+    // into the source, so that repeated names skip the global table's lock.
+    struct SymbolCacheEntry
+    {
+        std::string_view name;
+        Symbol symbol{0};
+    };
+    static constexpr std::size_t SYMBOL_CACHE_SIZE = 1024;
+    std::vector<SymbolCacheEntry> symbol_cache;
+
+    // Token array backend: replays an already lexed TokenStream by index.
+    const TokenStream* token_stream = nullptr;
+    std::size_t token_position = 0;
+
+    // Queue backend: takes the batches of a lexer running on another thread.
+    SpscQueue<TokenBatch>* token_queue = nullptr;
+    TokenBatch queue_batch;
+    std::size_t queue_position = 0;
+
+    // Tokens read ahead of the parser by the stream, buffer and queue backends.
+    std::deque<Token> lookahead;
+
+    Symbol intern_source_identifier(std::string_view name);
+    bool read_stream_char();
+    Token get_from_stream();
+    Token get_from_buffer();
+    Token get_from_queue();
+    Token lex();
 
 public:
     virtual Token get();
     virtual Token peek();
+    // Looks `distance` tokens past the next one without consuming anything.
+    Token peek(std::size_t distance);
 
     Lexer(std::basic_istream<char>& text_stream);
-    std::queue<Token> fetch_all();
+    Lexer(const SourceBuffer& source);
+    Lexer(SourceBuffer&& source) = delete;
+    // Lexes a range of a buffer in place, which has to outlive the lexer.
+    // Token offsets are relative to the start of `source`.
+    explicit Lexer(std::string_view source);
+    Lexer(const TokenStream& tokens);
+    Lexer(TokenStream&& tokens) = delete;
+    // Reads the batches another thread pushes to `tokens`, rethrowing the
+    // error of a failed batch where its next token would have been.
+    explicit Lexer(SpscQueue<TokenBatch>& tokens);
+
+    // Lexes everything up to and including the EOF token.
+    TokenStream fetch_all();
+    // Index of the next token when replaying a TokenStream.
+    std::size_t position() const noexcept;
+    void seek(std::size_t index);
+
     Lexer operator>>(Token& output_token);
 };
 
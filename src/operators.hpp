@@ -0,0 +1,102 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace kccani
+{
+
+enum class Associativity : std::uint8_t
+{
+    LEFT,
+    RIGHT,
+};
+
+struct OperatorInfo
+{
+    // Binary precedence, higher binds tighter; 0 if the byte is no binary
+    // operator.
+    std::int16_t precedence = 0;
+    Associativity associativity = Associativity::LEFT;
+    bool unary = false;
+    // Compiled to an instruction by codegen rather than a call to a
+    // user-defined `binary<op>` / `unary<op>` function.
+    bool builtin = false;
+
+    [[nodiscard]] constexpr bool is_binary() const noexcept { return this->precedence > 0; }
+
+    constexpr bool operator ==(const OperatorInfo& other) const noexcept
+    {
+        return this->precedence == other.precedence
+            && this->associativity == other.associativity
+            && this->unary == other.unary
+            && this->builtin == other.builtin;
+    }
+
+    // Minimum precedence for the operators of the right operand, which is what
+    // makes equal precedence group to the left or to the right.
+    [[nodiscard]] constexpr int right_binding_power() const noexcept
+    {
+        return this->associativity == Associativity::LEFT ? this->precedence + 1 : this->precedence;
+    }
+};
+
+// Operator properties indexed directly by the operator byte, so the parser's
+// lookup is a single load.
+class OperatorTable
+{
+    std::array<OperatorInfo, 256> entries{};
+
+public:
+    static constexpr int MAX_PRECEDENCE = 1000;
+
+    [[nodiscard]] constexpr const OperatorInfo& operator[](char opcode) const noexcept
+    {
+        return this->entries[static_cast<unsigned char>(opcode)];
+    }
+
+    constexpr void set(char opcode, OperatorInfo info) noexcept
+    {
+        this->entries[static_cast<unsigned char>(opcode)] = info;
+    }
+
+    constexpr bool operator ==(const OperatorTable& other) const noexcept
+    {
+        for (std::size_t i = 0; i < this->entries.size(); i++)
+            if (!(this->entries[i] == other.entries[i]))
+                return false;
+        return true;
+    }
+    constexpr bool operator !=(const OperatorTable& other) const noexcept { return !(*this == other); }
+
+    // The operators the language has without any definitions.
+    static constexpr OperatorTable builtin() noexcept
+    {
+        OperatorTable table;
+        table.set('<', {100, Associativity::LEFT, false, true});
+        table.set('+', {200, Associativity::LEFT, false, true});
+        table.set('-', {300, Associativity::LEFT, false, true});
+        table.set('*', {400, Associativity::LEFT, false, true});
+        return table;
+    }
+
+    // Whether `opcode` may be given a user definition: any special character
+    // that is neither punctuation of the grammar nor a builtin operator.
+    [[nodiscard]] constexpr bool can_define(char opcode) const noexcept
+    {
+        switch (opcode)
+        {
+        case '(': case ')': case ',': case ';': case '#':
+            return false;
+        default:
+            return !(*this)[opcode].builtin && static_cast<unsigned char>(opcode) > ' ';
+        }
+    }
+};
+
+inline constexpr OperatorTable BUILTIN_OPERATORS = OperatorTable::builtin();
+
+static_assert(BUILTIN_OPERATORS['*'].precedence > BUILTIN_OPERATORS['<'].precedence);
+static_assert(!BUILTIN_OPERATORS['('].is_binary());
+
+}
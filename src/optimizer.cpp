@@ -0,0 +1,99 @@
+#include "optimizer.hpp"
+
+#include <algorithm>
+
+#include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Analysis/InlineCost.h>
+#include <llvm/Transforms/IPO/Inliner.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+
+namespace kccani
+{
+
+PhaseTimers::PhaseTimers()
+{
+    this->timers[FRONT_END].init("front-end", "Parsing and code generation", this->group);
+    this->timers[FUNCTION_PASSES].init("function-passes", "Function passes", this->group);
+    this->timers[MODULE_PASSES].init("module-passes", "Module passes", this->group);
+}
+
+void PhaseTimers::print(llvm::raw_ostream& out)
+{
+    this->group.print(out, true);
+}
+
+llvm::FunctionPassManager Optimizer::function_pipeline()
+{
+    llvm::FunctionPassManager passes;
+    passes.addPass(llvm::InstCombinePass());
+    passes.addPass(llvm::ReassociatePass());
+    passes.addPass(llvm::GVNPass());
+    passes.addPass(llvm::SimplifyCFGPass());
+    return passes;
+}
+
+Optimizer::Optimizer(unsigned _level, PhaseTimers* _timers)
+    : level(std::min(_level, MAX_LEVEL)), timers(_timers)
+{
+    this->pass_builder.registerModuleAnalyses(this->module_analyses);
+    this->pass_builder.registerCGSCCAnalyses(this->cgscc_analyses);
+    this->pass_builder.registerFunctionAnalyses(this->function_analyses);
+    this->pass_builder.registerLoopAnalyses(this->loop_analyses);
+    this->pass_builder.crossRegisterProxies(
+        this->loop_analyses, this->function_analyses, this->cgscc_analyses, this->module_analyses);
+
+    if (this->level >= 1)
+        this->function_passes = function_pipeline();
+    if (this->level >= 2)
+    {
+        llvm::ModuleInlinerWrapperPass inliner(llvm::getInlineParams(this->level, 0));
+        inliner.getPM().addPass(llvm::createCGSCCToFunctionPassAdaptor(function_pipeline()));
+        this->module_passes.addPass(std::move(inliner));
+    }
+}
+
+// Analysis results are cached by the address of the IR they are about, and
+// a module handed to a JIT is freed behind the optimizer's back: a later
+// function at the same address must not find them.
+void Optimizer::clear_analyses()
+{
+    this->loop_analyses.clear();
+    this->function_analyses.clear();
+    this->cgscc_analyses.clear();
+    this->module_analyses.clear();
+}
+
+void Optimizer::run(llvm::Function& function)
+{
+    if (this->level < 1)
+        return;
+    llvm::Timer* front_end = nullptr;
+    if (this->timers && (*this->timers)[PhaseTimers::FRONT_END].isRunning())
+    {
+        front_end = &(*this->timers)[PhaseTimers::FRONT_END];
+        front_end->stopTimer();
+    }
+    {
+        llvm::TimeRegion region(this->timers ? &(*this->timers)[PhaseTimers::FUNCTION_PASSES] : nullptr);
+        this->function_passes.run(function, this->function_analyses);
+    }
+    this->function_analyses.clear(function, function.getName());
+    if (front_end)
+        front_end->startTimer();
+}
+
+void Optimizer::run(llvm::Module& module)
+{
+    if (this->level < 2)
+        return;
+    {
+        llvm::TimeRegion region(this->timers ? &(*this->timers)[PhaseTimers::MODULE_PASSES] : nullptr);
+        this->module_passes.run(module, this->module_analyses);
+    }
+    this->clear_analyses();
+}
+
+}
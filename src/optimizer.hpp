@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace kccani
+{
+
+// Time spent in each phase of compilation, as LLVM's timers measure it (wall,
+// user and system time). The front end phase is paused while function passes
+// run inside it, so the phases add up to the whole.
+class PhaseTimers
+{
+public:
+    enum Phase : std::size_t
+    {
+        FRONT_END,
+        FUNCTION_PASSES,
+        MODULE_PASSES,
+        PHASE_COUNT,
+    };
+
+private:
+    llvm::TimerGroup group{"kccani", "Compilation phases"};
+    std::array<llvm::Timer, PHASE_COUNT> timers;
+
+public:
+    PhaseTimers();
+    PhaseTimers(const PhaseTimers&) = delete;
+    PhaseTimers& operator=(const PhaseTimers&) = delete;
+
+    [[nodiscard]] llvm::Timer& operator[](Phase phase) noexcept { return this->timers[phase]; }
+    // Prints the phases that ran and starts them over.
+    void print(llvm::raw_ostream& out);
+};
+
+// Runs LLVM's new pass manager over generated code, in two pipelines:
+//
+//  * per function, as soon as CodeGeneratorLLVM finishes it: instcombine,
+//    reassociate, GVN and simplifycfg, from -O1 on;
+//  * per module, once it is complete: inlining followed by the function
+//    pipeline again over the inlined code, from -O2 on, with -O3 inlining
+//    more eagerly.
+//
+// -O0 runs no passes at all.
+class Optimizer
+{
+    unsigned level;
+    PhaseTimers* timers;
+
+    llvm::LoopAnalysisManager loop_analyses;
+    llvm::FunctionAnalysisManager function_analyses;
+    llvm::CGSCCAnalysisManager cgscc_analyses;
+    llvm::ModuleAnalysisManager module_analyses;
+    llvm::PassBuilder pass_builder;
+    llvm::FunctionPassManager function_passes;
+    llvm::ModulePassManager module_passes;
+
+    static llvm::FunctionPassManager function_pipeline();
+    void clear_analyses();
+
+public:
+    static constexpr unsigned MAX_LEVEL = 3;
+
+    // `_level` is clamped to MAX_LEVEL. The phases are timed in `_timers`
+    // when given, which must outlive the optimizer.
+    explicit Optimizer(unsigned _level, PhaseTimers* _timers = nullptr);
+    Optimizer(const Optimizer&) = delete;
+    Optimizer& operator=(const Optimizer&) = delete;
+
+    [[nodiscard]] unsigned get_level() const noexcept { return this->level; }
+
+    // Runs the function pipeline over a verified, complete function.
+    void run(llvm::Function& function);
+    // Runs the module pipeline over a complete module.
+    void run(llvm::Module& module);
+};
+
+}
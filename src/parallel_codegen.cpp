@@ -0,0 +1,269 @@
+#include "parallel_codegen.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticPrinter.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+#include <spdlog/spdlog.h>
+
+#include "optimizer.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// What generating an item introduces into its module.
+struct ItemDeclaration
+{
+    enum Kind
+    {
+        NONE,
+        FUNCTION,
+        EXPRESSION,
+    };
+    Kind kind = NONE;
+    // A FUNCTION with a body rather than an extern.
+    bool definition = false;
+    Symbol name{0};
+    ArenaSpan<const Symbol> parameters;
+};
+
+// Reports what the linker finds through spdlog. The default handler exits
+// the process on errors.
+struct LinkDiagnosticHandler : llvm::DiagnosticHandler
+{
+    bool handleDiagnostics(const llvm::DiagnosticInfo& info) override
+    {
+        std::string message;
+        llvm::raw_string_ostream out(message);
+        llvm::DiagnosticPrinterRawOStream printer(out);
+        info.print(printer);
+        out.flush();
+        if (info.getSeverity() == llvm::DS_Error)
+            spdlog::error(message);
+        else
+            spdlog::warn(message);
+        return true;
+    }
+};
+
+}
+
+ParallelCodeGenerator::ParallelCodeGenerator(unsigned threads, unsigned _optimization_level, std::size_t _min_chunk_items)
+    : optimization_level(_optimization_level), min_chunk_items(std::max<std::size_t>(_min_chunk_items, 1))
+{
+    if (threads != 1)
+        this->pool = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(threads));
+}
+
+// `declaration_of(item)` is the ItemDeclaration of an item and
+// `generate_item(codegen, item)` generates it.
+template <typename DeclarationOf, typename GenerateItem>
+std::vector<GeneratedModule> ParallelCodeGenerator::generate_chunks(
+    std::size_t item_count,
+    DeclarationOf declaration_of,
+    GenerateItem generate_item
+)
+{
+    std::size_t workers = this->pool ? this->pool->getThreadCount() : 1;
+    std::size_t chunk_count = std::max<std::size_t>(1, std::min(workers, item_count / this->min_chunk_items));
+    std::vector<std::size_t> chunk_begins(chunk_count + 1);
+    for (std::size_t chunk = 0; chunk <= chunk_count; chunk++)
+        chunk_begins[chunk] = item_count * chunk / chunk_count;
+
+    // For every chunk, the items before it whose declaration is the last of
+    // its name, in source order, and the number of top level expressions.
+    // A later declaration replaces an earlier one, as in CodeGeneratorLLVM.
+    //
+    // A chunk's generator cannot tell a function defined in an earlier chunk
+    // from one only declared there, so definitions of those are dropped here
+    // with the error CodeGeneratorLLVM reports, keeping the first one.
+    std::vector<ItemDeclaration> declarations(item_count);
+    std::vector<std::vector<std::size_t>> declared_before(chunk_count);
+    std::vector<std::size_t> expressions_before(chunk_count);
+    std::unique_ptr<bool[]> dropped(new bool[item_count]());
+    std::unordered_map<std::uint32_t, std::size_t> last_declaration;
+    std::unordered_map<std::uint32_t, std::size_t> first_definition;
+    std::size_t expression_count = 0;
+    for (std::size_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+        for (const auto& [name, item] : last_declaration)
+            declared_before[chunk].push_back(item);
+        std::sort(declared_before[chunk].begin(), declared_before[chunk].end());
+        expressions_before[chunk] = expression_count;
+        for (std::size_t item = chunk_begins[chunk]; item < chunk_begins[chunk + 1]; item++)
+        {
+            declarations[item] = declaration_of(item);
+            const ItemDeclaration& declaration = declarations[item];
+            auto first = first_definition.find(declaration.name.id);
+            if (declaration.definition && first != first_definition.end() && first->second < chunk_begins[chunk])
+            {
+                const ItemDeclaration& previous = declarations[last_declaration[declaration.name.id]];
+                if (previous.parameters.size() != declaration.parameters.size())
+                    spdlog::error("Definition of " + declaration.name.str() + " does not match its declaration");
+                else
+                    spdlog::error("Redefinition of function " + declaration.name.str());
+                dropped[item] = true;
+                continue;
+            }
+            if (declaration.kind == ItemDeclaration::FUNCTION)
+            {
+                last_declaration[declaration.name.id] = item;
+                if (declaration.definition)
+                    first_definition.emplace(declaration.name.id, item);
+            }
+            else if (declaration.kind == ItemDeclaration::EXPRESSION)
+                expression_count++;
+        }
+    }
+
+    std::vector<GeneratedModule> modules(chunk_count);
+    std::vector<std::exception_ptr> errors(chunk_count);
+    auto run = [&](std::size_t chunk) {
+        try
+        {
+            // Declared first, the generator must not outlive it.
+            Optimizer optimizer(this->optimization_level);
+            CodeGeneratorLLVM codegen;
+            codegen.set_optimizer(optimizer);
+            codegen.number_expressions_from(expressions_before[chunk]);
+            for (std::size_t item : declared_before[chunk])
+                codegen.declare_function(declarations[item].name, declarations[item].parameters);
+            for (std::size_t item = chunk_begins[chunk]; item < chunk_begins[chunk + 1]; item++)
+            {
+                if (!dropped[item])
+                    generate_item(codegen, item);
+            }
+            modules[chunk] = codegen.take_module();
+        }
+        catch (...)
+        {
+            errors[chunk] = std::current_exception();
+        }
+    };
+    if (this->pool && chunk_count > 1)
+    {
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++)
+            this->pool->async([&run, chunk]() { run(chunk); });
+        this->pool->wait();
+    }
+    else
+    {
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++)
+            run(chunk);
+    }
+
+    for (const std::exception_ptr& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+    return modules;
+}
+
+std::vector<GeneratedModule> ParallelCodeGenerator::generate(const std::vector<ParsedAstContentType>& items)
+{
+    return this->generate_chunks(items.size(),
+        [&](std::size_t item) {
+            ItemDeclaration declaration;
+            const FunctionPrototypeAST* prototype = nullptr;
+            if (auto function = std::get_if<FunctionAST*>(&items[item]))
+            {
+                prototype = (*function)->prototype;
+                declaration.definition = true;
+            }
+            else if (auto extern_prototype = std::get_if<FunctionPrototypeAST*>(&items[item]))
+                prototype = *extern_prototype;
+            else if (std::holds_alternative<ExprAST*>(items[item]))
+                declaration.kind = ItemDeclaration::EXPRESSION;
+            if (prototype)
+            {
+                declaration.kind = ItemDeclaration::FUNCTION;
+                declaration.name = prototype->name;
+                declaration.parameters = prototype->args;
+            }
+            return declaration;
+        },
+        [&](CodeGeneratorLLVM& codegen, std::size_t item) {
+            std::visit(std::ref(codegen), items[item]);
+        });
+}
+
+std::vector<GeneratedModule> ParallelCodeGenerator::generate(const FlatAst& ast)
+{
+    const std::vector<FlatAst::Item>& items = ast.get_items();
+    return this->generate_chunks(items.size(),
+        [&](std::size_t item) {
+            ItemDeclaration declaration;
+            switch (items[item].kind)
+            {
+            case FlatAst::ItemKind::FUNCTION:
+            case FlatAst::ItemKind::EXTERN:
+                declaration.kind = ItemDeclaration::FUNCTION;
+                declaration.definition = items[item].kind == FlatAst::ItemKind::FUNCTION;
+                declaration.name = items[item].name;
+                declaration.parameters = ast.parameters_of(items[item]);
+                break;
+            case FlatAst::ItemKind::EXPRESSION:
+                declaration.kind = ItemDeclaration::EXPRESSION;
+                break;
+            case FlatAst::ItemKind::ERROR:
+                break;
+            }
+            return declaration;
+        },
+        [&](CodeGeneratorLLVM& codegen, std::size_t item) {
+            codegen(ast, items[item]);
+        });
+}
+
+// Modules of different contexts cannot be linked directly, each one is
+// written to bitcode and read back into `context` first.
+std::unique_ptr<llvm::Module> ParallelCodeGenerator::link(std::vector<GeneratedModule> modules, llvm::LLVMContext& context)
+{
+    auto previous_handler = context.getDiagnosticHandler();
+    context.setDiagnosticHandler(std::make_unique<LinkDiagnosticHandler>());
+    std::unique_ptr<llvm::Module> linked;
+    bool failed = false;
+    for (GeneratedModule& generated : modules)
+    {
+        llvm::SmallVector<char, 0> bitcode;
+        generated.module.withModuleDo([&](llvm::Module& module) {
+            llvm::raw_svector_ostream out(bitcode);
+            llvm::WriteBitcodeToFile(module, out);
+        });
+        auto module = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()), "kccani_jit"), context);
+        if (!module)
+        {
+            spdlog::error(llvm::toString(module.takeError()));
+            failed = true;
+            break;
+        }
+        if (!linked)
+            linked = std::move(*module);
+        else if (llvm::Linker::linkModules(*linked, std::move(*module)))
+        {
+            failed = true;
+            break;
+        }
+    }
+    context.setDiagnosticHandler(std::move(previous_handler));
+    if (failed)
+        return nullptr;
+    if (!linked)
+        linked = std::make_unique<llvm::Module>("kccani_jit", context);
+    return linked;
+}
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/ThreadPool.h>
+
+#include "ast.hpp"
+#include "codegen.hpp"
+#include "flat_ast.hpp"
+
+namespace kccani
+{
+
+// Generates and optimizes code for the items of a program on a thread pool.
+//
+// The items are split into consecutive chunks of at least `min_chunk_items`,
+// each generated into a module of its own by a CodeGeneratorLLVM with its own
+// LLVMContext and its own Optimizer, so the workers share no LLVM state. A
+// chunk's module first declares every function the items before the chunk
+// declare or define, which is all its items may refer to. The modules come
+// back in source order and with distinct names for the top level expressions,
+// ready for JitEngine::run() or link().
+//
+// Module passes only see one chunk, so calls across chunks are not inlined.
+// A function defined again in a later chunk keeps its first definition and
+// the later one is reported as a redefinition, as sequentially, even when
+// the body of the first fails to generate.
+class ParallelCodeGenerator
+{
+    unsigned optimization_level;
+    std::size_t min_chunk_items;
+    std::unique_ptr<llvm::ThreadPool> pool;
+
+    template <typename DeclarationOf, typename GenerateItem>
+    std::vector<GeneratedModule> generate_chunks(
+        std::size_t item_count,
+        DeclarationOf declaration_of,
+        GenerateItem generate_item
+    );
+
+public:
+    static constexpr std::size_t DEFAULT_MIN_CHUNK_ITEMS = 64;
+
+    // `threads` 0 uses every hardware thread, 1 generates on the calling
+    // thread. Every chunk is optimized at -O`_optimization_level`.
+    explicit ParallelCodeGenerator(
+        unsigned threads = 0,
+        unsigned _optimization_level = 0,
+        std::size_t _min_chunk_items = DEFAULT_MIN_CHUNK_ITEMS
+    );
+
+    std::vector<GeneratedModule> generate(const std::vector<ParsedAstContentType>& items);
+    std::vector<GeneratedModule> generate(const FlatAst& ast);
+
+    // Links `modules` into one module in `context`, in order. Reports the
+    // error and returns nullptr if they do not link.
+    static std::unique_ptr<llvm::Module> link(std::vector<GeneratedModule> modules, llvm::LLVMContext& context);
+};
+
+}
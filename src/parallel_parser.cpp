@@ -0,0 +1,200 @@
+#include "parallel_parser.hpp"
+
+#include <exception>
+
+#include <llvm/Support/Threading.h>
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "scan.hpp"
+
+namespace kccani
+{
+
+ParallelParser::ParallelParser(unsigned threads, std::size_t _min_chunk_bytes) : min_chunk_bytes(_min_chunk_bytes)
+{
+    if (threads != 1)
+        this->pool = std::make_unique<llvm::ThreadPool>(llvm::hardware_concurrency(threads));
+}
+
+// Walks the tokens the way Lexer::get_from_buffer() does, without interning
+// identifiers or converting numbers.
+std::vector<std::size_t> ParallelParser::split(std::string_view source, std::size_t min_bytes)
+{
+    const scan::ScanKernels& kernels = scan::active_kernels();
+    const char* begin = source.data();
+    const char* end = begin + source.size();
+    const char* cursor = begin;
+    std::vector<std::size_t> boundaries{0};
+    while (cursor != end)
+    {
+        char current_char = *cursor;
+        if (scan::has_class(current_char, scan::CHAR_WHITESPACE))
+            cursor = kernels.skip_whitespace(cursor + 1, end);
+        else if (scan::has_class(current_char, scan::CHAR_ALPHA))
+        {
+            const char* token_begin = cursor;
+            cursor = kernels.skip_identifier(cursor + 1, end);
+            std::string_view word(token_begin, cursor - token_begin);
+            std::size_t offset = token_begin - begin;
+            if ((word == "def" || word == "extern")
+                && offset > boundaries.back() && offset - boundaries.back() >= min_bytes)
+                boundaries.push_back(offset);
+        }
+        else if (scan::has_class(current_char, scan::CHAR_DIGIT | scan::CHAR_DOT))
+            cursor = kernels.skip_number(cursor + 1, end);
+        else if (current_char == '#')
+            cursor = kernels.find_line_end(cursor + 1, end);
+        else
+            cursor++;
+    }
+    return boundaries;
+}
+
+// Parses the items of a chunk. The sequential parser reads a `;` right
+// before the next chunk together with the item that chunk starts with, so
+// all but the last chunk skip theirs instead of ending on an empty item.
+template <typename Builder>
+static void parse_chunk_items(Lexer& lexer, BasicParser<Builder>& parser, bool last_chunk,
+    std::vector<typename Builder::Item>& items)
+{
+    while (lexer.peek().type != Token::TokenType::TOKEN_EOF)
+    {
+        if (!last_chunk && lexer.peek() == ';')
+            lexer.get();
+        else
+            items.push_back(parser.get());
+    }
+}
+
+// Parses every chunk into `outputs`, concurrently if there is a pool, and
+// returns the number of leading chunks whose result can be used as is.
+// `parse_chunk(text, last_chunk, output, sink)` returns whether its chunk is
+// such a one.
+template <typename Output, typename ParseChunk>
+std::size_t ParallelParser::parse_chunks(
+    std::string_view source,
+    const std::vector<std::size_t>& boundaries,
+    std::vector<Output>& outputs,
+    std::vector<BufferedDiagnostics>& diagnostics,
+    ParseChunk parse_chunk
+)
+{
+    std::size_t chunk_count = boundaries.size();
+    outputs.resize(chunk_count);
+    diagnostics.resize(chunk_count);
+    std::unique_ptr<bool[]> usable(new bool[chunk_count]());
+
+    auto run = [&](std::size_t chunk) {
+        std::size_t chunk_end = chunk + 1 < chunk_count ? boundaries[chunk + 1] : source.size();
+        std::string_view text = source.substr(boundaries[chunk], chunk_end - boundaries[chunk]);
+        try
+        {
+            usable[chunk] = parse_chunk(text, chunk + 1 == chunk_count, outputs[chunk], diagnostics[chunk]);
+        }
+        catch (const std::exception&)
+        {
+            // Thrown again, in order, by the sequential parse of the rest.
+            usable[chunk] = false;
+        }
+    };
+    if (this->pool && chunk_count > 1)
+    {
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++)
+            this->pool->async([&run, chunk]() { run(chunk); });
+        this->pool->wait();
+    }
+    else
+    {
+        for (std::size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            run(chunk);
+            if (!usable[chunk])
+                return this->parallel_chunks = chunk;
+        }
+    }
+
+    std::size_t prefix = 0;
+    while (prefix < chunk_count && usable[prefix])
+        prefix++;
+    return this->parallel_chunks = prefix;
+}
+
+ParsedProgram ParallelParser::parse(std::string_view source, DiagnosticSink& sink)
+{
+    struct Chunk
+    {
+        std::shared_ptr<AstArena> arena;
+        std::vector<ParsedAstContentType> items;
+    };
+    auto boundaries = ParallelParser::split(source, this->min_chunk_bytes);
+    std::vector<Chunk> chunks;
+    std::vector<BufferedDiagnostics> diagnostics;
+    std::size_t usable = this->parse_chunks(source, boundaries, chunks, diagnostics,
+        [](std::string_view text, bool last_chunk, Chunk& chunk, BufferedDiagnostics& chunk_sink) {
+            Lexer lexer(text);
+            Parser parser(lexer);
+            parser.set_diagnostics(chunk_sink);
+            parse_chunk_items(lexer, parser, last_chunk, chunk.items);
+            chunk.arena = parser.arena();
+            return chunk_sink.get_messages().empty() && parser.get_operators() == BUILTIN_OPERATORS;
+        });
+
+    ParsedProgram program;
+    for (std::size_t chunk = 0; chunk < usable; chunk++)
+    {
+        diagnostics[chunk].replay(sink);
+        program.arenas.push_back(std::move(chunks[chunk].arena));
+        program.items.insert(program.items.end(), chunks[chunk].items.begin(), chunks[chunk].items.end());
+    }
+    if (usable < boundaries.size())
+    {
+        Lexer lexer(source.substr(boundaries[usable]));
+        Parser parser(lexer);
+        parser.set_diagnostics(sink);
+        auto rest = parser.fetch_all();
+        program.arenas.push_back(parser.arena());
+        program.items.insert(program.items.end(), rest.begin(), rest.end());
+    }
+    return program;
+}
+
+FlatAst ParallelParser::parse_flat(std::string_view source, DiagnosticSink& sink)
+{
+    auto boundaries = ParallelParser::split(source, this->min_chunk_bytes);
+    std::vector<FlatAst> chunks;
+    std::vector<BufferedDiagnostics> diagnostics;
+    std::size_t usable = this->parse_chunks(source, boundaries, chunks, diagnostics,
+        [](std::string_view text, bool last_chunk, FlatAst& ast, BufferedDiagnostics& chunk_sink) {
+            Lexer lexer(text);
+            BasicParser<FlatAstBuilder> parser(lexer, FlatAstBuilder(ast));
+            parser.set_diagnostics(chunk_sink);
+            std::vector<FlatAstBuilder::Item> items;
+            parse_chunk_items(lexer, parser, last_chunk, items);
+            return chunk_sink.get_messages().empty() && parser.get_operators() == BUILTIN_OPERATORS;
+        });
+
+    if (boundaries.size() == 1 && usable == 1)
+    {
+        diagnostics[0].replay(sink);
+        return std::move(chunks[0]);
+    }
+    FlatAst program;
+    for (std::size_t chunk = 0; chunk < usable; chunk++)
+    {
+        diagnostics[chunk].replay(sink);
+        program.append(chunks[chunk]);
+    }
+    if (usable < boundaries.size())
+    {
+        FlatAst rest;
+        Lexer lexer(source.substr(boundaries[usable]));
+        BasicParser<FlatAstBuilder> parser(lexer, FlatAstBuilder(rest));
+        parser.set_diagnostics(sink);
+        parser.fetch_all();
+        program.append(rest);
+    }
+    return program;
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <llvm/Support/ThreadPool.h>
+
+#include "arena.hpp"
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "flat_ast.hpp"
+
+namespace kccani
+{
+
+// Top level items spread over the arenas of the parsers that made them.
+struct ParsedProgram
+{
+    std::vector<std::shared_ptr<AstArena>> arenas;
+    std::vector<ParsedAstContentType> items;
+};
+
+// Parses large sources on a thread pool.
+//
+// A pre-scan splits the text before `def` and `extern` tokens into chunks of
+// at least `min_chunk_bytes`, which are lexed and parsed concurrently. No
+// construct continues through one of those keywords, so a chunk that parses
+// without diagnostics and without defining operators yields exactly the items
+// the sequential parser would. From the first chunk that does not, where error
+// recovery or new operators can change how the rest reads, the text is
+// parsed sequentially. The result and the diagnostics, reported in order to
+// the sink passed in, are therefore the same as Parser::fetch_all()'s.
+class ParallelParser
+{
+    std::size_t min_chunk_bytes;
+    std::unique_ptr<llvm::ThreadPool> pool;
+    std::size_t parallel_chunks = 0;
+
+    template <typename Output, typename ParseChunk>
+    std::size_t parse_chunks(
+        std::string_view source,
+        const std::vector<std::size_t>& boundaries,
+        std::vector<Output>& outputs,
+        std::vector<BufferedDiagnostics>& diagnostics,
+        ParseChunk parse_chunk
+    );
+
+public:
+    static constexpr std::size_t DEFAULT_MIN_CHUNK_BYTES = 64 << 10;
+
+    // `threads` 0 uses every hardware thread, 1 parses on the calling thread.
+    explicit ParallelParser(unsigned threads = 0, std::size_t _min_chunk_bytes = DEFAULT_MIN_CHUNK_BYTES);
+
+    // Offsets where chunks start: 0 first, then positions of `def` or
+    // `extern` tokens at least `min_bytes` after the previous chunk start.
+    static std::vector<std::size_t> split(std::string_view source, std::size_t min_bytes);
+
+    ParsedProgram parse(std::string_view source, DiagnosticSink& diagnostics = DiagnosticSink::standard());
+    FlatAst parse_flat(std::string_view source, DiagnosticSink& diagnostics = DiagnosticSink::standard());
+
+    // Leading chunks of the last parse whose concurrent result was used, for
+    // diagnostics.
+    [[nodiscard]] std::size_t last_parallel_chunks() const noexcept { return this->parallel_chunks; }
+};
+
+}
@@ -1,254 +1,345 @@
 #include "parser.hpp"
+#include "flat_ast.hpp"
 
-#include <spdlog/spdlog.h>
-#include <map>
-#include <limits>
+#include <string>
 
 namespace kccani
 {
 
 // Primary Expression Parsing
 
-std::unique_ptr<ExprAST> Parser::parse_number_expr()
+template <typename Builder>
+typename BasicParser<Builder>::Expr BasicParser<Builder>::parse_number_expr()
 {
     Token number_token = this->program.get();
-    double number_value = std::get<double>(number_token.data.value());
-    auto result = std::make_unique<NumberExprAST>(number_value);
-    return std::move(result);
+    double number_value = number_token.number();
+    return this->builder.number(number_value);
 }
 
-std::unique_ptr<ExprAST> Parser::parse_parenthesized_expr()
+template <typename Builder>
+typename BasicParser<Builder>::Expr BasicParser<Builder>::parse_primary()
 {
-    this->program.get();
-    auto expression = this->parse_expr();
-    if (!expression)
-    {
-        return nullptr;
-    }
-    if (!(this->program.peek() == ')'))
+    const Token& token = this->program.peek();
+    if (token.type == Token::TokenType::TOKEN_SPECIAL && !(token == '('))
     {
-        spdlog::error("Expected `)` to close parenthesized expression");
-        return nullptr;
+        this->diagnostics->error("Attempted primary expression parsing non a non-primary expression");
+        return {};
     }
-    this->program.get();
-    return expression;
+    return this->parse_expression(UNARY_ONLY, {});
 }
 
-std::unique_ptr<ExprAST> Parser::parse_identifier_expr()
+// Expressions
+
+// Pratt parsing with the recursion made explicit, so that nesting depth costs
+// heap rather than native stack. Each iteration is in one of two states:
+//
+// - Operand: reading prefix operators, then a primary. Parentheses and call
+//   arguments start a nested expression by pushing a frame and resetting
+//   `min_precedence`.
+// - Operators: `value` is a complete operand. Operators binding at least as
+//   tightly as `min_precedence` are folded in, each pushing a frame holding
+//   its left operand while its right operand is read with the precedence the
+//   operator's right binding power requires. When none is left, the frame on
+//   top says what `value` completes.
+//
+// The builder sees the same calls in the same order as from a recursive
+// descent parser, and errors stop it at the same token.
+template <typename Builder>
+typename BasicParser<Builder>::Expr BasicParser<Builder>::parse_expression(int min_precedence, Expr lhs)
 {
-    // Extract the identifier name
-    Token identifier = this->program.get();
-    if (identifier.type != Token::TokenType::TOKEN_IDENTIFIER)
-        spdlog::error("Expected token should be an identifier, but is not");
-    std::string identifier_name = std::get<std::string>(identifier.data.value());
-    // If it's not a function call, process it as a variable name
-    if (!(this->program.peek() == '('))
-    {
-        return std::make_unique<VariableExprAST>(identifier_name);
-    }
-    // If it is a function call and has no args, process it as such
-    this->program.get();
-    std::vector<std::unique_ptr<ExprAST>> function_args;
-    if (this->program.peek() == ')')
-    {
-        this->program.get();
-        return std::make_unique<FunctionCallExprAST>(
-            identifier_name, std::move(function_args));
-    }
-    // Otherwise collect args until close parenthesis, process that
-    std::vector<std::unique_ptr<ExprAST>> args;
+    const std::size_t frames_begin = this->pending_frames.size();
+    auto fail = [&]() -> Expr {
+        for (std::size_t frame = frames_begin; frame < this->pending_frames.size(); frame++)
+        {
+            if (this->pending_frames[frame].kind == ExprFrame::Kind::CALL)
+            {
+                this->pending_args.resize(this->pending_frames[frame].args_begin);
+                break;
+            }
+        }
+        this->pending_frames.resize(frames_begin);
+        return {};
+    };
+
+    Expr value = lhs;
+    bool have_operand = static_cast<bool>(lhs);
     while (true)
     {
-        if (auto arg = this->parse_expr())
-            args.push_back(std::move(arg));
-        else
-            return nullptr;
-
-        if (this->program.peek() == ')')
+        if (!have_operand)
         {
-            this->program.get();
-            break;
+            const Token& token = this->program.peek();
+            if (token.type == Token::TokenType::TOKEN_SPECIAL && this->operators[token.special()].unary)
+            {
+                this->pending_frames.push_back({ExprFrame::Kind::UNARY, this->program.get().special(), 0, {}});
+                continue;
+            }
+            if (token.type == Token::TokenType::TOKEN_NUMBER)
+                value = this->parse_number_expr();
+            else if (token.type == Token::TokenType::TOKEN_IDENTIFIER)
+            {
+                Symbol identifier_name = this->program.get().symbol();
+                // If it's not a function call, process it as a variable name
+                if (!(this->program.peek() == '('))
+                    value = this->builder.variable(identifier_name);
+                else
+                {
+                    this->program.get();
+                    if (this->program.peek() == ')')
+                    {
+                        this->program.get();
+                        value = this->builder.call(identifier_name, this->pending_args, this->pending_args.size());
+                    }
+                    else
+                    {
+                        // Nested calls stack their args on top of ours in the
+                        // shared scratch vector.
+                        this->pending_frames.push_back(
+                            {ExprFrame::Kind::CALL, '\0', min_precedence, {}, identifier_name, this->pending_args.size()});
+                        min_precedence = 0;
+                        continue;
+                    }
+                }
+            }
+            else if (token == '(')
+            {
+                this->program.get();
+                this->pending_frames.push_back({ExprFrame::Kind::PARENTHESES, '\0', min_precedence, {}});
+                min_precedence = 0;
+                continue;
+            }
+            else
+            {
+                this->diagnostics->error("Attempted primary expression parsing non a non-primary expression");
+                return fail();
+            }
+            have_operand = true;
+            // Prefix operators bind tighter than any binary one.
+            while (this->pending_frames.size() > frames_begin
+                && this->pending_frames.back().kind == ExprFrame::Kind::UNARY)
+            {
+                value = this->builder.unary(this->pending_frames.back().opcode, value);
+                this->pending_frames.pop_back();
+            }
         }
-        if (!(this->program.peek() == ','))
+
+        const Token& token = this->program.peek();
+        if (token.type == Token::TokenType::TOKEN_SPECIAL)
         {
-            spdlog::error("Expected ')' or ',' after end of expression in argument list");
-            return nullptr;
+            const OperatorInfo& info = this->operators[token.special()];
+            if (info.is_binary() && info.precedence >= min_precedence)
+            {
+                this->pending_frames.push_back({ExprFrame::Kind::BINARY, this->program.get().special(), min_precedence, value});
+                min_precedence = info.right_binding_power();
+                have_operand = false;
+                continue;
+            }
         }
-        this->program.get();
-    }
-    return std::make_unique<FunctionCallExprAST>(identifier_name, std::move(args));
-}
-
-std::unique_ptr<ExprAST> Parser::parse_primary()
-{
-    if (this->program.peek().type == Token::TokenType::TOKEN_IDENTIFIER)
-    {
-        return this->parse_identifier_expr();
-    }
-    else if (this->program.peek().type == Token::TokenType::TOKEN_NUMBER)
-    {
-        return this->parse_number_expr();
-    }
-    else if (this->program.peek() == '(')
-    {
-        return this->parse_parenthesized_expr();
-    }
-    else
-    {
-        spdlog::error("Attempted primary expression parsing non a non-primary expression");
-        return nullptr;
-    }
-}
-
-// Binary expressions and assignments
-
-std::unique_ptr<ExprAST> Parser::parse_binary_op_rhs(
-    int expression_precedence,
-    std::unique_ptr<ExprAST> lhs
-)
-{
-    const std::map<char, int> OP_PRECEDENCE = {{'<', 100}, {'+', 200}, {'-', 300}, {'*', 400}};
-
-    while (this->program.peek().type == Token::TokenType::TOKEN_SPECIAL) {
-        char opcode = std::get<char>(this->program.peek().data.value());
-        int token_precedence = OP_PRECEDENCE.count(opcode) != 0
-            ? OP_PRECEDENCE.at(opcode)
-            : std::numeric_limits<int>::min();
-        if (token_precedence < expression_precedence)
-            return std::move(lhs);
-        this->program.get();
 
-        auto rhs = this->parse_primary();
-        if (!rhs)
-            return nullptr;
-
-        // if opcode binds less tightly with RHS than the operator after RHS,
-        // let the pending operator take RHS as its LHS.
-        if (this->program.peek().type == Token::TokenType::TOKEN_SPECIAL)
+        // No operator continues `value`: it is complete at this level.
+        if (this->pending_frames.size() == frames_begin)
+            return value;
+        ExprFrame frame = this->pending_frames.back();
+        switch (frame.kind)
         {
-            char next_opcode = std::get<char>(this->program.peek().data.value());
-            int next_precedence = OP_PRECEDENCE.count(next_opcode) != 0
-                ? OP_PRECEDENCE.at(next_opcode)
-                : std::numeric_limits<int>::min();
-            if (token_precedence < next_precedence) {
-                rhs = this->parse_binary_op_rhs(token_precedence + 1, std::move(rhs));
-                if (!rhs)
-                    return nullptr;
+        case ExprFrame::Kind::BINARY:
+            this->pending_frames.pop_back();
+            value = this->builder.binary(frame.opcode, frame.lhs, value);
+            min_precedence = frame.min_precedence;
+            continue;
+        case ExprFrame::Kind::PARENTHESES:
+            if (!(this->program.peek() == ')'))
+            {
+                this->diagnostics->error("Expected `)` to close parenthesized expression");
+                return fail();
+            }
+            this->program.get();
+            break;
+        case ExprFrame::Kind::CALL:
+            this->pending_args.push_back(value);
+            if (this->program.peek() == ',')
+            {
+                this->program.get();
+                min_precedence = 0;
+                have_operand = false;
+                continue;
+            }
+            if (!(this->program.peek() == ')'))
+            {
+                this->diagnostics->error("Expected ')' or ',' after end of expression in argument list");
+                return fail();
             }
+            this->program.get();
+            value = this->builder.call(frame.callee, this->pending_args, frame.args_begin);
+            this->pending_args.resize(frame.args_begin);
+            break;
+        case ExprFrame::Kind::UNARY:
+            // Applied as soon as their operand is complete.
+            break;
+        }
+        // A parenthesized expression or a call is a primary of the enclosing
+        // expression.
+        this->pending_frames.pop_back();
+        min_precedence = frame.min_precedence;
+        while (this->pending_frames.size() > frames_begin
+            && this->pending_frames.back().kind == ExprFrame::Kind::UNARY)
+        {
+            value = this->builder.unary(this->pending_frames.back().opcode, value);
+            this->pending_frames.pop_back();
         }
-
-        lhs = std::make_unique<BinaryExprAST>(opcode, std::move(lhs), std::move(rhs));
     }
-    return std::move(lhs);
 }
 
-std::unique_ptr<ExprAST> Parser::parse_expr() {
-    auto lhs = this->parse_primary();
-    if (!lhs)
-        return nullptr;
-
-    return this->parse_binary_op_rhs(0, std::move(lhs));
+template <typename Builder>
+typename BasicParser<Builder>::Expr BasicParser<Builder>::parse_expr() {
+    return this->parse_expression(0, {});
 }
 
 // Parsing function blocks and top level (main code in script)
 
-std::unique_ptr<FunctionPrototypeAST> Parser::parse_function_proto()
+template <typename Builder>
+typename BasicParser<Builder>::Prototype BasicParser<Builder>::parse_function_proto()
 {
     if (this->program.peek().type != Token::TokenType::TOKEN_IDENTIFIER)
     {
-        spdlog::error("Expected function name in prototype");
-        return nullptr;
+        this->diagnostics->error("Expected function name in prototype");
+        return {};
+    }
+    Symbol function_name = this->program.get().symbol();
+
+    // `binary<op> [precedence]` and `unary<op>` define operators, implemented
+    // by the function named `binary<op>` / `unary<op>`.
+    Symbol keyword = function_name;
+    char opcode = '\0';
+    int precedence = DEFAULT_OPERATOR_PRECEDENCE;
+    if ((function_name == symbols::BINARY || function_name == symbols::UNARY)
+        && this->program.peek().type == Token::TokenType::TOKEN_SPECIAL
+        && this->operators.can_define(this->program.peek().special()))
+    {
+        opcode = this->program.get().special();
+        if (function_name == symbols::BINARY && this->program.peek().type == Token::TokenType::TOKEN_NUMBER)
+        {
+            double value = this->program.get().number();
+            if (!(value >= 1 && value <= OperatorTable::MAX_PRECEDENCE))
+            {
+                this->diagnostics->error("Operator precedence must be between 1 and " + std::to_string(OperatorTable::MAX_PRECEDENCE));
+                return {};
+            }
+            precedence = static_cast<int>(value);
+        }
+        function_name = Symbol::intern(std::string(function_name.name()) + opcode);
     }
-    std::string function_name = std::get<std::string>(this->program.get().data.value());
 
     if (!(this->program.get() == '('))
     {
-        spdlog::error("Expected '(' in prototype");
-        return nullptr;
+        this->diagnostics->error("Expected '(' in prototype");
+        return {};
     }
 
-    std::vector<std::string> arguments;
+    this->pending_params.clear();
     while (this->program.peek().type == Token::TokenType::TOKEN_IDENTIFIER)
     {
-       arguments.push_back(std::get<std::string>(this->program.get().data.value()));
+       this->pending_params.push_back(this->program.get().symbol());
     }
     if (!(this->program.get() == ')'))
     {
-        spdlog::error("Expected ')' in prototype");
-        return nullptr;
+        this->diagnostics->error("Expected ')' in prototype");
+        return {};
+    }
+
+    if (opcode != '\0')
+    {
+        OperatorInfo info = this->operators[opcode];
+        std::size_t operand_count = 2;
+        if (keyword == symbols::UNARY)
+        {
+            operand_count = 1;
+            info.unary = true;
+        }
+        else
+        {
+            info.precedence = static_cast<std::int16_t>(precedence);
+        }
+        if (this->pending_params.size() != operand_count)
+        {
+            this->diagnostics->error("Operator " + function_name.str() + " needs " + std::to_string(operand_count) + " operands");
+            return {};
+        }
+        this->operators.set(opcode, info);
     }
 
-    return std::make_unique<FunctionPrototypeAST>(function_name, std::move(arguments));
+    return this->builder.prototype(function_name, this->pending_params);
 }
 
-std::unique_ptr<FunctionAST> Parser::parse_function_definition()
+template <typename Builder>
+typename BasicParser<Builder>::Function BasicParser<Builder>::parse_function_definition()
 {
     this->program.get();
     auto prototype = this->parse_function_proto();
     if (!prototype)
-        return nullptr;
+        return {};
     auto body = this->parse_expr();
     if (!body)
-        return nullptr;
-    return std::make_unique<FunctionAST>(std::move(prototype), std::move(body));
+        return {};
+    return this->builder.function(prototype, body);
 }
 
-std::unique_ptr<FunctionAST> Parser::parse_top_level_expr()
+template <typename Builder>
+typename BasicParser<Builder>::Function BasicParser<Builder>::parse_top_level_expr()
 {
     auto expr = this->parse_expr();
     if (!expr)
-        return nullptr;
+        return {};
 
-    auto prototype = std::make_unique<FunctionPrototypeAST>(
-        "__anon_expr",
-        std::vector<std::string>()
-    );
-    return std::make_unique<FunctionAST>(std::move(prototype), std::move(expr));
+    this->pending_params.clear();
+    auto prototype = this->builder.prototype(symbols::ANON_EXPR, this->pending_params);
+    return this->builder.function(prototype, expr);
 }
 
-std::unique_ptr<FunctionPrototypeAST> Parser::parse_extern()
+template <typename Builder>
+typename BasicParser<Builder>::Prototype BasicParser<Builder>::parse_extern()
 {
     this->program.get();
     return this->parse_function_proto();
 }
 
-Parser::Parser(Lexer& lexer) : program(lexer)
+template <typename Builder>
+BasicParser<Builder>::BasicParser(Lexer& lexer, Builder _builder) : program(lexer), builder(std::move(_builder))
 {
 }
 
-ParsedAstContentType Parser::get() {
+template <typename Builder>
+typename BasicParser<Builder>::Item BasicParser<Builder>::get() {
     if (this->program.peek().type != Token::TokenType::TOKEN_EOF)
     {
+        this->builder.begin_item();
         if (this->program.peek() == ';')
         {
             this->program.get();
-            return std::move(this->get());
+            return this->get();
         }
         else if (this->program.peek().type == Token::TokenType::TOKEN_DEF)
         {
-            ParsedAstContentType defn{this->parse_function_definition()};
-            if (std::get<std::unique_ptr<FunctionAST>>(defn) != nullptr)
-                return std::move(defn);
+            if (auto defn = this->parse_function_definition())
+                return this->builder.function_item(defn);
         }
         else if (this->program.peek().type == Token::TokenType::TOKEN_EXTERN)
         {
-            ParsedAstContentType call{this->parse_extern()};
-            if (std::get<std::unique_ptr<FunctionPrototypeAST>>(call) != nullptr)
-                return std::move(call);
+            if (auto call = this->parse_extern())
+                return this->builder.extern_item(call);
         }
         else
         {
-            ParsedAstContentType expr{this->parse_expr()};
-            if (std::get<std::unique_ptr<ExprAST>>(expr) != nullptr)
-                return std::move(expr);
+            if (auto expr = this->parse_expr())
+                return this->builder.expression_item(expr);
         }
     }
-    return std::monostate{};  // EOF or error token
+    return this->builder.error_item();  // EOF or error token
 }
 
-std::vector<ParsedAstContentType> Parser::fetch_all()
+template <typename Builder>
+std::vector<typename BasicParser<Builder>::Item> BasicParser<Builder>::fetch_all()
 {
-    std::vector<ParsedAstContentType> ast_list;
+    std::vector<Item> ast_list;
     while (this->program.peek().type != Token::TokenType::TOKEN_EOF)
     {
         ast_list.push_back(this->get());
@@ -256,10 +347,19 @@ std::vector<ParsedAstContentType> Parser::fetch_all()
     return ast_list;
 }
 
-Parser Parser::operator>>(ParsedAstContentType& ast)
+template <typename Builder>
+BasicParser<Builder>& BasicParser<Builder>::operator>>(Item& ast)
 {
     ast = this->get();
     return *this;
 }
 
+template class BasicParser<AstBuilder>;
+template class BasicParser<FlatAstBuilder>;
+
+Parser::Parser(Lexer& lexer, std::shared_ptr<AstArena> arena, bool share_subexpressions)
+    : BasicParser<AstBuilder>(lexer, AstBuilder(std::move(arena), share_subexpressions))
+{
+}
+
 }
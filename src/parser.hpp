@@ -1,14 +1,30 @@
+#pragma once
+
+#include <cstdint>
 #include <deque>
+#include <limits>
 #include <memory>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include "ast.hpp"
+#include "diagnostics.hpp"
 #include "lexer.hpp"
+#include "operators.hpp"
 
 namespace kccani
 {
 
-class Parser
+// Recursive descent parser over a Lexer, except for expressions, which are
+// parsed with an explicit stack so that their nesting depth is not bounded
+// by the native stack. What it builds is up to `Builder`:
+// AstBuilder makes the arena allocated pointer tree, FlatAstBuilder appends
+// to a FlatAst. A builder supplies the node handle types Expr, Prototype,
+// Function and Item, where value initialised Expr, Prototype and Function
+// handles are the failed ones (and test false), and the construction methods
+// used below. Both builders are instantiated in parser.cpp.
+template <typename Builder>
+class BasicParser
 {
 private:
 
@@ -20,27 +36,91 @@ private:
     FRIEND_TEST(ParserTests, BracketedBinaryExpressionsGetParsed);
     FRIEND_TEST(ParserTests, GeneratesTheCorrectParsedExpression);
     FRIEND_TEST(ParserTests, ParsesFunctionPrototypeCorrectly);
+    // Drives the expression parsing stages directly, see bench/bench_parser.cpp.
+    friend class ParserBenchmark;
+
+    using Expr = typename Builder::Expr;
+    using Prototype = typename Builder::Prototype;
+    using Function = typename Builder::Function;
+    using Item = typename Builder::Item;
 
     Lexer& program;
+    Builder builder;
+    // Scratch space for the argument lists being parsed, handed to the
+    // builder once complete.
+    std::vector<Expr> pending_args;
+    std::vector<Symbol> pending_params;
+    // A construct parse_expression() is in the middle of: a prefix or binary
+    // operator waiting for its operand, a parenthesized expression or a call
+    // argument. `min_precedence` is that of the enclosing expression.
+    struct ExprFrame
+    {
+        enum class Kind : std::uint8_t
+        {
+            UNARY,
+            BINARY,
+            PARENTHESES,
+            CALL,
+        };
+        Kind kind;
+        char opcode;
+        int min_precedence;
+        Expr lhs;
+        Symbol callee{0};
+        std::size_t args_begin = 0;
+    };
+    std::vector<ExprFrame> pending_frames;
+    DiagnosticSink* diagnostics = &DiagnosticSink::standard();
+    // The builtin operators plus those defined so far in this input.
+    OperatorTable operators = BUILTIN_OPERATORS;
+
+    // As `min_precedence`, stops before any binary operator.
+    static constexpr int UNARY_ONLY = std::numeric_limits<int>::max();
 
-    std::unique_ptr<ExprAST> parse_number_expr();
-    std::unique_ptr<ExprAST> parse_parenthesized_expr();
-    std::unique_ptr<ExprAST> parse_identifier_expr();
-    std::unique_ptr<ExprAST> parse_primary();
-    std::unique_ptr<ExprAST> parse_binary_op_rhs(int, std::unique_ptr<ExprAST>);
-    std::unique_ptr<ExprAST> parse_expr();
+    Expr parse_number_expr();
+    Expr parse_primary();
+    // Parses operators binding at least as tightly as `min_precedence`,
+    // applied to `lhs` or, if that is empty, to an operand parsed first.
+    Expr parse_expression(int min_precedence, Expr lhs);
+    Expr parse_expr();
 
-    std::unique_ptr<FunctionPrototypeAST> parse_function_proto();
-    std::unique_ptr<FunctionAST> parse_function_definition();
-    std::unique_ptr<FunctionAST> parse_top_level_expr();
-    std::unique_ptr<FunctionPrototypeAST> parse_extern();
+    Prototype parse_function_proto();
+    Function parse_function_definition();
+    Function parse_top_level_expr();
+    Prototype parse_extern();
 
 public:
-    Parser(Lexer& lexer);
-    virtual ParsedAstContentType get();
-    std::vector<ParsedAstContentType> fetch_all();
+    // Precedence of `def binary<op>` without an explicit one; the builtin
+    // operators range from 100 for `<` to 400 for `*`.
+    static constexpr int DEFAULT_OPERATOR_PRECEDENCE = 50;
+
+    BasicParser(Lexer& lexer, Builder _builder);
+    virtual ~BasicParser() = default;
+
+    [[nodiscard]] Builder& get_builder() noexcept { return this->builder; }
+    [[nodiscard]] const OperatorTable& get_operators() const noexcept { return this->operators; }
+    // Parses on as if the input so far had defined the operators of `table`.
+    void set_operators(const OperatorTable& table) noexcept { this->operators = table; }
+    // Where parse errors go from now on; `sink` has to outlive the parser.
+    void set_diagnostics(DiagnosticSink& sink) noexcept { this->diagnostics = &sink; }
+    virtual Item get();
+    std::vector<Item> fetch_all();
 
-    Parser operator>>(ParsedAstContentType& ast);
+    BasicParser& operator>>(Item& ast);
+};
+
+class Parser : public BasicParser<AstBuilder>
+{
+public:
+    // Nodes are allocated in `arena`, which has to outlive the ASTs returned.
+    // With `share_subexpressions` equal subexpressions become one node, see
+    // AstBuilder.
+    Parser(
+        Lexer& lexer,
+        std::shared_ptr<AstArena> arena = std::make_shared<AstArena>(),
+        bool share_subexpressions = false
+    );
+    [[nodiscard]] const std::shared_ptr<AstArena>& arena() noexcept { return this->get_builder().arena(); }
 };
 
 }
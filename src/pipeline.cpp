@@ -0,0 +1,113 @@
+#include "pipeline.hpp"
+
+#include <exception>
+#include <memory>
+#include <thread>
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "spsc_queue.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// An item on its way to the consumer, keeping the arena it lives in alive.
+struct StreamedItem
+{
+    ParsedAstContentType ast;
+    std::shared_ptr<AstArena> arena;
+};
+
+}
+
+Pipeline::Pipeline(std::size_t _token_batch_size, std::size_t _queue_capacity, std::size_t _arena_bytes)
+    : token_batch_size(_token_batch_size), queue_capacity(_queue_capacity), arena_bytes(_arena_bytes)
+{
+}
+
+void Pipeline::run(std::string_view source, const Consumer& consume, DiagnosticSink& diagnostics) const
+{
+    SpscQueue<TokenBatch> tokens(this->queue_capacity);
+    SpscQueue<StreamedItem> items(this->queue_capacity);
+    std::exception_ptr parse_error;
+
+    std::thread lexer_thread([this, source, &tokens]() {
+        TokenBatch batch;
+        batch.tokens.reserve(this->token_batch_size);
+        try
+        {
+            Lexer lexer(source);
+            while (true)
+            {
+                Token token = lexer.get();
+                batch.tokens.push_back(token);
+                if (token.type == Token::TokenType::TOKEN_EOF)
+                    break;
+                if (batch.tokens.size() == this->token_batch_size)
+                {
+                    if (!tokens.push(std::move(batch)))
+                        return;
+                    batch = TokenBatch();
+                    batch.tokens.reserve(this->token_batch_size);
+                }
+            }
+        }
+        catch (...)
+        {
+            batch.error = std::current_exception();
+        }
+        tokens.push(std::move(batch));
+    });
+
+    std::thread parser_thread([this, &tokens, &items, &diagnostics, &parse_error]() {
+        try
+        {
+            Lexer lexer(tokens);
+            Parser parser(lexer);
+            parser.set_diagnostics(diagnostics);
+            while (lexer.peek().type != Token::TokenType::TOKEN_EOF)
+            {
+                StreamedItem item{parser.get(), parser.arena()};
+                if (!items.push(std::move(item)))
+                    break;
+                if (parser.arena()->size() >= this->arena_bytes)
+                    parser.get_builder().set_arena(std::make_shared<AstArena>());
+            }
+        }
+        catch (...)
+        {
+            parse_error = std::current_exception();
+        }
+        // Stops the lexer if it is still running, and ends the item stream.
+        tokens.close();
+        items.close();
+    });
+
+    std::exception_ptr consume_error;
+    try
+    {
+        StreamedItem item;
+        while (items.pop(item))
+        {
+            consume(item.ast);
+            item = StreamedItem();
+        }
+    }
+    catch (...)
+    {
+        consume_error = std::current_exception();
+        items.close();
+    }
+    parser_thread.join();
+    lexer_thread.join();
+
+    if (consume_error)
+        std::rethrow_exception(consume_error);
+    if (parse_error)
+        std::rethrow_exception(parse_error);
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string_view>
+
+#include "ast.hpp"
+#include "diagnostics.hpp"
+
+namespace kccani
+{
+
+// Compiles one source with lexing, parsing and whatever consumes the items
+// (usually code generation) running at the same time.
+//
+// A lexer thread hands batches of tokens to a parser thread, which hands
+// every top level item on as soon as it is parsed, both through bounded
+// SpscQueues. The calling thread consumes the items in source order. The
+// parser moves to a fresh arena every `arena_bytes`, and an arena is freed
+// once all of its items are consumed, so memory held for tokens and ASTs is
+// bounded by the queue sizes rather than by the size of the source.
+//
+// Subexpressions are never shared: marking a node shared writes to it while
+// the consumer may be reading it.
+class Pipeline
+{
+    std::size_t token_batch_size;
+    std::size_t queue_capacity;
+    std::size_t arena_bytes;
+
+public:
+    static constexpr std::size_t DEFAULT_TOKEN_BATCH_SIZE = 1024;
+    static constexpr std::size_t DEFAULT_QUEUE_CAPACITY = 64;
+    static constexpr std::size_t DEFAULT_ARENA_BYTES = 256 << 10;
+
+    // `_queue_capacity` is the capacity of both queues, in token batches and
+    // in items.
+    explicit Pipeline(
+        std::size_t _token_batch_size = DEFAULT_TOKEN_BATCH_SIZE,
+        std::size_t _queue_capacity = DEFAULT_QUEUE_CAPACITY,
+        std::size_t _arena_bytes = DEFAULT_ARENA_BYTES
+    );
+
+    // Called on the thread running the pipeline. The item's nodes are only
+    // valid during the call.
+    using Consumer = std::function<void(const ParsedAstContentType&)>;
+
+    // Calls `consume` with the items Parser::fetch_all() would return, in
+    // order. Parse errors go to `diagnostics` from the parser thread. An
+    // exception from lexing or parsing is rethrown after the items before it
+    // are consumed, one from `consume` stops the other stages and is rethrown.
+    void run(
+        std::string_view source,
+        const Consumer& consume,
+        DiagnosticSink& diagnostics = DiagnosticSink::standard()
+    ) const;
+};
+
+}
@@ -0,0 +1,268 @@
+#include "scan.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KCCANI_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace kccani
+{
+
+namespace scan
+{
+
+static constexpr std::array<std::uint8_t, 256> build_char_class_table()
+{
+    std::array<std::uint8_t, 256> table{};
+    table[' '] = table['\t'] = CHAR_WHITESPACE;
+    table['\n'] = table['\r'] = CHAR_WHITESPACE | CHAR_LINE_END;
+    for (int c = 'a'; c <= 'z'; c++)
+        table[c] = table[c - 'a' + 'A'] = CHAR_ALPHA;
+    for (int c = '0'; c <= '9'; c++)
+        table[c] = CHAR_DIGIT;
+    table['.'] = CHAR_DOT;
+    return table;
+}
+
+const std::array<std::uint8_t, 256> CHAR_CLASS_TABLE = build_char_class_table();
+
+// Scalar kernels, also used for the tails that are too short for a vector.
+
+template <std::uint8_t CLASS>
+static inline const char* skip_class_scalar(const char* begin, const char* end)
+{
+    while (begin != end && has_class(*begin, CLASS))
+        begin++;
+    return begin;
+}
+
+static const char* skip_whitespace_scalar(const char* begin, const char* end)
+{
+    return skip_class_scalar<CHAR_WHITESPACE>(begin, end);
+}
+
+static const char* skip_identifier_scalar(const char* begin, const char* end)
+{
+    return skip_class_scalar<CHAR_ALPHA | CHAR_DIGIT>(begin, end);
+}
+
+static const char* skip_number_scalar(const char* begin, const char* end)
+{
+    return skip_class_scalar<CHAR_DIGIT | CHAR_DOT>(begin, end);
+}
+
+static const char* find_line_end_scalar(const char* begin, const char* end)
+{
+    while (begin != end && !has_class(*begin, CHAR_LINE_END))
+        begin++;
+    return begin;
+}
+
+static const ScanKernels SCALAR_KERNELS = {
+    skip_whitespace_scalar,
+    skip_identifier_scalar,
+    skip_number_scalar,
+    find_line_end_scalar,
+};
+
+#ifdef KCCANI_SCAN_X86
+
+// SSE2 kernels: 16 bytes per step. Each `match_*` returns a byte mask of the
+// lanes belonging to the class; the kernels stop at the first lane that does
+// not (or, for line ends, the first lane that does).
+
+static inline __m128i in_range_sse2(__m128i bytes, char low, char high)
+{
+    // Unsigned `bytes - low <= high - low`, expressed with the SSE2 min.
+    __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+    __m128i bound = _mm_set1_epi8(static_cast<char>(high - low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(shifted, bound), shifted);
+}
+
+static inline __m128i match_whitespace_sse2(__m128i bytes)
+{
+    return _mm_or_si128(
+        _mm_or_si128(
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\t'))),
+        _mm_or_si128(
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')),
+            _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r'))));
+}
+
+static inline __m128i match_identifier_sse2(__m128i bytes)
+{
+    __m128i lowered = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+    return _mm_or_si128(in_range_sse2(lowered, 'a', 'z'), in_range_sse2(bytes, '0', '9'));
+}
+
+static inline __m128i match_number_sse2(__m128i bytes)
+{
+    return _mm_or_si128(in_range_sse2(bytes, '0', '9'), _mm_cmpeq_epi8(bytes, _mm_set1_epi8('.')));
+}
+
+static inline __m128i match_line_end_sse2(__m128i bytes)
+{
+    return _mm_or_si128(
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\n')),
+        _mm_cmpeq_epi8(bytes, _mm_set1_epi8('\r')));
+}
+
+template <__m128i (*MATCH)(__m128i), bool STOP_ON_MATCH, const char* (*TAIL)(const char*, const char*)>
+static inline const char* scan_sse2(const char* begin, const char* end)
+{
+    while (end - begin >= 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        unsigned mask = _mm_movemask_epi8(MATCH(bytes));
+        if (!STOP_ON_MATCH)
+            mask = ~mask & 0xFFFF;
+        if (mask)
+            return begin + __builtin_ctz(mask);
+        begin += 16;
+    }
+    return TAIL(begin, end);
+}
+
+static const ScanKernels SSE2_KERNELS = {
+    scan_sse2<match_whitespace_sse2, false, skip_whitespace_scalar>,
+    scan_sse2<match_identifier_sse2, false, skip_identifier_scalar>,
+    scan_sse2<match_number_sse2, false, skip_number_scalar>,
+    scan_sse2<match_line_end_sse2, true, find_line_end_scalar>,
+};
+
+// AVX2 kernels: the same scheme 32 bytes at a time. They are compiled for
+// AVX2 through target attributes and only selected after a CPUID check.
+
+#define KCCANI_AVX2 __attribute__((target("avx2")))
+
+KCCANI_AVX2 static inline __m256i in_range_avx2(__m256i bytes, char low, char high)
+{
+    __m256i shifted = _mm256_sub_epi8(bytes, _mm256_set1_epi8(low));
+    __m256i bound = _mm256_set1_epi8(static_cast<char>(high - low));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, bound), shifted);
+}
+
+KCCANI_AVX2 static inline __m256i match_whitespace_avx2(__m256i bytes)
+{
+    return _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')),
+            _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r'))));
+}
+
+KCCANI_AVX2 static inline __m256i match_identifier_avx2(__m256i bytes)
+{
+    __m256i lowered = _mm256_or_si256(bytes, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(in_range_avx2(lowered, 'a', 'z'), in_range_avx2(bytes, '0', '9'));
+}
+
+KCCANI_AVX2 static inline __m256i match_number_avx2(__m256i bytes)
+{
+    return _mm256_or_si256(
+        in_range_avx2(bytes, '0', '9'), _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('.')));
+}
+
+KCCANI_AVX2 static inline __m256i match_line_end_avx2(__m256i bytes)
+{
+    return _mm256_or_si256(
+        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\n')),
+        _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('\r')));
+}
+
+template <__m256i (*MATCH)(__m256i), bool STOP_ON_MATCH, const char* (*TAIL)(const char*, const char*)>
+KCCANI_AVX2 static const char* scan_avx2(const char* begin, const char* end)
+{
+    while (end - begin >= 32)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        unsigned mask = _mm256_movemask_epi8(MATCH(bytes));
+        if (!STOP_ON_MATCH)
+            mask = ~mask;
+        if (mask)
+            return begin + __builtin_ctz(mask);
+        begin += 32;
+    }
+    // Finish with at most one 16 byte step before going scalar.
+    return TAIL(begin, end);
+}
+
+static const ScanKernels AVX2_KERNELS = {
+    scan_avx2<match_whitespace_avx2, false, scan_sse2<match_whitespace_sse2, false, skip_whitespace_scalar>>,
+    scan_avx2<match_identifier_avx2, false, scan_sse2<match_identifier_sse2, false, skip_identifier_scalar>>,
+    scan_avx2<match_number_avx2, false, scan_sse2<match_number_sse2, false, skip_number_scalar>>,
+    scan_avx2<match_line_end_avx2, true, scan_sse2<match_line_end_sse2, true, find_line_end_scalar>>,
+};
+
+#endif
+
+bool is_supported(InstructionSet isa)
+{
+    switch (isa)
+    {
+    case InstructionSet::SCALAR:
+        return true;
+#ifdef KCCANI_SCAN_X86
+    case InstructionSet::SSE2:
+        return __builtin_cpu_supports("sse2");
+    case InstructionSet::AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const ScanKernels& kernels_for(InstructionSet isa)
+{
+    switch (isa)
+    {
+#ifdef KCCANI_SCAN_X86
+    case InstructionSet::SSE2:
+        return SSE2_KERNELS;
+    case InstructionSet::AVX2:
+        return AVX2_KERNELS;
+#endif
+    default:
+        return SCALAR_KERNELS;
+    }
+}
+
+static InstructionSet detect_instruction_set()
+{
+#ifdef KCCANI_SCAN_X86
+    // Runs from a static initializer, possibly before libgcc's own.
+    __builtin_cpu_init();
+#endif
+    for (auto isa : {InstructionSet::AVX2, InstructionSet::SSE2})
+        if (is_supported(isa))
+            return isa;
+    return InstructionSet::SCALAR;
+}
+
+static InstructionSet selected_isa = detect_instruction_set();
+
+const ScanKernels& active_kernels()
+{
+    return kernels_for(selected_isa);
+}
+
+InstructionSet active_instruction_set()
+{
+    return selected_isa;
+}
+
+bool use_instruction_set(InstructionSet isa)
+{
+    if (!is_supported(isa))
+        return false;
+    selected_isa = isa;
+    return true;
+}
+
+}
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace kccani
+{
+
+namespace scan
+{
+
+// Byte classes recognised by the lexer. Unlike <cctype> these ignore the
+// current locale and are defined for every byte value.
+enum CharClass : std::uint8_t
+{
+    CHAR_WHITESPACE = 1 << 0,
+    CHAR_ALPHA = 1 << 1,
+    CHAR_DIGIT = 1 << 2,
+    CHAR_DOT = 1 << 3,
+    CHAR_LINE_END = 1 << 4,
+};
+
+extern const std::array<std::uint8_t, 256> CHAR_CLASS_TABLE;
+
+inline bool has_class(char c, std::uint8_t char_class)
+{
+    return (CHAR_CLASS_TABLE[static_cast<unsigned char>(c)] & char_class) != 0;
+}
+
+// Each kernel scans [begin, end) and returns the first position where the
+// run it is looking for stops, or `end` if it runs to the end of the buffer.
+struct ScanKernels
+{
+    // Skips ' ', '\t', '\n' and '\r'.
+    const char* (*skip_whitespace)(const char* begin, const char* end);
+    // Skips [A-Za-z0-9].
+    const char* (*skip_identifier)(const char* begin, const char* end);
+    // Skips [0-9.].
+    const char* (*skip_number)(const char* begin, const char* end);
+    // Finds the first '\n' or '\r'.
+    const char* (*find_line_end)(const char* begin, const char* end);
+};
+
+enum class InstructionSet
+{
+    SCALAR,
+    SSE2,
+    AVX2,
+};
+
+// Whether the kernels for `isa` were compiled in and the host CPU runs them.
+bool is_supported(InstructionSet isa);
+const ScanKernels& kernels_for(InstructionSet isa);
+
+// The kernels used by the lexer, picked from the best supported instruction
+// set on first use. `use_instruction_set` overrides the choice and returns
+// false (leaving it unchanged) if `isa` is not supported.
+const ScanKernels& active_kernels();
+InstructionSet active_instruction_set();
+bool use_instruction_set(InstructionSet isa);
+
+}
+
+}
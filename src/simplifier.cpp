@@ -0,0 +1,401 @@
+#include "simplifier.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <string_view>
+
+namespace kccani
+{
+
+namespace
+{
+
+// C math functions without side effects, which an `extern` may declare.
+constexpr std::string_view PURE_HOST_FUNCTIONS[] = {
+    "acos", "asin", "atan", "atan2", "cbrt", "ceil", "cos", "cosh", "exp", "exp2", "fabs", "floor", "fmax",
+    "fmin", "fmod", "hypot", "log", "log10", "log2", "pow", "round", "sin", "sinh", "sqrt", "tan", "tanh", "trunc",
+};
+
+std::size_t hash_combine(std::size_t seed, std::size_t value)
+{
+    return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+std::uint64_t bits_of(double value)
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+bool is_builtin(char opcode)
+{
+    return opcode == '+' || opcode == '-' || opcode == '*' || opcode == '<';
+}
+
+// As the code CodeGeneratorLLVM generates computes it.
+double fold(char opcode, double lhs, double rhs)
+{
+    switch (opcode)
+    {
+    case '+':
+        return lhs + rhs;
+    case '-':
+        return lhs - rhs;
+    case '*':
+        return lhs * rhs;
+    default:
+        return !(lhs >= rhs) ? 1.0 : 0.0;
+    }
+}
+
+Symbol operator_function(Symbol keyword, char opcode)
+{
+    return Symbol::intern(std::string(keyword.name()) + opcode);
+}
+
+}
+
+AstSimplifier::AstSimplifier(std::shared_ptr<AstArena> arena, bool _fast_math)
+    : builder(std::move(arena), true), fast_math(_fast_math)
+{
+}
+
+bool AstSimplifier::is_pure_function(Symbol name) const
+{
+    return name.id < this->function_purity.size() && this->function_purity[name.id] == Purity::PURE;
+}
+
+void AstSimplifier::set_purity(Symbol name, Purity purity)
+{
+    if (name.id >= this->function_purity.size())
+        this->function_purity.resize(std::max<std::size_t>(name.id + 1, SymbolTable::global().size()), Purity::UNKNOWN);
+    this->function_purity[name.id] = purity;
+}
+
+ExprAST* AstSimplifier::record(ExprAST* node, NodeInfo info)
+{
+    this->infos[node] = info;
+    return node;
+}
+
+ExprAST* AstSimplifier::make_number(double value)
+{
+    return this->record(this->builder.number(value), {hash_combine(0, bits_of(value)), true});
+}
+
+ExprAST* AstSimplifier::make_variable(Symbol name)
+{
+    return this->record(this->builder.variable(name), {hash_combine(1, std::hash<std::string_view>()(name.name())), true});
+}
+
+// The builder allocates nodes with side effects anew every time, so that no
+// two uses become one.
+ExprAST* AstSimplifier::make_binary(char opcode, ExprAST* lhs, ExprAST* rhs)
+{
+    bool pure = this->info(lhs).pure && this->info(rhs).pure
+        && (is_builtin(opcode) || this->is_pure_function(operator_function(symbols::BINARY, opcode)));
+    std::size_t hash = hash_combine(2, static_cast<unsigned char>(opcode));
+    hash = hash_combine(hash, this->info(lhs).hash);
+    hash = hash_combine(hash, this->info(rhs).hash);
+    return this->record(this->builder.binary(opcode, lhs, rhs, pure), {hash, pure});
+}
+
+// The arguments are `results[args_begin, end)`.
+ExprAST* AstSimplifier::make_call(Symbol callee, std::size_t args_begin)
+{
+    bool pure = this->is_pure_function(callee);
+    std::size_t hash = hash_combine(3, std::hash<std::string_view>()(callee.name()));
+    for (std::size_t i = args_begin; i < this->results.size(); i++)
+    {
+        pure = pure && this->info(this->results[i]).pure;
+        hash = hash_combine(hash, this->info(this->results[i]).hash);
+    }
+    return this->record(this->builder.call(callee, this->results, args_begin, pure), {hash, pure});
+}
+
+ExprAST* AstSimplifier::make_unary(char opcode, ExprAST* operand)
+{
+    bool pure = this->info(operand).pure && this->is_pure_function(operator_function(symbols::UNARY, opcode));
+    std::size_t hash = hash_combine(4, static_cast<unsigned char>(opcode));
+    hash = hash_combine(hash, this->info(operand).hash);
+    return this->record(this->builder.unary(opcode, operand, pure), {hash, pure});
+}
+
+// The canonical order of commutative operands: constants last, the rest by
+// structural hash. Two operands with side effects keep their order.
+bool AstSimplifier::goes_before(const ExprAST* lhs, const ExprAST* rhs) const
+{
+    const bool lhs_constant = lhs->get_type() == ExprAST::ExpressionType::NUMBER_EXPR;
+    const bool rhs_constant = rhs->get_type() == ExprAST::ExpressionType::NUMBER_EXPR;
+    if (lhs_constant != rhs_constant)
+        return rhs_constant;
+    const NodeInfo& lhs_info = this->info(lhs);
+    const NodeInfo& rhs_info = this->info(rhs);
+    if (!lhs_info.pure && !rhs_info.pure)
+        return false;
+    return lhs_info.hash < rhs_info.hash;
+}
+
+ExprAST* AstSimplifier::simplify_binary(char opcode, ExprAST* lhs, ExprAST* rhs)
+{
+    if (!is_builtin(opcode))
+        return this->make_binary(opcode, lhs, rhs);
+    auto lhs_number = dyn_cast<NumberExprAST>(lhs);
+    auto rhs_number = dyn_cast<NumberExprAST>(rhs);
+    if (lhs_number && rhs_number)
+        return this->make_number(fold(opcode, lhs_number->value, rhs_number->value));
+    if ((opcode == '+' || opcode == '*') && this->goes_before(rhs, lhs))
+    {
+        std::swap(lhs, rhs);
+        std::swap(lhs_number, rhs_number);
+    }
+    if (rhs_number)
+    {
+        const double value = rhs_number->value;
+        if ((opcode == '*' && value == 1.0)
+            || (opcode == '-' && bits_of(value) == bits_of(0.0))
+            || (opcode == '+' && bits_of(value) == bits_of(-0.0)))
+            return lhs;
+        if (this->fast_math && (opcode == '+' || opcode == '-') && value == 0.0)
+            return lhs;
+        if (this->fast_math && opcode == '*' && value == 0.0 && this->info(lhs).pure)
+            return this->make_number(0.0);
+    }
+    // Equal pure operands are the same node.
+    if (this->fast_math && lhs == rhs && this->info(lhs).pure && (opcode == '-' || opcode == '<'))
+        return this->make_number(0.0);
+    return this->make_binary(opcode, lhs, rhs);
+}
+
+// The operands of the chain are `results[results_begin, end)`, already
+// simplified. Those that are chains of the same operator themselves, as
+// simplification can make them, are flattened into this one.
+ExprAST* AstSimplifier::simplify_chain(char opcode, std::size_t results_begin)
+{
+    const double identity = opcode == '+' ? 0.0 : 1.0;
+    double constant = identity;
+    std::vector<ExprAST*>& operands = this->chain_operands;
+    operands.clear();
+    std::vector<std::pair<ExprAST*, bool>> pending;
+    for (std::size_t i = this->results.size(); i-- > results_begin;)
+        pending.emplace_back(this->results[i], false);
+    while (!pending.empty())
+    {
+        auto [node, negated] = pending.back();
+        pending.pop_back();
+        if (auto number = dyn_cast<NumberExprAST>(node))
+        {
+            constant = fold(opcode, constant, negated ? -number->value : number->value);
+            continue;
+        }
+        auto binary = dyn_cast<BinaryExprAST>(node);
+        if (binary && (binary->opcode == opcode
+            || (opcode == '+' && binary->opcode == '-' && dyn_cast<NumberExprAST>(binary->rhs))))
+        {
+            pending.emplace_back(binary->rhs, binary->opcode == '-');
+            pending.emplace_back(binary->lhs, false);
+            continue;
+        }
+        operands.push_back(node);
+    }
+
+    const bool pure = std::all_of(operands.begin(), operands.end(), [this](ExprAST* node) {
+        return this->info(node).pure;
+    });
+    if (opcode == '*' && constant == 0.0 && pure)
+        return this->make_number(0.0);
+    const auto impure = std::count_if(operands.begin(), operands.end(), [this](ExprAST* node) {
+        return !this->info(node).pure;
+    });
+    if (impure <= 1)
+        std::stable_sort(operands.begin(), operands.end(), [this](ExprAST* lhs, ExprAST* rhs) {
+            return this->info(lhs).hash < this->info(rhs).hash;
+        });
+    if (operands.empty())
+        return this->make_number(constant);
+    ExprAST* value = operands[0];
+    for (std::size_t i = 1; i < operands.size(); i++)
+        value = this->make_binary(opcode, value, operands[i]);
+    if (constant == identity)
+        return value;
+    if (opcode == '+' && constant < 0)
+        return this->make_binary('-', value, this->make_number(-constant));
+    return this->make_binary(opcode, value, this->make_number(constant));
+}
+
+// The operator of the chain `node` roots with fast math: `+` for sums,
+// subtractions of a number included, `*` for products, 0 for none.
+char AstSimplifier::chain_of(const BinaryExprAST* node) const
+{
+    if (!this->fast_math)
+        return 0;
+    if (node->opcode == '+' || node->opcode == '*')
+        return node->opcode;
+    if (node->opcode == '-' && dyn_cast<NumberExprAST>(node->rhs))
+        return '+';
+    return 0;
+}
+
+// Appends the operands of the chain to `chain_terms`, left to right.
+void AstSimplifier::collect_chain_terms(const BinaryExprAST* root, char opcode)
+{
+    std::vector<ChainTerm> pending{{root}};
+    while (!pending.empty())
+    {
+        ChainTerm term = pending.back();
+        pending.pop_back();
+        auto binary = dyn_cast<BinaryExprAST>(term.node);
+        if (!term.negated && binary && this->chain_of(binary) == opcode)
+        {
+            pending.push_back({binary->rhs, binary->opcode == '-'});
+            pending.push_back({binary->lhs});
+            continue;
+        }
+        this->chain_terms.push_back(term);
+    }
+}
+
+// Post-order with an explicit stack, like CodeGeneratorLLVM::generate_expression().
+// A chain is visited as one node with all of its operands as children.
+ExprAST* AstSimplifier::simplify(const ExprAST* root)
+{
+    std::vector<PendingNode>& pending = this->pending_nodes;
+    std::vector<ExprAST*>& values = this->results;
+    pending.clear();
+    values.clear();
+    this->chain_terms.clear();
+    pending.push_back({root});
+    while (!pending.empty())
+    {
+        PendingNode& top = pending.back();
+        const ExprAST* node = top.node;
+        switch (node->get_type())
+        {
+        case ExprAST::ExpressionType::NUMBER_EXPR:
+            values.push_back(this->make_number(static_cast<const NumberExprAST*>(node)->value));
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::VARIABLE_EXPR:
+            values.push_back(this->make_variable(static_cast<const VariableExprAST*>(node)->name));
+            pending.pop_back();
+            break;
+        case ExprAST::ExpressionType::BINARY_EXPR:
+        {
+            auto binary = static_cast<const BinaryExprAST*>(node);
+            if (top.next_child == 0 && !top.chain && (top.chain = this->chain_of(binary)))
+            {
+                top.terms_begin = this->chain_terms.size();
+                this->collect_chain_terms(binary, top.chain);
+                top.terms_end = this->chain_terms.size();
+                top.results_begin = values.size();
+            }
+            if (top.chain)
+            {
+                std::size_t term = top.terms_begin + top.next_child;
+                if (term < top.terms_end)
+                {
+                    top.next_child++;
+                    ChainTerm chain_term = this->chain_terms[term];
+                    if (chain_term.negated)
+                        values.push_back(this->make_number(-static_cast<const NumberExprAST*>(chain_term.node)->value));
+                    else
+                        pending.push_back({chain_term.node});
+                    break;
+                }
+                ExprAST* value = this->simplify_chain(top.chain, top.results_begin);
+                values.resize(top.results_begin);
+                values.push_back(value);
+                this->chain_terms.resize(top.terms_begin);
+                pending.pop_back();
+                break;
+            }
+            if (top.next_child < 2)
+            {
+                const ExprAST* child = top.next_child == 0 ? binary->lhs : binary->rhs;
+                top.next_child++;
+                pending.push_back({child});
+                break;
+            }
+            ExprAST* rhs = values.back();
+            values.pop_back();
+            values.back() = this->simplify_binary(binary->opcode, values.back(), rhs);
+            pending.pop_back();
+            break;
+        }
+        case ExprAST::ExpressionType::UNARY_EXPR:
+        {
+            auto unary = static_cast<const UnaryExprAST*>(node);
+            if (top.next_child == 0)
+            {
+                top.next_child++;
+                pending.push_back({unary->operand});
+                break;
+            }
+            values.back() = this->make_unary(unary->opcode, values.back());
+            pending.pop_back();
+            break;
+        }
+        case ExprAST::ExpressionType::FUNCTION_CALL_EXPR:
+        {
+            auto call = static_cast<const FunctionCallExprAST*>(node);
+            if (top.next_child < call->args.size())
+            {
+                const ExprAST* arg = call->args[top.next_child];
+                top.next_child++;
+                pending.push_back({arg});
+                break;
+            }
+            std::size_t args_begin = values.size() - call->args.size();
+            ExprAST* value = this->make_call(call->callee, args_begin);
+            values.resize(args_begin);
+            values.push_back(value);
+            pending.pop_back();
+            break;
+        }
+        }
+    }
+    return values.back();
+}
+
+ParsedAstContentType AstSimplifier::simplify(const ParsedAstContentType& item)
+{
+    return std::visit(*this, item);
+}
+
+void AstSimplifier::simplify(std::vector<ParsedAstContentType>& items)
+{
+    for (ParsedAstContentType& item : items)
+        item = this->simplify(item);
+}
+
+ParsedAstContentType AstSimplifier::operator()(FunctionAST* ast)
+{
+    ExprAST* body = this->simplify(ast->body);
+    this->set_purity(ast->prototype->name, this->info(body).pure ? Purity::PURE : Purity::IMPURE);
+    return this->builder.function(ast->prototype, body);
+}
+
+// A function already known keeps what is known of it.
+ParsedAstContentType AstSimplifier::operator()(FunctionPrototypeAST* ast)
+{
+    if (ast->name.id < this->function_purity.size() && this->function_purity[ast->name.id] != Purity::UNKNOWN)
+        return ast;
+    const bool pure = std::find(std::begin(PURE_HOST_FUNCTIONS), std::end(PURE_HOST_FUNCTIONS), ast->name.name())
+        != std::end(PURE_HOST_FUNCTIONS);
+    this->set_purity(ast->name, pure ? Purity::PURE : Purity::IMPURE);
+    return ast;
+}
+
+ParsedAstContentType AstSimplifier::operator()(ExprAST* ast)
+{
+    return this->simplify(ast);
+}
+
+ParsedAstContentType AstSimplifier::operator()(std::monostate ast)
+{
+    return ast;
+}
+
+}
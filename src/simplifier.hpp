@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "arena.hpp"
+#include "ast.hpp"
+#include "symbol.hpp"
+
+namespace kccani
+{
+
+// Rewrites pointer trees into smaller equivalent ones before code
+// generation, so that less IR reaches LLVM.
+//
+// Always, as none of these changes a result under IEEE arithmetic: constant
+// operands of the builtin operators are folded, `x * 1`, `x - 0` and
+// `x + -0` become `x`, and the operands of `+` and `*` are put in a
+// canonical order, constants last. The tree is rebuilt with a hash-consing
+// AstBuilder, so that equal subexpressions, canonical order making more of
+// them equal, become one shared node, which CodeGeneratorLLVM generates once
+// per function.
+//
+// With `fast_math`, as if no value were NaN, infinite or a signed zero and
+// floating point arithmetic were associative: chains of `+` and of `*` are
+// flattened, their constants folded into one and their operands sorted,
+// `x + 0` and `x - x` become what they would be for reals, and so does
+// `x * 0` when `x` has no side effect.
+//
+// Calls are only shared, and `x - x` only folded, when the callee is known
+// to have no side effect: an `extern` of a pure C math function, or a
+// function defined earlier whose body calls only such functions. Operands
+// with side effects are never reordered among themselves.
+class AstSimplifier
+{
+    struct NodeInfo
+    {
+        // Structural, so that the canonical order does not depend on where
+        // nodes are allocated.
+        std::size_t hash;
+        bool pure;
+    };
+    // An operand of a `+` or `*` chain, the negation of a number for a
+    // subtracted one.
+    struct ChainTerm
+    {
+        const ExprAST* node;
+        bool negated = false;
+    };
+    // An original node in the middle of the walk: `next_child` of its
+    // operands or chain terms visited, its chain terms being
+    // `chain_terms[terms_begin, terms_end)`.
+    struct PendingNode
+    {
+        const ExprAST* node;
+        std::uint32_t next_child = 0;
+        char chain = 0;
+        std::size_t terms_begin = 0;
+        std::size_t terms_end = 0;
+        std::size_t results_begin = 0;
+    };
+    enum class Purity : std::uint8_t
+    {
+        UNKNOWN,
+        PURE,
+        IMPURE,
+    };
+
+    AstBuilder builder;
+    bool fast_math;
+    std::unordered_map<const ExprAST*, NodeInfo> infos;
+    // By Symbol::id.
+    std::vector<Purity> function_purity;
+    std::vector<PendingNode> pending_nodes;
+    std::vector<ExprAST*> results;
+    std::vector<ChainTerm> chain_terms;
+    std::vector<ExprAST*> chain_operands;
+
+    bool is_pure_function(Symbol name) const;
+    void set_purity(Symbol name, Purity purity);
+    const NodeInfo& info(const ExprAST* node) const { return this->infos.at(node); }
+    ExprAST* record(ExprAST* node, NodeInfo info);
+
+    ExprAST* make_number(double value);
+    ExprAST* make_variable(Symbol name);
+    ExprAST* make_binary(char opcode, ExprAST* lhs, ExprAST* rhs);
+    ExprAST* make_call(Symbol callee, std::size_t args_begin);
+    ExprAST* make_unary(char opcode, ExprAST* operand);
+    bool goes_before(const ExprAST* lhs, const ExprAST* rhs) const;
+    ExprAST* simplify_binary(char opcode, ExprAST* lhs, ExprAST* rhs);
+    ExprAST* simplify_chain(char opcode, std::size_t results_begin);
+    char chain_of(const BinaryExprAST* node) const;
+    void collect_chain_terms(const BinaryExprAST* root, char opcode);
+
+public:
+    // Nodes are allocated in `arena`, that of the trees to simplify, whose
+    // unchanged parts such as prototypes the results point to.
+    explicit AstSimplifier(std::shared_ptr<AstArena> arena, bool _fast_math = false);
+
+    // Items must be simplified in source order, for calls to know their
+    // callees.
+    ExprAST* simplify(const ExprAST* expression);
+    ParsedAstContentType simplify(const ParsedAstContentType& item);
+    void simplify(std::vector<ParsedAstContentType>& items);
+
+    ParsedAstContentType operator()(FunctionAST* ast);
+    ParsedAstContentType operator()(FunctionPrototypeAST* ast);
+    ParsedAstContentType operator()(ExprAST* ast);
+    ParsedAstContentType operator()(std::monostate ast);
+};
+
+}
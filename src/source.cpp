@@ -0,0 +1,113 @@
+#include "source.hpp"
+
+#include <cerrno>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kccani
+{
+
+SourceBuffer SourceBuffer::from_file(const std::string& file_name)
+{
+    if (file_name == "-")
+        return SourceBuffer::from_fd(STDIN_FILENO);
+
+    int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Could not open " + file_name);
+
+    struct stat file_stat;
+    if (::fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+    {
+        void* mapping = ::mmap(
+            nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            ::close(fd);
+            ::madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+            SourceBuffer buffer;
+            buffer.data_begin = static_cast<const char*>(mapping);
+            buffer.data_size = file_stat.st_size;
+            buffer.mapped = true;
+            return buffer;
+        }
+    }
+
+    // Not mappable (empty file, FIFO, procfs entry, ...), fall back to reads.
+    try
+    {
+        SourceBuffer buffer = SourceBuffer::from_fd(fd);
+        ::close(fd);
+        return buffer;
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+}
+
+SourceBuffer SourceBuffer::from_fd(int fd)
+{
+    std::string text;
+    std::size_t filled = 0;
+    while (true)
+    {
+        text.resize(filled + READ_BLOCK_SIZE);
+        ssize_t count = ::read(fd, text.data() + filled, READ_BLOCK_SIZE);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category(), "Could not read source");
+        }
+        if (count == 0)
+            break;
+        filled += count;
+    }
+    text.resize(filled);
+    return SourceBuffer::from_string(std::move(text));
+}
+
+SourceBuffer SourceBuffer::from_string(std::string text)
+{
+    SourceBuffer buffer;
+    buffer.owned_data = std::move(text);
+    buffer.data_begin = buffer.owned_data.data();
+    buffer.data_size = buffer.owned_data.size();
+    return buffer;
+}
+
+SourceBuffer::SourceBuffer(SourceBuffer&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+SourceBuffer& SourceBuffer::operator=(SourceBuffer&& other) noexcept
+{
+    if (this == &other)
+        return *this;
+    if (this->mapped)
+        ::munmap(const_cast<char*>(this->data_begin), this->data_size);
+
+    this->mapped = std::exchange(other.mapped, false);
+    this->data_size = std::exchange(other.data_size, 0);
+    this->owned_data = std::move(other.owned_data);
+    // Short strings live inline, so the pointer has to be re-derived after a move.
+    this->data_begin = this->mapped ? other.data_begin : this->owned_data.data();
+    other.data_begin = nullptr;
+    return *this;
+}
+
+SourceBuffer::~SourceBuffer()
+{
+    if (this->mapped)
+        ::munmap(const_cast<char*>(this->data_begin), this->data_size);
+}
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace kccani
+{
+
+// An immutable, contiguous view of a whole source file. Regular files are
+// memory-mapped, anything else (stdin, pipes, sockets) is drained in large
+// blocks into an owned buffer. Token data handed out by a Lexer reading from
+// a SourceBuffer points into it, so it must outlive those tokens.
+class SourceBuffer
+{
+    const char* data_begin = nullptr;
+    std::size_t data_size = 0;
+    bool mapped = false;
+    std::string owned_data;
+
+    SourceBuffer() = default;
+
+public:
+    static constexpr std::size_t READ_BLOCK_SIZE = 1 << 20;
+
+    // Maps `file_name`, or reads it blockwise if it cannot be mapped.
+    // The name "-" refers to standard input.
+    static SourceBuffer from_file(const std::string& file_name);
+    static SourceBuffer from_fd(int fd);
+    static SourceBuffer from_string(std::string text);
+
+    SourceBuffer(SourceBuffer&& other) noexcept;
+    SourceBuffer& operator=(SourceBuffer&& other) noexcept;
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+    ~SourceBuffer();
+
+    [[nodiscard]] const char* begin() const noexcept { return this->data_begin; }
+    [[nodiscard]] const char* end() const noexcept { return this->data_begin + this->data_size; }
+    [[nodiscard]] std::size_t size() const noexcept { return this->data_size; }
+    [[nodiscard]] bool is_mapped() const noexcept { return this->mapped; }
+    [[nodiscard]] std::string_view view() const noexcept { return {this->data_begin, this->data_size}; }
+};
+
+}
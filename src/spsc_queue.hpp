@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace kccani
+{
+
+// Bounded lock-free queue between exactly one producer and one consumer
+// thread, a ring buffer whose two indices are each written by one side only.
+//
+// Either side may close() the queue: once closed, push() fails, and pop()
+// fails as soon as the queue is empty. A producer closes it to mark the end
+// of the stream, a consumer to tell the producer to stop.
+template <typename T>
+class SpscQueue
+{
+    static constexpr std::size_t CACHE_LINE = 64;
+
+    std::vector<T> slots;
+    std::size_t mask;
+
+    // Next slot to pop, written by the consumer.
+    alignas(CACHE_LINE) std::atomic<std::size_t> head{0};
+    // Next slot to push, written by the producer.
+    alignas(CACHE_LINE) std::atomic<std::size_t> tail{0};
+    alignas(CACHE_LINE) std::atomic<bool> closed{false};
+    // Each side's last seen value of the other side's index, so that while
+    // the queue is neither full nor empty they do not share a cache line.
+    alignas(CACHE_LINE) std::size_t producer_head = 0;
+    alignas(CACHE_LINE) std::size_t consumer_tail = 0;
+
+    static std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        return size;
+    }
+
+    // Spins briefly, then yields: a blocked side usually waits on a thread
+    // that is running, possibly on the same core.
+    static void back_off(unsigned& attempts)
+    {
+        if (++attempts > 64)
+            std::this_thread::yield();
+    }
+
+public:
+    // Rounded up to a power of two.
+    explicit SpscQueue(std::size_t capacity) : slots(round_up(capacity)), mask(round_up(capacity) - 1) {}
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    [[nodiscard]] std::size_t capacity() const noexcept { return this->slots.size(); }
+
+    // Producer side. Moves from `value` only if there is room.
+    bool try_push(T&& value)
+    {
+        std::size_t position = this->tail.load(std::memory_order_relaxed);
+        if (position - this->producer_head == this->slots.size())
+        {
+            this->producer_head = this->head.load(std::memory_order_acquire);
+            if (position - this->producer_head == this->slots.size())
+                return false;
+        }
+        this->slots[position & this->mask] = std::move(value);
+        this->tail.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    bool try_pop(T& value)
+    {
+        std::size_t position = this->head.load(std::memory_order_relaxed);
+        if (position == this->consumer_tail)
+        {
+            this->consumer_tail = this->tail.load(std::memory_order_acquire);
+            if (position == this->consumer_tail)
+                return false;
+        }
+        value = std::move(this->slots[position & this->mask]);
+        this->head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Waits while the queue is full. False, leaving `value` alone, if it is
+    // closed.
+    bool push(T&& value)
+    {
+        unsigned attempts = 0;
+        while (!this->closed.load(std::memory_order_acquire))
+        {
+            if (this->try_push(std::move(value)))
+                return true;
+            back_off(attempts);
+        }
+        return false;
+    }
+
+    // Waits while the queue is empty. False once it is closed and drained.
+    bool pop(T& value)
+    {
+        unsigned attempts = 0;
+        while (!this->try_pop(value))
+        {
+            if (this->closed.load(std::memory_order_acquire))
+                // Whatever was pushed before closing is visible now.
+                return this->try_pop(value);
+            back_off(attempts);
+        }
+        return true;
+    }
+
+    void close() noexcept { this->closed.store(true, std::memory_order_release); }
+    [[nodiscard]] bool is_closed() const noexcept { return this->closed.load(std::memory_order_acquire); }
+};
+
+}
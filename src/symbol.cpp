@@ -0,0 +1,78 @@
+#include "symbol.hpp"
+
+#include <cassert>
+#include <mutex>
+
+namespace kccani
+{
+
+Symbol Symbol::intern(std::string_view name)
+{
+    return SymbolTable::global().intern(name);
+}
+
+std::string_view Symbol::name() const
+{
+    return SymbolTable::global().name(*this);
+}
+
+std::string Symbol::str() const
+{
+    return std::string(this->name());
+}
+
+SymbolTable::SymbolTable()
+{
+    [[maybe_unused]] Symbol def = this->intern("def");
+    [[maybe_unused]] Symbol extern_ = this->intern("extern");
+    [[maybe_unused]] Symbol anon_expr = this->intern("__anon_expr");
+    [[maybe_unused]] Symbol binary = this->intern("binary");
+    [[maybe_unused]] Symbol unary = this->intern("unary");
+    assert(def == symbols::DEF);
+    assert(extern_ == symbols::EXTERN);
+    assert(anon_expr == symbols::ANON_EXPR);
+    assert(binary == symbols::BINARY);
+    assert(unary == symbols::UNARY);
+}
+
+SymbolTable& SymbolTable::global()
+{
+    static SymbolTable table;
+    return table;
+}
+
+Symbol SymbolTable::intern(std::string_view name)
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(this->mutex);
+        auto existing = this->ids.find(name);
+        if (existing != this->ids.end())
+            return Symbol(existing->second);
+    }
+
+    std::unique_lock<std::shared_mutex> lock(this->mutex);
+    // Another thread may have added it in between.
+    auto existing = this->ids.find(name);
+    if (existing != this->ids.end())
+        return Symbol(existing->second);
+
+    auto id = static_cast<std::uint32_t>(this->names.size());
+    std::string_view stored_name = this->names.emplace_back(name);
+    this->ids.emplace(stored_name, id);
+    return Symbol(id);
+}
+
+std::string_view SymbolTable::name(Symbol symbol) const
+{
+    std::shared_lock<std::shared_mutex> lock(this->mutex);
+    assert(symbol.id < this->names.size());
+    return this->names[symbol.id];
+}
+
+std::size_t SymbolTable::size() const
+{
+    std::shared_lock<std::shared_mutex> lock(this->mutex);
+    return this->names.size();
+}
+
+}
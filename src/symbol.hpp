@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace kccani
+{
+
+// An interned identifier. Symbols are dense small integers handed out by the
+// global SymbolTable, so they compare in one instruction and can index flat
+// arrays in place of name-keyed maps.
+class Symbol
+{
+public:
+    std::uint32_t id;
+
+    constexpr explicit Symbol(std::uint32_t _id) : id(_id) {}
+
+    static Symbol intern(std::string_view name);
+    std::string_view name() const;
+    std::string str() const;
+
+    constexpr bool operator ==(Symbol other) const noexcept { return this->id == other.id; }
+    constexpr bool operator !=(Symbol other) const noexcept { return this->id != other.id; }
+};
+
+// Symbols interned by the table before anything else, in this order.
+namespace symbols
+{
+constexpr Symbol DEF{0};
+constexpr Symbol EXTERN{1};
+constexpr Symbol ANON_EXPR{2};
+// Prototype names that define an operator, see BasicParser::parse_function_proto().
+constexpr Symbol BINARY{3};
+constexpr Symbol UNARY{4};
+}
+
+class SymbolTable
+{
+    // Lookups of names already interned, the common case once a program's
+    // identifiers have been seen, only need a shared lock.
+    mutable std::shared_mutex mutex;
+    // A deque never moves its elements, so the views used as keys stay valid.
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, std::uint32_t> ids;
+
+    SymbolTable();
+
+public:
+    static SymbolTable& global();
+
+    Symbol intern(std::string_view name);
+    std::string_view name(Symbol symbol) const;
+    // One past the largest symbol id handed out so far.
+    std::size_t size() const;
+};
+
+// The entry of `symbol` in a table indexed by Symbol::id, growing the table
+// to every symbol interned so far if it is too short for it.
+template <typename T>
+T& symbol_slot(std::vector<T>& table, Symbol symbol)
+{
+    if (symbol.id >= table.size())
+        table.resize(std::max<std::size_t>(symbol.id + 1, SymbolTable::global().size()), T{});
+    return table[symbol.id];
+}
+
+}
+
+template <>
+struct std::hash<kccani::Symbol>
+{
+    std::size_t operator()(kccani::Symbol symbol) const noexcept
+    {
+        return std::hash<std::uint32_t>()(symbol.id);
+    }
+};
@@ -0,0 +1,232 @@
+#include "vm.hpp"
+
+#include <algorithm>
+
+#include <llvm/Support/DynamicLibrary.h>
+
+#include "error.hpp"
+
+#if defined(__GNUC__)
+#define KCCANI_VM_COMPUTED_GOTO 1
+#endif
+
+namespace kccani
+{
+
+enum LinkState : std::uint8_t
+{
+    UNLINKED,
+    LINKED_DECLARATION,
+    LINKED_DEFINITION,
+};
+
+VirtualMachine::VirtualMachine(BytecodeProgram& _program) : program(_program)
+{
+    // Makes the symbols of the process, the C library's among them,
+    // available to SearchForAddressOfSymbol().
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    this->registers.resize(1 << 12);
+    this->frames.reserve(1 << 8);
+}
+
+// A depth-first walk over the callees. States are only kept once the whole
+// walk succeeded, so that a function left unlinked is walked again later.
+void VirtualMachine::link(std::uint32_t entry)
+{
+    std::vector<BytecodeFunction>& functions = this->program.functions;
+    this->link_states.resize(functions.size(), UNLINKED);
+    std::vector<std::uint32_t> linked;
+    std::vector<std::uint32_t> pending{entry};
+    try
+    {
+        while (!pending.empty())
+        {
+            std::uint32_t index = pending.back();
+            pending.pop_back();
+            BytecodeFunction& function = functions[index];
+            const LinkState state = function.is_defined() ? LINKED_DEFINITION : LINKED_DECLARATION;
+            if (this->link_states[index] == state)
+                continue;
+            this->link_states[index] = state;
+            linked.push_back(index);
+            if (function.is_defined())
+            {
+                pending.insert(pending.end(), function.callees.begin(), function.callees.end());
+                continue;
+            }
+            if (!function.host)
+                function.host = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(function.name);
+            if (!function.host)
+                throw VmException("Symbols not found: [ " + function.name + " ]");
+            if (function.arity > MAX_HOST_ARITY)
+                throw VmException("Cannot call " + function.name + " with more than "
+                    + std::to_string(MAX_HOST_ARITY) + " arguments");
+        }
+    }
+    catch (const VmException&)
+    {
+        for (std::uint32_t index : linked)
+            this->link_states[index] = UNLINKED;
+        throw;
+    }
+}
+
+double VirtualMachine::call_host(const BytecodeFunction& function, const double* arguments)
+{
+    const double* a = arguments;
+    switch (function.arity)
+    {
+    case 0:
+        return reinterpret_cast<double (*)()>(function.host)();
+    case 1:
+        return reinterpret_cast<double (*)(double)>(function.host)(a[0]);
+    case 2:
+        return reinterpret_cast<double (*)(double, double)>(function.host)(a[0], a[1]);
+    case 3:
+        return reinterpret_cast<double (*)(double, double, double)>(function.host)(a[0], a[1], a[2]);
+    case 4:
+        return reinterpret_cast<double (*)(double, double, double, double)>(function.host)(a[0], a[1], a[2], a[3]);
+    case 5:
+        return reinterpret_cast<double (*)(double, double, double, double, double)>(function.host)(
+            a[0], a[1], a[2], a[3], a[4]);
+    default:
+        return reinterpret_cast<double (*)(double, double, double, double, double, double)>(function.host)(
+            a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+}
+
+// `entry` must be linked. The state of the running function lives in
+// locals: `r` points at its first register and is renewed whenever the
+// register file grows.
+double VirtualMachine::execute(std::uint32_t entry, llvm::ArrayRef<double> arguments)
+{
+    const BytecodeFunction* functions = this->program.functions.data();
+    const BytecodeFunction& function = functions[entry];
+    if (!function.is_defined())
+        return call_host(function, arguments.data());
+    if (this->registers.size() < function.register_count)
+        this->registers.resize(function.register_count);
+    std::copy(arguments.begin(), arguments.end(), this->registers.begin());
+    this->frames.clear();
+
+    std::size_t base = 0;
+    double* r = this->registers.data();
+    const Instruction* pc = function.code.data();
+    const double* constants = function.constants.data();
+    Instruction instruction;
+
+#ifdef KCCANI_VM_COMPUTED_GOTO
+    // In the order of Opcode.
+    static void* const handlers[] = {
+        &&handle_LOAD_CONSTANT,
+        &&handle_MOVE,
+        &&handle_ADD,
+        &&handle_SUBTRACT,
+        &&handle_MULTIPLY,
+        &&handle_LESS_THAN,
+        &&handle_CALL,
+        &&handle_RETURN,
+    };
+#define VM_DISPATCH() \
+    do \
+    { \
+        instruction = *pc++; \
+        goto *handlers[static_cast<std::uint8_t>(instruction.opcode)]; \
+    } while (false)
+#define VM_CASE(opcode) handle_##opcode
+    VM_DISPATCH();
+#else
+#define VM_DISPATCH() goto dispatch
+#define VM_CASE(opcode) case Opcode::opcode
+dispatch:
+    instruction = *pc++;
+    switch (instruction.opcode)
+#endif
+    {
+    VM_CASE(LOAD_CONSTANT):
+        r[instruction.destination] = constants[instruction.index()];
+        VM_DISPATCH();
+    VM_CASE(MOVE):
+        r[instruction.destination] = r[instruction.left];
+        VM_DISPATCH();
+    VM_CASE(ADD):
+        r[instruction.destination] = r[instruction.left] + r[instruction.right];
+        VM_DISPATCH();
+    VM_CASE(SUBTRACT):
+        r[instruction.destination] = r[instruction.left] - r[instruction.right];
+        VM_DISPATCH();
+    VM_CASE(MULTIPLY):
+        r[instruction.destination] = r[instruction.left] * r[instruction.right];
+        VM_DISPATCH();
+    VM_CASE(LESS_THAN):
+        r[instruction.destination] = !(r[instruction.left] >= r[instruction.right]) ? 1.0 : 0.0;
+        VM_DISPATCH();
+    VM_CASE(CALL):
+    {
+        const BytecodeFunction& callee = functions[instruction.index()];
+        if (!callee.is_defined())
+        {
+            r[instruction.destination] = call_host(callee, r + instruction.destination);
+            VM_DISPATCH();
+        }
+        if (this->frames.size() >= MAX_CALL_DEPTH)
+            throw VmException("Calls nested too deep in " + callee.name);
+        this->frames.push_back({pc, constants, base});
+        base += instruction.destination;
+        if (base + callee.register_count > this->registers.size())
+            this->registers.resize(std::max(2 * this->registers.size(), base + callee.register_count));
+        r = this->registers.data() + base;
+        pc = callee.code.data();
+        constants = callee.constants.data();
+        VM_DISPATCH();
+    }
+    VM_CASE(RETURN):
+    {
+        double value = r[instruction.left];
+        if (this->frames.empty())
+            return value;
+        r[0] = value;
+        const Frame& frame = this->frames.back();
+        pc = frame.return_address;
+        constants = frame.constants;
+        base = frame.base;
+        this->frames.pop_back();
+        r = this->registers.data() + base;
+        VM_DISPATCH();
+    }
+    }
+#undef VM_DISPATCH
+#undef VM_CASE
+    __builtin_unreachable();
+}
+
+std::vector<double> VirtualMachine::run()
+{
+    std::vector<std::uint32_t> expressions = std::move(this->program.expressions);
+    this->program.expressions.clear();
+    for (std::uint32_t expression : expressions)
+        this->link(expression);
+    std::vector<double> values;
+    values.reserve(expressions.size());
+    for (std::uint32_t expression : expressions)
+        values.push_back(this->execute(expression, {}));
+    return values;
+}
+
+double VirtualMachine::call(const std::string& name, llvm::ArrayRef<double> arguments)
+{
+    std::uint32_t function = this->program.find(std::string_view(name));
+    if (function == BytecodeProgram::NO_FUNCTION)
+        throw VmException("No function named " + name);
+    return this->call(function, arguments);
+}
+
+double VirtualMachine::call(std::uint32_t function, llvm::ArrayRef<double> arguments)
+{
+    if (this->program.functions[function].arity != arguments.size())
+        throw VmException("Incorrect number of arguments passed to " + this->program.functions[function].name);
+    this->link(function);
+    return this->execute(function, arguments);
+}
+
+}
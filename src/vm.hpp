@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include "bytecode.hpp"
+
+namespace kccani
+{
+
+// Interprets the bytecode of a BytecodeProgram, the engine to use when a
+// program runs too briefly to pay for LLVM: compiling to bytecode is a
+// single pass over the AST, and nothing is compiled to native code.
+//
+// Dispatch is threaded, each instruction jumping straight to the next one's
+// handler through a table of label addresses, where the compiler supports
+// computed goto, and a switch in a loop elsewhere. Calls use no native
+// stack: a callee's registers start at the register its caller placed its
+// first argument in, so its arguments need no copying, and its result is
+// left in the same register.
+//
+// Functions that are only declared, the `extern`s, call the host function
+// of the same name, looked up in the process like JitEngine does. Every
+// function a run or call can reach is linked before it starts, so a missing
+// one throws VmException before anything is evaluated.
+class VirtualMachine
+{
+    struct Frame
+    {
+        const Instruction* return_address;
+        const double* constants;
+        std::size_t base;
+    };
+
+    BytecodeProgram& program;
+    std::vector<double> registers;
+    std::vector<Frame> frames;
+    // How each function was linked: not yet, as a declaration or as a
+    // definition, which an extern linked earlier may have become since.
+    std::vector<std::uint8_t> link_states;
+
+    void link(std::uint32_t entry);
+    static double call_host(const BytecodeFunction& function, const double* arguments);
+    double execute(std::uint32_t entry, llvm::ArrayRef<double> arguments);
+
+public:
+    // Calls nested deeper throw VmException, as unbounded recursion would.
+    static constexpr std::size_t MAX_CALL_DEPTH = 1 << 16;
+    // Host functions take at most this many arguments.
+    static constexpr std::uint32_t MAX_HOST_ARITY = 6;
+
+    // `_program` must outlive the machine, and may grow between runs.
+    explicit VirtualMachine(BytecodeProgram& _program);
+
+    // Evaluates the program's top level expressions compiled since the last
+    // run, in order, and forgets them. Throws VmException, before
+    // evaluating any of them, if they do not link.
+    std::vector<double> run();
+    // Calls a function of the program, an expression's included. Throws
+    // VmException if there is none of that name or arity.
+    double call(const std::string& name, llvm::ArrayRef<double> arguments = {});
+    double call(std::uint32_t function, llvm::ArrayRef<double> arguments = {});
+};
+
+}
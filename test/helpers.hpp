@@ -0,0 +1,71 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "../src/arena.hpp"
+#include "../src/ast.hpp"
+#include "../src/codegen.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+
+// Fixtures shared by the test files: parsing a program, printing, generating
+// and running it with the JIT.
+namespace kccani
+{
+
+// Parses `program` into `arena`, which the items must not outlive.
+inline std::vector<ParsedAstContentType> parse(const std::string& program, const std::shared_ptr<AstArena>& arena)
+{
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    Parser parser(lexer, arena);
+    return parser.fetch_all();
+}
+
+// The item as to_string() prints it, "<error>" for one that failed to parse.
+inline std::string item_to_string(const ParsedAstContentType& ast)
+{
+    if (auto function = std::get_if<FunctionAST*>(&ast))
+        return (*function)->to_string();
+    if (auto prototype = std::get_if<FunctionPrototypeAST*>(&ast))
+        return (*prototype)->to_string();
+    if (auto expression = std::get_if<ExprAST*>(&ast))
+        return (*expression)->to_string();
+    return "<error>";
+}
+
+inline void generate(CodeGeneratorLLVM& codegen, const std::vector<ParsedAstContentType>& items)
+{
+    for (const auto& ast : items)
+        std::visit(std::ref(codegen), ast);
+}
+
+inline void generate(CodeGeneratorLLVM& codegen, const std::string& program)
+{
+    auto arena = std::make_shared<AstArena>();
+    generate(codegen, parse(program, arena));
+}
+
+// Generates `items` into one module and evaluates its top level expressions
+// with a JitEngine.
+inline std::vector<double> run_program(const std::vector<ParsedAstContentType>& items)
+{
+    CodeGeneratorLLVM codegen;
+    generate(codegen, items);
+    JitEngine jit;
+    return jit.run(codegen.take_module());
+}
+
+inline std::vector<double> run_program(const std::string& program)
+{
+    auto arena = std::make_shared<AstArena>();
+    return run_program(parse(program, arena));
+}
+
+}
@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "../src/ast_cache.hpp"
+#include "../src/codegen.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+FlatAst parse_flat(const SourceBuffer& source)
+{
+    FlatAst ast;
+    Lexer lexer(source);
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(ast)).fetch_all();
+    return ast;
+}
+
+void write_file(const std::string& path, const char* text)
+{
+    FILE* file = std::fopen(path.c_str(), "w");
+    ASSERT_NE(file, nullptr);
+    std::fputs(text, file);
+    std::fclose(file);
+}
+
+std::string generate(const FlatAst& ast)
+{
+    CodeGeneratorLLVM codegen;
+    codegen.generate(ast);
+    return codegen.to_string();
+}
+
+}
+
+TEST(AstCacheTests, RoundTripsTheSamplePrograms)
+{
+    for (const char* name : {"test_arithmetic.kld", "test_simple.kld", "test_extern.kld", "test_operators.kld"})
+    {
+        auto source = SourceBuffer::from_file(std::string("../../test/sample_programs/") + name);
+        FlatAst ast = parse_flat(source);
+        std::uint64_t hash = AstCache::source_hash(source.view());
+
+        auto loaded = AstCache::deserialize(AstCache::serialize(ast, hash), hash);
+        ASSERT_TRUE(loaded.has_value()) << name;
+        ASSERT_EQ(loaded->get_items().size(), ast.get_items().size());
+        for (std::size_t i = 0; i < ast.get_items().size(); i++)
+            EXPECT_EQ(loaded->to_string(loaded->get_items()[i]), ast.to_string(ast.get_items()[i]));
+        EXPECT_EQ(generate(*loaded), generate(ast));
+    }
+}
+
+TEST(AstCacheTests, RejectsImagesOfOtherSourcesAndDamagedImages)
+{
+    auto source = SourceBuffer::from_string("def f(x y) x*y + g(x, 2); extern g(a b); f(1, 2)");
+    FlatAst ast = parse_flat(source);
+    std::uint64_t hash = AstCache::source_hash(source.view());
+    std::string image = AstCache::serialize(ast, hash);
+
+    ASSERT_TRUE(AstCache::deserialize(image, hash).has_value());
+    ASSERT_FALSE(AstCache::deserialize(image, hash + 1).has_value());
+    ASSERT_FALSE(AstCache::deserialize("", hash).has_value());
+    for (std::size_t size = 0; size < image.size(); size += 8)
+        ASSERT_FALSE(AstCache::deserialize(std::string_view(image).substr(0, size), hash).has_value());
+
+    std::string wrong_version = image;
+    wrong_version[4] ^= 1;
+    ASSERT_FALSE(AstCache::deserialize(wrong_version, hash).has_value());
+}
+
+TEST(AstCacheTests, LoadOrParseWritesTheCacheAndThenUsesIt)
+{
+    std::string path = "ast_cache_test_" + std::to_string(::getpid()) + ".kld";
+    std::string cache_path = AstCache::cache_path(path);
+    ASSERT_EQ(cache_path, path + "c");
+    write_file(path, "def sq(x) x*x; sq(3)");
+    auto source = SourceBuffer::from_file(path);
+
+    bool cache_hit = true;
+    FlatAst parsed = AstCache::load_or_parse(source, path, &cache_hit);
+    ASSERT_FALSE(cache_hit);
+    FlatAst loaded = AstCache::load_or_parse(source, path, &cache_hit);
+    ASSERT_TRUE(cache_hit);
+    ASSERT_EQ(loaded.size(), parsed.size());
+    ASSERT_EQ(loaded.to_string(loaded.get_items()[0]), "def sq(x){(x) * (x)}");
+
+    // An edited source no longer matches the image.
+    auto edited = SourceBuffer::from_string("def sq(x) x*x; sq(4)");
+    AstCache::load_or_parse(edited, path, &cache_hit);
+    ASSERT_FALSE(cache_hit);
+
+    std::remove(path.c_str());
+    std::remove(cache_path.c_str());
+}
+
+TEST(AstCacheTests, ProgramsWithErrorsAreNotCached)
+{
+    std::string path = "ast_cache_error_test_" + std::to_string(::getpid()) + ".kld";
+    write_file(path, "def f(x) x * ; 1 + 2");
+    auto source = SourceBuffer::from_file(path);
+
+    bool cache_hit = true;
+    AstCache::load_or_parse(source, path, &cache_hit);
+    ASSERT_FALSE(cache_hit);
+    ASSERT_FALSE(AstCache::read(AstCache::cache_path(path), AstCache::source_hash(source.view())).has_value());
+    std::remove(path.c_str());
+}
+
+TEST(AstCacheTests, TrailingSemicolonsAreNoErrors)
+{
+    std::string path = "ast_cache_semicolon_test_" + std::to_string(::getpid()) + ".kld";
+    write_file(path, "def f(x) x*2;\nf(3);\n");
+    auto source = SourceBuffer::from_file(path);
+
+    bool cache_hit = true;
+    AstCache::load_or_parse(source, path, &cache_hit);
+    ASSERT_FALSE(cache_hit);
+    AstCache::load_or_parse(source, path, &cache_hit);
+    ASSERT_TRUE(cache_hit);
+    std::remove(path.c_str());
+    std::remove(AstCache::cache_path(path).c_str());
+}
+
+TEST(AstCacheTests, OnlyRegularFilesAreCached)
+{
+    auto source = SourceBuffer::from_string("def sq(x) x*x; sq(3)");
+    bool cache_hit = true;
+    AstCache::load_or_parse(source, "-", &cache_hit);
+    ASSERT_FALSE(cache_hit);
+    struct stat file_stat;
+    ASSERT_NE(::stat(AstCache::cache_path("-").c_str(), &file_stat), 0);
+
+    std::string fifo = "ast_cache_fifo_test_" + std::to_string(::getpid());
+    ASSERT_EQ(::mkfifo(fifo.c_str(), 0600), 0);
+    AstCache::load_or_parse(source, fifo, &cache_hit);
+    ASSERT_FALSE(cache_hit);
+    ASSERT_NE(::stat(AstCache::cache_path(fifo).c_str(), &file_stat), 0);
+    std::remove(fifo.c_str());
+}
+
+}
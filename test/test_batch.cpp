@@ -0,0 +1,145 @@
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/batch.hpp"
+#include "../src/error.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// Points that are not a multiple of any vector width, with both signs and
+// both orders of x and y.
+std::vector<double> xs(std::size_t points)
+{
+    std::vector<double> values(points);
+    for (std::size_t i = 0; i < points; i++)
+        values[i] = static_cast<double>(i) * 0.5 - 100;
+    return values;
+}
+
+std::vector<double> ys(std::size_t points)
+{
+    std::vector<double> values(points);
+    for (std::size_t i = 0; i < points; i++)
+        values[i] = static_cast<double>(i * 37 % 101) - 20;
+    return values;
+}
+
+}
+
+TEST(BatchTests, EvaluatesEveryPoint)
+{
+    auto arena = std::make_shared<AstArena>();
+    BatchEvaluator evaluator;
+    auto asts = parse("def sq(x) x * x; def f(x y) sq(x) - y * 3 + (x < y); f(1, 2)", arena);
+    BatchKernel kernel = evaluator.compile(asts, "f");
+    ASSERT_EQ(kernel.arity, 2);
+    const std::size_t points = 1003;
+    std::vector<double> x = xs(points), y = ys(points), results(points);
+    evaluator.evaluate(kernel, {x, y}, results);
+    for (std::size_t i = 0; i < points; i++)
+        ASSERT_EQ(results[i], x[i] * x[i] - y[i] * 3 + (x[i] < y[i] ? 1 : 0)) << "at " << i;
+}
+
+TEST(BatchTests, RunsUserDefinedOperatorsAndExterns)
+{
+    auto arena = std::make_shared<AstArena>();
+    auto source = SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    auto asts = parse(std::string(source.view()) + "; extern sin(x); def g(x) sin(x) * 2 | x;", arena);
+    BatchEvaluator evaluator;
+    BatchKernel f = evaluator.compile(asts, "f");
+    BatchKernel g = evaluator.compile(asts, "g");
+    const std::size_t points = 257;
+    std::vector<double> x = xs(points), y = ys(points), results(points);
+    evaluator.evaluate(f, {x, y}, results);
+    for (std::size_t i = 0; i < points; i++)
+        ASSERT_EQ(results[i], (1 - x[i] * 2) + y[i] * (x[i] < 1 + y[i] ? 1 : 0)) << "at " << i;
+    evaluator.evaluate(g, {x}, results);
+    for (std::size_t i = 0; i < points; i++)
+        ASSERT_EQ(results[i], std::sin(x[i]) * 2 + x[i]) << "at " << i;
+}
+
+TEST(BatchTests, SplitsThePointsAcrossThreads)
+{
+    auto arena = std::make_shared<AstArena>();
+    auto asts = parse("def f(x y) (x + y) * (x - y) - x * 0.25;", arena);
+    BatchEvaluator serial, parallel(4, false, 16);
+    const std::size_t points = 1001;
+    std::vector<double> x = xs(points), y = ys(points), expected(points), results(points);
+    serial.evaluate(serial.compile(asts, "f"), {x, y}, expected);
+    parallel.evaluate(parallel.compile(asts, "f"), {x, y}, results);
+    ASSERT_EQ(results, expected);
+}
+
+TEST(BatchTests, OverlappingResultsMatchOnePointAtATime)
+{
+    auto arena = std::make_shared<AstArena>();
+    auto asts = parse("def f(x) x * 0.5 + 1;", arena);
+    BatchEvaluator evaluator(4, false, 16);
+    BatchKernel kernel = evaluator.compile(asts, "f");
+    const std::size_t points = 1000;
+
+    std::vector<double> values = xs(points + 1), expected = values;
+    for (std::size_t i = 0; i < points; i++)
+        expected[i + 1] = expected[i] * 0.5 + 1;
+    llvm::MutableArrayRef<double> all(values);
+    evaluator.evaluate(kernel, {all.drop_back()}, all.drop_front());
+    ASSERT_EQ(values, expected);
+
+    values = xs(points);
+    expected = values;
+    for (double& value : expected)
+        value = value * 0.5 + 1;
+    evaluator.evaluate(kernel, {values}, values);
+    ASSERT_EQ(values, expected);
+}
+
+TEST(BatchTests, FastMathStaysClose)
+{
+    auto arena = std::make_shared<AstArena>();
+    BatchEvaluator evaluator(1, true);
+    BatchKernel kernel = evaluator.compile(parse("def f(x y) x * y + x * 3 + 1 + y * y;", arena), "f");
+    const std::size_t points = 1000;
+    std::vector<double> x = xs(points), y = ys(points), results(points);
+    evaluator.evaluate(kernel, {x, y}, results);
+    for (std::size_t i = 0; i < points; i++)
+        ASSERT_NEAR(results[i], x[i] * y[i] + x[i] * 3 + 1 + y[i] * y[i], 1e-9) << "at " << i;
+}
+
+TEST(BatchTests, NullaryFunctionsAndEmptyRanges)
+{
+    auto arena = std::make_shared<AstArena>();
+    BatchEvaluator evaluator;
+    BatchKernel kernel = evaluator.compile(parse("def c() 1 + 2;", arena), "c");
+    std::vector<double> results(5);
+    evaluator.evaluate(kernel, {}, results);
+    ASSERT_EQ(results, std::vector<double>(5, 3));
+    evaluator.evaluate(kernel, {}, {});
+}
+
+TEST(BatchTests, MismatchedArgumentsAreReported)
+{
+    auto arena = std::make_shared<AstArena>();
+    BatchEvaluator evaluator;
+    auto asts = parse("extern sin(x); def f(x y) x + y; def g(x) y;", arena);
+    ASSERT_THROW(evaluator.compile(asts, "sin"), JitException);
+    ASSERT_THROW(evaluator.compile(asts, "g"), JitException);
+    ASSERT_THROW(evaluator.compile(asts, "h"), JitException);
+    BatchKernel kernel = evaluator.compile(asts, "f");
+    std::vector<double> x(4), y(3), results(4);
+    ASSERT_THROW(evaluator.evaluate(kernel, {x}, results), JitException);
+    ASSERT_THROW(evaluator.evaluate(kernel, {x, y}, results), JitException);
+    evaluator.evaluate(kernel, {x, x}, results);
+}
+
+}
@@ -0,0 +1,245 @@
+#include <cmath>
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include "../src/code_cache.hpp"
+#include "../src/codegen.hpp"
+#include "../src/emitter.hpp"
+#include "../src/error.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// Key of the first definition of `program`, parsed to the pointer tree.
+std::string pointer_key(const std::string& program)
+{
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    Parser parser(lexer);
+    for (auto& ast : parser.fetch_all())
+    {
+        if (!std::holds_alternative<FunctionAST*>(ast))
+            continue;
+        auto function = std::get<FunctionAST*>(ast);
+        FunctionKey key("test", function->prototype->name, function->prototype->args);
+        key.add_body(function->body);
+        return key.finish();
+    }
+    return "";
+}
+
+// The same with the FlatAst.
+std::string flat_key(const std::string& program)
+{
+    auto source = SourceBuffer::from_string(program);
+    FlatAst ast;
+    Lexer lexer(source);
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(ast)).fetch_all();
+    for (const FlatAst::Item& item : ast.get_items())
+    {
+        if (item.kind != FlatAst::ItemKind::FUNCTION)
+            continue;
+        FunctionKey key("test", item.name, ast.parameters_of(item));
+        key.add_body(ast, item);
+        return key.finish();
+    }
+    return "";
+}
+
+GeneratedModule generate(const std::string& program, CodeCache& cache, const std::string& target)
+{
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+    codegen.set_code_cache(cache, target);
+    for (auto& ast : parser.fetch_all())
+        std::visit(std::ref(codegen), ast);
+    return codegen.take_module();
+}
+
+// A fresh cache directory, removed with the fixture.
+class CodeCacheTests : public ::testing::Test
+{
+protected:
+    llvm::SmallString<128> directory;
+
+    void SetUp() override
+    {
+        ASSERT_FALSE(llvm::sys::fs::createUniqueDirectory("kccani_code_cache_test", this->directory));
+    }
+
+    void TearDown() override
+    {
+        llvm::sys::fs::remove_directories(this->directory);
+    }
+
+    std::string path(const std::string& name) const
+    {
+        llvm::SmallString<128> file(this->directory);
+        llvm::sys::path::append(file, name);
+        return std::string(file);
+    }
+};
+
+const char* const PROGRAM =
+    "extern sin(x);"
+    "def binary| 5 (a b) a + b * 2;"
+    "def f(a b) sin(a) | b;"
+    "def g(x) f(x, x) * x;"
+    "def loop(n) loop(n - 1);"
+    "f(0, 2);"
+    "g(0) + 3";
+
+}
+
+TEST(FunctionKeyTests, KeysIgnoreParameterNamesAndFormatting)
+{
+    std::string key = pointer_key("def f(a b) a * (b + g(a, 1));");
+    ASSERT_TRUE(CodeCache::is_key(key));
+    ASSERT_EQ(pointer_key("def f(x y)\n    x*(y+g(x,1));"), key);
+    ASSERT_NE(pointer_key("def f(a b) b * (a + g(a, 1));"), key);
+    ASSERT_NE(pointer_key("def f(a b) a * (b + g(a, 2));"), key);
+    ASSERT_NE(pointer_key("def f(a b) a * (b + h(a, 1));"), key);
+    ASSERT_NE(pointer_key("def h(a b) a * (b + g(a, 1));"), key);
+    ASSERT_NE(pointer_key("def f(a b c) a * (b + g(a, 1));"), key);
+}
+
+TEST(FunctionKeyTests, PointerTreesAndFlatAstsHaveTheSameKeys)
+{
+    for (const char* program : {"def f(a b) a * (b + g(a, 1));", "def binary| 5 (a b) a + b * 2;",
+                                "def f(x) x < 1 - (x - 1) * y;", "def zero() 0;"})
+        EXPECT_EQ(flat_key(program), pointer_key(program)) << program;
+}
+
+TEST_F(CodeCacheTests, StoresAndLoadsObjectsAndCountsThem)
+{
+    CodeCache cache(std::string(this->directory));
+    std::string key(40, 'a');
+    ASSERT_EQ(cache.load(key), nullptr);
+    cache.store(key, llvm::MemoryBufferRef("object code", key));
+    auto object = cache.load(key);
+    ASSERT_NE(object, nullptr);
+    ASSERT_EQ(object->getBuffer().str(), "object code");
+
+    auto statistics = cache.get_statistics();
+    ASSERT_EQ(statistics.hits, 1);
+    ASSERT_EQ(statistics.misses, 1);
+    ASSERT_EQ(statistics.stores, 1);
+    ASSERT_EQ(statistics.evictions, 0);
+    ASSERT_EQ(statistics.bytes, 11);
+}
+
+TEST_F(CodeCacheTests, EvictsTheLeastRecentlyUsedObjects)
+{
+    CodeCache cache(std::string(this->directory), 250);
+    std::string object(100, 'x');
+    std::string first(40, '1'), second(40, '2'), third(40, '3');
+    cache.store(first, llvm::MemoryBufferRef(object, first));
+    cache.store(second, llvm::MemoryBufferRef(object, second));
+    ASSERT_NE(cache.load(first), nullptr);
+    cache.store(third, llvm::MemoryBufferRef(object, third));
+
+    ASSERT_EQ(cache.get_statistics().evictions, 1);
+    ASSERT_EQ(cache.get_statistics().bytes, 200);
+    ASSERT_FALSE(llvm::sys::fs::exists(this->path(second + ".o")));
+    ASSERT_NE(cache.load(first), nullptr);
+    ASSERT_NE(cache.load(third), nullptr);
+    ASSERT_EQ(cache.load(second), nullptr);
+}
+
+TEST_F(CodeCacheTests, ReopenedCachesKnowTheirObjects)
+{
+    std::string key(40, 'b');
+    {
+        CodeCache cache(std::string(this->directory));
+        cache.store(key, llvm::MemoryBufferRef("object code", key));
+    }
+    CodeCache cache(std::string(this->directory), 5);
+    ASSERT_EQ(cache.get_statistics().bytes, 11);
+    cache.store(std::string(40, 'c'), llvm::MemoryBufferRef("obj", "c"));
+    ASSERT_EQ(cache.get_statistics().evictions, 1);
+    ASSERT_EQ(cache.load(key), nullptr);
+}
+
+TEST_F(CodeCacheTests, JitRunsHitOnTheSecondCompilation)
+{
+    CodeCache cache(std::string(this->directory));
+    std::string target = JitEngine::target_description();
+    {
+        auto generated = generate(PROGRAM, cache, target);
+        ASSERT_EQ(generated.function_modules.size(), 4);
+        ASSERT_TRUE(generated.objects.empty());
+        JitEngine jit(1, &cache);
+        ASSERT_EQ(jit.run(std::move(generated)), (std::vector<double>{4, 3}));
+    }
+    ASSERT_EQ(cache.get_statistics().stores, 4);
+
+    auto generated = generate(PROGRAM, cache, target);
+    ASSERT_TRUE(generated.function_modules.empty());
+    ASSERT_EQ(generated.objects.size(), 4);
+    ASSERT_EQ(cache.get_statistics().hits, 4);
+    JitEngine jit(1, &cache);
+    ASSERT_EQ(jit.run(std::move(generated)), (std::vector<double>{4, 3}));
+}
+
+TEST_F(CodeCacheTests, HitsStillCheckTheirCallees)
+{
+    CodeCache cache(std::string(this->directory));
+    std::string target = JitEngine::target_description();
+    JitEngine(1, &cache).run(generate("extern sin(x); def f(x) sin(x) * 2; f(0)", cache, target));
+
+    auto generated = generate("extern sin(x y); def f(x) sin(x) * 2;", cache, target);
+    ASSERT_EQ(cache.get_statistics().hits, 1);
+    ASSERT_TRUE(generated.objects.empty());
+    generated = generate("def f(x) sin(x) * 2;", cache, target);
+    ASSERT_TRUE(generated.objects.empty());
+    generated = generate("extern sin(x); def f(x) sin(x) * 2; def f(x) sin(x) * 2;", cache, target);
+    ASSERT_EQ(generated.objects.size(), 1);
+}
+
+TEST_F(CodeCacheTests, SharedLibrariesLinkCachedObjects)
+{
+    CodeCache cache(std::string(this->directory));
+    Emitter emitter(0, &cache);
+    for (int compilation = 0; compilation < 2; compilation++)
+    {
+        std::string library_path = this->path("cached_" + std::to_string(compilation) + ".so");
+        auto generated = generate(PROGRAM, cache, emitter.target_description());
+        ASSERT_EQ(generated.objects.size(), compilation == 0 ? 0 : 4);
+        emitter.emit(generated, EmitKind::SHARED_LIBRARY, library_path);
+
+        auto header = llvm::MemoryBuffer::getFile(this->path("cached_" + std::to_string(compilation) + ".h"));
+        ASSERT_TRUE(header);
+        ASSERT_NE((*header)->getBuffer().str().find("double f(double, double);\ndouble g(double);\ndouble loop(double);\n"),
+            std::string::npos);
+
+        std::string error;
+        auto library = llvm::sys::DynamicLibrary::getPermanentLibrary(library_path.c_str(), &error);
+        ASSERT_TRUE(library.isValid()) << error;
+        auto g = reinterpret_cast<double (*)(double)>(library.getAddressOfSymbol("g"));
+        ASSERT_NE(g, nullptr);
+        ASSERT_DOUBLE_EQ(g(1), std::sin(1.0) + 2);
+    }
+    ASSERT_EQ(cache.get_statistics().stores, 4);
+
+    auto generated = generate(PROGRAM, cache, emitter.target_description());
+    ASSERT_THROW(emitter.emit(generated, EmitKind::LLVM_IR, this->path("cached.ll")), EmitException);
+}
+
+}
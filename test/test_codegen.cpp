@@ -1,11 +1,14 @@
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <gtest/gtest.h>
+#include <llvm/Support/CrashRecoveryContext.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "../src/lexer.hpp"
 #include "../src/parser.hpp"
 #include "../src/codegen.hpp"
+#include "../src/source.hpp"
 
 using namespace kccani;
 
@@ -32,4 +35,228 @@ TEST(CodegenTests, CorrectLlvmIrGeneratedForASimpleFunctionDefn)
         "  ret double %multmp\n"
         "}\n";
     ASSERT_EQ(actual_codegen, expected_codegen);
-}
\ No newline at end of file
+}
+TEST(CodegenTests, SharedSubexpressionsAreEmittedOncePerFunction)
+{
+    auto source = kccani::SourceBuffer::from_string(
+        "def f(x y) (x*y + 1) * (x*y + 1);"
+        "def g(x y) x*y + g(x, y) + g(x, y)");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer, std::make_shared<kccani::AstArena>(), true);
+    CodeGeneratorLLVM codegen;
+
+    auto ast_list = parser.fetch_all();
+    ASSERT_EQ(ast_list.size(), 2);
+    std::string f_codegen = kccani::CodeGeneratorLLVM::to_string(std::visit(std::ref(codegen), ast_list[0]));
+    std::string g_codegen = kccani::CodeGeneratorLLVM::to_string(std::visit(std::ref(codegen), ast_list[1]));
+
+    const std::string expected_f =
+        "define double @f(double \%x, double \%y) {\n"
+        "entry:\n"
+        "  \%multmp = fmul double \%x, \%y\n"
+        "  \%addtmp = fadd double \%multmp, 1.000000e+00\n"
+        "  \%multmp1 = fmul double \%addtmp, \%addtmp\n"
+        "  ret double \%multmp1\n"
+        "}\n";
+    ASSERT_EQ(f_codegen, expected_f);
+
+    // x*y is shared with f, but emitted again in g. The calls are not
+    // shared and happen twice.
+    const std::string expected_g =
+        "define double @g(double \%x, double \%y) {\n"
+        "entry:\n"
+        "  \%multmp = fmul double \%x, \%y\n"
+        "  \%calltmp = call double @g(double \%x, double \%y)\n"
+        "  \%addtmp = fadd double \%multmp, \%calltmp\n"
+        "  \%calltmp1 = call double @g(double \%x, double \%y)\n"
+        "  \%addtmp2 = fadd double \%addtmp, \%calltmp1\n"
+        "  ret double \%addtmp2\n"
+        "}\n";
+    ASSERT_EQ(g_codegen, expected_g);
+}
+
+TEST(CodegenTests, SharingNeverMergesSideEffects)
+{
+    auto source = kccani::SourceBuffer::from_string(
+        "extern putchard(x);"
+        "def binary| 5 (a b) a + b;"
+        "def f(x) (putchard(x) + 1) * (putchard(x) + 1);"
+        "def g(a b) (a | b) * (a | b)");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer, std::make_shared<kccani::AstArena>(), true);
+    CodeGeneratorLLVM codegen;
+
+    auto ast_list = parser.fetch_all();
+    ASSERT_EQ(ast_list.size(), 4);
+    std::visit(std::ref(codegen), ast_list[0]);
+    std::visit(std::ref(codegen), ast_list[1]);
+    std::string f_codegen = kccani::CodeGeneratorLLVM::to_string(std::visit(std::ref(codegen), ast_list[2]));
+    std::string g_codegen = kccani::CodeGeneratorLLVM::to_string(std::visit(std::ref(codegen), ast_list[3]));
+
+    const std::string expected_f =
+        "define double @f(double \%x) {\n"
+        "entry:\n"
+        "  \%calltmp = call double @putchard(double \%x)\n"
+        "  \%addtmp = fadd double \%calltmp, 1.000000e+00\n"
+        "  \%calltmp1 = call double @putchard(double \%x)\n"
+        "  \%addtmp2 = fadd double \%calltmp1, 1.000000e+00\n"
+        "  \%multmp = fmul double \%addtmp, \%addtmp2\n"
+        "  ret double \%multmp\n"
+        "}\n";
+    ASSERT_EQ(f_codegen, expected_f);
+    ASSERT_EQ(std::count(g_codegen.begin(), g_codegen.end(), '|'), 2) << g_codegen;
+}
+
+TEST(CodegenTests, TheSameAstCanBeGeneratedTwice)
+{
+    auto source = kccani::SourceBuffer::from_file("../../test/sample_programs/test_simple.kld");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer);
+    auto ast_list = parser.fetch_all();
+
+    CodeGeneratorLLVM first;
+    for (auto& ast : ast_list)
+        std::visit(std::ref(first), ast);
+    CodeGeneratorLLVM second;
+    for (auto& ast : ast_list)
+        std::visit(std::ref(second), ast);
+
+    ASSERT_EQ(first.to_string(), second.to_string());
+    ASSERT_EQ(
+        std::get<FunctionAST*>(ast_list[0])->to_string(),
+        "def fib(x){(fib((x) - (1.000000))) + (fib((x) - (2.000000)))}");
+}
+
+TEST(CodegenTests, UserDefinedOperatorsCallTheirFunctions)
+{
+    auto source = kccani::SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+
+    auto ast_list = parser.fetch_all();
+    ASSERT_EQ(ast_list.size(), 5);
+    for (std::size_t i = 0; i < 3; i++)
+        std::visit(std::ref(codegen), ast_list[i]);
+    std::string actual_codegen = kccani::CodeGeneratorLLVM::to_string(std::visit(std::ref(codegen), ast_list[3]));
+
+    const std::string expected_codegen =
+        "define double @f(double \%x, double \%y) {\n"
+        "entry:\n"
+        "  \%unop = call double @\"unary!\"(double \%x)\n"
+        "  \%addtmp = fadd double 1.000000e+00, \%y\n"
+        "  \%cmptmp = fcmp ult double \%x, \%addtmp\n"
+        "  \%booltmp = uitofp i1 \%cmptmp to double\n"
+        "  \%binop = call double @\"binary&\"(double \%y, double \%booltmp)\n"
+        "  \%binop1 = call double @\"binary|\"(double \%unop, double \%binop)\n"
+        "  ret double \%binop1\n"
+        "}\n";
+    ASSERT_EQ(actual_codegen, expected_codegen);
+}
+
+TEST(CodegenTests, UndefinedOperatorsAreReported)
+{
+    auto source = kccani::SourceBuffer::from_string("def binary| 5 (a b) a; def g(x) x | x");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+
+    // The parser knows `|` but its function was never generated.
+    auto ast_list = parser.fetch_all();
+    ASSERT_EQ(ast_list.size(), 2);
+    auto result = std::visit(std::ref(codegen), ast_list[1]);
+    ASSERT_EQ(std::get<llvm::Function*>(result), nullptr);
+}
+
+TEST(CodegenTests, DeeplyNestedExpressionsGenerateOnASmallStack)
+{
+    constexpr std::size_t DEPTH = 50000;
+    std::string program = "def g(a b) a; def f(a) ";
+    for (std::size_t i = 0; i < DEPTH; i++)
+        program += "g(a, a + ";
+    program += "a" + std::string(DEPTH, ')');
+
+    llvm::CrashRecoveryContext context;
+    ASSERT_TRUE(context.RunSafelyOnThread([&]() {
+        auto source = kccani::SourceBuffer::from_string(program);
+        kccani::Lexer lexer(source);
+        kccani::Parser parser(lexer);
+        CodeGeneratorLLVM codegen;
+        auto ast_list = parser.fetch_all();
+        ASSERT_EQ(ast_list.size(), 2);
+        std::visit(std::ref(codegen), ast_list[0]);
+        auto result = std::visit(std::ref(codegen), ast_list[1]);
+        auto function = std::get<llvm::Function*>(result);
+        ASSERT_NE(function, nullptr);
+        // A call and an addition per level, and the return.
+        ASSERT_EQ(function->getInstructionCount(), 2 * DEPTH + 1);
+    }, 256 << 10));
+}
+
+TEST(CodegenTests, FailingOperandsFailTheWholeExpression)
+{
+    auto source = kccani::SourceBuffer::from_string("def g(a b) a; def f(x) g(x, y) + (x * z); def h(x) g(x, 1) * x");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+
+    auto ast_list = parser.fetch_all();
+    ASSERT_EQ(ast_list.size(), 3);
+    std::visit(std::ref(codegen), ast_list[0]);
+    ASSERT_EQ(std::get<llvm::Function*>(std::visit(std::ref(codegen), ast_list[1])), nullptr);
+    ASSERT_EQ(codegen.get_module().getFunction("f"), nullptr);
+    // Nothing is left behind on the operand stacks for the next function.
+    ASSERT_NE(std::get<llvm::Function*>(std::visit(std::ref(codegen), ast_list[2])), nullptr);
+}
+
+TEST(CodegenTests, TopLevelExpressionsBecomeFunctions)
+{
+    auto source = kccani::SourceBuffer::from_string("def f(x) x; f(1); 2 * f(3)");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+    for (auto& ast : parser.fetch_all())
+        std::visit(std::ref(codegen), ast);
+
+    const std::string expected_codegen =
+        "; ModuleID = 'kccani_jit'\n"
+        "source_filename = \"kccani_jit\"\n"
+        "\n"
+        "define double @f(double \%x) {\n"
+        "entry:\n"
+        "  ret double \%x\n"
+        "}\n"
+        "\n"
+        "define double @__anon_expr() {\n"
+        "entry:\n"
+        "  \%calltmp = call double @f(double 1.000000e+00)\n"
+        "  ret double \%calltmp\n"
+        "}\n"
+        "\n"
+        "define double @__anon_expr.1() {\n"
+        "entry:\n"
+        "  \%calltmp = call double @f(double 3.000000e+00)\n"
+        "  \%multmp = fmul double 2.000000e+00, \%calltmp\n"
+        "  ret double \%multmp\n"
+        "}\n";
+    ASSERT_EQ(codegen.to_string(), expected_codegen);
+
+    // The next module declares what was defined so far and numbers on.
+    auto generated = codegen.take_module();
+    ASSERT_EQ(generated.expressions, (std::vector<std::string>{"__anon_expr", "__anon_expr.1"}));
+    ASSERT_NE(codegen.get_module().getFunction("f"), nullptr);
+    ASSERT_TRUE(codegen.get_module().getFunction("f")->isDeclaration());
+    ASSERT_EQ(codegen.get_module().getFunction("__anon_expr"), nullptr);
+}
+
+TEST(CodegenTests, RedefinitionsAreReported)
+{
+    auto source = kccani::SourceBuffer::from_string("def f(x) x; def f(y) y + 1");
+    kccani::Lexer lexer(source);
+    kccani::Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+
+    auto ast_list = parser.fetch_all();
+    ASSERT_NE(std::get<llvm::Function*>(std::visit(std::ref(codegen), ast_list[0])), nullptr);
+    ASSERT_EQ(std::get<llvm::Function*>(std::visit(std::ref(codegen), ast_list[1])), nullptr);
+}
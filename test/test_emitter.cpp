@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <variant>
+#include <vector>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+
+#include "../src/codegen.hpp"
+#include "../src/emitter.hpp"
+#include "../src/error.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+const char* const PROGRAM =
+    "extern sin(x);"
+    "def binary| 5 (a b) a + b * 2;"
+    "def f(a b) sin(a) | b;"
+    "def zero() 0;"
+    "f(0, 2)";
+
+GeneratedModule generate(const std::string& program)
+{
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+    for (auto& ast : parser.fetch_all())
+        std::visit(std::ref(codegen), ast);
+    return codegen.take_module();
+}
+
+std::string output_path(const std::string& name, EmitKind kind)
+{
+    return "emitter_test_" + name + "_" + std::to_string(::getpid()) + Emitter::extension(kind);
+}
+
+}
+
+TEST(EmitterTests, ParsesOutputKinds)
+{
+    ASSERT_EQ(Emitter::parse_kind("ll"), EmitKind::LLVM_IR);
+    ASSERT_EQ(Emitter::parse_kind("bc"), EmitKind::BITCODE);
+    ASSERT_EQ(Emitter::parse_kind("asm"), EmitKind::ASSEMBLY);
+    ASSERT_EQ(Emitter::parse_kind("obj"), EmitKind::OBJECT);
+    ASSERT_EQ(Emitter::parse_kind("shared"), EmitKind::SHARED_LIBRARY);
+    ASSERT_THROW(Emitter::parse_kind("exe"), EmitException);
+}
+
+TEST(EmitterTests, HeadersDeclareTheDefinedFunctions)
+{
+    auto generated = generate(PROGRAM);
+    std::string header = generated.module.withModuleDo([](llvm::Module& module) {
+        return Emitter::c_header(module);
+    });
+    ASSERT_NE(header.find("#pragma once\n"), std::string::npos);
+    ASSERT_NE(header.find("extern \"C\" {\n#endif\n\ndouble f(double, double);\ndouble zero(void);\n\n#ifdef"),
+        std::string::npos);
+    ASSERT_EQ(header.find("sin"), std::string::npos);
+    ASSERT_EQ(header.find("binary"), std::string::npos);
+    ASSERT_EQ(header.find("__anon_expr"), std::string::npos);
+}
+
+TEST(EmitterTests, WritesIrBitcodeAssemblyAndObjects)
+{
+    Emitter emitter;
+    auto generated = generate(PROGRAM);
+    generated.module.withModuleDo([&](llvm::Module& module) {
+        for (EmitKind kind : {EmitKind::LLVM_IR, EmitKind::BITCODE})
+        {
+            std::string path = output_path("ir", kind);
+            emitter.emit(module, kind, path);
+            llvm::LLVMContext context;
+            llvm::SMDiagnostic error;
+            auto read = llvm::parseIRFile(path, error, context);
+            std::remove(path.c_str());
+            ASSERT_NE(read, nullptr) << path;
+            ASSERT_FALSE(read->getFunction("f")->isDeclaration());
+            ASSERT_EQ(read->getTargetTriple(), emitter.get_target_machine().getTargetTriple().str());
+        }
+
+        std::string assembly_path = output_path("asm", EmitKind::ASSEMBLY);
+        emitter.emit(module, EmitKind::ASSEMBLY, assembly_path);
+        auto assembly = llvm::MemoryBuffer::getFile(assembly_path);
+        std::remove(assembly_path.c_str());
+        ASSERT_TRUE(assembly);
+        ASSERT_NE((*assembly)->getBuffer().str().find("zero"), std::string::npos);
+
+        std::string object_path = output_path("obj", EmitKind::OBJECT);
+        emitter.emit(module, EmitKind::OBJECT, object_path);
+        auto object = llvm::object::ObjectFile::createObjectFile(object_path);
+        std::remove(object_path.c_str());
+        ASSERT_TRUE(bool(object)) << llvm::toString(object.takeError());
+        std::vector<std::string> symbols;
+        for (const auto& symbol : object->getBinary()->symbols())
+            if (auto name = symbol.getName())
+                symbols.push_back(name->str());
+            else
+                llvm::consumeError(name.takeError());
+        ASSERT_NE(std::find(symbols.begin(), symbols.end(), "f"), symbols.end());
+        ASSERT_NE(std::find(symbols.begin(), symbols.end(), "zero"), symbols.end());
+    });
+}
+
+TEST(EmitterTests, SharedLibrariesLoadWithoutAJit)
+{
+    Emitter emitter(2);
+    llvm::SmallString<128> path(output_path("shared", EmitKind::SHARED_LIBRARY));
+    ASSERT_FALSE(llvm::sys::fs::make_absolute(path));
+    std::string library_path(path);
+    std::string header_path = library_path.substr(0, library_path.size() - 3) + ".h";
+    auto generated = generate(PROGRAM);
+    generated.module.withModuleDo([&](llvm::Module& module) {
+        emitter.emit(module, EmitKind::SHARED_LIBRARY, library_path);
+    });
+    ASSERT_TRUE(llvm::sys::fs::exists(header_path));
+
+    std::string error;
+    auto library = llvm::sys::DynamicLibrary::getPermanentLibrary(library_path.c_str(), &error);
+    std::remove(library_path.c_str());
+    std::remove(header_path.c_str());
+    ASSERT_TRUE(library.isValid()) << error;
+    auto f = reinterpret_cast<double (*)(double, double)>(library.getAddressOfSymbol("f"));
+    ASSERT_NE(f, nullptr);
+    ASSERT_DOUBLE_EQ(f(0, 2), 4);
+    ASSERT_DOUBLE_EQ(f(1, 1), std::sin(1.0) + 2);
+}
+
+TEST(EmitterTests, UnwritableOutputsAreReported)
+{
+    Emitter emitter;
+    auto generated = generate("def f(x) x;");
+    generated.module.withModuleDo([&](llvm::Module& module) {
+        ASSERT_THROW(emitter.emit(module, EmitKind::OBJECT, "no_such_directory/f.o"), EmitException);
+    });
+}
+
+}
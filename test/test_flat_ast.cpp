@@ -0,0 +1,155 @@
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+#include <spdlog/sinks/ostream_sink.h>
+#include <spdlog/spdlog.h>
+
+#include "../src/source.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/codegen.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+void expect_same_as_tree(const std::string& file_name)
+{
+    auto source = SourceBuffer::from_file("../../test/sample_programs/" + file_name);
+
+    auto tree_lexer = Lexer(source);
+    auto tree_parser = Parser(tree_lexer);
+    auto tree = tree_parser.fetch_all();
+    CodeGeneratorLLVM tree_codegen;
+    for (auto& ast : tree)
+        std::visit(std::ref(tree_codegen), ast);
+
+    FlatAst flat;
+    auto flat_lexer = Lexer(source);
+    auto flat_parser = BasicParser<FlatAstBuilder>(flat_lexer, FlatAstBuilder(flat));
+    auto items = flat_parser.fetch_all();
+    CodeGeneratorLLVM flat_codegen;
+    flat_codegen.generate(flat);
+
+    ASSERT_EQ(items.size(), tree.size());
+    ASSERT_EQ(flat.get_items().size(), tree.size());
+    for (std::size_t i = 0; i < tree.size(); i++)
+    {
+        const FlatAst::Item& item = flat.get_items()[items[i]];
+        EXPECT_EQ(item.kind == FlatAst::ItemKind::ERROR ? "<error>" : flat.to_string(item), item_to_string(tree[i]));
+    }
+    EXPECT_EQ(flat_codegen.to_string(), tree_codegen.to_string());
+}
+
+// What `run` logs, one message per line.
+template <typename Run>
+std::string logged_errors(Run&& run)
+{
+    std::ostringstream log;
+    auto logger = std::make_shared<spdlog::logger>("errors", std::make_shared<spdlog::sinks::ostream_sink_st>(log));
+    logger->set_pattern("%v");
+    auto previous = spdlog::default_logger();
+    spdlog::set_default_logger(logger);
+    run();
+    spdlog::set_default_logger(previous);
+    return log.str();
+}
+
+}
+
+TEST(FlatAstTests, MatchesTheTreeOnSamplePrograms)
+{
+    expect_same_as_tree("test_arithmetic.kld");
+    expect_same_as_tree("test_simple.kld");
+    expect_same_as_tree("test_extern.kld");
+    expect_same_as_tree("test_operators.kld");
+}
+
+TEST(FlatAstTests, CodegenReportsTheErrorsOfTheTree)
+{
+    auto source = SourceBuffer::from_string(
+        "extern g(a); def binary| 5 (a b) a + b;"
+        "def f(x) y + z;"
+        "def h(x) g(u, v) + w;"
+        "def k(x) g(y + q(z)) * unknown(v) + (a | b) + g(g(x) + p);"
+        "def m(x) g(x, 1) | (x | g(x, t))");
+
+    auto tree_lexer = Lexer(source);
+    auto tree_parser = Parser(tree_lexer);
+    auto tree = tree_parser.fetch_all();
+    CodeGeneratorLLVM tree_codegen;
+    std::string tree_errors = logged_errors([&]() {
+        for (auto& ast : tree)
+            std::visit(std::ref(tree_codegen), ast);
+    });
+
+    FlatAst flat;
+    auto flat_lexer = Lexer(source);
+    auto flat_parser = BasicParser<FlatAstBuilder>(flat_lexer, FlatAstBuilder(flat));
+    flat_parser.fetch_all();
+    CodeGeneratorLLVM flat_codegen;
+    std::string flat_errors = logged_errors([&]() { flat_codegen.generate(flat); });
+
+    EXPECT_EQ(flat_errors, tree_errors);
+    EXPECT_NE(tree_errors.find("Unknown variable name: y\nUnknown variable name: z\n"), std::string::npos)
+        << tree_errors;
+    EXPECT_EQ(flat_codegen.to_string(), tree_codegen.to_string());
+}
+
+TEST(FlatAstTests, NodesArePostOrder)
+{
+    auto source = SourceBuffer::from_string("f(g(1, h(2)), 3 * x, k())");
+    FlatAst flat;
+    auto lexer = Lexer(source);
+    auto parser = BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(flat));
+    parser.fetch_all();
+
+    ASSERT_EQ(flat.get_items().size(), 1);
+    const FlatAst::Item& item = flat.get_items()[0];
+    ASSERT_EQ(item.kind, FlatAst::ItemKind::EXPRESSION);
+    ASSERT_EQ(item.body, flat.size() - 1);
+    ASSERT_EQ(flat.to_string(item), "f(g(1.000000, h(2.000000)), (3.000000) * (x), k())");
+
+    FlatAst::NodeIndex root = item.body;
+    ASSERT_EQ(flat.kind(root), FlatAst::NodeKind::CALL);
+    ASSERT_EQ(flat.callee(root).str(), "f");
+    ASSERT_EQ(flat.argument_count(root), 3);
+    for (std::uint32_t i = 0; i < flat.argument_count(root); i++)
+        ASSERT_LT(flat.argument(root, i), root);
+
+    FlatAst::NodeIndex product = flat.argument(root, 1);
+    ASSERT_EQ(flat.kind(product), FlatAst::NodeKind::BINARY);
+    ASSERT_EQ(flat.opcode(product), '*');
+    ASSERT_EQ(flat.number(flat.lhs(product)), 3.0);
+    ASSERT_EQ(flat.variable(flat.rhs(product)).str(), "x");
+}
+
+TEST(FlatAstTests, FailedItemsLeaveNoNodesBehind)
+{
+    auto source = SourceBuffer::from_string("def f(x) x * ; 1 + 2");
+    FlatAst flat;
+    auto lexer = Lexer(source);
+    auto parser = BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(flat));
+    parser.fetch_all();
+
+    std::vector<FlatAst::ItemKind> kinds;
+    for (const FlatAst::Item& item : flat.get_items())
+        kinds.push_back(item.kind);
+    ASSERT_EQ(kinds.front(), FlatAst::ItemKind::ERROR);
+    ASSERT_EQ(kinds.back(), FlatAst::ItemKind::EXPRESSION);
+
+    const FlatAst::Item& last = flat.get_items().back();
+    ASSERT_EQ(flat.to_string(last), "(1.000000) + (2.000000)");
+    ASSERT_EQ(last.nodes_begin, 0);
+    ASSERT_EQ(flat.size(), 3);
+}
+
+}
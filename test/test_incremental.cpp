@@ -0,0 +1,167 @@
+#include <random>
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+#include <spdlog/spdlog.h>
+
+#include "../src/error.hpp"
+#include "../src/incremental.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+using namespace kccani;
+
+static std::vector<std::string> describe_all(const IncrementalParser& parser)
+{
+    std::vector<std::string> descriptions;
+    for (const auto& item : parser.get_items())
+        descriptions.push_back(item_to_string(item.ast));
+    return descriptions;
+}
+
+static const char* PROGRAM =
+    "# Compute the x'th fibonacci number.\n"
+    "def fib(x)\n"
+    "    fib(x-1) + fib(x-2);\n"
+    "extern atan2(x y);\n"
+    "def test(x) (1+2+x)*(x+(1+2));\n"
+    "y;\n"
+    "(2)\n";
+
+TEST(IncrementalTests, InitialParseMatchesParser)
+{
+    IncrementalParser incremental(PROGRAM);
+    auto source = SourceBuffer::from_string(PROGRAM);
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto expected = parser.fetch_all();
+
+    ASSERT_EQ(incremental.get_items().size(), expected.size());
+    for (std::size_t i = 0; i < expected.size(); i++)
+        EXPECT_EQ(item_to_string(incremental.get_items()[i].ast), item_to_string(expected[i]));
+    EXPECT_EQ(incremental.text(), PROGRAM);
+}
+
+TEST(IncrementalTests, EditInsideAnItemKeepsTheOthers)
+{
+    IncrementalParser incremental(PROGRAM);
+    std::vector<FunctionAST*> before;
+    for (const auto& item : incremental.get_items())
+        before.push_back(std::holds_alternative<FunctionAST*>(item.ast) ? std::get<FunctionAST*>(item.ast) : nullptr);
+
+    std::string text = PROGRAM;
+    std::size_t offset = text.find("1+2+x");
+    incremental.apply(SourceEdit{offset, 1, "42"});
+    text.replace(offset, 1, "42");
+
+    EXPECT_EQ(incremental.text(), text);
+    EXPECT_EQ(incremental.last_reparsed_items(), 1u);
+    EXPECT_EQ(describe_all(incremental), describe_all(IncrementalParser(text)));
+    for (std::size_t i = 0; i < before.size(); i++)
+    {
+        if (i == 2 || !before[i])
+            continue;
+        EXPECT_EQ(std::get<FunctionAST*>(incremental.get_items()[i].ast), before[i]);
+    }
+}
+
+TEST(IncrementalTests, RemovingASeparatorMergesItems)
+{
+    IncrementalParser incremental(PROGRAM);
+    std::size_t items = incremental.get_items().size();
+
+    std::string text = PROGRAM;
+    std::size_t offset = text.find("y;") + 1;
+    incremental.apply(SourceEdit{offset, 1, ""});
+    text.erase(offset, 1);
+
+    ASSERT_EQ(incremental.get_items().size(), items - 1);
+    EXPECT_EQ(describe_all(incremental), describe_all(IncrementalParser(text)));
+    EXPECT_EQ(incremental.text(), text);
+
+    // And splitting them again.
+    incremental.apply(SourceEdit{offset, 0, ";"});
+    EXPECT_EQ(incremental.get_items().size(), items);
+    EXPECT_EQ(incremental.text(), PROGRAM);
+}
+
+TEST(IncrementalTests, EditsAfterAnOperatorDefinitionUseIt)
+{
+    std::string text = "def binary| 5 (a b) a + b\ndef g(x) x | 1\ng(2)\n";
+    IncrementalParser incremental(text);
+
+    std::size_t offset = text.find("x | 1");
+    incremental.apply(SourceEdit{offset + 4, 1, "2"});
+    text.replace(offset + 4, 1, "2");
+
+    EXPECT_EQ(incremental.last_reparsed_items(), 1u);
+    EXPECT_EQ(describe_all(incremental), describe_all(IncrementalParser(text)));
+    EXPECT_NE(item_to_string(incremental.get_items()[1].ast), "<error>");
+}
+
+TEST(IncrementalTests, RedefiningAnOperatorReparsesItsUsers)
+{
+    std::string text = "def binary| 5 (a b) a + b\ndef g(x) x | 1 * 2\ndef h(x) x | x < 3\n";
+    IncrementalParser incremental(text);
+
+    // Binding tighter than `*` and `<` regroups both bodies.
+    std::size_t offset = text.find("5");
+    incremental.apply(SourceEdit{offset, 1, "50"});
+    text.replace(offset, 1, "50");
+
+    EXPECT_EQ(incremental.last_reparsed_items(), 3u);
+    EXPECT_EQ(describe_all(incremental), describe_all(IncrementalParser(text)));
+
+    // And so does removing it, which leaves `|` without a meaning.
+    auto log_level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::off);
+    incremental.apply(SourceEdit{0, text.find("def g"), ""});
+    text.erase(0, text.find("def g"));
+    EXPECT_EQ(describe_all(incremental), describe_all(IncrementalParser(text)));
+    spdlog::set_level(log_level);
+}
+
+TEST(IncrementalTests, RandomEditsMatchAFullReparse)
+{
+    static const char* FRAGMENTS[] = {
+        "def ", "extern ", "f", "x", "y", "fib", "(", ")", ",", ";", " ", "\n",
+        "+", "-", "*", "<", "1", "2.5", ".", "# note\n", "def g(a b) a*b;\n",
+        "|", "def binary| 5 (a b) a+b;\n", "def binary| 50 (a b) a-b;\n", "def unary| (a) 0-a;\n",
+    };
+    auto log_level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::off);
+
+    std::mt19937 random(42);
+    IncrementalParser incremental(PROGRAM);
+    std::string text = PROGRAM;
+    for (int step = 0; step < 2000; step++)
+    {
+        std::size_t offset = std::uniform_int_distribution<std::size_t>(0, text.size())(random);
+        std::size_t removed = std::uniform_int_distribution<std::size_t>(0, std::min<std::size_t>(4, text.size() - offset))(random);
+        std::string inserted = random() % 3 == 0 ? "" :
+            FRAGMENTS[random() % (sizeof(FRAGMENTS) / sizeof(FRAGMENTS[0]))];
+
+        std::string edited = text;
+        edited.replace(offset, removed, inserted);
+        try
+        {
+            incremental.apply(SourceEdit{offset, removed, inserted});
+        }
+        catch (const ParsingException&)
+        {
+            // A failed edit leaves the parser untouched.
+            EXPECT_THROW(IncrementalParser{edited}, ParsingException);
+            ASSERT_EQ(incremental.text(), text);
+            continue;
+        }
+        text = edited;
+
+        ASSERT_EQ(incremental.text(), text);
+        ASSERT_EQ(incremental.size(), text.size());
+        ASSERT_EQ(describe_all(incremental), describe_all(IncrementalParser(text))) << text;
+    }
+    spdlog::set_level(log_level);
+}
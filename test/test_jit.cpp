@@ -0,0 +1,144 @@
+#include <cmath>
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/codegen.hpp"
+#include "../src/error.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+TEST(JitTests, EvaluatesTopLevelExpressionsInOrder)
+{
+    ASSERT_EQ(run_program("def sq(x) x * x; sq(3) + 1; def quad(x) sq(sq(x)); quad(2); 4 < 3"),
+        (std::vector<double>{10, 16, 0}));
+}
+
+TEST(JitTests, RunsUserDefinedOperators)
+{
+    auto source = SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    ASSERT_EQ(run_program(std::string(source.view())), (std::vector<double>{-4}));
+}
+
+TEST(JitTests, ExternsResolveAgainstTheHostProcess)
+{
+    auto results = run_program("extern sin(x); extern atan2(y x); sin(0) + atan2(13, 5 + 8)");
+    ASSERT_EQ(results.size(), 1);
+    ASSERT_DOUBLE_EQ(results[0], std::atan2(13.0, 13.0));
+}
+
+TEST(JitTests, FunctionsStayCallableFromLaterModules)
+{
+    auto source = SourceBuffer::from_string("def sq(x) x * x; sq(4); def cube(x) sq(x) * x; cube(3) + sq(2)");
+    Lexer lexer(source);
+    Parser parser(lexer);
+    CodeGeneratorLLVM codegen;
+    JitEngine jit;
+
+    // One module per item, the way the REPL runs them.
+    std::vector<double> results;
+    for (auto& ast : parser.fetch_all())
+    {
+        std::visit(std::ref(codegen), ast);
+        for (double value : jit.run(codegen.take_module()))
+            results.push_back(value);
+    }
+    ASSERT_EQ(results, (std::vector<double>{16, 31}));
+    ASSERT_EQ(jit.call("__anon_expr.1"), 31);
+}
+
+TEST(JitTests, FlatAstsRunTheSame)
+{
+    auto source = SourceBuffer::from_string("def f(a b) a * b - 1; f(2, 3); f(f(1, 2), 5)");
+    FlatAst ast;
+    Lexer lexer(source);
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(ast)).fetch_all();
+    CodeGeneratorLLVM codegen;
+    codegen.generate(ast);
+    JitEngine jit;
+    ASSERT_EQ(jit.run(codegen.take_module()), (std::vector<double>{5, 4}));
+}
+
+TEST(JitTests, UnresolvedExternsAreReported)
+{
+    ASSERT_THROW(run_program("extern kccaniundefined(x); kccaniundefined(1)"), JitException);
+}
+
+TEST(LazyJitTests, EvaluatesLikeTheEagerEngine)
+{
+    auto arena = std::make_shared<AstArena>();
+    auto source = SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    LazyJitEngine jit;
+    ASSERT_EQ(jit.run(parse(std::string(source.view()), arena)), (std::vector<double>{-4}));
+
+    LazyJitEngine optimized(2);
+    ASSERT_EQ(optimized.run(parse("def sq(x) x * x; sq(3) + 1; def quad(x) sq(sq(x)); quad(2); 4 < 3", arena)),
+        (std::vector<double>{10, 16, 0}));
+}
+
+TEST(LazyJitTests, CompilesOnlyTheFunctionsThatAreCalled)
+{
+    auto arena = std::make_shared<AstArena>();
+    LazyJitEngine jit;
+    ASSERT_TRUE(jit.run(parse("extern sin(x); def sq(x) x * x; def f(x) sq(x) + sin(0); def g(x) x - 1;", arena)).empty());
+    ASSERT_EQ(jit.get_compiled_functions(), 0);
+    ASSERT_EQ(jit.run(parse("f(3)", arena)), (std::vector<double>{9}));
+    ASSERT_EQ(jit.get_compiled_functions(), 2);
+    ASSERT_EQ(jit.run(parse("f(2) + g(2)", arena)), (std::vector<double>{5}));
+    ASSERT_EQ(jit.get_compiled_functions(), 3);
+    ASSERT_EQ(jit.call("__anon_expr"), 9);
+}
+
+TEST(LazyJitTests, BodiesSeeFunctionsDefinedAfterThem)
+{
+    auto arena = std::make_shared<AstArena>();
+    LazyJitEngine jit;
+    jit.run(parse("def f(x) g(x) + 1;", arena));
+    ASSERT_EQ(jit.run(parse("def g(x) x * x; f(3)", arena)), (std::vector<double>{10}));
+}
+
+TEST(LazyJitTests, BodiesThatFailToGenerateEvaluateToNan)
+{
+    auto arena = std::make_shared<AstArena>();
+    LazyJitEngine jit;
+    auto results = jit.run(parse("def f(x) kccaniundefined(x); def g(x) x; f(1); g(2)", arena));
+    ASSERT_EQ(results.size(), 2);
+    ASSERT_TRUE(std::isnan(results[0]));
+    ASSERT_EQ(results[1], 2);
+}
+
+TEST(LazyJitTests, HotFunctionsTierUpInTheBackground)
+{
+    auto arena = std::make_shared<AstArena>();
+    LazyJitEngine jit(3, 10);
+    jit.run(parse("def sq(x) x * x; def f(x) sq(x) + 1; def g(x) x - 1;", arena));
+    std::string calls = "g(1)";
+    for (int i = 0; i < 4; i++)
+        calls += " + f(" + std::to_string(i) + ")";
+    ASSERT_EQ(jit.run(parse(calls + ";" + calls, arena)), (std::vector<double>{18, 18}));
+    jit.wait_for_tier_ups();
+    ASSERT_EQ(jit.get_tier_statistics().tier_up_requests, 0);
+
+    // The tenth calls of f and sq.
+    ASSERT_EQ(jit.run(parse("f(3) + f(4)", arena)), (std::vector<double>{27}));
+    jit.wait_for_tier_ups();
+    auto statistics = jit.get_tier_statistics();
+    ASSERT_EQ(statistics.baseline_compilations, 3);
+    ASSERT_EQ(statistics.tier_up_requests, 2);
+    ASSERT_EQ(statistics.tier_ups, 2);
+    ASSERT_EQ(statistics.failed_tier_ups, 0);
+
+    ASSERT_EQ(jit.run(parse(calls, arena)), (std::vector<double>{18}));
+    ASSERT_EQ(jit.get_tier_statistics().tier_up_requests, 2);
+    ASSERT_EQ(jit.get_compiled_functions(), 3);
+}
+
+}
@@ -1,8 +1,12 @@
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <gtest/gtest.h>
 
+#include "../src/error.hpp"
 #include "../src/lexer.hpp"
+#include "../src/scan.hpp"
+#include "../src/source.hpp"
 
 using namespace kccani;
 
@@ -15,11 +19,9 @@ TEST(LexerTests, OutputsTheRightNumberOfTokensOfCorrectTypes)
     auto token_list = lexer.fetch_all();
 
     int count_def = 0, count_var = 0, count_val = 0, count_op = 0, count_eof = 0;
-    while (!token_list.empty())
+    for (std::size_t i = 0; i < token_list.size(); i++)
     {
-        auto token = token_list.front();
-        token_list.pop();
-        switch (token.type)
+        switch (token_list.type(i))
         {
         case Token::TokenType::TOKEN_DEF:
             count_def++;
@@ -44,3 +46,101 @@ TEST(LexerTests, OutputsTheRightNumberOfTokensOfCorrectTypes)
     EXPECT_EQ(count_val, 3);
     EXPECT_EQ(count_op, 12);
 }
+
+TEST(LexerTests, BufferedLexerMatchesStreamLexer)
+{
+    for (auto file_name : {
+        "../../test/sample_programs/test_simple.kld",
+        "../../test/sample_programs/test_extern.kld",
+        "../../test/sample_programs/test_arithmetic.kld"})
+    {
+        std::ifstream fin(file_name, std::ios::in);
+        if (!fin.is_open())
+            FAIL();
+        auto stream_tokens = kccani::Lexer(fin).fetch_all();
+
+        auto source = SourceBuffer::from_file(file_name);
+        auto buffer_tokens = kccani::Lexer(source).fetch_all();
+
+        ASSERT_EQ(stream_tokens.size(), buffer_tokens.size());
+        for (std::size_t i = 0; i < stream_tokens.size(); i++)
+        {
+            EXPECT_TRUE(stream_tokens[i] == buffer_tokens[i]);
+            EXPECT_EQ(stream_tokens.offset(i), buffer_tokens.offset(i));
+            EXPECT_EQ(stream_tokens.length(i), buffer_tokens.length(i));
+        }
+    }
+}
+
+TEST(LexerTests, BufferedLexerInternsIdentifiers)
+{
+    auto source = SourceBuffer::from_string("fib(x1) fib");
+    kccani::Lexer lexer(source);
+
+    Token identifier = lexer.get();
+    ASSERT_EQ(identifier.type, Token::TokenType::TOKEN_IDENTIFIER);
+    ASSERT_TRUE(identifier == "fib");
+    EXPECT_TRUE(identifier == Symbol::intern("fib"));
+
+    EXPECT_TRUE(lexer.get() == '(');
+    EXPECT_TRUE(lexer.get() == "x1");
+    EXPECT_TRUE(lexer.get() == ')');
+    // The final token is not lost when the source has no trailing newline.
+    EXPECT_TRUE(lexer.get() == identifier.symbol());
+    EXPECT_EQ(lexer.get().type, Token::TokenType::TOKEN_EOF);
+}
+
+TEST(LexerTests, TokenStreamReplaysWithArbitraryLookahead)
+{
+    auto source = SourceBuffer::from_string("def f(x) x * 2.5;");
+    auto tokens = kccani::Lexer(source).fetch_all();
+    ASSERT_EQ(tokens.size(), 10);
+    EXPECT_EQ(tokens.offset(3), 6);
+    EXPECT_EQ(tokens.length(3), 1);
+
+    kccani::Lexer replay(tokens);
+    EXPECT_EQ(replay.peek(0).type, Token::TokenType::TOKEN_DEF);
+    EXPECT_TRUE(replay.peek(7) == 2.5);
+    EXPECT_EQ(replay.peek(100).type, Token::TokenType::TOKEN_EOF);
+    replay.seek(5);
+    EXPECT_TRUE(replay.get() == "x");
+    EXPECT_EQ(replay.position(), 6);
+    EXPECT_TRUE(replay.peek() == '*');
+}
+
+TEST(LexerTests, NumbersOutOfRangeAreRejected)
+{
+    const std::string huge = "1" + std::string(400, '0');
+    for (const std::string& literal : {huge, huge + ".5", "0." + std::string(400, '0') + "1"})
+    {
+        auto source = SourceBuffer::from_string("f(" + literal + ")");
+        EXPECT_THROW(kccani::Lexer(source).fetch_all(), ParsingException) << literal;
+    }
+    auto source = SourceBuffer::from_string("1" + std::string(300, '0'));
+    EXPECT_TRUE(kccani::Lexer(source).fetch_all()[0] == 1e300);
+}
+
+TEST(LexerTests, ScanKernelsAgreeAcrossInstructionSets)
+{
+    const std::string alphabet = "  \t\n\r.0123456789azAZ_#(+";
+    std::mt19937 random(7);
+    std::string text(4096, ' ');
+    for (auto& c : text)
+        c = alphabet[random() % alphabet.size()];
+
+    const auto& reference = scan::kernels_for(scan::InstructionSet::SCALAR);
+    for (auto isa : {scan::InstructionSet::SSE2, scan::InstructionSet::AVX2})
+    {
+        if (!scan::is_supported(isa))
+            continue;
+        const auto& kernels = scan::kernels_for(isa);
+        const char* end = text.data() + text.size();
+        for (const char* begin = text.data(); begin != end; begin++)
+        {
+            ASSERT_EQ(kernels.skip_whitespace(begin, end), reference.skip_whitespace(begin, end));
+            ASSERT_EQ(kernels.skip_identifier(begin, end), reference.skip_identifier(begin, end));
+            ASSERT_EQ(kernels.skip_number(begin, end), reference.skip_number(begin, end));
+            ASSERT_EQ(kernels.find_line_end(begin, end), reference.find_line_end(begin, end));
+        }
+    }
+}
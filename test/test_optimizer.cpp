@@ -0,0 +1,114 @@
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/codegen.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/optimizer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+std::size_t calls_in(const llvm::Function& function)
+{
+    std::size_t calls = 0;
+    for (const auto& block : function)
+        for (const auto& instruction : block)
+            calls += llvm::isa<llvm::CallInst>(instruction);
+    return calls;
+}
+
+}
+
+TEST(OptimizerTests, LevelZeroRunsNoPasses)
+{
+    Optimizer optimizer(0);
+    CodeGeneratorLLVM codegen;
+    codegen.set_optimizer(optimizer);
+    generate(codegen, "def test(x) (1 + 2 + x) * (x + (1 + 2));");
+    codegen.optimize_module();
+    // fadd, fadd, fmul, ret.
+    ASSERT_EQ(codegen.get_module().getFunction("test")->getInstructionCount(), 4);
+}
+
+TEST(OptimizerTests, FunctionPassesMergeEqualSubexpressions)
+{
+    Optimizer optimizer(1);
+    CodeGeneratorLLVM codegen;
+    codegen.set_optimizer(optimizer);
+    generate(codegen, "def test(x) (1 + 2 + x) * (x + (1 + 2));");
+    // Before the module is complete: x + 3 once, squared.
+    ASSERT_EQ(codegen.get_module().getFunction("test")->getInstructionCount(), 3);
+}
+
+TEST(OptimizerTests, ModulePassesInlineFromLevelTwo)
+{
+    for (unsigned level : {1u, 2u, 3u})
+    {
+        Optimizer optimizer(level);
+        CodeGeneratorLLVM codegen;
+        codegen.set_optimizer(optimizer);
+        generate(codegen, "def sq(x) x * x; def f(y) sq(y) + 1;");
+        codegen.optimize_module();
+        EXPECT_EQ(calls_in(*codegen.get_module().getFunction("f")), level < 2 ? 1 : 0) << "-O" << level;
+    }
+}
+
+TEST(OptimizerTests, OptimizedCodeEvaluatesTheSame)
+{
+    const std::string program =
+        "def binary: 1 (x y) y;"
+        "def sq(x) x * x; def f(a b) sq(a + b) - sq(a - b) : a * 4 * b;"
+        "f(3, 5); sq(1.5) + f(2, 2); f(1, 2) < f(2, 1);";
+    for (unsigned level = 0; level <= Optimizer::MAX_LEVEL; level++)
+    {
+        Optimizer optimizer(level);
+        CodeGeneratorLLVM codegen;
+        codegen.set_optimizer(optimizer);
+        generate(codegen, program);
+        JitEngine jit;
+        EXPECT_EQ(jit.run(codegen.take_module()), (std::vector<double>{60, 18.25, 0})) << "-O" << level;
+    }
+}
+
+TEST(OptimizerTests, PhasesAreTimedWhenTheyRun)
+{
+    PhaseTimers timers;
+    Optimizer unoptimized(0, &timers);
+    CodeGeneratorLLVM codegen;
+    codegen.set_optimizer(unoptimized);
+    generate(codegen, "def sq(x) x * x; def f(y) sq(y) + 1;");
+    codegen.optimize_module();
+    ASSERT_FALSE(timers[PhaseTimers::FUNCTION_PASSES].hasTriggered());
+    ASSERT_FALSE(timers[PhaseTimers::MODULE_PASSES].hasTriggered());
+
+    Optimizer optimizer(2, &timers);
+    CodeGeneratorLLVM optimized;
+    optimized.set_optimizer(optimizer);
+    {
+        llvm::TimeRegion front_end(timers[PhaseTimers::FRONT_END]);
+        generate(optimized, "def sq(x) x * x; def f(y) sq(y) + 1;");
+    }
+    optimized.optimize_module();
+    ASSERT_TRUE(timers[PhaseTimers::FRONT_END].hasTriggered());
+    ASSERT_TRUE(timers[PhaseTimers::FUNCTION_PASSES].hasTriggered());
+    ASSERT_TRUE(timers[PhaseTimers::MODULE_PASSES].hasTriggered());
+
+    std::string report;
+    llvm::raw_string_ostream out(report);
+    timers.print(out);
+    out.flush();
+    ASSERT_NE(report.find("Function passes"), std::string::npos);
+    ASSERT_NE(report.find("Module passes"), std::string::npos);
+    ASSERT_FALSE(timers[PhaseTimers::FUNCTION_PASSES].hasTriggered());
+}
+
+}
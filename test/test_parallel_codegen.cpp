@@ -0,0 +1,119 @@
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+#include <llvm/IR/Verifier.h>
+#include <spdlog/spdlog.h>
+
+#include "../src/codegen.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parallel_codegen.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// Each function calls the one before it, every third item is an expression
+// calling the latest function and the first item defines an operator used
+// all along.
+std::string chained_program(std::size_t functions)
+{
+    std::string program = "def binary| 5 (a b) a + b * 2;\ndef f0(a b) a | b;\n";
+    for (std::size_t i = 1; i < functions; i++)
+    {
+        program += "def f" + std::to_string(i) + "(a b) f" + std::to_string(i - 1) + "(b, a) - a | 1;\n";
+        if (i % 2 == 0)
+            program += "f" + std::to_string(i) + "(" + std::to_string(i) + ", 2);\n";
+    }
+    return program;
+}
+
+std::vector<GeneratedModule> generate_in_parallel(const std::string& program, unsigned optimization_level = 0)
+{
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    Parser parser(lexer);
+    auto items = parser.fetch_all();
+    return ParallelCodeGenerator(4, optimization_level, 4).generate(items);
+}
+
+}
+
+TEST(ParallelCodegenTests, ChunksRunAsTheSequentialProgram)
+{
+    std::string program = chained_program(40);
+    auto modules = generate_in_parallel(program);
+    ASSERT_EQ(modules.size(), 4);
+    JitEngine jit(4);
+    ASSERT_EQ(jit.run(std::move(modules)), run_program(program));
+}
+
+TEST(ParallelCodegenTests, OptimizedChunksRunTheSame)
+{
+    std::string program = chained_program(40);
+    JitEngine jit;
+    ASSERT_EQ(jit.run(generate_in_parallel(program, 2)), run_program(program));
+}
+
+TEST(ParallelCodegenTests, FlatAstsGenerateTheSame)
+{
+    std::string program = chained_program(40);
+    auto source = SourceBuffer::from_string(program);
+    Lexer lexer(source);
+    FlatAst ast;
+    BasicParser<FlatAstBuilder> parser(lexer, FlatAstBuilder(ast));
+    parser.fetch_all();
+    JitEngine jit;
+    ASSERT_EQ(jit.run(ParallelCodeGenerator(4, 0, 4).generate(ast)), run_program(program));
+}
+
+TEST(ParallelCodegenTests, ExpressionsAreNamedAcrossChunks)
+{
+    std::vector<std::string> names;
+    for (GeneratedModule& module : generate_in_parallel(chained_program(40)))
+        names.insert(names.end(), module.expressions.begin(), module.expressions.end());
+    ASSERT_EQ(names.size(), 19);
+    ASSERT_EQ(names.front(), "__anon_expr");
+    for (std::size_t i = 1; i < names.size(); i++)
+        ASSERT_EQ(names[i], "__anon_expr." + std::to_string(i));
+}
+
+TEST(ParallelCodegenTests, LinksIntoOneModule)
+{
+    llvm::LLVMContext context;
+    auto linked = ParallelCodeGenerator::link(generate_in_parallel(chained_program(40)), context);
+    ASSERT_NE(linked, nullptr);
+    ASSERT_FALSE(llvm::verifyModule(*linked, &llvm::errs()));
+    for (std::size_t i = 0; i < 40; i++)
+        ASSERT_FALSE(linked->getFunction("f" + std::to_string(i))->isDeclaration()) << i;
+    ASSERT_FALSE(linked->getFunction("__anon_expr.18")->isDeclaration());
+}
+
+TEST(ParallelCodegenTests, RedefinitionsInOtherChunksKeepTheFirst)
+{
+    std::string program = chained_program(40) + "def f0(a b) a;\nf0(1, 2);\ndef f1(a) a;\nf1(3, 4);\n";
+    auto log_level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::off);
+    llvm::LLVMContext context;
+    ASSERT_NE(ParallelCodeGenerator::link(generate_in_parallel(program), context), nullptr);
+    JitEngine jit;
+    ASSERT_EQ(jit.run(generate_in_parallel(program)), run_program(program));
+    spdlog::set_level(log_level);
+}
+
+TEST(ParallelCodegenTests, SmallProgramsStayInOneChunk)
+{
+    auto modules = generate_in_parallel("def f(x) x * 2; f(4)");
+    ASSERT_EQ(modules.size(), 1);
+    JitEngine jit;
+    ASSERT_EQ(jit.run(std::move(modules)), (std::vector<double>{8}));
+}
+
+}
@@ -0,0 +1,143 @@
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/codegen.hpp"
+#include "../src/diagnostics.hpp"
+#include "../src/error.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parallel_parser.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// `terminator` follows every definition.
+std::string program_of(std::size_t functions, const std::string& terminator = "")
+{
+    std::string program = "extern sin(x);\n";
+    for (std::size_t i = 0; i < functions; i++)
+    {
+        std::string name = "f" + std::to_string(i);
+        program += "# " + name + " is defined below\n";
+        program += "def " + name + "(a b) a * " + std::to_string(i) + " + sin(b)";
+        if (i > 0)
+            program += " - f" + std::to_string(i - 1) + "(b, a)";
+        program += terminator + "\n";
+        if (i % 7 == 0)
+            program += name + "(1, 2);\n";
+    }
+    return program;
+}
+
+// Parses `program` both ways and checks the items and diagnostics match.
+void expect_same_as_sequential(const std::string& program)
+{
+    BufferedDiagnostics sequential_diagnostics;
+    Lexer lexer(program);
+    Parser parser(lexer);
+    parser.set_diagnostics(sequential_diagnostics);
+    auto sequential = parser.fetch_all();
+
+    ParallelParser parallel_parser(4, 64);
+    ASSERT_GT(ParallelParser::split(program, 64).size(), 4);
+
+    BufferedDiagnostics parallel_diagnostics;
+    auto parallel = parallel_parser.parse(program, parallel_diagnostics);
+    ASSERT_EQ(parallel.items.size(), sequential.size());
+    for (std::size_t i = 0; i < sequential.size(); i++)
+        ASSERT_EQ(item_to_string(parallel.items[i]), item_to_string(sequential[i])) << "item " << i;
+    ASSERT_EQ(parallel_diagnostics.get_messages(), sequential_diagnostics.get_messages());
+
+    BufferedDiagnostics flat_diagnostics;
+    FlatAst flat = parallel_parser.parse_flat(program, flat_diagnostics);
+    ASSERT_EQ(flat.get_items().size(), sequential.size());
+    for (std::size_t i = 0; i < sequential.size(); i++)
+    {
+        if (flat.get_items()[i].kind != FlatAst::ItemKind::ERROR)
+        {
+            ASSERT_EQ(flat.to_string(flat.get_items()[i]), item_to_string(sequential[i])) << "item " << i;
+        }
+    }
+    ASSERT_EQ(flat_diagnostics.get_messages(), sequential_diagnostics.get_messages());
+}
+
+}
+
+TEST(ParallelParserTests, SplitsOnlyBeforeDefAndExternTokens)
+{
+    std::string source = "def f(x) x # def in a comment\n undef(1) define(2) x1def extern g(a); def h() 1";
+    auto boundaries = ParallelParser::split(source, 0);
+    std::vector<std::string> starts;
+    for (std::size_t boundary : boundaries)
+        starts.push_back(source.substr(boundary, 3));
+    ASSERT_EQ(starts, (std::vector<std::string>{"def", "ext", "def"}));
+    ASSERT_EQ(boundaries[1], source.find("extern"));
+
+    // Chunks are at least the requested size.
+    ASSERT_EQ(ParallelParser::split(source, source.size()).size(), 1);
+}
+
+TEST(ParallelParserTests, MatchesTheSequentialParser)
+{
+    expect_same_as_sequential(program_of(200));
+}
+
+TEST(ParallelParserTests, ChunksEndingInSemicolonsAreUsed)
+{
+    std::string program = program_of(200, ";");
+    expect_same_as_sequential(program);
+
+    std::size_t chunks = ParallelParser::split(program, 64).size();
+    ParallelParser parallel_parser(4, 64);
+    parallel_parser.parse(program);
+    EXPECT_EQ(parallel_parser.last_parallel_chunks(), chunks);
+    parallel_parser.parse_flat(program);
+    EXPECT_EQ(parallel_parser.last_parallel_chunks(), chunks);
+}
+
+TEST(ParallelParserTests, ErrorsAreReportedInSourceOrder)
+{
+    std::string program = program_of(60);
+    program.insert(program.find("def f20"), "def broken(x) x * ;\n");
+    program.insert(program.find("def f40"), "def (x) 1\n");
+    expect_same_as_sequential(program);
+}
+
+TEST(ParallelParserTests, OperatorsDefinedMidwayApplyToTheRest)
+{
+    std::string program = program_of(60);
+    program.insert(program.find("def f30"), "def binary| 5 (a b) a + b;\ndef g(x y) x | y * 2;\n");
+    expect_same_as_sequential(program);
+}
+
+TEST(ParallelParserTests, LexerExceptionsPropagateLikeSequentially)
+{
+    std::string program = program_of(60);
+    program.insert(program.find("def f50"), "def bad(x) x + . ;\n");
+    ParallelParser parallel_parser(4, 64);
+    ASSERT_THROW(parallel_parser.parse(program), ParsingException);
+}
+
+TEST(ParallelParserTests, CodegenOfTheMergedFlatAstMatches)
+{
+    std::string program = program_of(100);
+    Lexer lexer(program);
+    FlatAst sequential;
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(sequential)).fetch_all();
+    FlatAst parallel = ParallelParser(4, 64).parse_flat(program);
+
+    CodeGeneratorLLVM sequential_codegen;
+    sequential_codegen.generate(sequential);
+    CodeGeneratorLLVM parallel_codegen;
+    parallel_codegen.generate(parallel);
+    ASSERT_EQ(parallel_codegen.to_string(), sequential_codegen.to_string());
+}
+
+}
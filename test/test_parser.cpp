@@ -3,10 +3,13 @@
 #include <fstream>
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <llvm/Support/CrashRecoveryContext.h>
 
 #include "../src/ast.hpp"
+#include "../src/diagnostics.hpp"
 #include "../src/lexer.hpp"
 #include "../src/parser.hpp"
+#include "../src/source.hpp"
 
 namespace kccani 
 {
@@ -38,9 +41,9 @@ TEST(ParserTests, NumberExpressionsGetParsedAsNumberExpr)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_number_expr();
+    ExprAST* expr = parser.parse_number_expr();
 
-    NumberExprAST* ast(dynamic_cast<NumberExprAST*>(expr.get()));
+    NumberExprAST* ast(dyn_cast<NumberExprAST>(expr));
     ASSERT_EQ(ast->value, 3.0);
 }
 
@@ -62,9 +65,9 @@ TEST(ParserTests, NumberExpressionsGetParsedAsPrimaryExpr)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_primary();
+    ExprAST* expr = parser.parse_primary();
 
-    NumberExprAST* ast(dynamic_cast<NumberExprAST*>(expr.get()));
+    NumberExprAST* ast(dyn_cast<NumberExprAST>(expr));
     ASSERT_EQ(ast->value, 3.0);
 }
 
@@ -88,13 +91,13 @@ TEST(ParserTests, SimpleBinaryExpressionsGetParsed)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_expr();
+    ExprAST* expr = parser.parse_expr();
 
-    BinaryExprAST* ast = dynamic_cast<BinaryExprAST*>(expr.get());
+    BinaryExprAST* ast = dyn_cast<BinaryExprAST>(expr);
     ASSERT_EQ(ast->opcode, '+');
-    NumberExprAST* lhs = dynamic_cast<NumberExprAST*>(ast->lhs.get());
+    NumberExprAST* lhs = dyn_cast<NumberExprAST>(ast->lhs);
     ASSERT_EQ(lhs->value, 3.0);
-    NumberExprAST* rhs = dynamic_cast<NumberExprAST*>(ast->rhs.get());
+    NumberExprAST* rhs = dyn_cast<NumberExprAST>(ast->rhs);
     ASSERT_EQ(rhs->value, 2.0);
 }
 
@@ -120,15 +123,15 @@ TEST(ParserTests, BinaryOperatorExpressionsGetParsedWithCorrectPrecedence1)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_expr();
+    ExprAST* expr = parser.parse_expr();
 
-    BinaryExprAST* ast = dynamic_cast<BinaryExprAST*>(expr.get());
+    BinaryExprAST* ast = dyn_cast<BinaryExprAST>(expr);
     ASSERT_EQ(ast->opcode, '+');
-    NumberExprAST* lhs = dynamic_cast<NumberExprAST*>(ast->lhs.get());
+    NumberExprAST* lhs = dyn_cast<NumberExprAST>(ast->lhs);
     ASSERT_EQ(lhs->value, 3.0);
-    BinaryExprAST* rhs = dynamic_cast<BinaryExprAST*>(ast->rhs.get());
-    NumberExprAST* rlhs = dynamic_cast<NumberExprAST*>(rhs->lhs.get());
-    NumberExprAST* rrhs = dynamic_cast<NumberExprAST*>(rhs->rhs.get());
+    BinaryExprAST* rhs = dyn_cast<BinaryExprAST>(ast->rhs);
+    NumberExprAST* rlhs = dyn_cast<NumberExprAST>(rhs->lhs);
+    NumberExprAST* rrhs = dyn_cast<NumberExprAST>(rhs->rhs);
     ASSERT_EQ(rhs->opcode, '*');
     ASSERT_EQ(rlhs->value, 2.0);
     ASSERT_EQ(rrhs->value, 5.0);
@@ -156,17 +159,17 @@ TEST(ParserTests, BinaryOperatorExpressionsGetParsedWithCorrectPrecedence2)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_expr();
+    ExprAST* expr = parser.parse_expr();
 
-    BinaryExprAST* ast = dynamic_cast<BinaryExprAST*>(expr.get());
+    BinaryExprAST* ast = dyn_cast<BinaryExprAST>(expr);
     ASSERT_EQ(ast->opcode, '+');
-    BinaryExprAST* lhs = dynamic_cast<BinaryExprAST*>(ast->lhs.get());
-    NumberExprAST* llhs = dynamic_cast<NumberExprAST*>(lhs->lhs.get());
-    NumberExprAST* lrhs = dynamic_cast<NumberExprAST*>(lhs->rhs.get());
+    BinaryExprAST* lhs = dyn_cast<BinaryExprAST>(ast->lhs);
+    NumberExprAST* llhs = dyn_cast<NumberExprAST>(lhs->lhs);
+    NumberExprAST* lrhs = dyn_cast<NumberExprAST>(lhs->rhs);
     ASSERT_EQ(lhs->opcode, '*');
     ASSERT_EQ(llhs->value, 3.0);
     ASSERT_EQ(lrhs->value, 2.0);
-    NumberExprAST* rhs = dynamic_cast<NumberExprAST*>(ast->rhs.get());
+    NumberExprAST* rhs = dyn_cast<NumberExprAST>(ast->rhs);
     ASSERT_EQ(rhs->value, 5.0);
 }
 
@@ -192,13 +195,13 @@ TEST(ParserTests, BracketedBinaryExpressionsGetParsed)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_primary();
+    ExprAST* expr = parser.parse_primary();
 
-    BinaryExprAST* ast = dynamic_cast<BinaryExprAST*>(expr.get());
+    BinaryExprAST* ast = dyn_cast<BinaryExprAST>(expr);
     ASSERT_EQ(ast->opcode, '+');
-    NumberExprAST* lhs = dynamic_cast<NumberExprAST*>(ast->lhs.get());
+    NumberExprAST* lhs = dyn_cast<NumberExprAST>(ast->lhs);
     ASSERT_EQ(lhs->value, 3.0);
-    NumberExprAST* rhs = dynamic_cast<NumberExprAST*>(ast->rhs.get());
+    NumberExprAST* rhs = dyn_cast<NumberExprAST>(ast->rhs);
     ASSERT_EQ(rhs->value, 2.0);
 }
 
@@ -228,8 +231,8 @@ TEST(ParserTests, GeneratesTheCorrectParsedExpression)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<ExprAST> expr = parser.parse_expr();
-    BinaryExprAST* ast(dynamic_cast<BinaryExprAST*>(expr.get()));
+    ExprAST* expr = parser.parse_expr();
+    BinaryExprAST* ast(dyn_cast<BinaryExprAST>(expr));
     ASSERT_EQ(
         expr->to_string(),
         "(3.000000) * ((2.000000) + ((5.000000) * (4.000000)))");
@@ -257,9 +260,9 @@ TEST(ParserTests, ParsesFunctionPrototypeCorrectly)
     });
 
     auto parser = Parser(lexer);
-    std::unique_ptr<FunctionPrototypeAST> fn = parser.parse_function_proto();
+    FunctionPrototypeAST* fn = parser.parse_function_proto();
 
-    FunctionPrototypeAST* ast(dynamic_cast<FunctionPrototypeAST*>(fn.get()));
+    FunctionPrototypeAST* ast(dynamic_cast<FunctionPrototypeAST*>(fn));
     ASSERT_EQ(ast->to_string(), "def func(x, y)");
 }
 
@@ -274,12 +277,12 @@ TEST(ParserTests, TopLevelParsingParsesASimpleFileWithFunctionDefinitions)
 
     ASSERT_EQ(ast_list.size(), 2);
 
-    ASSERT_TRUE(std::holds_alternative<std::unique_ptr<FunctionAST>>(ast_list[0]));
-    auto ast_1 = std::get<std::unique_ptr<FunctionAST>>(std::move(ast_list[0]));
+    ASSERT_TRUE(std::holds_alternative<FunctionAST*>(ast_list[0]));
+    auto ast_1 = std::get<FunctionAST*>(ast_list[0]);
     ASSERT_EQ(ast_1->to_string(), "def fib(x){(fib((x) - (1.000000))) + (fib((x) - (2.000000)))}");
 
-    ASSERT_TRUE(std::holds_alternative<std::unique_ptr<ExprAST>>(ast_list[1]));
-    auto ast_2 = std::get<std::unique_ptr<ExprAST>>(std::move(ast_list[1]));
+    ASSERT_TRUE(std::holds_alternative<ExprAST*>(ast_list[1]));
+    auto ast_2 = std::get<ExprAST*>(ast_list[1]);
     ASSERT_EQ(ast_2->to_string(), "fib(6.000000)");
 }
 
@@ -294,13 +297,183 @@ TEST(ParserTests, TopLevelParsingParsesASimpleFileWithExternAndCall)
 
     ASSERT_EQ(ast_list.size(), 2);
 
-    ASSERT_TRUE(std::holds_alternative<std::unique_ptr<FunctionPrototypeAST>>(ast_list[0]));
-    auto ast_1 = std::get<std::unique_ptr<FunctionPrototypeAST>>(std::move(ast_list[0]));
+    ASSERT_TRUE(std::holds_alternative<FunctionPrototypeAST*>(ast_list[0]));
+    auto ast_1 = std::get<FunctionPrototypeAST*>(ast_list[0]);
     ASSERT_EQ(ast_1->to_string(), "def atan2(x, y)");
 
-    ASSERT_TRUE(std::holds_alternative<std::unique_ptr<ExprAST>>(ast_list[1]));
-    auto ast_2 = std::get<std::unique_ptr<ExprAST>>(std::move(ast_list[1]));
+    ASSERT_TRUE(std::holds_alternative<ExprAST*>(ast_list[1]));
+    auto ast_2 = std::get<ExprAST*>(ast_list[1]);
     ASSERT_EQ(ast_2->to_string(), "atan2(13.000000, (5.000000) + (8.000000))");
 }
 
+TEST(ParserTests, NestedCallArgumentsAreKeptApart)
+{
+    auto source = SourceBuffer::from_string("f(g(1, h(2)), 3, k())");
+    auto lexer = Lexer(source);
+    auto parser = Parser(lexer);
+    auto ast_list = parser.fetch_all();
+
+    ASSERT_EQ(ast_list.size(), 1);
+    ASSERT_TRUE(std::holds_alternative<ExprAST*>(ast_list[0]));
+    ASSERT_EQ(
+        std::get<ExprAST*>(ast_list[0])->to_string(),
+        "f(g(1.000000, h(2.000000)), 3.000000, k())");
+    ASSERT_GT(parser.arena()->size(), 0);
+}
+
+TEST(ParserTests, SharingSubexpressionsBuildsADag)
+{
+    auto source = SourceBuffer::from_string("(1+2+x)*(x+(1+2)) + f(x, 1+2)");
+    auto lexer = Lexer(source);
+    auto parser = Parser(lexer, std::make_shared<AstArena>(), true);
+    auto ast_list = parser.fetch_all();
+
+    ASSERT_EQ(ast_list.size(), 1);
+    auto root = dyn_cast<BinaryExprAST>(std::get<ExprAST*>(ast_list[0]));
+    ASSERT_NE(root, nullptr);
+    ASSERT_EQ(root->to_string(),
+        "((((1.000000) + (2.000000)) + (x)) * ((x) + ((1.000000) + (2.000000)))) + "
+        "(f(x, (1.000000) + (2.000000)))");
+
+    auto product = dyn_cast<BinaryExprAST>(root->lhs);
+    auto left = dyn_cast<BinaryExprAST>(product->lhs);
+    auto right = dyn_cast<BinaryExprAST>(product->rhs);
+    auto call = dyn_cast<FunctionCallExprAST>(root->rhs);
+    ASSERT_EQ(left->lhs, right->rhs);
+    ASSERT_EQ(left->rhs, right->lhs);
+    ASSERT_EQ(call->args[1], left->lhs);
+    ASSERT_TRUE(left->lhs->shared);
+    ASSERT_FALSE(root->shared);
+
+    auto unshared_lexer = Lexer(source);
+    auto unshared_parser = Parser(unshared_lexer);
+    unshared_parser.fetch_all();
+    ASSERT_LT(parser.arena()->size(), unshared_parser.arena()->size());
+}
+
+TEST(ParserTests, UserDefinedOperatorsParseWithTheirPrecedence)
+{
+    std::ifstream fin("../../test/sample_programs/test_operators.kld", std::ios::in);
+    if (!fin.is_open())
+        FAIL();
+    auto lexer = Lexer(fin);
+    auto parser = Parser(lexer);
+    auto ast_list = parser.fetch_all();
+
+    ASSERT_EQ(ast_list.size(), 5);
+    ASSERT_EQ(std::get<FunctionAST*>(ast_list[0])->to_string(), "def unary!(v){(1.000000) - ((v) * (2.000000))}");
+    ASSERT_EQ(std::get<FunctionAST*>(ast_list[1])->to_string(), "def binary|(a, b){(a) + (b)}");
+    ASSERT_EQ(
+        std::get<FunctionAST*>(ast_list[3])->to_string(),
+        "def f(x, y){(!(x)) | ((y) & ((x) < ((1.000000) + (y))))}");
+    ASSERT_EQ(std::get<ExprAST*>(ast_list[4])->to_string(), "(f(1.000000, 2.000000)) | (!(3.000000))");
+
+    const OperatorTable& operators = parser.get_operators();
+    ASSERT_EQ(operators['|'].precedence, 5);
+    ASSERT_EQ(operators['&'].precedence, 6);
+    ASSERT_TRUE(operators['!'].unary);
+    ASSERT_FALSE(operators['!'].is_binary());
+    ASSERT_EQ(operators['*'].precedence, BUILTIN_OPERATORS['*'].precedence);
+}
+
+TEST(ParserTests, OperatorDefinitionsAreChecked)
+{
+    auto source = SourceBuffer::from_string(
+        "def binary+ (a b) a;"
+        "def binary% 0 (a b) a;"
+        "def unary~(a b) a;"
+        "def binary(x) x;");
+    auto lexer = Lexer(source);
+    auto parser = Parser(lexer);
+
+    // Builtin operators cannot be redefined, `binary` alone is an ordinary name.
+    auto redefined = parser.get();
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(redefined));
+    while (!(lexer.peek() == ';'))
+        lexer.get();
+    lexer.get();
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(parser.get()));
+    ASSERT_FALSE(parser.get_operators()['%'].is_binary());
+    while (!(lexer.peek() == ';'))
+        lexer.get();
+    lexer.get();
+    ASSERT_TRUE(std::holds_alternative<std::monostate>(parser.get()));
+    ASSERT_FALSE(parser.get_operators()['~'].unary);
+    lexer.get();
+    auto ordinary = parser.get();
+    ASSERT_TRUE(std::holds_alternative<FunctionAST*>(ordinary));
+    ASSERT_EQ(std::get<FunctionAST*>(ordinary)->to_string(), "def binary(x){x}");
+}
+
+TEST(ParserTests, BuiltinOperatorTableIsConstant)
+{
+    static_assert(BUILTIN_OPERATORS['<'].precedence < BUILTIN_OPERATORS['+'].precedence);
+    static_assert(BUILTIN_OPERATORS['+'].precedence < BUILTIN_OPERATORS['-'].precedence);
+    static_assert(BUILTIN_OPERATORS['-'].precedence < BUILTIN_OPERATORS['*'].precedence);
+    static_assert(BUILTIN_OPERATORS['+'].right_binding_power() == BUILTIN_OPERATORS['+'].precedence + 1);
+    static_assert(OperatorInfo{10, Associativity::RIGHT}.right_binding_power() == 10);
+    ASSERT_TRUE(BUILTIN_OPERATORS['*'].builtin);
+    ASSERT_FALSE(BUILTIN_OPERATORS[','].is_binary());
+}
+
+TEST(ParserTests, DeeplyNestedExpressionsParseOnASmallStack)
+{
+    constexpr std::size_t DEPTH = 100000;
+    std::string parentheses = std::string(DEPTH, '(') + "a" + std::string(DEPTH, ')');
+    std::string right_operands;
+    for (std::size_t i = 0; i < DEPTH; i++)
+        right_operands += "(a + ";
+    right_operands += "a" + std::string(DEPTH, ')');
+    std::string calls;
+    for (std::size_t i = 0; i < DEPTH; i++)
+        calls += "f(1, ";
+    calls += "a" + std::string(DEPTH, ')');
+    std::string prefix_operators = "def unary! (x) x; " + std::string(DEPTH, '!') + "a";
+
+    // Recursing once per level would need well over the 256 KiB given here.
+    llvm::CrashRecoveryContext context;
+    ASSERT_TRUE(context.RunSafelyOnThread([&]() {
+        auto source = SourceBuffer::from_string(parentheses + "; " + right_operands + "; " + calls + "; " + prefix_operators);
+        auto lexer = Lexer(source);
+        auto parser = Parser(lexer);
+        auto asts = parser.fetch_all();
+        ASSERT_EQ(asts.size(), 5);
+
+        ASSERT_NE(dyn_cast<VariableExprAST>(std::get<ExprAST*>(asts[0])), nullptr);
+        std::size_t depth = 0;
+        for (auto expr = std::get<ExprAST*>(asts[1]); auto binary = dyn_cast<BinaryExprAST>(expr); expr = binary->rhs)
+            depth++;
+        ASSERT_EQ(depth, DEPTH);
+        depth = 0;
+        for (auto expr = std::get<ExprAST*>(asts[2]); auto call = dyn_cast<FunctionCallExprAST>(expr); expr = call->args[1])
+            depth++;
+        ASSERT_EQ(depth, DEPTH);
+        depth = 0;
+        for (auto expr = std::get<ExprAST*>(asts[4]); auto unary = dyn_cast<UnaryExprAST>(expr); expr = unary->operand)
+            depth++;
+        ASSERT_EQ(depth, DEPTH);
+    }, 256 << 10));
+}
+
+TEST(ParserTests, ErrorsInNestedExpressionsStopAtTheFailingToken)
+{
+    auto source = SourceBuffer::from_string("f(1, (2 + ; ((a ; g(4 ; 3");
+    auto lexer = Lexer(source);
+    auto parser = Parser(lexer);
+    BufferedDiagnostics diagnostics;
+    parser.set_diagnostics(diagnostics);
+
+    // Each failure leaves the token it failed on to the next item.
+    auto asts = parser.fetch_all();
+    ASSERT_EQ(asts.size(), 4);
+    for (std::size_t i = 0; i < 3; i++)
+        ASSERT_TRUE(std::holds_alternative<std::monostate>(asts[i])) << "item " << i;
+    ASSERT_EQ(std::get<ExprAST*>(asts[3])->to_string(), "3.000000");
+    ASSERT_EQ(diagnostics.get_messages(), (std::vector<std::string>{
+        "Attempted primary expression parsing non a non-primary expression",
+        "Expected `)` to close parenthesized expression",
+        "Expected ')' or ',' after end of expression in argument list",
+    }));
+}
+
 }
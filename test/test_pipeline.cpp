@@ -0,0 +1,156 @@
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/codegen.hpp"
+#include "../src/diagnostics.hpp"
+#include "../src/error.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/pipeline.hpp"
+#include "../src/source.hpp"
+#include "../src/spsc_queue.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// Small batches, queues and arenas, so that every hand-over is exercised.
+const Pipeline SMALL_PIPELINE(3, 2, 64);
+
+void expect_same_as_sequential(std::string_view source)
+{
+    BufferedDiagnostics sequential_diagnostics;
+    Lexer lexer(source);
+    Parser parser(lexer);
+    parser.set_diagnostics(sequential_diagnostics);
+    std::vector<std::string> sequential;
+    CodeGeneratorLLVM sequential_codegen;
+    for (auto& ast : parser.fetch_all())
+    {
+        sequential.push_back(item_to_string(ast));
+        std::visit(std::ref(sequential_codegen), ast);
+    }
+
+    BufferedDiagnostics pipeline_diagnostics;
+    std::vector<std::string> pipelined;
+    CodeGeneratorLLVM pipeline_codegen;
+    SMALL_PIPELINE.run(source, [&](const ParsedAstContentType& ast) {
+        pipelined.push_back(item_to_string(ast));
+        std::visit(std::ref(pipeline_codegen), ast);
+    }, pipeline_diagnostics);
+
+    ASSERT_EQ(pipelined, sequential);
+    ASSERT_EQ(pipeline_diagnostics.get_messages(), sequential_diagnostics.get_messages());
+    ASSERT_EQ(pipeline_codegen.to_string(), sequential_codegen.to_string());
+}
+
+}
+
+TEST(SpscQueueTests, DeliversEverythingInOrderAcrossThreads)
+{
+    SpscQueue<int> queue(4);
+    ASSERT_EQ(queue.capacity(), 4);
+    std::thread producer([&queue]() {
+        for (int i = 0; i < 100000; i++)
+            queue.push(int(i));
+        queue.close();
+    });
+    std::vector<int> received;
+    int value;
+    while (queue.pop(value))
+        received.push_back(value);
+    producer.join();
+
+    ASSERT_EQ(received.size(), 100000);
+    for (int i = 0; i < 100000; i++)
+        ASSERT_EQ(received[i], i);
+}
+
+TEST(SpscQueueTests, ClosingStopsBothSides)
+{
+    SpscQueue<int> queue(3);
+    ASSERT_EQ(queue.capacity(), 4);
+    for (int i = 0; i < 4; i++)
+        ASSERT_TRUE(queue.try_push(int(i)));
+    ASSERT_FALSE(queue.try_push(4));
+
+    queue.close();
+    ASSERT_FALSE(queue.push(4));
+    int value;
+    for (int i = 0; i < 4; i++)
+    {
+        ASSERT_TRUE(queue.pop(value));
+        ASSERT_EQ(value, i);
+    }
+    ASSERT_FALSE(queue.pop(value));
+}
+
+TEST(PipelineTests, LexerReadsTokenBatchesFromAQueue)
+{
+    std::string source = "def f(x) x * 2 + g(x, 1.5) ; f(3)";
+    SpscQueue<TokenBatch> queue(8);
+    TokenBatch first{{}, nullptr};
+    TokenBatch second{{}, nullptr};
+    Lexer buffer_lexer(source);
+    std::vector<Token> expected;
+    for (Token token = buffer_lexer.get(); ; token = buffer_lexer.get())
+    {
+        expected.push_back(token);
+        (expected.size() <= 5 ? first : second).tokens.push_back(token);
+        if (token.type == Token::TokenType::TOKEN_EOF)
+            break;
+    }
+    queue.push(std::move(first));
+    queue.push(std::move(second));
+
+    Lexer lexer(queue);
+    ASSERT_EQ(lexer.peek(6), expected[6]);
+    for (const Token& token : expected)
+        ASSERT_EQ(lexer.get(), token);
+    ASSERT_EQ(lexer.get().type, Token::TokenType::TOKEN_EOF);
+}
+
+TEST(PipelineTests, MatchesTheSequentialCompilerOnSamplePrograms)
+{
+    for (auto file_name : {"test_arithmetic.kld", "test_simple.kld", "test_extern.kld", "test_operators.kld"})
+    {
+        auto source = SourceBuffer::from_file(std::string("../../test/sample_programs/") + file_name);
+        expect_same_as_sequential(source.view());
+    }
+}
+
+TEST(PipelineTests, ReportsParseErrorsLikeTheSequentialParser)
+{
+    expect_same_as_sequential("def f(x) x + 1; def (y) 2; def g(a b) a * ; f(2) + g(1, 2); 4 +");
+}
+
+TEST(PipelineTests, LexerErrorsAreThrownAfterTheItemsBeforeThem)
+{
+    std::vector<std::string> consumed;
+    ASSERT_THROW(SMALL_PIPELINE.run("def f(x) x + 1; f(2); def g(y) y + . ; g(1)",
+        [&](const ParsedAstContentType& ast) { consumed.push_back(item_to_string(ast)); }),
+        ParsingException);
+    ASSERT_EQ(consumed.size(), 2);
+}
+
+TEST(PipelineTests, ConsumerErrorsStopThePipeline)
+{
+    std::string source;
+    for (int i = 0; i < 1000; i++)
+        source += "def f" + std::to_string(i) + "(x) x * " + std::to_string(i) + "\n";
+    int consumed = 0;
+    ASSERT_THROW(SMALL_PIPELINE.run(source, [&](const ParsedAstContentType&) {
+        if (++consumed == 10)
+            throw std::runtime_error("stop");
+    }), std::runtime_error);
+    ASSERT_EQ(consumed, 10);
+}
+
+}
@@ -0,0 +1,152 @@
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/codegen.hpp"
+#include "../src/jit.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/simplifier.hpp"
+#include "../src/source.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// Parses `program` into `arena`, which the results must not outlive, and
+// simplifies it.
+std::vector<ParsedAstContentType> parse_simplified(const std::string& program, const std::shared_ptr<AstArena>& arena,
+                                                   bool fast_math = false)
+{
+    auto asts = parse(program, arena);
+    AstSimplifier(arena, fast_math).simplify(asts);
+    return asts;
+}
+
+// The simplified body of the last non-empty item of `program`.
+std::string last_body(const std::string& program, bool fast_math = false)
+{
+    auto arena = std::make_shared<AstArena>();
+    auto asts = parse_simplified(program, arena, fast_math);
+    while (std::holds_alternative<std::monostate>(asts.back()))
+        asts.pop_back();
+    if (std::holds_alternative<FunctionAST*>(asts.back()))
+        return std::get<FunctionAST*>(asts.back())->body->to_string();
+    return std::get<ExprAST*>(asts.back())->to_string();
+}
+
+std::string simplified_ir(const std::string& program, bool fast_math = false)
+{
+    auto arena = std::make_shared<AstArena>();
+    CodeGeneratorLLVM codegen;
+    generate(codegen, parse_simplified(program, arena, fast_math));
+    return codegen.to_string();
+}
+
+std::size_t count(const std::string& text, const std::string& pattern)
+{
+    std::size_t found = 0;
+    for (std::size_t at = text.find(pattern); at != std::string::npos; at = text.find(pattern, at + 1))
+        found++;
+    return found;
+}
+
+}
+
+TEST(SimplifierTests, FoldsConstantsAndExactIdentities)
+{
+    ASSERT_EQ(last_body("1 + 2 * 3 - (4 < 5)"), "6.000000");
+    // The constant is -0.
+    ASSERT_EQ(last_body("def f(x) (1 * x * 1 - 0) + (0 - 0) * (0 - 1);"), "x");
+    // Not exact for x = -0, NaN or infinity.
+    ASSERT_EQ(last_body("def f(x) x + 0;"), "(x) + (0.000000)");
+    ASSERT_EQ(last_body("def f(x) x * 0;"), "(x) * (0.000000)");
+    ASSERT_EQ(last_body("def f(x) x - x;"), "(x) - (x)");
+}
+
+TEST(SimplifierTests, CanonicalOrderSharesCommutedSubexpressions)
+{
+    ASSERT_EQ(last_body("def f(x) (1 + 2 + x) * (x + (1 + 2));"), "((x) + (3.000000)) * ((x) + (3.000000))");
+    std::string ir = simplified_ir("def f(x) (1 + 2 + x) * (x + (1 + 2));");
+    ASSERT_EQ(count(ir, "fadd"), 1);
+    ASSERT_EQ(count(ir, "fmul"), 1);
+    ASSERT_EQ(count(simplified_ir("def g(a b) (a * b + 1) * (b * a + 1);"), "fmul"), 2);
+}
+
+TEST(SimplifierTests, FastMathReassociatesSumsAndProducts)
+{
+    ASSERT_EQ(last_body("def f(x) 1 + x + 2;"), "((x) + (1.000000)) + (2.000000)");
+    ASSERT_EQ(last_body("def f(x) 1 + x + 2;", true), "(x) + (3.000000)");
+    ASSERT_EQ(last_body("def f(x) 1 + x + 2 - 4 * 1;", true), "(x) - (1.000000)");
+    ASSERT_EQ(last_body("def f(x) 2 * x * 0.5;", true), "x");
+    ASSERT_EQ(last_body("def f(x) x + 0;", true), "x");
+    ASSERT_EQ(last_body("def f(x) (x - 1) * 0;", true), "0.000000");
+    ASSERT_EQ(last_body("def f(x) (x + 1) - (1 + x);", true), "0.000000");
+    ASSERT_EQ(last_body("def f(x y) (y + 1) + x + 2;", true), last_body("def f(x y) x + (3 + y);", true));
+}
+
+TEST(SimplifierTests, CallsWithSideEffectsAreNeverMerged)
+{
+    // sin is a pure C function, h calls only pure functions, putchard and p
+    // are not known to be pure.
+    std::string program =
+        "extern sin(x); extern putchard(x);"
+        "def h(x) sin(x) * 2;"
+        "def p(x) putchard(x);"
+        "def pure(x) (sin(x) + 1) * (sin(x) + 1) + (h(x) - 1) * (h(x) - 1);"
+        "def impure(x) (putchard(x) + 1) * (putchard(x) + 1) + (p(x) - 1) * (p(x) - 1);";
+    std::string ir = simplified_ir(program);
+    std::string pure = ir.substr(ir.find("define double @pure"));
+    pure = pure.substr(0, pure.find("define double @impure"));
+    std::string impure = ir.substr(ir.find("define double @impure"));
+    ASSERT_EQ(count(pure, "call double @sin"), 1);
+    ASSERT_EQ(count(pure, "call double @h"), 1);
+    ASSERT_EQ(count(impure, "call double @putchard"), 2);
+    ASSERT_EQ(count(impure, "call double @p("), 2);
+
+    ASSERT_EQ(last_body("extern putchard(x); def f(x) putchard(2) + 1 + putchard(1);", true),
+        "((putchard(2.000000)) + (putchard(1.000000))) + (1.000000)");
+    ASSERT_EQ(last_body("extern putchard(x); def f(x) putchard(x) * 0;", true), "(putchard(x)) * (0.000000)");
+}
+
+TEST(SimplifierTests, ResultsDoNotChange)
+{
+    std::string program =
+        "def binary| 5 (a b) a + b * 2;"
+        "def f(x y) (1 + 2 + x) * (x + (1 + 2)) - y * 1 + (y - 0) | 1 * x;"
+        "f(2, 3); f(0.5, 0 - 1) < 4; (1 + 2) * f(1, 1)";
+    auto arena = std::make_shared<AstArena>();
+    ASSERT_EQ(run_program(parse_simplified(program, arena)), run_program(program));
+    auto source = SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    ASSERT_EQ(run_program(parse_simplified(std::string(source.view()), arena, true)), (std::vector<double>{-4}));
+}
+
+TEST(SimplifierTests, DeepAndWideExpressionsDoNotRecurse)
+{
+    std::string wide = "def f(a) a";
+    for (int i = 0; i < (1 << 16); i++)
+        wide += " + a * 1";
+    std::string deep;
+    for (int i = 0; i < (1 << 16); i++)
+        deep += "(1 + ";
+    deep += "a" + std::string(1 << 16, ')');
+    for (bool fast_math : {false, true})
+    {
+        auto arena = std::make_shared<AstArena>();
+        auto asts = parse_simplified(wide + "; def g(a) " + deep + ";", arena, fast_math);
+        ASSERT_TRUE(std::holds_alternative<FunctionAST*>(asts[1]));
+        auto deep_body = dyn_cast<BinaryExprAST>(std::get<FunctionAST*>(asts[1])->body);
+        ASSERT_NE(deep_body, nullptr);
+        if (fast_math)
+        {
+            ASSERT_EQ(dyn_cast<NumberExprAST>(deep_body->rhs)->value, 1 << 16);
+        }
+    }
+}
+
+}
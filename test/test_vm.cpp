@@ -0,0 +1,139 @@
+#include <cmath>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "../src/bytecode.hpp"
+#include "../src/error.hpp"
+#include "../src/flat_ast.hpp"
+#include "../src/lexer.hpp"
+#include "../src/parser.hpp"
+#include "../src/source.hpp"
+#include "../src/vm.hpp"
+#include "helpers.hpp"
+
+namespace kccani
+{
+
+namespace
+{
+
+// Compiles `program` from the pointer tree and tells how many items did.
+std::size_t compile(const std::string& program, BytecodeProgram& bytecode)
+{
+    auto arena = std::make_shared<AstArena>();
+    BytecodeCompiler compiler(bytecode);
+    std::size_t compiled = 0;
+    for (auto& ast : parse(program, arena))
+        compiled += std::visit(std::ref(compiler), ast);
+    return compiled;
+}
+
+// The same from the FlatAst.
+void compile_flat(const std::string& program, BytecodeProgram& bytecode)
+{
+    auto source = SourceBuffer::from_string(program);
+    FlatAst ast;
+    Lexer lexer(source);
+    BasicParser<FlatAstBuilder>(lexer, FlatAstBuilder(ast)).fetch_all();
+    BytecodeCompiler(bytecode).compile(ast);
+}
+
+std::vector<double> run_on_vm(const std::string& program)
+{
+    BytecodeProgram bytecode;
+    compile(program, bytecode);
+    VirtualMachine vm(bytecode);
+    return vm.run();
+}
+
+}
+
+TEST(VmTests, EvaluatesTopLevelExpressionsInOrder)
+{
+    ASSERT_EQ(run_on_vm("def sq(x) x * x; sq(3) + 1; def quad(x) sq(sq(x)); quad(2); 4 < 3"),
+        (std::vector<double>{10, 16, 0}));
+}
+
+TEST(VmTests, RunsUserDefinedOperators)
+{
+    auto source = SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    ASSERT_EQ(run_on_vm(std::string(source.view())), (std::vector<double>{-4}));
+}
+
+TEST(VmTests, ExternsCallTheHostFunctions)
+{
+    auto results = run_on_vm("extern sin(x); extern atan2(y x); sin(0) + atan2(13, 5 + 8)");
+    ASSERT_EQ(results.size(), 1);
+    ASSERT_DOUBLE_EQ(results[0], std::atan2(13.0, 13.0));
+}
+
+TEST(VmTests, CallArgumentsShareTheCalleesRegisters)
+{
+    BytecodeProgram bytecode;
+    ASSERT_EQ(compile("def g(x y) x - y; def f(a b) a * (b + g(a, 1));", bytecode), 2);
+    ASSERT_EQ(bytecode.to_string(bytecode.functions[bytecode.find("f")]),
+        "def f/2, 4 registers\n"
+        "    load_constant r2, 1.000000\n"
+        "    move r3, r2\n"
+        "    move r2, r0\n"
+        "    call r2, g\n"
+        "    add r2, r1, r2\n"
+        "    multiply r2, r0, r2\n"
+        "    return r2\n");
+    VirtualMachine vm(bytecode);
+    ASSERT_EQ(vm.call("f", {3, 4}), 3 * (4 + 3 - 1));
+}
+
+TEST(VmTests, FlatAstsCompileToTheSameBytecode)
+{
+    auto source = SourceBuffer::from_file("../../test/sample_programs/test_operators.kld");
+    std::string program = std::string(source.view()) + "; def h(a b) a * b - 1; h(2, 3); h(h(1, 2), 5) < 4";
+    BytecodeProgram pointer, flat;
+    compile(program, pointer);
+    compile_flat(program, flat);
+    ASSERT_EQ(flat.to_string(), pointer.to_string());
+    ASSERT_EQ(VirtualMachine(flat).run(), (std::vector<double>{-4, 5, 0}));
+}
+
+TEST(VmTests, FunctionsStayCallableFromLaterRuns)
+{
+    BytecodeProgram bytecode;
+    VirtualMachine vm(bytecode);
+    compile("def sq(x) x * x; extern g(x); def f(x) g(x) * 2;", bytecode);
+    ASSERT_TRUE(vm.run().empty());
+    compile("sq(4); def g(x) sq(x) + 1; f(2)", bytecode);
+    ASSERT_EQ(vm.run(), (std::vector<double>{16, 10}));
+    ASSERT_EQ(vm.call("sq", {3}), 9);
+    ASSERT_EQ(vm.call("__anon_expr"), 16);
+    ASSERT_THROW(vm.call("sq"), VmException);
+    ASSERT_THROW(vm.call("kccaniundefined"), VmException);
+}
+
+TEST(VmTests, ItemsThatFailToCompileAreSkipped)
+{
+    BytecodeProgram bytecode;
+    ASSERT_EQ(compile("def f(x) y; def g(x) x; g(2); f(1); h(1); g(1, 2); def g(x) x + 1;", bytecode), 2);
+    ASSERT_EQ(bytecode.find("f"), BytecodeProgram::NO_FUNCTION);
+    ASSERT_EQ(VirtualMachine(bytecode).run(), (std::vector<double>{2}));
+}
+
+TEST(VmTests, UnresolvedExternsAreReportedBeforeRunning)
+{
+    BytecodeProgram bytecode;
+    VirtualMachine vm(bytecode);
+    compile("extern kccaniundefined(x); def f(x) kccaniundefined(x); 1; f(1)", bytecode);
+    ASSERT_THROW(vm.run(), VmException);
+    compile("def g(x) x + 1; g(1)", bytecode);
+    ASSERT_EQ(vm.run(), (std::vector<double>{2}));
+    ASSERT_THROW(vm.call("f", {1}), VmException);
+}
+
+TEST(VmTests, UnboundedRecursionIsReported)
+{
+    ASSERT_THROW(run_on_vm("def f(x) f(x + 1); f(1)"), VmException);
+}
+
+}